@@ -0,0 +1,539 @@
+/*
+    核心组件的微基准测试（make bench）
+    每个用例先预热一轮，再跑 repeat 轮，记录中位数和最小值，结果写成JSON；
+    给了基线文件时逐项比较各轮最小值（受调度、频率波动的影响最小），比基线慢超过阈值的用例算回归，进程返回1（make bench 失败）
+
+    用法（在 build/ 目录下，makefile 已经带好参数）：
+        ../bin/bench [-r 轮数] [-f 名字前缀] [-o 结果.json] [-b 基线.json] [-t 阈值百分比] [-s 资源目录]
+    基线和机器、编译选项相关，换机器后用 make bench-baseline 重新生成
+*/
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <thread>
+#include <random>
+#include <functional>
+#include <algorithm>
+#include <chrono>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "../code/buffer/buffer.h"
+#include "../code/http/httprequest.h"
+#include "../code/http/httpresponse.h"
+#include "../code/cache/filecache.h"
+#include "../code/timer/heaptimer.h"
+#include "../code/timer/cachedclock.h"
+#include "../code/pool/threadpool.h"
+#include "../code/log/blockqueue.h"
+#include "../code/log/log.h"
+#include "../code/server/iplimiter.h"
+
+using namespace std;
+using BenchClock = chrono::steady_clock;
+
+// 一个用例：run(n) 执行n次操作，返回耗时（纳秒）；准备工作放在run里计时之外
+struct BenchCase {
+    string name;
+    size_t ops;
+    function<int64_t(size_t)> run;
+};
+
+struct BenchResult {
+    string name;
+    size_t ops;
+    double nsPerOp;     // 各轮的中位数
+    double minNsPerOp;  // 各轮的最小值
+};
+
+static int64_t Since(BenchClock::time_point start) {
+    return chrono::duration_cast<chrono::nanoseconds>(BenchClock::now() - start).count();
+}
+
+// 防止编译器把结果优化掉
+static volatile size_t benchSink;
+static void Consume(size_t v) {
+    benchSink = v;
+}
+
+/* ---------------- Buffer ---------------- */
+static int64_t BenchAppend(size_t n, size_t chunk) {
+    Buffer buff;
+    string data(chunk, 'x');
+    auto start = BenchClock::now();
+    for(size_t i = 0; i < n; i++) {
+        buff.Append(data.data(), data.size());
+        if(buff.ReadableBytes() >= 64 * 1024) {
+            buff.RetrieveAll();     // 和连接的读缓冲一样，处理完就清空，只测追加本身
+        }
+    }
+    int64_t ns = Since(start);
+    Consume(buff.ReadableBytes());
+    return ns;
+}
+
+// 每次往socketpair写入chunk字节再ReadFd读出，耗时包含一次write系统调用
+static int64_t BenchReadFd(size_t n, size_t chunk) {
+    int fds[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        return -1;
+    }
+    string data(chunk, 'x');
+    Buffer buff;
+    int err = 0;
+    auto start = BenchClock::now();
+    for(size_t i = 0; i < n; i++) {
+        ssize_t w = write(fds[0], data.data(), data.size());
+        (void)w;
+        buff.ReadFd(fds[1], &err);
+        buff.RetrieveAll();
+    }
+    int64_t ns = Since(start);
+    close(fds[0]);
+    close(fds[1]);
+    return ns;
+}
+
+/* ---------------- HttpRequest ---------------- */
+// 请求样本：浏览器的GET、keep-alive的短GET、带Cookie的GET、POST登录表单
+static const vector<string>& Corpus() {
+    static const vector<string> corpus = {
+        "GET / HTTP/1.1\r\n"
+        "Host: 127.0.0.1:1316\r\n"
+        "Connection: keep-alive\r\n"
+        "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/120.0 Safari/537.36\r\n"
+        "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+        "Accept-Encoding: gzip, deflate, br\r\n"
+        "Accept-Language: zh-CN,zh;q=0.9,en;q=0.8\r\n"
+        "\r\n",
+
+        "GET /picture HTTP/1.1\r\n"
+        "Host: 127.0.0.1\r\n"
+        "Connection: keep-alive\r\n"
+        "\r\n",
+
+        "GET /welcome.html HTTP/1.1\r\n"
+        "Host: 127.0.0.1\r\n"
+        "Connection: keep-alive\r\n"
+        "Cookie: sid=00112233445566778899aabbccddeeff\r\n"
+        "\r\n",
+
+        "POST /login HTTP/1.1\r\n"
+        "Host: 127.0.0.1\r\n"
+        "Connection: keep-alive\r\n"
+        "Content-Type: application/x-www-form-urlencoded\r\n"
+        "Content-Length: 33\r\n"
+        "\r\n"
+        "username=name&password=password12",
+    };
+    return corpus;
+}
+
+// 和HttpConn::process一样：先Scan确认完整，再parse（登录只会标记待验证，不访问数据库）
+static int64_t BenchParse(size_t n, int which) {
+    const vector<string>& corpus = Corpus();
+    Buffer buff;
+    HttpRequest request;
+    size_t ok = 0;
+    auto start = BenchClock::now();
+    for(size_t i = 0; i < n; i++) {
+        const string& req = which < 0 ? corpus[i % corpus.size()] : corpus[which];
+        buff.Append(req);
+        size_t len = 0;
+        if(HttpRequest::Scan(buff, &len) == HttpRequest::SCAN_OK) {
+            request.Init();
+            ok += request.parse(buff);
+        }
+        buff.RetrieveAll();
+    }
+    int64_t ns = Since(start);
+    Consume(ok);
+    return ns;
+}
+
+/* ---------------- HttpResponse ---------------- */
+static string srcDir = "../resources/";
+
+// 每次都是完整的一次响应：stat + open + mmap 文件，生成状态行和响应头，再munmap
+// cached时打开FileCache，正文直接用缓存里的内容（第一次读文件不计时）
+static int64_t BenchResponse(size_t n, const char* file, int code, bool cached = false) {
+    FileCache::Instance()->SetLimits(cached ? 256 * 1024 : 0, cached ? 64 * 1024 * 1024 : 0);
+    if(cached) { FileCache::Instance()->Get(srcDir + file); }
+    Buffer buff;
+    HttpResponse response;
+    size_t bytes = 0;
+    auto start = BenchClock::now();
+    for(size_t i = 0; i < n; i++) {
+        string path = file;
+        response.Init(srcDir, path, true, code);
+        response.MakeResponse(buff);
+        bytes += buff.ReadableBytes() + response.FileLen();
+        response.UnmapFile();
+        buff.RetrieveAll();
+    }
+    int64_t ns = Since(start);
+    Consume(bytes);
+    FileCache::Instance()->SetLimits(0, 0);
+    return ns;
+}
+
+/* ---------------- HeapTimer ---------------- */
+// 打乱的id，模拟连接fd的随机到达
+static vector<int> ShuffledIds(size_t n) {
+    vector<int> ids(n);
+    for(size_t i = 0; i < n; i++) { ids[i] = static_cast<int>(i); }
+    shuffle(ids.begin(), ids.end(), mt19937(42));
+    return ids;
+}
+
+// 堆的规模是nodes，n次操作分成 n/nodes 轮（每轮一个新的定时器），小规模时也有足够的操作数，结果才稳定
+static int64_t BenchTimerAdd(size_t n, size_t nodes) {
+    CachedClock::Update();
+    vector<int> ids = ShuffledIds(nodes);
+    mt19937 rng(1);
+    int64_t ns = 0;
+    for(size_t round = 0; round < max<size_t>(1, n / nodes); round++) {
+        HeapTimer timer;
+        auto start = BenchClock::now();
+        for(size_t i = 0; i < nodes; i++) {
+            timer.add(ids[i], 1000 + rng() % 60000, []() {});
+        }
+        ns += Since(start);
+    }
+    return ns;
+}
+
+// 堆里已经有nodes个结点，再随机调整（延后和提前都有）
+static int64_t BenchTimerAdjust(size_t n, size_t nodes) {
+    CachedClock::Update();
+    vector<int> ids = ShuffledIds(nodes);
+    mt19937 rng(2);
+    HeapTimer timer;
+    for(size_t i = 0; i < nodes; i++) {
+        timer.add(ids[i], 1000 + rng() % 60000, []() {});
+    }
+    auto start = BenchClock::now();
+    for(size_t i = 0; i < n; i++) {
+        timer.adjust(ids[rng() % nodes], 1000 + rng() % 60000);
+    }
+    return Since(start);
+}
+
+// nodes个结点全部到期，一次tick清空（每个结点一次出堆加一次回调）
+static int64_t BenchTimerTick(size_t n, size_t nodes) {
+    vector<int> ids = ShuffledIds(nodes);
+    mt19937 rng(3);
+    size_t fired = 0;
+    int64_t ns = 0;
+    for(size_t round = 0; round < max<size_t>(1, n / nodes); round++) {
+        CachedClock::Update();
+        HeapTimer timer;
+        for(size_t i = 0; i < nodes; i++) {
+            timer.add(ids[i], rng() % 20, [&fired]() { fired++; });
+        }
+        this_thread::sleep_for(chrono::milliseconds(20 + 2 * HeapTimer::SLACK_MS));
+        CachedClock::Update();
+        auto start = BenchClock::now();
+        timer.tick();
+        ns += Since(start);
+    }
+    Consume(fired);
+    return ns;
+}
+
+/* ---------------- ThreadPool ---------------- */
+// producers个线程一共提交n个空任务，计时到全部执行完
+static int64_t BenchThreadPool(size_t n, int producers) {
+    ThreadPool pool(4);
+    atomic<size_t> done(0);
+    auto start = BenchClock::now();
+    vector<thread> threads;
+    for(int p = 0; p < producers; p++) {
+        threads.emplace_back([&pool, &done, n, producers, p]() {
+            size_t cnt = n / producers + (static_cast<size_t>(p) < n % producers ? 1 : 0);
+            for(size_t i = 0; i < cnt; i++) {
+                pool.AddTask([&done]() { done.fetch_add(1, memory_order_relaxed); });
+            }
+        });
+    }
+    for(auto& t : threads) { t.join(); }
+    while(done.load(memory_order_relaxed) < n) {
+        this_thread::yield();
+    }
+    return Since(start);
+}
+
+// 静态/数据库混合负载：每10个任务里1个阻塞2ms（查数据库），其余是几微秒的计算（静态文件），
+// 每200us提交10个（5万个/秒），计时到全部执行完。固定4个线程最多每秒处理2000个阻塞任务，跟不上，短任务跟着排队；
+// 自适应（2~64个线程，目标排队1ms）时按排队时间加线程，阻塞比例高，单核上也会扩容，总耗时接近提交用的时间
+static int64_t BenchPoolMixed(size_t n, bool adaptive) {
+    ThreadPool pool(adaptive ? 2 : 4);
+    if(adaptive) {
+        pool.SetAdaptive(2, 64, 1000, 1000, "bench");
+    }
+    atomic<size_t> done(0);
+    auto start = BenchClock::now();
+    for(size_t i = 0; i < n; i++) {
+        if(i % 10 == 0) {
+            this_thread::sleep_until(start + chrono::microseconds(20 * i));
+            pool.AddTask([&done]() {
+                this_thread::sleep_for(chrono::milliseconds(2));
+                done.fetch_add(1, memory_order_relaxed);
+            });
+        } else {
+            pool.AddTask([&done]() {
+                size_t x = 0;
+                for(int k = 0; k < 2000; k++) { x += k * k; }
+                Consume(x);
+                done.fetch_add(1, memory_order_relaxed);
+            });
+        }
+    }
+    while(done.load(memory_order_relaxed) < n) {
+        this_thread::sleep_for(chrono::microseconds(100));
+    }
+    return Since(start);
+}
+
+/* ---------------- BlockQueue ---------------- */
+// producers个生产者push_back，一个消费者pop，计时到消费完n个
+static int64_t BenchBlockQueue(size_t n, int producers) {
+    BlockQueue<size_t> queue(1024);
+    size_t sum = 0;
+    auto start = BenchClock::now();
+    thread consumer([&queue, &sum, n]() {
+        size_t item = 0;
+        for(size_t i = 0; i < n && queue.pop(item); i++) {
+            sum += item;
+        }
+    });
+    vector<thread> threads;
+    for(int p = 0; p < producers; p++) {
+        threads.emplace_back([&queue, n, producers, p]() {
+            size_t cnt = n / producers + (static_cast<size_t>(p) < n % producers ? 1 : 0);
+            for(size_t i = 0; i < cnt; i++) {
+                queue.push_back(i);
+            }
+        });
+    }
+    for(auto& t : threads) { t.join(); }
+    consumer.join();
+    int64_t ns = Since(start);
+    Consume(sum);
+    return ns;
+}
+
+/* ---------------- Log ---------------- */
+// queueSize为0是同步写（调用线程直接写文件），否则异步（BLOCK策略，持续写入时受写线程的速度限制）
+// 异步时测的是调用线程的开销，不等写线程写完文件
+static int64_t BenchLog(size_t n, int queueSize) {
+    Log* log = Log::Instance();
+    log->init(1, "./bench_log", ".log", queueSize);
+    auto start = BenchClock::now();
+    for(size_t i = 0; i < n; i++) {
+        log->write(1, "Client[%d](%s:%d) in, userCount:%d", 17, "127.0.0.1", 50000 + static_cast<int>(i % 10000), 128);
+    }
+    log->flush();
+    int64_t ns = Since(start);
+    return ns;
+}
+
+/* ---------------- IpLimiter ---------------- */
+// 表里先放好ips个不同的IPv4地址（不计时），再按打乱的顺序对已有的IP做n次检查：
+// request是取令牌，connect是连接数加一再减一（accept + close）；1m时表有64MB以上，基本每次都是缓存不命中
+// 容量多留1/4，各分片不均匀时也都能放进表里（放不进的直接放行，会显得更快）
+static int64_t BenchIpLimiter(size_t n, size_t ips, bool connect) {
+    IpLimiter limiter;
+    limiter.Init(1000, 1000000, 1000000, 60, ips + ips / 4);
+    vector<int> ids = ShuffledIds(ips);
+    IpLimiter::Key key = {0, 0};
+    for(size_t i = 0; i < ips; i++) {
+        key.lo = 0xffff00000000ULL | static_cast<uint32_t>(i);
+        limiter.Request(key);
+    }
+    size_t allowed = 0;
+    auto start = BenchClock::now();
+    for(size_t i = 0; i < n; i++) {
+        key.lo = 0xffff00000000ULL | static_cast<uint32_t>(ids[i % ips]);
+        if(connect) {
+            allowed += limiter.Connect(key);
+            limiter.Disconnect(key);
+        } else {
+            allowed += limiter.Request(key);
+        }
+    }
+    int64_t ns = Since(start);
+    Consume(allowed);
+    return ns;
+}
+
+/* ---------------- 用例表 ---------------- */
+static vector<BenchCase> Cases() {
+    vector<BenchCase> cases = {
+        {"buffer_append_64B",       2000000, [](size_t n) { return BenchAppend(n, 64); }},
+        {"buffer_append_4KB",       200000,  [](size_t n) { return BenchAppend(n, 4096); }},
+        {"buffer_readfd_4KB",       100000,  [](size_t n) { return BenchReadFd(n, 4096); }},
+        {"buffer_readfd_64KB",      10000,   [](size_t n) { return BenchReadFd(n, 65536); }},
+        {"httprequest_parse_browser_get", 100000, [](size_t n) { return BenchParse(n, 0); }},
+        {"httprequest_parse_short_get",   100000, [](size_t n) { return BenchParse(n, 1); }},
+        {"httprequest_parse_cookie_get",  100000, [](size_t n) { return BenchParse(n, 2); }},
+        {"httprequest_parse_post_login",  100000, [](size_t n) { return BenchParse(n, 3); }},
+        {"httprequest_parse_mix",         100000, [](size_t n) { return BenchParse(n, -1); }},
+        {"httpresponse_make_index",       100000, [](size_t n) { return BenchResponse(n, "/index.html", 200); }},
+        {"httpresponse_make_404",         100000, [](size_t n) { return BenchResponse(n, "/not-exist.html", -1); }},
+        {"httpresponse_make_index_cached", 100000, [](size_t n) { return BenchResponse(n, "/index.html", 200, true); }},
+        {"threadpool_addtask_1p",   500000,  [](size_t n) { return BenchThreadPool(n, 1); }},
+        {"threadpool_addtask_4p",   500000,  [](size_t n) { return BenchThreadPool(n, 4); }},
+        {"threadpool_mixed_fixed",    5000,  [](size_t n) { return BenchPoolMixed(n, false); }},
+        {"threadpool_mixed_adaptive", 5000,  [](size_t n) { return BenchPoolMixed(n, true); }},
+        {"blockqueue_1p1c",         1000000, [](size_t n) { return BenchBlockQueue(n, 1); }},
+        {"blockqueue_4p1c",         1000000, [](size_t n) { return BenchBlockQueue(n, 4); }},
+        {"log_write_sync",          300000,  [](size_t n) { return BenchLog(n, 0); }},
+        {"log_write_async",         300000,  [](size_t n) { return BenchLog(n, 1024); }},
+        {"iplimiter_request_1k",    1000000, [](size_t n) { return BenchIpLimiter(n, 1000, false); }},
+        {"iplimiter_request_1m",    1000000, [](size_t n) { return BenchIpLimiter(n, 1000000, false); }},
+        {"iplimiter_connect_1m",    1000000, [](size_t n) { return BenchIpLimiter(n, 1000000, true); }},
+    };
+    for(size_t nodes : {10000, 100000, 1000000}) {     // 堆的规模
+        string suffix = "_" + to_string(nodes / 1000) + "k";
+        cases.push_back({"heaptimer_add" + suffix, 1000000, [nodes](size_t n) { return BenchTimerAdd(n, nodes); }});
+        cases.push_back({"heaptimer_adjust" + suffix, 1000000, [nodes](size_t n) { return BenchTimerAdjust(n, nodes); }});
+        // tick每轮要等定时器到期（几十毫秒），轮数少一些
+        cases.push_back({"heaptimer_tick" + suffix, min<size_t>(1000000, nodes * 10), [nodes](size_t n) { return BenchTimerTick(n, nodes); }});
+    }
+    return cases;
+}
+
+/* ---------------- JSON 输出和基线比较 ---------------- */
+static string ToJson(const vector<BenchResult>& results, int repeat) {
+    string out = "{\n  \"repeat\": " + to_string(repeat) + ",\n  \"benchmarks\": [\n";
+    char line[256];
+    for(size_t i = 0; i < results.size(); i++) {
+        const BenchResult& r = results[i];
+        snprintf(line, sizeof(line),
+                 "    {\"name\": \"%s\", \"ops\": %zu, \"ns_per_op\": %.2f, \"min_ns_per_op\": %.2f, \"ops_per_sec\": %.0f}%s\n",
+                 r.name.c_str(), r.ops, r.nsPerOp, r.minNsPerOp,
+                 r.nsPerOp > 0 ? 1e9 / r.nsPerOp : 0.0, i + 1 < results.size() ? "," : "");
+        out += line;
+    }
+    out += "  ]\n}\n";
+    return out;
+}
+
+// 只读自己写出的格式：每个用例一行，取出 name 和 min_ns_per_op
+static map<string, double> LoadBaseline(const char* path) {
+    map<string, double> baseline;
+    FILE* fp = fopen(path, "r");
+    if(!fp) {
+        return baseline;
+    }
+    char line[1024];
+    while(fgets(line, sizeof(line), fp)) {
+        const char* name = strstr(line, "\"name\": \"");
+        const char* ns = strstr(line, "\"min_ns_per_op\": ");
+        if(!name || !ns) {
+            continue;
+        }
+        name += strlen("\"name\": \"");
+        const char* end = strchr(name, '"');
+        if(!end) {
+            continue;
+        }
+        baseline[string(name, end)] = atof(ns + strlen("\"min_ns_per_op\": "));
+    }
+    fclose(fp);
+    return baseline;
+}
+
+static void Usage() {
+    fprintf(stderr, "usage: bench [-r repeat] [-f prefix] [-o result.json] [-b baseline.json] [-t threshold%%] [-s srcDir]\n");
+}
+
+int main(int argc, char* argv[]) {
+    int repeat = 5;
+    double threshold = 15;      // 百分比
+    const char* prefix = "";
+    const char* outPath = nullptr;
+    const char* basePath = nullptr;
+    int opt;
+    while((opt = getopt(argc, argv, "r:f:o:b:t:s:h")) != -1) {
+        switch(opt) {
+        case 'r': repeat = max(1, atoi(optarg)); break;
+        case 'f': prefix = optarg; break;
+        case 'o': outPath = optarg; break;
+        case 'b': basePath = optarg; break;
+        case 't': threshold = atof(optarg); break;
+        case 's': srcDir = optarg; break;
+        default: Usage(); return 2;
+        }
+    }
+
+    vector<BenchResult> results;
+    for(BenchCase& c : Cases()) {
+        if(c.name.compare(0, strlen(prefix), prefix) != 0) {
+            continue;
+        }
+        c.run(c.ops / 10 + 1);      // 预热：分配内存、填充页缓存
+        vector<double> rounds;
+        for(int i = 0; i < repeat; i++) {
+            int64_t ns = c.run(c.ops);
+            if(ns < 0) {
+                break;
+            }
+            rounds.push_back(static_cast<double>(ns) / c.ops);
+        }
+        if(rounds.empty()) {
+            fprintf(stderr, "%-32s failed\n", c.name.c_str());
+            continue;
+        }
+        sort(rounds.begin(), rounds.end());
+        BenchResult r = {c.name, c.ops, rounds[rounds.size() / 2], rounds.front()};
+        results.push_back(r);
+        fprintf(stderr, "%-32s %12.2f ns/op  (min %.2f)\n", r.name.c_str(), r.nsPerOp, r.minNsPerOp);
+    }
+
+    string json = ToJson(results, repeat);
+    if(outPath) {
+        FILE* fp = fopen(outPath, "w");
+        if(!fp) {
+            perror(outPath);
+            return 2;
+        }
+        fputs(json.c_str(), fp);
+        fclose(fp);
+    } else {
+        fputs(json.c_str(), stdout);
+    }
+
+    if(!basePath) {
+        return 0;
+    }
+    map<string, double> baseline = LoadBaseline(basePath);
+    if(baseline.empty()) {
+        fprintf(stderr, "baseline %s not found or empty\n", basePath);
+        return 2;
+    }
+    int regressions = 0;
+    fprintf(stderr, "\ncompare with %s (threshold %.1f%%)\n", basePath, threshold);
+    for(const BenchResult& r : results) {
+        auto it = baseline.find(r.name);
+        if(it == baseline.end() || it->second <= 0) {
+            fprintf(stderr, "%-32s (no baseline)\n", r.name.c_str());
+            continue;
+        }
+        double change = (r.minNsPerOp / it->second - 1) * 100;
+        bool regressed = change > threshold;
+        regressions += regressed;
+        fprintf(stderr, "%-32s %12.2f -> %12.2f ns/op  %+7.1f%%%s\n",
+                r.name.c_str(), it->second, r.minNsPerOp, change, regressed ? "  REGRESSION" : "");
+    }
+    if(regressions) {
+        fprintf(stderr, "%d benchmark(s) regressed more than %.1f%%\n", regressions, threshold);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,64 @@
+#ifndef BLOOM_FILTER_H
+#define BLOOM_FILTER_H
+
+#include <vector>
+#include <atomic>
+#include <string>
+#include <cstdint>
+#include <cassert>
+
+/*
+    布隆过滤器：MayContain返回false时一定不存在，返回true时可能存在
+    位数组用原子变量，Add和MayContain可以在多个线程中并发调用，不需要加锁
+    双重哈希 h1 + i*h2 模拟 k 个哈希函数
+*/
+class BloomFilter {
+public:
+    explicit BloomFilter(size_t bits = 1 << 20, int hashNum = 7)
+        : bits_((bits + 63) / 64 * 64), hashNum_(hashNum), words_(bits_ / 64) {
+        assert(bits_ > 0 && hashNum_ > 0);
+        for(auto& w : words_) w = 0;
+    }
+
+    void Add(const std::string& key) {
+        uint64_t h1, h2;
+        Hash_(key, h1, h2);
+        for(int i = 0; i < hashNum_; i++) {
+            uint64_t bit = (h1 + i * h2) % bits_;
+            words_[bit / 64].fetch_or(1ULL << (bit % 64), std::memory_order_relaxed);
+        }
+    }
+
+    bool MayContain(const std::string& key) const {
+        uint64_t h1, h2;
+        Hash_(key, h1, h2);
+        for(int i = 0; i < hashNum_; i++) {
+            uint64_t bit = (h1 + i * h2) % bits_;
+            if(!(words_[bit / 64].load(std::memory_order_relaxed) & (1ULL << (bit % 64)))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    // FNV-1a 64位，第二个哈希值由第一个再混合得到（保证是奇数）
+    static void Hash_(const std::string& key, uint64_t& h1, uint64_t& h2) {
+        uint64_t h = 1469598103934665603ULL;
+        for(unsigned char c : key) {
+            h ^= c;
+            h *= 1099511628211ULL;
+        }
+        h1 = h;
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdULL;
+        h ^= h >> 33;
+        h2 = h | 1;
+    }
+
+    size_t bits_;
+    int hashNum_;
+    std::vector<std::atomic<uint64_t>> words_;
+};
+
+#endif // BLOOM_FILTER_H
@@ -0,0 +1,114 @@
+#include "filecache.h"
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <chrono>
+
+FileCache* FileCache::Instance() {
+    static FileCache cache;
+    return &cache;
+}
+
+void FileCache::SetLimits(size_t maxFileBytes, size_t maxTotalBytes, int revalidateMs) {
+    std::lock_guard<std::mutex> locker(mtx_);
+    maxFile_ = maxFileBytes;
+    maxTotal_ = maxTotalBytes;
+    revalidateMs_ = revalidateMs;
+    map_.clear();
+    bytes_ = 0;
+}
+
+int64_t FileCache::NowMs_() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+FileCache::EntryPtr FileCache::Peek(const std::string& path) {
+    if(!Enabled()) {
+        return nullptr;
+    }
+    std::lock_guard<std::mutex> locker(mtx_);
+    auto it = map_.find(path);
+    if(it == map_.end() || NowMs_() - it->second.checkedMs >= revalidateMs_) {
+        return nullptr;
+    }
+    return it->second.entry;    // 命中数由之后生成响应时的Get统计
+}
+
+FileCache::EntryPtr FileCache::Get(const std::string& path) {
+    if(!Enabled()) {
+        return nullptr;
+    }
+    {
+        std::lock_guard<std::mutex> locker(mtx_);
+        auto it = map_.find(path);
+        if(it != map_.end() && NowMs_() - it->second.checkedMs < revalidateMs_) {
+            hits_++;
+            return it->second.entry;
+        }
+    }
+    return Load_(path);
+}
+
+// stat和读文件都不持有锁，两个线程同时加载同一个文件时后放进去的覆盖前面的，内容一样
+FileCache::EntryPtr FileCache::Load_(const std::string& path) {
+    struct stat st;
+    bool ok = stat(path.data(), &st) == 0 && S_ISREG(st.st_mode) && (st.st_mode & S_IROTH) &&
+              static_cast<size_t>(st.st_size) <= maxFile_;
+    {
+        std::lock_guard<std::mutex> locker(mtx_);
+        auto it = map_.find(path);
+        if(it != map_.end()) {
+            const Entry& old = *it->second.entry;
+            if(ok && old.mtime == st.st_mtime && old.data.size() == static_cast<size_t>(st.st_size)) {
+                it->second.checkedMs = NowMs_();    // 文件没变
+                hits_++;
+                return it->second.entry;
+            }
+            bytes_ -= old.data.size();
+            map_.erase(it);
+        }
+        misses_++;
+        if(!ok || bytes_ + st.st_size > maxTotal_) {
+            return nullptr;     // 交给调用方按原来的方式处理（404/403/mmap）
+        }
+    }
+
+    int fd = open(path.data(), O_RDONLY);
+    if(fd < 0) {
+        return nullptr;
+    }
+    auto entry = std::make_shared<Entry>();
+    entry->data.resize(st.st_size);
+    entry->mtime = st.st_mtime;
+    size_t got = 0;
+    while(got < entry->data.size()) {
+        ssize_t len = read(fd, &entry->data[got], entry->data.size() - got);
+        if(len <= 0) {
+            break;
+        }
+        got += len;
+    }
+    close(fd);
+    if(got != entry->data.size()) {
+        return nullptr;     // 读的时候文件被截短了
+    }
+
+    std::lock_guard<std::mutex> locker(mtx_);
+    if(bytes_ + entry->data.size() > maxTotal_ && map_.count(path) == 0) {
+        return entry;       // 这期间别的文件占满了，这次照样用，不放进缓存
+    }
+    Slot& slot = map_[path];
+    if(slot.entry) {
+        bytes_ -= slot.entry->data.size();
+    }
+    slot.entry = entry;
+    slot.checkedMs = NowMs_();
+    bytes_ += entry->data.size();
+    return entry;
+}
+
+size_t FileCache::GetBytes() {
+    std::lock_guard<std::mutex> locker(mtx_);
+    return bytes_;
+}
@@ -0,0 +1,63 @@
+#ifndef FILE_CACHE_H
+#define FILE_CACHE_H
+
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <memory>
+#include <atomic>
+#include <ctime>
+#include <cstdint>
+
+/*
+    静态文件内容缓存（进程内），小文件整个读进内存，响应直接从这里发，不再每次stat + open + mmap
+        只缓存能读的普通文件（和HttpResponse判断200的条件一样），不超过maxFileBytes
+        总量到了maxTotalBytes就不再加入新文件（资源目录一般很小，不做淘汰）
+        条目超过revalidateMs没确认过，下次Get时stat一次，文件改了就重新读，删了就去掉
+    条目是shared_ptr，响应持有它直到发完，期间文件被替换也不影响正在发的内容
+*/
+class FileCache {
+public:
+    struct Entry {
+        std::string data;   // 文件内容
+        time_t mtime;
+    };
+    using EntryPtr = std::shared_ptr<const Entry>;
+
+    static FileCache* Instance();
+    // maxTotalBytes为0时关闭（Get/Peek都返回空），不调用时关闭
+    void SetLimits(size_t maxFileBytes, size_t maxTotalBytes, int revalidateMs = 1000);
+    bool Enabled() const { return maxTotal_ > 0; }
+
+    EntryPtr Get(const std::string& path);     // 不在缓存或需要确认时会stat/读文件，文件不能缓存时返回空
+    EntryPtr Peek(const std::string& path);    // 只查内存：不在缓存或需要确认时返回空，不碰磁盘（主循环线程用）
+
+    uint64_t GetHits() const { return hits_; }
+    uint64_t GetMisses() const { return misses_; }
+    size_t GetBytes();
+
+private:
+    FileCache() = default;
+    ~FileCache() = default;
+
+    struct Slot {
+        EntryPtr entry;
+        int64_t checkedMs;  // 最近一次确认文件没变的时间
+    };
+    static int64_t NowMs_();
+    EntryPtr Load_(const std::string& path);   // stat + 读文件，更新缓存
+
+private:
+    std::mutex mtx_;
+    std::unordered_map<std::string, Slot> map_;
+    size_t bytes_ = 0;
+
+    size_t maxFile_ = 0;
+    size_t maxTotal_ = 0;
+    int revalidateMs_ = 1000;
+
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> misses_{0};
+};
+
+#endif // FILE_CACHE_H
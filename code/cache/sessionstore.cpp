@@ -0,0 +1,347 @@
+#include "sessionstore.h"
+#include "../log/log.h"
+
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <sys/random.h>     // getrandom
+
+using namespace std;
+
+static const char SESSION_MAGIC[8] = {'S', 'E', 'S', 'S', 'I', 'O', 'N', '1'};
+static const uint32_t SESSION_VERSION = 2;     // 2：各分片的占用数放进了文件头
+static_assert(std::atomic<uint32_t>::is_always_lock_free, "shared counters need lock-free atomics");
+
+class SessionStore::Locker {
+public:
+    Locker(SessionStore* store, size_t shard) : store_(store), shard_(shard) { store_->Lock_(shard_); }
+    ~Locker() { store_->Unlock_(shard_); }
+
+private:
+    SessionStore* store_;
+    size_t shard_;
+};
+
+SessionStore* SessionStore::Instance() {
+    static SessionStore store;
+    return &store;
+}
+
+SessionStore::~SessionStore() {
+    if(mem_) {
+        munmap(mem_, memLen_);
+    }
+    if(fd_ >= 0) {
+        close(fd_);
+    }
+}
+
+bool SessionStore::Init(int ttlSec, size_t maxSessions, const char* path) {
+    assert(ttlSec > 0 && maxSessions > 0);
+    ttlSec_ = ttlSec;
+    if(mem_) {
+        munmap(mem_, memLen_);
+        mem_ = nullptr;
+        header_ = nullptr;
+    }
+    if(fd_ >= 0) {
+        close(fd_);
+        fd_ = -1;
+    }
+    perShard_ = (maxSessions * 2 + SHARD_NUM - 1) / SHARD_NUM;
+    size_t slotNum = perShard_ * SHARD_NUM;
+    memLen_ = sizeof(Header) + slotNum * sizeof(Slot);
+
+    if(path && *path) {
+        if(!Map_(path, slotNum)) {
+            return false;
+        }
+    } else {
+        mem_ = mmap(nullptr, memLen_, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(mem_ == MAP_FAILED) {
+            mem_ = nullptr;
+            LOG_ERROR("SessionStore: mmap failed!");
+            return false;
+        }
+        header_ = static_cast<Header*>(mem_);
+        memcpy(header_->magic, SESSION_MAGIC, sizeof(SESSION_MAGIC));
+        header_->version = SESSION_VERSION;
+        header_->slotNum = static_cast<uint32_t>(slotNum);
+    }
+    slots_ = reinterpret_cast<Slot*>(header_ + 1);
+
+    // 重新统计（顺便清掉重启期间过期的会话；之前的进程改到一半崩溃了，占用数也能纠正过来）
+    int64_t now = time(nullptr);
+    for(size_t i = 0; i < SHARD_NUM; i++) {
+        Locker locker(this, i);
+        uint32_t used = 0;
+        Slot* base = Base_(i);
+        for(size_t j = 0; j < perShard_; j++) {
+            if(base[j].token[0]) { used++; }
+        }
+        header_->used[i] = used;
+        ExpireShard_(i, now);
+    }
+    LOG_INFO("SessionStore init: %zu slots, %zu sessions restored, %s", slotNum, GetCount(), path ? path : "memory");
+    return true;
+}
+
+/*
+    文件的格式、容量都对得上就直接映射接着用（热升级时旧进程还在用它）
+    否则在临时文件里建一张空表再rename覆盖：还映射着原文件的进程不受影响（截断它的映射会SIGBUS），各用各的
+*/
+bool SessionStore::Map_(const char* path, size_t slotNum) {
+    int fd = open(path, O_RDWR | O_CLOEXEC);   // CLOEXEC：热升级exec出来的新进程要自己打开，记录锁才分得开
+    if(fd >= 0) {
+        struct stat st = {0};
+        if(fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) == memLen_) {
+            void* mem = mmap(nullptr, memLen_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+            if(mem != MAP_FAILED) {
+                Header* header = static_cast<Header*>(mem);
+                if(memcmp(header->magic, SESSION_MAGIC, sizeof(SESSION_MAGIC)) == 0 &&
+                   header->version == SESSION_VERSION && header->slotNum == slotNum) {
+                    fd_ = fd;
+                    mem_ = mem;
+                    header_ = header;
+                    return true;
+                }
+                munmap(mem, memLen_);
+            }
+        }
+        close(fd);
+    }
+
+    string tmp = string(path) + ".tmp." + to_string(getpid());
+    fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd < 0) {
+        LOG_ERROR("SessionStore: open %s failed!", tmp.c_str());
+        return false;
+    }
+    void* mem = MAP_FAILED;
+    if(ftruncate(fd, memLen_) == 0) {
+        mem = mmap(nullptr, memLen_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    if(mem == MAP_FAILED) {
+        LOG_ERROR("SessionStore: create %s failed!", tmp.c_str());
+        close(fd);
+        unlink(tmp.c_str());
+        return false;
+    }
+    Header* header = static_cast<Header*>(mem);    // ftruncate扩出来的部分都是0：空表
+    memcpy(header->magic, SESSION_MAGIC, sizeof(SESSION_MAGIC));
+    header->version = SESSION_VERSION;
+    header->slotNum = static_cast<uint32_t>(slotNum);
+    if(rename(tmp.c_str(), path) < 0) {
+        LOG_ERROR("SessionStore: rename %s to %s failed!", tmp.c_str(), path);
+        munmap(mem, memLen_);
+        close(fd);
+        unlink(tmp.c_str());
+        return false;
+    }
+    fd_ = fd;
+    mem_ = mem;
+    header_ = header;
+    return true;
+}
+
+/*
+    同一个进程的线程共用一个打开的文件，记录锁挡不住彼此，所以先拿进程内的互斥锁，
+    再拿文件上这个分片的记录锁（第shard个字节，只是约定的加锁位置，和文件内容无关），挡住另一个进程
+*/
+void SessionStore::Lock_(size_t shard) {
+    shards_[shard].mtx.lock();
+    if(fd_ >= 0) {
+        struct flock fl;
+        memset(&fl, 0, sizeof(fl));
+        fl.l_type = F_WRLCK;
+        fl.l_whence = SEEK_SET;
+        fl.l_start = static_cast<off_t>(shard);
+        fl.l_len = 1;
+        while(fcntl(fd_, F_OFD_SETLKW, &fl) < 0 && errno == EINTR) {}
+    }
+}
+
+void SessionStore::Unlock_(size_t shard) {
+    if(fd_ >= 0) {
+        struct flock fl;
+        memset(&fl, 0, sizeof(fl));
+        fl.l_type = F_UNLCK;
+        fl.l_whence = SEEK_SET;
+        fl.l_start = static_cast<off_t>(shard);
+        fl.l_len = 1;
+        fcntl(fd_, F_OFD_SETLK, &fl);
+    }
+    shards_[shard].mtx.unlock();
+}
+
+size_t SessionStore::GetCount() const {
+    if(!header_) {
+        return 0;
+    }
+    size_t total = 0;
+    for(int i = 0; i < SHARD_NUM; i++) {
+        total += header_->used[i].load(memory_order_relaxed);
+    }
+    return total;
+}
+
+// 令牌只能是32个小写十六进制字符，其他一律不查表
+bool SessionStore::IsToken_(const string& token) {
+    if(token.size() != TOKEN_LEN) {
+        return false;
+    }
+    for(char c : token) {
+        if(!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// 令牌本身就是随机数，直接取前16个十六进制字符当哈希值
+size_t SessionStore::Hash_(const char* token) {
+    size_t h = 0;
+    for(int i = 0; i < 16; i++) {
+        char c = token[i];
+        h = (h << 4) | static_cast<size_t>(c <= '9' ? c - '0' : c - 'a' + 10);
+    }
+    return h;
+}
+
+bool SessionStore::Find_(size_t shard, const char* token, size_t* idx) {
+    Slot* base = Base_(shard);
+    size_t i = (Hash_(token) / SHARD_NUM) % perShard_;
+    for(size_t k = 0; k < perShard_; k++) {
+        if(!base[i].token[0]) {
+            *idx = i;   // 空槽：没找到，插入位置
+            return false;
+        }
+        if(memcmp(base[i].token, token, TOKEN_LEN) == 0) {
+            *idx = i;
+            return true;
+        }
+        i = (i + 1) % perShard_;
+    }
+    *idx = perShard_;   // 分片满了
+    return false;
+}
+
+// 后移删除：把后面本该更靠前的元素挪到空出来的位置，保证线性探测链不断
+void SessionStore::Erase_(size_t shard, size_t idx) {
+    Slot* base = Base_(shard);
+    size_t i = idx, j = idx;
+    while(true) {
+        base[i].token[0] = 0;
+        while(true) {
+            j = (j + 1) % perShard_;
+            if(!base[j].token[0]) {
+                header_->used[shard]--;
+                return;
+            }
+            size_t k = (Hash_(base[j].token) / SHARD_NUM) % perShard_;  // j处元素的理想位置
+            // k 落在 (i, j] 之间说明 j 不需要前移
+            bool stay = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+            if(!stay) { break; }
+        }
+        base[i] = base[j];
+        i = j;
+    }
+}
+
+size_t SessionStore::ExpireShard_(size_t shard, int64_t now) {
+    Slot* base = Base_(shard);
+    size_t cnt = 0;
+    for(size_t j = 0; j < perShard_; ) {
+        if(base[j].token[0] && base[j].expires <= now) {
+            Erase_(shard, j);
+            cnt++;
+            continue;   // 后面的元素可能挪到了j，再看一次
+        }
+        j++;
+    }
+    return cnt;
+}
+
+string SessionStore::Create(const string& name) {
+    if(!mem_ || name.empty() || name.size() >= NAME_LEN) {
+        return "";
+    }
+    unsigned char rnd[TOKEN_LEN / 2];
+    if(getrandom(rnd, sizeof(rnd), 0) != static_cast<ssize_t>(sizeof(rnd))) {
+        return "";
+    }
+    static const char HEX[] = "0123456789abcdef";
+    string token(TOKEN_LEN, '0');
+    for(int i = 0; i < TOKEN_LEN / 2; i++) {
+        token[2 * i] = HEX[rnd[i] >> 4];
+        token[2 * i + 1] = HEX[rnd[i] & 0xf];
+    }
+
+    size_t shard = Hash_(token.data()) % SHARD_NUM;
+    Locker locker(this, shard);
+    int64_t now = time(nullptr);
+    if(header_->used[shard] >= perShard_ * 3 / 4 && ExpireShard_(shard, now) == 0) {
+        LOG_WARN("SessionStore: shard %zu is full!", shard);
+        return "";  // 负载太高线性探测会变慢，宁可不发令牌
+    }
+    size_t idx = 0;
+    if(Find_(shard, token.data(), &idx) || idx == perShard_) {
+        return "";  // 128位随机数撞上了，不可能发生
+    }
+    Slot& slot = Base_(shard)[idx];
+    memcpy(slot.name, name.c_str(), name.size() + 1);
+    slot.expires = now + ttlSec_;
+    memcpy(slot.token, token.data(), TOKEN_LEN);    // 最后写令牌，槽才算占用
+    header_->used[shard]++;
+    return token;
+}
+
+bool SessionStore::Verify(const string& token, string* name) {
+    if(!mem_ || !IsToken_(token)) {
+        return false;
+    }
+    size_t shard = Hash_(token.data()) % SHARD_NUM;
+    Locker locker(this, shard);
+    size_t idx = 0;
+    if(!Find_(shard, token.data(), &idx)) {
+        return false;
+    }
+    Slot& slot = Base_(shard)[idx];
+    if(slot.expires <= time(nullptr)) {
+        Erase_(shard, idx);
+        return false;
+    }
+    if(name) {
+        name->assign(slot.name, strnlen(slot.name, NAME_LEN));
+    }
+    return true;
+}
+
+void SessionStore::Remove(const string& token) {
+    if(!mem_ || !IsToken_(token)) {
+        return;
+    }
+    size_t shard = Hash_(token.data()) % SHARD_NUM;
+    Locker locker(this, shard);
+    size_t idx = 0;
+    if(Find_(shard, token.data(), &idx)) {
+        Erase_(shard, idx);
+    }
+}
+
+size_t SessionStore::Expire(int shardNum) {
+    if(!mem_) {
+        return 0;
+    }
+    int64_t now = time(nullptr);
+    size_t cnt = 0;
+    for(int i = 0; i < shardNum && i < SHARD_NUM; i++) {
+        size_t shard = cursor_++ % SHARD_NUM;
+        Locker locker(this, shard);
+        cnt += ExpireShard_(shard, now);
+    }
+    return cnt;
+}
@@ -0,0 +1,80 @@
+#ifndef SESSION_STORE_H
+#define SESSION_STORE_H
+
+#include <string>
+#include <mutex>
+#include <atomic>
+#include <ctime>
+#include <cstdint>
+
+/*
+    登录会话表：登录成功后发一个随机令牌（Set-Cookie: sid=...），之后带着有效令牌的请求O(1)认证，不再查数据库
+        存储：固定容量的开放寻址哈希表（线性探测，删除用后移法，不留墓碑），按令牌哈希分片，每个分片一把锁
+        过期：Verify 时顺带检查；另外由主循环的定时器周期调用 Expire，每次清理几个分片回收空间
+        持久化：Init 传入文件路径时，表直接放在 mmap(MAP_SHARED) 的文件里，进程重启后会话仍然有效
+               （写入即进入页缓存，进程崩溃也不丢；机器掉电会丢失最近的写入）
+        多进程：热升级时新旧两个进程同时映射同一个文件，分片锁除了进程内的互斥锁，还要拿文件上这个分片的
+               OFD记录锁（fcntl F_OFD_SETLKW，进程退出时内核自动释放），各分片的占用数也放在文件里；
+               文件格式或容量变了时在临时文件里重建再rename过去，不截断别的进程还映射着的文件
+*/
+class SessionStore {
+public:
+    static const int TOKEN_LEN = 32;    // 16字节随机数的十六进制
+    static const int NAME_LEN = 56;     // 用户名 char(50) + '\0'
+
+    static SessionStore* Instance();
+    // maxSessions：容量（实际槽数是它的两倍，负载不超过一半）；path为空则只放在内存
+    bool Init(int ttlSec, size_t maxSessions, const char* path = nullptr);
+
+    std::string Create(const std::string& name);    // 新建会话，返回令牌；表满时返回空串
+    bool Verify(const std::string& token, std::string* name);
+    void Remove(const std::string& token);
+    size_t Expire(int shardNum);    // 清理接下来shardNum个分片里过期的会话，返回清理的个数
+
+    int GetTtl() const { return ttlSec_; }
+    size_t GetCount() const;
+
+private:
+    SessionStore() = default;
+    ~SessionStore();
+
+    static const int SHARD_NUM = 64;
+
+    struct Slot {
+        char token[TOKEN_LEN];  // 首字节为0表示空槽
+        char name[NAME_LEN];
+        int64_t expires;        // 过期时间（unix秒，重启后依然有意义）
+    };
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t slotNum;
+        std::atomic<uint32_t> used[SHARD_NUM];  // 各分片已占用的槽数（和槽一样在进程间共享）
+    };
+    struct alignas(64) Shard {
+        std::mutex mtx;
+    };
+    class Locker;           // 分片锁：进程内的互斥锁 + 文件上的记录锁
+
+    static bool IsToken_(const std::string& token);
+    static size_t Hash_(const char* token);
+    Slot* Base_(size_t shard) { return slots_ + shard * perShard_; }
+    bool Find_(size_t shard, const char* token, size_t* idx);
+    void Erase_(size_t shard, size_t idx);
+    size_t ExpireShard_(size_t shard, int64_t now);    // 持有分片锁调用
+    void Lock_(size_t shard);
+    void Unlock_(size_t shard);
+    bool Map_(const char* path, size_t slotNum);    // 打开/重建文件并映射，fd_留着加记录锁
+
+    int ttlSec_ = 3600;
+    int fd_ = -1;               // 映射的文件，只放在内存时为-1
+    void* mem_ = nullptr;       // 映射区：Header + Slot[slotNum]
+    size_t memLen_ = 0;
+    Header* header_ = nullptr;
+    Slot* slots_ = nullptr;
+    size_t perShard_ = 0;       // 每个分片的槽数
+    Shard shards_[SHARD_NUM];
+    std::atomic<size_t> cursor_{0};     // Expire 下一次从哪个分片开始
+};
+
+#endif // SESSION_STORE_H
@@ -0,0 +1,131 @@
+#include "usercache.h"
+
+#include <functional>
+#include <cstring>
+#include <sys/random.h>     // getrandom
+#include <openssl/evp.h>    // EVP_Digest / SHA256
+#include <openssl/crypto.h> // CRYPTO_memcmp
+
+using namespace std;
+
+UserCache* UserCache::Instance() {
+    static UserCache cache;
+    return &cache;
+}
+
+void UserCache::Init(int ttlSec, int negTtlSec, size_t maxEntries, size_t bloomBits) {
+    ttlSec_ = ttlSec;
+    negTtlSec_ = negTtlSec;
+    maxPerShard_ = maxEntries / SHARD_NUM + 1;
+    bloom_ = make_unique<BloomFilter>(bloomBits, 7);
+    bloomReady_ = false;
+    for(auto& shard : shards_) {
+        lock_guard<mutex> locker(shard.mtx);
+        shard.map.clear();
+    }
+}
+
+UserCache::Shard& UserCache::GetShard_(const string& name) {
+    return shards_[hash<string>()(name) % SHARD_NUM];
+}
+
+// SHA256(盐 + 密码)
+void UserCache::Digest_(const unsigned char* salt, const string& pwd, unsigned char* out) {
+    string input(reinterpret_cast<const char*>(salt), 16);
+    input += pwd;
+    unsigned int len = 0;
+    EVP_Digest(input.data(), input.size(), out, &len, EVP_sha256(), nullptr);
+}
+
+UserCache::Result UserCache::Verify(const string& name, const string& pwd) {
+    Shard& shard = GetShard_(name);
+    Entry entry;
+    {
+        lock_guard<mutex> locker(shard.mtx);
+        auto it = shard.map.find(name);
+        if(it == shard.map.end()) {
+            misses_++;
+            return MISS;
+        }
+        if(it->second.expires <= time(nullptr)) {
+            shard.map.erase(it);    // 过期了，顺便删掉
+            misses_++;
+            return MISS;
+        }
+        entry = it->second;
+    }
+    hits_++;
+    if(!entry.exists) {
+        return NOT_EXIST;
+    }
+    // 哈希放在锁外算；比较用定长比较，避免时间侧信道
+    unsigned char hash[32];
+    Digest_(entry.salt, pwd, hash);
+    return CRYPTO_memcmp(hash, entry.hash, sizeof(hash)) == 0 ? MATCH : MISMATCH;
+}
+
+void UserCache::PutUser(const string& name, const string& pwd) {
+    Entry entry;
+    entry.exists = true;
+    if(getrandom(entry.salt, sizeof(entry.salt), 0) != sizeof(entry.salt)) {
+        return;     // 拿不到随机数就不缓存
+    }
+    Digest_(entry.salt, pwd, entry.hash);
+    entry.expires = time(nullptr) + ttlSec_;
+    Put_(name, entry);
+}
+
+void UserCache::PutNotExist(const string& name) {
+    Entry entry;
+    memset(&entry, 0, sizeof(entry));
+    entry.exists = false;
+    entry.expires = time(nullptr) + negTtlSec_;
+    Put_(name, entry);
+}
+
+void UserCache::Put_(const string& name, const Entry& entry) {
+    Shard& shard = GetShard_(name);
+    lock_guard<mutex> locker(shard.mtx);
+    if(shard.map.size() >= maxPerShard_ && !shard.map.count(name)) {
+        // 分片满了：先清掉过期的，还不够就随便淘汰一个
+        time_t now = time(nullptr);
+        for(auto it = shard.map.begin(); it != shard.map.end(); ) {
+            if(it->second.expires <= now) it = shard.map.erase(it);
+            else ++it;
+        }
+        if(shard.map.size() >= maxPerShard_) {
+            shard.map.erase(shard.map.begin());
+        }
+    }
+    shard.map[name] = entry;
+}
+
+void UserCache::Invalidate(const string& name) {
+    Shard& shard = GetShard_(name);
+    lock_guard<mutex> locker(shard.mtx);
+    shard.map.erase(name);
+}
+
+void UserCache::AddToBloom(const string& name) {
+    if(bloom_) bloom_->Add(name);
+}
+
+void UserCache::SetBloomReady(bool ready) {
+    bloomReady_ = ready;
+}
+
+bool UserCache::MayExist(const string& name) {
+    if(!bloom_ || !bloomReady_) {
+        return true;    // 没装载完，不能下"一定不存在"的结论
+    }
+    if(!bloom_->MayContain(name)) {
+        bloomSkips_++;
+        return false;
+    }
+    return true;
+}
+
+double UserCache::GetHitRatio() const {
+    uint64_t hits = hits_, misses = misses_;
+    return hits + misses == 0 ? 0.0 : static_cast<double>(hits) / (hits + misses);
+}
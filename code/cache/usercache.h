@@ -0,0 +1,87 @@
+#ifndef USER_CACHE_H
+#define USER_CACHE_H
+
+#include <string>
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <ctime>
+#include <cstdint>
+
+#include "bloomfilter.h"
+
+/*
+    登录凭据缓存（进程内），挡在 SqlConnPool 前面
+        正缓存：用户名 -> 随机盐 + SHA256(盐 + 密码)，内存里不保存明文密码
+        负缓存：用户名不存在（TTL更短），挡住对不存在用户的反复登录
+        布隆过滤器：启动时装入所有用户名，注册时若判定"一定不存在"就跳过查重的SELECT
+    都按字节比较用户名，只有存储有唯一约束兜底（UserStore::UniqueNames）时才用来跳过查重
+    按用户名哈希分片，每个分片一把锁
+*/
+class UserCache {
+public:
+    enum Result {
+        MISS,           // 缓存里没有，需要查数据库
+        MATCH,          // 用户存在且密码正确
+        MISMATCH,       // 用户存在但密码错误
+        NOT_EXIST,      // 用户不存在（负缓存）
+    };
+
+    static UserCache* Instance();
+    void Init(int ttlSec = 300, int negTtlSec = 30, size_t maxEntries = 100000,
+              size_t bloomBits = 1 << 24);
+
+    Result Verify(const std::string& name, const std::string& pwd);
+    void PutUser(const std::string& name, const std::string& pwd);  // 数据库查到的用户
+    void PutNotExist(const std::string& name);                      // 数据库查不到的用户
+    void Invalidate(const std::string& name);                       // 注册、修改密码后立即失效
+
+    // 布隆过滤器：只有全部用户名都装载完成（SetBloomReady）后才会返回false
+    void AddToBloom(const std::string& name);
+    void SetBloomReady(bool ready);
+    bool MayExist(const std::string& name);
+
+    // 统计
+    uint64_t GetHits() const { return hits_; }
+    uint64_t GetMisses() const { return misses_; }
+    uint64_t GetBloomSkips() const { return bloomSkips_; }
+    uint64_t GetQueriesSaved() const { return hits_ + bloomSkips_; }   // 省掉的数据库查询
+    double GetHitRatio() const;
+
+private:
+    UserCache() = default;
+    ~UserCache() = default;
+
+    struct Entry {
+        bool exists;
+        unsigned char salt[16];
+        unsigned char hash[32];
+        time_t expires;
+    };
+    struct Shard {
+        std::mutex mtx;
+        std::unordered_map<std::string, Entry> map;
+    };
+
+    Shard& GetShard_(const std::string& name);
+    void Put_(const std::string& name, const Entry& entry);
+    static void Digest_(const unsigned char* salt, const std::string& pwd, unsigned char* out);
+
+private:
+    static const int SHARD_NUM = 16;
+
+    Shard shards_[SHARD_NUM];
+    int ttlSec_ = 300;
+    int negTtlSec_ = 30;
+    size_t maxPerShard_ = 100000 / SHARD_NUM;
+
+    std::unique_ptr<BloomFilter> bloom_;
+    std::atomic<bool> bloomReady_{false};
+
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> misses_{0};
+    std::atomic<uint64_t> bloomSkips_{0};
+};
+
+#endif // USER_CACHE_H
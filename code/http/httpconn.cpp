@@ -1,14 +1,32 @@
 #include "httpconn.h"
+#include "../metrics/probes.h"
+#include <algorithm>
+#include <cstring>
 using namespace std;
 
 const char* HttpConn::srcDir;
 std::atomic<int> HttpConn::userCount;
 bool HttpConn::isET;
+int HttpConn::keepAliveSec = 60;
+int HttpConn::maxRequests = 0;
+bool HttpConn::metricsOnMainPort = true;
+std::atomic<bool> HttpConn::draining(false);
+
+static std::atomic<uint64_t> connSeq(0);   // 分配连接序号
 
 HttpConn::HttpConn() { 
     fd_ = -1;
+    seq_ = 0;
     addr_ = { 0 };
     isClose_ = true;
+    keepAlive_ = false;
+    admin_ = false;
+    reqCount_ = 0;
+    reqClass_ = CLASS_STATIC;
+    phase_ = HEADER;
+    busy_ = false;
+    expired_ = false;
+    timerPhase_ = HEADER;
 };
 
 HttpConn::~HttpConn() { 
@@ -25,25 +43,39 @@ void HttpConn::Close() {
     }
 }
 
-void HttpConn::init(int fd, const sockaddr_in& addr) {
+void HttpConn::init(int fd, const sockaddr_in& addr, bool admin) {
     assert(fd > 0);
     userCount++;
     fd_ = fd;
+    seq_ = ++connSeq;
     addr_ = addr;
     writeBuff_.RetrieveAll();
     readBuff_.RetrieveAll();
     isClose_ = false;
+    keepAlive_ = false;
+    admin_ = admin;
+    reqCount_ = 0;
+    reqClass_ = admin ? CLASS_ADMIN : CLASS_STATIC;
+    phase_ = HEADER;
+    busy_ = false;
+    expired_ = false;
+    timerPhase_ = HEADER;
+    trace_.Reset();
     LOG_INFO("Client[%d](%s:%d) in, userCount:%d", fd_, GetIP(), GetPort(), (int)userCount);
 }
 
 ssize_t HttpConn::read(int* saveErrno) {
     ssize_t len = -1;
+    bool fresh = readBuff_.ReadableBytes() == 0;
     do {
         len = readBuff_.ReadFd(fd_, saveErrno); // 将fd的内容读到readBuff_缓冲区，会用到iovec
         if (len <= 0) {
             break;
         }
     } while (isET); // ET:边沿触发要一次性全部读出
+    if(fresh && readBuff_.ReadableBytes() > 0) {
+        trace_.Begin(ReqTrace::Timing() ? Metrics::NowUs() : 0);   // 新请求的第一个字节
+    }
     return len;
 }
 
@@ -52,18 +84,126 @@ bool HttpConn::process() {
     if(readBuff_.ReadableBytes() <= 0) {
         return false;
     }
-    else if(request_.parse(readBuff_)) {
+
+    // 请求没收完就继续读，连接进入收请求头/正文的阶段
+    size_t len = 0;
+    HttpRequest::SCAN_STATE scan = HttpRequest::Scan(readBuff_, &len);
+    if(scan == HttpRequest::SCAN_HEADER || scan == HttpRequest::SCAN_BODY) {
+        SetPhase(scan == HttpRequest::SCAN_HEADER ? HEADER : BODY);
+        return false;
+    }
+    bool ok = false;
+    WS_PROBE(request__start, fd_);
+    if(scan == HttpRequest::SCAN_OK) {
+        reqCount_++;
+        // 只把这一个请求交给parse（parse会清空给它的缓冲区），流水线里后面的请求留到这个响应发完再处理
+        Buffer one(len);
+        one.Append(readBuff_.Peek(), len);
+        readBuff_.Retrieve(len);
+        ok = request_.parse(one);
+    } else {
+        LOG_WARN("Client[%d] request too large", fd_);
+        readBuff_.RetrieveAll();
+    }
+    trace_.Mark(ReqTrace::PARSE_DONE);
+    WS_PROBE(request__parsed, fd_, ok, request_.method().c_str(), request_.path().c_str());
+    if(admin_ || request_.path() == Metrics::PATH) {
+        reqClass_ = CLASS_ADMIN;
+    } else {
+        reqClass_ = ok && request_.IsVerifyPending() ? CLASS_DB : CLASS_STATIC;
+    }
+    if(ok && request_.IsVerifyPending() && !admin_) {
+        return false;   // 需要查数据库，先挂起，等FinishVerify
+    }
+    MakeResponse_(ok ? 200 : 400);
+    return true;
+}
+
+/*
+    主循环线程的快速路径用（见WebServer::SetInlineFastPath），要判断得很便宜：
+    只取请求行里的方法和路径，按ParsePath_的规则补全后查FileCache
+    登录/注册页（带会话时会换成欢迎页）、/metrics、管理端口的连接都不走快速路径
+*/
+bool HttpConn::IsCachedGet(size_t maxBytes) const {
+    if(admin_ || HttpRequest::Scan(readBuff_) != HttpRequest::SCAN_OK) {
+        return false;
+    }
+    const char CRLF[] = "\r\n";
+    const char* begin = readBuff_.Peek();
+    const char* lineEnd = search(begin, readBuff_.BeginWriteConst(), CRLF, CRLF + 2);
+    if(lineEnd - begin < 4 || memcmp(begin, "GET ", 4) != 0) {
+        return false;
+    }
+    const char* pathEnd = find(begin + 4, lineEnd, ' ');
+    if(lineEnd - pathEnd < 6 || memcmp(pathEnd, " HTTP/", 6) != 0) {
+        return false;
+    }
+    std::string path = HttpRequest::MapPath(std::string(begin + 4, pathEnd));
+    if(path == Metrics::PATH || HttpRequest::IsVerifyPath(path)) {
+        return false;
+    }
+    FileCache::EntryPtr entry = FileCache::Instance()->Peek(srcDir + path);
+    return entry && entry->data.size() <= maxBytes;
+}
+
+void HttpConn::FinishVerify(int ret) {
+    trace_.Mark(ReqTrace::VERIFY_DONE);
+    std::string cookie;
+    if(ret > 0 && request_.IsLogin()) {
+        // 登录成功，发会话令牌，之后带着它访问登录页不用再查数据库
+        SessionStore* sessions = SessionStore::Instance();
+        std::string token = sessions->Create(request_.GetPost("username"));
+        if(!token.empty()) {
+            cookie = "Set-Cookie: sid=" + token + "; Max-Age=" + std::to_string(sessions->GetTtl()) +
+                     "; Path=/; HttpOnly; SameSite=Lax\r\n";
+        }
+    }
+    request_.SetVerifyResult(ret);
+    MakeResponse_(ret < 0 ? 503 : 200, cookie);
+}
+
+void HttpConn::MakeResponse_(int code, const std::string& header) {
+    // 管理端口只提供/metrics，业务端口在没有单独管理端口时也提供
+    bool metrics = code == 200 && request_.path() == Metrics::PATH &&
+                   (admin_ || metricsOnMainPort) && Metrics::Instance()->Enabled();
+    if(code == 200 && admin_ && !metrics) {
+        code = 404;
+    }
+    // 达到单连接请求数上限后、服务器正在退出时，这个响应发完就关闭
+    keepAlive_ = code != 400 && request_.IsKeepAlive() && (maxRequests <= 0 || reqCount_ < maxRequests) &&
+                 !draining.load(std::memory_order_relaxed);
+    if(code == 200) {
         LOG_DEBUG("%s", request_.path().c_str());
         // 状态码200，代表OK
         // 请求成功。一般用于GET与POST请求
-        response_.Init(srcDir, request_.path(), request_.IsKeepAlive(), 200);
+        response_.Init(srcDir, request_.path(), keepAlive_, 200);
+    } else if(code == 503) {
+        // 状态码503，代表Service Unavailable
+        // 数据库暂时不可用（连接池等待超时），让客户端稍后重试
+        response_.Init(srcDir, request_.path(), keepAlive_, 503);
+    } else if(code == 404) {
+        response_.Init(srcDir, request_.path(), keepAlive_, 404);
     } else {
         // 状态码400，代表BAD Request
         // 客户端请求的语法错误，服务器无法理解
+        request_.path() = "/400.html";     // 请求没解析出路径时按空路径找文件会变成404
         response_.Init(srcDir, request_.path(), false, 400);
     }
+    if(keepAlive_) {
+        // 告诉客户端实际的空闲超时和这个连接还能发几个请求
+        std::string line = "Keep-Alive: timeout=" + std::to_string(keepAliveSec);
+        if(maxRequests > 0) { line += ", max=" + std::to_string(maxRequests - reqCount_); }
+        response_.AddHeader(line + "\r\n");
+    }
+    if(!header.empty()) {
+        response_.AddHeader(header);
+    }
 
-    response_.MakeResponse(writeBuff_); // 生成响应报文放入writeBuff_中
+    if(metrics) {
+        response_.MakeBodyResponse(writeBuff_, "text/plain; version=0.0.4", Metrics::Instance()->Render());
+    } else {
+        response_.MakeResponse(writeBuff_); // 生成响应报文放入writeBuff_中
+    }
     // 响应头
     iov_[0].iov_base = const_cast<char*>(writeBuff_.Peek());
     iov_[0].iov_len = writeBuff_.ReadableBytes();
@@ -76,12 +216,40 @@ bool HttpConn::process() {
         iovCnt_ = 2;
     }
     LOG_DEBUG("filesize:%d, %d  to %d", response_.FileLen() , iovCnt_, ToWriteBytes());
-    return true;
+    trace_.Mark(ReqTrace::RESPONSE_BUILT);
+    WS_PROBE(response__start, fd_, response_.Code(), ToWriteBytes());
+}
+
+void HttpConn::BeginBuffered() {
+    trace_.BeginInline(ReqTrace::Timing() ? Metrics::NowUs() : 0);
+}
+
+void HttpConn::FinishRequest() {
+    if(!ReqTrace::Timing()) {
+        return;
+    }
+    Metrics* metrics = Metrics::Instance();
+    int64_t now = Metrics::NowUs();
+    int code = response_.Code();
+    if(code >= 200 && code < 600) {
+        metrics->Add(static_cast<Metrics::Counter>(Metrics::RESP_2XX + code / 100 - 2));
+    }
+    if(trace_.Start()) {
+        metrics->Observe(Metrics::REQUEST_SECONDS, now - trace_.Start());
+    }
+    std::string stages;
+    if(trace_.Finish(now, &stages)) {
+        // 一个慢请求一行，key=value，方便grep和导入
+        LOG_WARN("slow_request fd=%d client=%s:%d method=%s path=%s code=%d %s",
+                 fd_, GetIP(), GetPort(), request_.method().c_str(), request_.path().c_str(),
+                 code, stages.c_str());
+    }
 }
 
 // 主要采用writev连续写函数
 ssize_t HttpConn::write(int* saveErrno) {
     ssize_t len = -1;
+    trace_.MarkOnce(ReqTrace::FIRST_WRITE);
     do {
         len = writev(fd_, iov_, iovCnt_);   // 将iov的内容写到fd(socket)中
         if(len <= 0) {
@@ -11,6 +11,8 @@
 #include "../buffer/buffer.h"
 #include "httprequest.h"
 #include "httpresponse.h"
+#include "../metrics/metrics.h"
+#include "../metrics/reqtrace.h"
 /*
 进行读写数据并调用httprequest 来解析数据以及httpresponse来生成响应
 */
@@ -19,13 +21,34 @@ public:
     static bool isET;                   // ET模式
     static const char* srcDir;          // HTTP 服务器的资源目录路径，用于加载静态文件（HTML、CSS、JS 等）
     static std::atomic<int> userCount;  // 用户连接数，原子操作
+    static int keepAliveSec;            // Keep-Alive响应头里的timeout（和服务器实际的空闲超时一致）
+    static int maxRequests;             // 一个连接最多处理的请求数，0为不限
+    static bool metricsOnMainPort;      // 业务端口上是否提供/metrics（配置了单独的管理端口时为false）
+    static std::atomic<bool> draining;  // 服务器正在退出（见WebServer::SetGracefulShutdown），之后的响应都带Connection: close
+
+    // 连接所处阶段，每个阶段有自己的超时（见WebServer::SetTimeouts）
+    enum Phase {
+        IDLE,       // keep-alive，等下一个请求
+        HEADER,     // 收请求头
+        BODY,       // 收正文
+        WRITE,      // 发响应
+    };
+
+    // 请求的分类（解析之后才知道），连接的读写任务按它进工作线程池的不同队列（见WebServer::SetRequestClasses）
+    // 读下一个请求时还没解析，沿用上一个请求的分类：新连接算静态，管理端口的连接一直是ADMIN
+    enum ReqClass {
+        CLASS_STATIC,   // 静态文件
+        CLASS_DB,       // 登录/注册，要查数据库
+        CLASS_ADMIN,    // /metrics
+        CLASS_NUM,
+    };
 
 public:
     HttpConn();
     ~HttpConn();
     void Close();
     
-    void init(int sockFd, const sockaddr_in& addr);
+    void init(int sockFd, const sockaddr_in& addr, bool admin = false);    // admin：管理端口的连接，只提供/metrics
     /*
         将fd的内容读到readBuff_缓冲区
     */
@@ -43,6 +66,14 @@ public:
         若无误则存在正文，通过mmap的mmFile_和mmFileStat_封装进iov_[1]
     */
     bool process(); 
+    /*
+        登录/注册请求：process解析完后返回false且IsVerifyPending为true，连接挂起
+        数据库线程验证完后，由主循环调用FinishVerify生成响应，之后和process返回true一样等待写
+    */
+    bool IsVerifyPending() const { return request_.IsVerifyPending(); }
+    bool IsLogin() const { return request_.IsLogin(); }
+    std::string GetPost(const char* key) const { return request_.GetPost(key); }
+    void FinishVerify(int ret);     // ret为UserVerify的返回值，-1时响应503
     /*
         处理iov_，全部（分批次）写入fd(socket)
     */
@@ -52,6 +83,7 @@ public:
     // 简单接口
     bool GetIsClose() { return isClose_; }
     int GetFd() const;
+    uint64_t GetSeq() const { return seq_; }
     int GetPort() const;
     const char* GetIP() const;
     sockaddr_in GetAddr() const;
@@ -59,19 +91,52 @@ public:
     int ToWriteBytes() { 
         return iov_[0].iov_len + iov_[1].iov_len; 
     }
-    bool IsKeepAlive() const {
-        return request_.IsKeepAlive();
-    }
+    bool IsKeepAlive() const { return keepAlive_; }     // 当前响应发完后是否保持连接
+    int GetCode() const { return response_.Code(); }    // 当前响应的状态码
+    int GetReqCount() const { return reqCount_; }       // 连接上已经收完的请求数
+    ReqClass GetClass() const { return reqClass_; }
+    bool IsAdmin() const { return admin_; }             // 管理端口的连接
+    // 请求的分阶段时间戳；响应发完时调用FinishRequest记请求耗时、各阶段直方图，慢请求打一行日志
+    ReqTrace& Trace() { return trace_; }
+    void FinishRequest();
+    void BeginBuffered();   // 流水线里的下一个请求已经在读缓冲区里，从现在开始计时
+    // 读缓冲区里是一个完整的GET，请求的文件在FileCache里且不超过maxBytes（只看请求行，不解析，不碰磁盘）
+    bool IsCachedGet(size_t maxBytes) const;
+    bool HasBuffered() const { return readBuff_.ReadableBytes() > 0; }   // 流水线：已经收到了后面的请求
+    size_t ReadableBytes() const { return readBuff_.ReadableBytes(); }
+    // 阶段由当前持有连接的一方设置（主循环或工作线程，交接都经过线程池队列/LoopQueue）
+    Phase GetPhase() const { return phase_; }
+    void SetPhase(Phase phase) { phase_ = phase; }
+
+    // 以下只由主循环访问
+    bool IsBusy() const { return busy_; }               // 交给了工作线程（或在等数据库），不能销毁
+    void SetBusy(bool busy) { busy_ = busy; }
+    bool IsExpired() const { return expired_; }         // 忙的时候超时了，交回主循环时关闭
+    void SetExpired() { expired_ = true; }
+    Phase GetTimerPhase() const { return timerPhase_; } // 定时器当前按哪个阶段设置的
+    void SetTimerPhase(Phase phase) { timerPhase_ = phase; }
 
 private:
+    void MakeResponse_(int code, const std::string& header = "");  // 生成响应报文，封装进iov_；header为额外的响应头
+
     HttpRequest request_;
     HttpResponse response_;
 
     int fd_;
+    uint64_t seq_;          // 连接序号，fd会被复用，异步回调用(fd, seq)确认还是同一个连接
     struct  sockaddr_in addr_;
     Buffer readBuff_;       // 读缓冲区
     Buffer writeBuff_;      // 写缓冲区
     bool isClose_;
+    bool keepAlive_;
+    bool admin_;
+    int reqCount_;          // 已经收完的请求数
+    ReqClass reqClass_;     // 最近一个请求的分类
+    ReqTrace trace_;
+    Phase phase_;
+    bool busy_;
+    bool expired_;
+    Phase timerPhase_;
     
     int iovCnt_;
     struct iovec iov_[2];
@@ -9,9 +9,15 @@ const unordered_set<string> HttpRequest::DEFAULT_HTML{
 const unordered_map<string, int> HttpRequest::DEFAULT_HTML_TAG {
             {"/register.html", 0}, {"/login.html", 1},  };
 
+// 登录查询按用户名合并（注册的去重由RegBatcher的预留集合负责）
+SingleFlight<string, HttpRequest::UserRow> HttpRequest::loginFlight_;
+std::atomic<bool> HttpRequest::coalesce_{true};
+
 void HttpRequest::Init() {
     state_ = REQUEST_LINE;
     method_ = path_ = version_ = body_ = "";
+    sessionUser_.clear();
+    verifyTag_ = -1;
     header_.clear();
     post_.clear();
 }
@@ -65,11 +71,48 @@ bool HttpRequest::parse(Buffer& buff) {
         if (state_ != FINISH) buff.RetrieveUntil(lineEnd + 2); // 读指针跳过回车换行
     }
     buff.RetrieveAll(); // 清空好习惯
+    CheckSession_();
     LOG_DEBUG("[%s], [%s], [%s]", method_.c_str(), path_.c_str(), version_.c_str());
     return true;
 }
 
 
+/*
+    只找请求头结束的空行和Content-Length，不解析内容
+    慢速客户端一个字节一个字节地发，每次只是在已收到的数据里查找，不会反复走正则
+    流水线（一次收到多个请求）时只看第一个，len给出它的长度，后面的留在缓冲区里
+*/
+HttpRequest::SCAN_STATE HttpRequest::Scan(const Buffer& buff, size_t* len) {
+    const char HEAD_END[] = "\r\n\r\n";
+    const char* begin = buff.Peek();
+    const char* end = buff.BeginWriteConst();
+    const char* headEnd = search(begin, end, HEAD_END, HEAD_END + 4);
+    if(headEnd == end) {
+        return buff.ReadableBytes() > MAX_HEADER_BYTES ? SCAN_TOO_LARGE : SCAN_HEADER;
+    }
+    if(static_cast<size_t>(headEnd - begin) > MAX_HEADER_BYTES) {
+        return SCAN_TOO_LARGE;
+    }
+    // 字段名不区分大小写
+    const char KEY[] = "\r\ncontent-length:";
+    const char* p = search(begin, headEnd, KEY, KEY + sizeof(KEY) - 1, [](char a, char b) {
+        return tolower(static_cast<unsigned char>(a)) == b;
+    });
+    size_t bodyLen = 0;
+    if(p != headEnd) {
+        p += sizeof(KEY) - 1;
+        while(p < headEnd && (*p == ' ' || *p == '\t')) { p++; }
+        for(; p < headEnd && isdigit(static_cast<unsigned char>(*p)); p++) {
+            bodyLen = bodyLen * 10 + (*p - '0');
+            if(bodyLen > MAX_BODY_BYTES) { return SCAN_TOO_LARGE; }
+        }
+    }
+    if(static_cast<size_t>(end - headEnd - 4) < bodyLen) {
+        return SCAN_BODY;
+    }
+    if(len) { *len = headEnd + 4 - begin + bodyLen; }
+    return SCAN_OK;
+}
 
 // 处理请求行
 bool HttpRequest::ParseRequestLine_(const string& line) {
@@ -78,7 +121,7 @@ bool HttpRequest::ParseRequestLine_(const string& line) {
     // ([^ ]*)：第二个捕获组，匹配路径
     // HTTP/：字面匹配 "HTTP/"
     // ([^ ]*)$：第三个捕获组，匹配版本号直到行尾  
-    regex patten("^([^ ]*) ([^ ]*) HTTP/([^ ]*)$"); 
+    static const regex patten("^([^ ]*) ([^ ]*) HTTP/([^ ]*)$");    // 只编译一次（多个工作线程同时regex_match是安全的）
     smatch subMatch;
 
     // 检查请求行是否匹配正则表达式
@@ -100,17 +143,17 @@ bool HttpRequest::ParseRequestLine_(const string& line) {
 
 // 解析路径
 void HttpRequest::ParsePath_() {
-    if(path_ == "/") {  
-        path_ = "/index.html"; 
+    path_ = MapPath(path_);
+}
+
+string HttpRequest::MapPath(const string& path) {
+    if(path == "/") {  
+        return "/index.html"; 
     }
-    else {
-        for(auto &item: DEFAULT_HTML) {
-            if(item == path_) {
-                path_ += ".html";
-                break;
-            }
-        }
+    if(DEFAULT_HTML.count(path)) {
+        return path + ".html";
     }
+    return path;
 }
 
 void HttpRequest::ParseHeader_(const string& line) {
@@ -119,7 +162,7 @@ void HttpRequest::ParseHeader_(const string& line) {
     // ([^:]*)：第一个捕获组，匹配任意非冒号字符（字段名）
     // : ?：匹配冒号和可选的空格
     // (.*)$：第二个捕获组，匹配剩余的所有字符（字段值）
-    regex patten("^([^:]*): ?(.*)$");
+    static const regex patten("^([^:]*): ?(.*)$");
     smatch subMatch;
     if(regex_match(line, subMatch, patten)) {
         header_[subMatch[1]] = subMatch[2];
@@ -150,18 +193,52 @@ void HttpRequest::ParsePost_() {
             int tag = DEFAULT_HTML_TAG.find(path_)->second; 
             LOG_DEBUG("Tag:%d", tag);
             if(tag == 0 || tag == 1) {
-                bool isLogin = (tag == 1);  // 为1则是登录
-                if(UserVerify(post_["username"], post_["password"], isLogin)) {
-                    path_ = "/welcome.html";
-                } 
-                else {
-                    path_ = "/error.html";
-                }
+                // 这里不直接查数据库，只记下需要验证，由数据库线程异步执行UserVerify
+                // 结果回来后调用SetVerifyResult确定最终的path_
+                verifyTag_ = tag;
             }
         }
     }   
 }
 
+/*
+    Cookie里带着有效的会话令牌（O(1)查会话表，不查数据库）：
+        访问登录页直接进入欢迎页；用同一个用户名提交登录也不再校验密码
+*/
+void HttpRequest::CheckSession_() {
+    string token = GetCookie("sid");
+    if(token.empty() || !SessionStore::Instance()->Verify(token, &sessionUser_)) {
+        sessionUser_.clear();
+        return;
+    }
+    if(path_ == "/login.html" && (method_ == "GET" || (verifyTag_ == 1 && GetPost("username") == sessionUser_))) {
+        LOG_DEBUG("Session user:%s", sessionUser_.c_str());
+        verifyTag_ = -1;
+        path_ = "/welcome.html";
+    }
+}
+
+// Cookie: a=1; sid=xxx
+string HttpRequest::GetCookie(const string& key) const {
+    auto it = header_.find("Cookie");
+    if(it == header_.end()) {
+        return "";
+    }
+    const string& cookie = it->second;
+    size_t pos = 0;
+    while(pos < cookie.size()) {
+        size_t end = cookie.find(';', pos);
+        if(end == string::npos) { end = cookie.size(); }
+        while(pos < end && cookie[pos] == ' ') { pos++; }
+        size_t eq = cookie.find('=', pos);
+        if(eq < end && cookie.compare(pos, eq - pos, key) == 0) {
+            return cookie.substr(eq + 1, end - eq - 1);
+        }
+        pos = end + 1;
+    }
+    return "";
+}
+
 // 16进制字符转换为对应的数值（0-15）
 int HttpRequest::ConverHex(char ch) {
     if (ch >= '0' && ch <= '9') return ch - '0';        // 数字字符
@@ -232,72 +309,105 @@ void HttpRequest::ParseFromUrlencoded_() {
     // assert(j - i == 1);
 }
 
-// 来验证登录或注册请求是否成功
-bool HttpRequest::UserVerify(const string &name, const string &pwd, bool isLogin) {
+// 来验证登录或注册请求是否成功：1 成功，0 失败，-1 数据库不可用（连接池超时等，应返回503）
+int HttpRequest::UserVerify(const string &name, const string &pwd, bool isLogin) {
+    if(!isLogin) {
+        // 注册走写合并，这里同步等待批量提交完成
+        std::promise<int> done;
+        std::future<int> ret = done.get_future();
+        UserRegister(name, pwd, [&done](int r) { done.set_value(r); });
+        return ret.get();
+    }
+
     // 第一步：检查用户名和密码非空
-    if(name == "" || pwd == "") { return false; }
+    if(name == "" || pwd == "") { return 0; }
     LOG_INFO("Verify name:%s pwd:%s", name.c_str(), pwd.c_str());
-    
-    // 第二步：获取数据库连接（通过 RAII 自动管理资源）
-    MYSQL* sql;
-    SqlConnRAII(&sql,  SqlConnPool::Instance());
-    assert(sql);
-    
-    bool flag = false;
-    if(!isLogin) { flag = true; }
-    // 第三步：构造 SQL 查询语句
-    char order[256] = { 0 };
-    snprintf(order, 256, "SELECT username, password FROM user WHERE username='%s' LIMIT 1", name.c_str());
-    LOG_DEBUG("%s", order);
-    // 第四步：执行 SQL 查询语句
-    MYSQL_RES *res = nullptr;
-    if(mysql_query(sql, order)) { 
-        mysql_free_result(res);
-        return false; 
+
+    // 先查凭据缓存，命中就不用去数据库了
+    UserCache::Result cached = UserCache::Instance()->Verify(name, pwd);
+    if(cached != UserCache::MISS) {
+        if(cached != UserCache::MATCH) { LOG_INFO("pwd error!"); }
+        return cached == UserCache::MATCH ? 1 : 0;
     }
-    res = mysql_store_result(sql);
-    unsigned int j = mysql_num_fields(res);
-    MYSQL_FIELD *fields = mysql_fetch_fields(res);
-    // 第五步：处理查询结果（是否已有这个用户名）
-    while(MYSQL_ROW row = mysql_fetch_row(res)) {
-        // 查询到有这个用户名
-        LOG_DEBUG("MYSQL ROW: %s %s", row[0], row[1]);
-        string password(row[1]);
-        
-        if(isLogin) {
-            if(pwd == password) { 
-                // 登录，且密码正确
-                flag = true; 
-            }
-            else {
-                // 登录，但密码不正确
-                flag = false;
-                LOG_INFO("pwd error!");
-            }
-        } 
-        else { 
-            // 注册，但用户名重复
-            flag = false; 
-            LOG_INFO("user used!");
-        }
+
+    // 第二步：同一时刻相同用户名的登录只去数据库查一次，其他请求等待并共享结果
+    UserRow row = coalesce_ ? loginFlight_.Do(name, [&name]() { return LookupUser_(name); }) : LookupUser_(name);
+    if(row.found < 0) { return -1; }
+    if(row.found == 1 && pwd == row.password) {
+        // 登录，且密码正确（每个请求用自己的密码去比对共享的查询结果）
+        LOG_DEBUG( "UserVerify success!!");
+        return 1;
+    }
+    // 登录，但用户不存在或密码不正确
+    LOG_INFO("pwd error!");
+    return 0;
+}
+
+/*
+    注册（不阻塞）：结果通过done回调，1 成功，0 用户名已被使用，-1 数据库不可用
+    用户名先在RegBatcher里预留，同一个用户名同时只有一个注册在途，其余的直接判定为"用户名已被使用"
+    预留成功后交给批处理线程，和同一时间段的其他注册一起查重、多行插入、一次提交，提交后才回调
+*/
+void HttpRequest::UserRegister(const string& name, const string& pwd, const std::function<void(int)>& done) {
+    if(name == "" || pwd == "") {
+        done(0);
+        return;
+    }
+    LOG_INFO("Verify name:%s pwd:%s", name.c_str(), pwd.c_str());
+
+    UserCache* cache = UserCache::Instance();
+    UserCache::Result cached = cache->Verify(name, pwd);
+    if(cached == UserCache::MATCH || cached == UserCache::MISMATCH) {
+        LOG_INFO("user used!");
+        done(0);
+        return;
     }
-    mysql_free_result(res);
-
-    /* 注册行为 且 用户名未被使用*/
-    if(!isLogin && flag == true) {
-        LOG_DEBUG("regirster!");
-        bzero(order, 256);
-        snprintf(order, 256,"INSERT INTO user(username, password) VALUES('%s','%s')", name.c_str(), pwd.c_str());
-        LOG_DEBUG( "%s", order);
-        if(mysql_query(sql, order)) { 
-            LOG_DEBUG( "Insert error!");
-            flag = false; 
+
+    // 负缓存或布隆过滤器能确定用户名一定不存在，就跳过查重
+    // 它们按字节比较用户名，和数据库的比较规则不一定一样（MySQL不区分大小写），只有存储自己有唯一约束兜底时才能跳过
+    bool check = !UserStore::Instance()->UniqueNames() ||
+                 (cached != UserCache::NOT_EXIST && cache->MayExist(name));
+    bool ok = RegBatcher::Instance()->Submit(name, pwd, check, [name, done](int ret) {
+        if(ret == 1) {
+            LOG_DEBUG("regirster!");
+            UserCache::Instance()->Invalidate(name);    // 负缓存立即失效
+            UserCache::Instance()->AddToBloom(name);
         }
-        else flag = true;
+        done(ret);
+    });
+    if(!ok) {
+        LOG_INFO("user used!");
+        done(0);
     }
-    // SqlConnPool::Instance()->FreeConn(sql);
-    LOG_DEBUG( "UserVerify success!!");
-    return flag;
+}
+
+// 查询用户（登录用），查询结果写入凭据缓存
+HttpRequest::UserRow HttpRequest::LookupUser_(const string& name) {
+    UserRow row;
+    row.found = UserStore::Instance()->Query(name, &row.password);
+    if(row.found == 1) { UserCache::Instance()->PutUser(name, row.password); }
+    else if(row.found == 0) { UserCache::Instance()->PutNotExist(name); }
+    return row;
+}
+
+/*
+    启动时把所有用户名装进布隆过滤器，全部装完才启用
+    之后注册时布隆过滤器判定"一定不存在"的用户名可以跳过查重
+*/
+void HttpRequest::LoadUserBloom() {
+    size_t cnt = 0;
+    bool ok = UserStore::Instance()->ForEachName([&cnt](const char* name) {
+        UserCache::Instance()->AddToBloom(name);
+        cnt++;
+    });
+    UserCache::Instance()->SetBloomReady(ok);
+    LOG_INFO("User bloom filter loaded: %zu users, %s", cnt, ok ? "ready" : "failed");
+}
+
+void HttpRequest::SetVerifyResult(int ret) {
+    assert(verifyTag_ >= 0);
+    path_ = ret > 0 ? "/welcome.html" : "/error.html";
+    verifyTag_ = -1;
 }
 
 std::string HttpRequest::path() const{
@@ -6,12 +6,18 @@
 #include <string>
 #include <regex>    // 正则表达式
 #include <errno.h>     
-#include <mysql/mysql.h>  //mysql
 #include <cassert>
+#include <functional>
+#include <future>     // 同步等待注册结果
+#include <atomic>
 
 #include "../buffer/buffer.h"
 #include "../log/log.h"
-#include "../pool/sqlconnpool.h"
+#include "../store/userstore.h"
+#include "../cache/usercache.h"
+#include "../cache/sessionstore.h"
+#include "../pool/singleflight.h"
+#include "../pool/regbatcher.h"
 
 class HttpRequest {
 public:
@@ -21,12 +27,24 @@ public:
         BODY,
         FINISH,        
     };
+    // 缓冲区里的请求是否已经完整（parse之前判断，不完整就继续读，不再按半个请求解析）
+    enum SCAN_STATE {
+        SCAN_HEADER,        // 请求头还没收完
+        SCAN_BODY,          // 请求头完整，正文不足Content-Length
+        SCAN_OK,            // 完整
+        SCAN_TOO_LARGE,     // 请求头或正文超过上限，不再继续收
+    };
+    static const size_t MAX_HEADER_BYTES = 8192;
+    static const size_t MAX_BODY_BYTES = 1024 * 1024;
     
     HttpRequest() { Init(); }
     ~HttpRequest() = default;
     void Init();
     // 关键函数
     bool parse(Buffer& buff);   
+    static SCAN_STATE Scan(const Buffer& buff, size_t* len = nullptr);     // SCAN_OK时len为这个请求的总长度
+    static std::string MapPath(const std::string& path);    // 请求路径对应的文件（"/"和DEFAULT_HTML补全为.html）
+    static bool IsVerifyPath(const std::string& path) { return DEFAULT_HTML_TAG.count(path) > 0; }  // 登录/注册页
     // 接口
     bool IsKeepAlive() const;
     std::string path() const;
@@ -35,8 +53,29 @@ public:
     std::string version() const;
     std::string GetPost(const std::string& key) const;
     std::string GetPost(const char* key) const;
+    std::string GetCookie(const std::string& key) const;
+    const std::string& GetSessionUser() const { return sessionUser_; }     // 有效会话令牌对应的用户，没有则为空
+
+    static void LoadUserBloom();    // 启动时把全部用户名装入凭据缓存的布隆过滤器
+    static int UserVerify(const std::string& name, const std::string& pwd, bool isLogin);   // 来验证登录或注册请求是否成功（阻塞，在数据库线程调用）：1成功 0失败 -1数据库不可用
+    static void UserRegister(const std::string& name, const std::string& pwd,
+                             const std::function<void(int)>& done);                     // 注册（不阻塞），批量提交后在批处理线程回调done
+
+    // 登录/注册请求解析完后处于"待验证"状态，需要UserVerify的结果才能确定响应哪个页面
+    bool IsVerifyPending() const { return verifyTag_ >= 0; }
+    bool IsLogin() const { return verifyTag_ == 1; }
+    void SetVerifyResult(int ret);
+
+    // 登录请求合并统计：查库调用次数 / 被合并（没有访问数据库）的次数，注册的冲突数见 RegBatcher::GetConflicts
+    static uint64_t GetVerifyCalls() { return loginFlight_.GetCalls(); }
+    static uint64_t GetVerifyCoalesced() { return loginFlight_.GetCoalesced(); }
+    static void SetLoginCoalescing(bool enable) { coalesce_ = enable; }    // 默认打开，关掉后每个缓存未命中的登录都查一次数据库（对比测试用）
 
 private:
+    struct UserRow {
+        int found = -1;         // 1 找到，0 没有这个用户，-1 数据库不可用
+        std::string password;
+    };
     bool ParseRequestLine_(const std::string& line);    // 处理请求行
     void ParsePath_();                                  // 处理请求路径
     void ParseHeader_(const std::string& line);         // 处理请求头
@@ -45,17 +84,23 @@ private:
     void ParsePost_();                                  // 处理Post事件
     static int ConverHex(char ch);  // 16进制转换为10进制
     void ParseFromUrlencoded_();    // 解析application/x-www-form-urlencoded格式的请求体
+    void CheckSession_();           // 校验Cookie里的会话令牌
 
-    static bool UserVerify(const std::string& name, const std::string& pwd, bool isLogin);  // 来验证登录或注册请求是否成功
+    static UserRow LookupUser_(const std::string& name);    // 到存储后端查询用户
 
 private:
     PARSE_STATE state_;
+    int verifyTag_;     // -1 不需要验证，0 注册，1 登录（DEFAULT_HTML_TAG）
     std::string method_, path_, version_, body_;    // 方法、URL、版本号、正文BODY
+    std::string sessionUser_;                       // 会话令牌对应的用户
     std::unordered_map<std::string, std::string> header_;   // 协议头
     std::unordered_map<std::string, std::string> post_;     // 正文BODY处理后存储
 
     static const std::unordered_set<std::string> DEFAULT_HTML;
     static const std::unordered_map<std::string, int> DEFAULT_HTML_TAG;
+
+    static SingleFlight<std::string, UserRow> loginFlight_;     // 并发的相同用户名登录只查一次数据库
+    static std::atomic<bool> coalesce_;
 };
 
 #endif
@@ -72,7 +117,7 @@ private:
     LOG_DEBUG("Tag:%d", tag);   
     // UserVerify
     LOG_INFO("Verify name:%s pwd:%s", name.c_str(), pwd.c_str());
-    LOG_DEBUG("%s", order); order是MYSQL指令
+    // 预编译语句 STMT_USER_QUERY / STMT_USER_INSERT，见 SqlConnPool::STMT_SQL
         // MYSQL中有这个username
         LOG_DEBUG("MYSQL ROW: %s %s", row[0], row[1]);
             // 登录，但密码不正确
@@ -81,7 +126,6 @@ private:
             LOG_INFO("user used!");
         // 注册行为 且 用户名未被使用
         LOG_DEBUG("regirster!");
-        LOG_DEBUG( "%s", order);
     LOG_DEBUG( "UserVerify success!!");
     // 正文BODY
     LOG_DEBUG("Body:%s, len:%d", line.c_str(), line.size());    
@@ -93,5 +137,7 @@ private:
     LOG_ERROR("HttpRequest::parse state is default");
     LOG_ERROR("RequestLine Error");
     LOG_DEBUG( "Insert error!");
+    LOG_ERROR("MySql query error(%u): %s", err, mysql_stmt_error(stmt));
+    LOG_ERROR("MySql insert error(%u): %s", err, mysql_stmt_error(stmt));
 
 */
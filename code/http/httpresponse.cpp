@@ -29,12 +29,14 @@ const unordered_map<int, string> HttpResponse::CODE_STATUS = {
     { 400, "Bad Request" },
     { 403, "Forbidden" },
     { 404, "Not Found" },
+    { 503, "Service Unavailable" },
 };
 
 const unordered_map<int, string> HttpResponse::CODE_PATH = {
     { 400, "/400.html" },   // 客户端请求的语法错误，服务器无法理解
     { 403, "/403.html" },   // 有的页面通常需要用户有一定的权限才能访问，如未登录
     { 404, "/404.html" },   // 当你发送请求的 URL 在服务器中找不到该资源，就会出现 404
+    { 503, "/503.html" },   // 服务器暂时无法处理（如数据库连接池等待超时），稍后重试
 };
 
 HttpResponse::HttpResponse() {
@@ -50,6 +52,7 @@ HttpResponse::~HttpResponse() {
 }
 
 void HttpResponse::UnmapFile() {
+    cached_.reset();
     if(mmFile_) {
         munmap(mmFile_, mmFileStat_.st_size);
         mmFile_ = nullptr;
@@ -63,15 +66,21 @@ void HttpResponse::Init(const string& srcDir, string& path, bool isKeepAlive, in
     isKeepAlive_ = isKeepAlive;
     path_ = path;
     srcDir_ = srcDir;
+    headers_.clear();
 
-    if(mmFile_) { UnmapFile(); }
+    UnmapFile();
     mmFile_ = nullptr; 
     mmFileStat_ = { 0 };
 }
 
 // 判断 HTTP 请求的目标资源是否有效，并据此设置响应状态码（code_）
 void HttpResponse::MakeResponse(Buffer& buff) {
-    if(stat((srcDir_ + path_).data(), &mmFileStat_) < 0 || S_ISDIR(mmFileStat_.st_mode)) {
+    // 缓存里的都是存在、能读的普通文件，命中就不用stat了
+    cached_ = FileCache::Instance()->Get(srcDir_ + path_);
+    if(cached_) {
+        if(code_ == -1) { code_ = 200; }
+    }
+    else if(stat((srcDir_ + path_).data(), &mmFileStat_) < 0 || S_ISDIR(mmFileStat_.st_mode)) {
         // 判断目标文件是否存在。stat 返回 -1 表示文件不存在或出错。
         // 判断该路径是否是一个目录（而不是文件）。静态资源请求一般只允许访问文件，如果是目录也返回 404。
         // 如果资源不存在或者是一个目录，则设置状态码为 404 Not Found
@@ -94,7 +103,10 @@ void HttpResponse::MakeResponse(Buffer& buff) {
 void HttpResponse::ErrorHtml_() {
     if(CODE_PATH.count(code_) == 1) {
         path_ = CODE_PATH.find(code_)->second;
-        assert(stat((srcDir_ + path_).data(), &mmFileStat_) == 0);
+        cached_ = FileCache::Instance()->Get(srcDir_ + path_);
+        if(!cached_) {
+            assert(stat((srcDir_ + path_).data(), &mmFileStat_) == 0);
+        }
     }
 }
 // 版本号 + 状态码 + 状态码解释
@@ -109,17 +121,32 @@ void HttpResponse::AddStateLine_(Buffer& buff) {
     }
     buff.Append("HTTP/1.1 " + to_string(code_) + " " + status + "\r\n");
 }
-// 协议头header（只有Connection、keep-alive、Content-type）
+// 协议头header（Date、Connection、Content-type，Keep-Alive由HttpConn按配置通过AddHeader加入）
 void HttpResponse::AddHeader_(Buffer& buff) {
+    buff.Append(CachedClock::HttpDate());   // 每秒格式化一次的 Date 头
     buff.Append("Connection: ");
     if(isKeepAlive_) {
         buff.Append("keep-alive\r\n");
-        // 这个连接能被重用最多 6 次，保持 120 秒，如果超时或次数超过就关闭
-        buff.Append("keep-alive: max=6, timeout=120\r\n");
     } else{
         buff.Append("close\r\n");
     }
     buff.Append("Content-type: " + GetFileType_() + "\r\n");
+    buff.Append(headers_);
+}
+
+void HttpResponse::MakeBodyResponse(Buffer& buff, const string& type, const string& body) {
+    if(code_ == -1) { code_ = 200; }
+    AddStateLine_(buff);
+    buff.Append(CachedClock::HttpDate());
+    buff.Append(isKeepAlive_ ? "Connection: keep-alive\r\n" : "Connection: close\r\n");
+    buff.Append("Content-type: " + type + "\r\n");
+    buff.Append(headers_);
+    buff.Append("Content-length: " + to_string(body.size()) + "\r\n\r\n");
+    buff.Append(body);
+}
+
+void HttpResponse::AddHeader(const string& line) {
+    headers_ += line;
 }
 // 判断path_文件类型 
 string HttpResponse::GetFileType_() {
@@ -136,6 +163,10 @@ string HttpResponse::GetFileType_() {
 }
 // 正常情况下补充Content-length；无资源和mmap失败时，还额外补充自定义的BODY
 void HttpResponse::AddContent_(Buffer& buff) {
+    if(cached_) {
+        buff.Append("Content-length: " + to_string(cached_->data.size()) + "\r\n\r\n");
+        return;
+    }
     int srcFd = open((srcDir_ + path_).data(), O_RDONLY);
     if(srcFd < 0) { 
         ErrorContent(buff, "File NotFound!");
@@ -188,9 +219,12 @@ void HttpResponse::ErrorContent(Buffer& buff, string message)
 }
 
 char* HttpResponse::File() {
+    if(cached_) {
+        return const_cast<char*>(cached_->data.data());     // 只用于writev，不会写
+    }
     return mmFile_;
 }
 
 size_t HttpResponse::FileLen() const {
-    return mmFileStat_.st_size;
+    return cached_ ? cached_->data.size() : mmFileStat_.st_size;
 }
\ No newline at end of file
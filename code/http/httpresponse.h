@@ -9,6 +9,8 @@
 
 #include "../buffer/buffer.h"
 #include "../log/log.h"
+#include "../timer/cachedclock.h"
+#include "../cache/filecache.h"
 
 class HttpResponse {
 public:
@@ -23,6 +25,9 @@ public:
     char* File();
     size_t FileLen() const;
     int Code() const { return code_; }
+    void AddHeader(const std::string& line);   // 额外的响应头（整行，含\r\n），Init之后、MakeResponse之前调用
+    // 正文在内存里（如/metrics）时代替MakeResponse：不找文件，正文直接跟在响应头后面
+    void MakeBodyResponse(Buffer& buff, const std::string& type, const std::string& body);
     
     void ErrorContent(Buffer& buff, std::string message);
 
@@ -38,9 +43,11 @@ private:
     std::string srcDir_;
     std::string path_;
     bool isKeepAlive_;
+    std::string headers_;   // 额外的响应头
     
     char* mmFile_; 
     struct stat mmFileStat_;
+    FileCache::EntryPtr cached_;    // 文件在FileCache里时正文直接用缓存的内容，不mmap
 
     static const std::unordered_map<std::string, std::string> SUFFIX_TYPE;  // 后缀类型集
     static const std::unordered_map<int, std::string> CODE_STATUS;          // 编码状态集
@@ -2,6 +2,7 @@
 # define BLOCKQUEUE_H
 
 #include <deque>
+#include <cassert>
 #include <condition_variable>
 #include <mutex>
 #include <sys/time.h>
@@ -15,6 +16,8 @@ public:
     bool empty();
     bool full();
     void push_back(const T& item);
+    bool try_push_back(const T& item);              // 非阻塞，队列满了直接返回false
+    bool push_back_evict(const T& item, T& evicted); // 队列满了就挤掉队头，被挤掉的放入evicted，返回是否挤掉
     void push_front(const T& item); 
     bool pop(T& item);  // 弹出的任务放入item
     bool pop(T& item, int timeout);  // 等待时间
@@ -26,6 +29,7 @@ public:
 
     void flush();
     void Close();
+    bool IsClosed();
 
 private:
     deque<T> deq_;                      // 底层数据结构
@@ -49,14 +53,21 @@ BlockQueue<T>::~BlockQueue() {
 
 template<typename T>
 void BlockQueue<T>::Close() {
-    // lock_guard<mutex> locker(mtx_); // 操控队列之前，都需要上锁
-    // deq_.clear();                   // 清空队列
-    clear();
-    isClose_ = true;
+    {
+        lock_guard<mutex> locker(mtx_); // 操控队列之前，都需要上锁（isClose_也在锁里改，等待的线程在锁里读）
+        deq_.clear();                   // 清空队列
+        isClose_ = true;
+    }
     condConsumer_.notify_all();
     condProducer_.notify_all();
 }
 
+template<typename T>
+bool BlockQueue<T>::IsClosed() {
+    lock_guard<mutex> locker(mtx_);
+    return isClose_;
+}
+
 template<typename T>
 void BlockQueue<T>::clear() {
     lock_guard<mutex> locker(mtx_);
@@ -79,12 +90,38 @@ template<typename T>
 void BlockQueue<T>::push_back(const T& item) {
     // 注意，条件变量需要搭配unique_lock
     unique_lock<mutex> locker(mtx_);    
-    condProducer_.wait(locker, [this]{ return deq_.size() < capacity_; });     
+    condProducer_.wait(locker, [this]{ return isClose_ || deq_.size() < capacity_; });
+    if(isClose_) return;                // 队列已关闭，不再接收
 
     deq_.push_back(item);
     condConsumer_.notify_one();         // 唤醒消费者
 }
 
+template<typename T>
+bool BlockQueue<T>::try_push_back(const T& item) {
+    lock_guard<mutex> locker(mtx_);
+    if(deq_.size() >= capacity_) {
+        return false;
+    }
+    deq_.push_back(item);
+    condConsumer_.notify_one();
+    return true;
+}
+
+template<typename T>
+bool BlockQueue<T>::push_back_evict(const T& item, T& evicted) {
+    lock_guard<mutex> locker(mtx_);
+    bool isEvicted = false;
+    if(deq_.size() >= capacity_) {
+        evicted = std::move(deq_.front());
+        deq_.pop_front();
+        isEvicted = true;
+    }
+    deq_.push_back(item);
+    condConsumer_.notify_one();
+    return isEvicted;
+}
+
 template<typename T>
 void BlockQueue<T>::push_front(const T& item) {
     unique_lock<mutex> locker(mtx_);
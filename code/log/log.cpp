@@ -1,4 +1,6 @@
 #include "log.h"
+#include "../metrics/metrics.h"
+#include "../metrics/probes.h"
 #include <iostream>
 
 // 懒汉式：局部静态变量法（最简单）
@@ -7,113 +9,218 @@ Log* Log::Instance() {
     return &log;
 }
 
+std::atomic<bool> Log::reopen_(false);
+
 Log::Log() {
     fp_ = nullptr;
     deque_ = nullptr;
     writeThread_ = nullptr;
 
-    lineCount_ = 0;
-    toDay_ = 0;
+    nextDay_ = 0;
     isAsync_ = false;
+    isOpen_ = false;
+    curFile_[0] = '\0';
+    fileBytes_ = 0;
+    openTime_ = 0;
+
+    maxFileBytes_ = MAX_FILE_BYTES;
+    rotateSec_ = 0;
+    maxBackups_ = 0;
+    keepDays_ = 0;
+    compress_ = false;
+
+    policy_ = BLOCK;
+    dropLevel_ = 3;
+    for(int i = 0; i < LEVEL_NUM; i++) {
+        dropped_[i] = 0;
+        reported_[i] = 0;
+    }
 }
 
 // 单例模式下，这个似乎不会执行，所以补充一个Close函数
 Log::~Log() {
-    while(!deque_->empty()) {
-        deque_->flush();    // 唤醒消费者，处理掉剩下的任务
+    Stop_();
+}
+
+// 停止写线程（先把队列里剩下的日志写完）和归档线程，关闭日志文件
+void Log::Stop_() {
+    if(deque_) {
+        while(!deque_->empty()) {
+            deque_->flush();    // 唤醒消费者，处理掉剩下的任务
+        }
+        deque_->Close();    // 关闭队列
+    }
+    if(writeThread_ && writeThread_->joinable()) {
+        writeThread_->join();   // 等待当前线程完成手中的任务
     }
-    deque_->Close();    // 关闭队列
-    writeThread_->join();   // 等待当前线程完成手中的任务
+    writeThread_ = nullptr;
+    deque_ = nullptr;
+    archiver_ = nullptr;    // 析构时等待归档线程退出
+
+    lock_guard<mutex> locker(fileMtx_);
     if(fp_) {       // 冲洗文件缓冲区，关闭文件描述符
-        lock_guard<mutex> locker(mtx_);
-        flush();        // 清空缓冲区中的数据
+        fflush(fp_);
         fclose(fp_);    // 关闭日志文件
+        fp_ = nullptr;
     }
 }
 
+void Log::SetRotate(size_t maxFileBytes, int rotateSec) {
+    lock_guard<mutex> locker(fileMtx_);
+    maxFileBytes_ = maxFileBytes;
+    rotateSec_ = rotateSec;
+}
+
+void Log::SetRetention(int maxBackups, int keepDays, bool compress) {
+    lock_guard<mutex> locker(fileMtx_);
+    maxBackups_ = maxBackups;
+    keepDays_ = keepDays;
+    compress_ = compress;
+}
+
 // 初始化日志实例
 void Log::init(int level, const char* path, const char* suffix, int maxQueCapacity) {
+    Stop_();    // 重复init时，先停掉上一次的写线程
+
     isOpen_ = true;
     path_ = path;
     suffix_ = suffix;
     level_ = level;
+
+    struct stat st = {0};
+    if (stat(path_, &st) == -1) {
+        mkdir(path_, 0777);
+    }
+    archiver_ = std::make_unique<LogArchiver>(path_, suffix_, maxBackups_, keepDays_, compress_);
+
+    time_t timer = time(nullptr);           // 该函数会返回从1970年1月1日0时0秒算起到现在所经过的秒数
+    struct tm systime;
+    localtime_r(&timer, &systime);          // 参数timer所指的当前秒数，转换成真实世界所使用的时间日期
+    {
+        lock_guard<mutex> locker(mtx_);
+        buff_.RetrieveAll();    // buff清零
+    }
+    {
+        lock_guard<mutex> locker(fileMtx_);
+        OpenFile_(systime);
+    }
+
+    // SIGHUP：外部工具（如logrotate）rename日志文件后，通知我们重新打开
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = SigHup_;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGHUP, &sa, nullptr);
+
     if (maxQueCapacity) {
-        // 异步方式
+        // 异步方式，文件的切换也全部交给写线程
         isAsync_ = true;
 
-        deque_ = std::make_unique<BlockQueue<std::string>>();
+        deque_ = std::make_unique<BlockQueue<LogLine>>(maxQueCapacity);
         writeThread_ = std::make_unique<std::thread>(FlushLogThread);
     }
     else isAsync_ = false;
+}
 
-    lineCount_ = 0;
-    time_t timer = time(nullptr);           // 该函数会返回从1970年1月1日0时0秒算起到现在所经过的秒数
-    struct tm* systime = localtime(&timer); // 参数timer所指的当前秒数，转换成真实世界所使用的时间日期
-    char fileName[LOG_NAME_LEN] = {0};
-    snprintf(fileName, LOG_NAME_LEN - 1, "%s/%04d_%02d_%02d%s", 
-            path_, systime->tm_year + 1900, systime->tm_mon + 1, systime->tm_mday, suffix_);
-    toDay_ = systime->tm_mday;
+// 打开t对应那一天的日志文件
+void Log::OpenFile_(const struct tm& t) {
+    snprintf(curFile_, LOG_NAME_LEN - 1, "%s/%04d_%02d_%02d%s",
+            path_, t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, suffix_);
+    fp_ = fopen(curFile_, "a"); // a追加写入，文件不存在则创建，存在则在末尾添加
+    assert(fp_ != nullptr);
 
-    {
-        lock_guard<mutex> locker(mtx_);
-        buff_.RetrieveAll();    // buff清零
-        if (fp_) {// 重新打开
-            flush();    
-            fclose(fp_);
-        }
-        
-        struct stat st = {0};
-        if (stat(path_, &st) == -1) {
-            mkdir(path_, 0777);
-        }
-        fp_ = fopen(fileName, "a"); // a追加写入，文件不存在则创建，存在则在末尾添加
+    struct stat st = {0};
+    fileBytes_ = (stat(curFile_, &st) == 0) ? st.st_size : 0;
+    openTime_ = time(nullptr);
+
+    struct tm tomorrow = t;
+    tomorrow.tm_mday += 1;
+    tomorrow.tm_hour = tomorrow.tm_min = tomorrow.tm_sec = 0;
+    tomorrow.tm_isdst = -1;
+    nextDay_ = mktime(&tomorrow);   // mktime会自动处理跨月、跨年
+
+    if(archiver_) archiver_->SetActive(curFile_);
+}
+
+/*
+    日志文件的切换，三种情况：
+    1. SIGHUP：文件已经被外部工具rename走了，直接重新打开同名文件
+    2. 跨天：关闭旧文件，打开当天的新文件，旧文件交给归档线程
+    3. 大小/时间达到阈值：把当前文件rename为带时分秒的备份，重新打开同名文件，备份交给归档线程
+    异步模式下只在写线程中调用，请求线程不会因为 fclose/fopen 而卡住
+*/
+void Log::RotateIfNeeded_() {
+    time_t now = time(nullptr);
+    if(reopen_.exchange(false)) {
+        if(fp_) fclose(fp_);
+        fp_ = fopen(curFile_, "a");
         assert(fp_ != nullptr);
+        struct stat st = {0};
+        fileBytes_ = (stat(curFile_, &st) == 0) ? st.st_size : 0;
+        openTime_ = now;
+        return;
     }
-}
 
-void Log::write(int level, const char *format, ...) {
-    struct timeval now = {0, 0};    // 结构体含秒sec，微妙usec
-    gettimeofday(&now, nullptr);    // 获取当前时间，为UTC时间，1970年以来的秒+微秒（timeval-now）、时区信息(timezone-nullptr)
-    time_t tSec = now.tv_sec;
-    struct tm *sysTime = localtime(&tSec);
-    struct tm t = *sysTime;
+    struct tm t;
+    if(now >= nextDay_) {
+        std::string old(curFile_);
+        fclose(fp_);
+        localtime_r(&now, &t);
+        OpenFile_(t);
+        if(archiver_) archiver_->Submit(old);
+        return;
+    }
 
-    {
-        unique_lock<mutex> locker(mtx_);
+    bool sizeFull = maxFileBytes_ > 0 && fileBytes_ >= maxFileBytes_;
+    bool timeUp = rotateSec_ > 0 && fileBytes_ > 0 && now - openTime_ >= rotateSec_;
+    if(!sizeFull && !timeUp) {
+        return;
+    }
 
-        // 日志日期：日期不一样，说明跨天了，需要切换到当天新的日志文件
-        // 日志行数：判断当前写的行数是否刚好是MAX_LINES的整数倍
-        if (toDay_ != t.tm_mday || (lineCount_ && (lineCount_  %  MAX_LINES == 0)))
-        {
-            char newFile[LOG_NAME_LEN];
-            char tail[36] = {0};
-            snprintf(tail, 36, "%04d_%02d_%02d", t.tm_year + 1900, t.tm_mon + 1, t.tm_mday);
-
-            if (toDay_ != t.tm_mday) {
-                toDay_ = t.tm_mday;
-                lineCount_ = 0;
-                snprintf(newFile, LOG_NAME_LEN - 72, "%s/%s%s", path_, tail, suffix_);
-            } else {
-                snprintf(newFile, LOG_NAME_LEN - 72, "%s/%s-%d%s", path_, tail, (lineCount_ / MAX_LINES), suffix_);
-            }
+    localtime_r(&now, &t);
+    char backup[LOG_NAME_LEN];
+    snprintf(backup, LOG_NAME_LEN - 1, "%s/%04d_%02d_%02d-%02d%02d%02d%s",
+            path_, t.tm_year + 1900, t.tm_mon + 1, t.tm_mday,
+            t.tm_hour, t.tm_min, t.tm_sec, suffix_);
+    auto exists = [](const char* name) {    // 原文件或已经压缩好的.gz
+        return access(name, F_OK) == 0 || access((std::string(name) + ".gz").c_str(), F_OK) == 0;
+    };
+    for(int i = 1; exists(backup); i++) {   // 同一秒内切换多次
+        snprintf(backup, LOG_NAME_LEN - 1, "%s/%04d_%02d_%02d-%02d%02d%02d-%d%s",
+                path_, t.tm_year + 1900, t.tm_mon + 1, t.tm_mday,
+                t.tm_hour, t.tm_min, t.tm_sec, i, suffix_);
+    }
 
-            flush();
-            fclose(fp_);
-            fp_ = fopen(newFile, "a");
-            assert(fp_ != nullptr);
-        }
+    fflush(fp_);
+    fclose(fp_);
+    rename(curFile_, backup);
+    fp_ = fopen(curFile_, "a");
+    assert(fp_ != nullptr);
+    fileBytes_ = 0;
+    openTime_ = now;
+    if(archiver_) archiver_->Submit(backup);
+}
+
+void Log::WriteFile_(const std::string& str) {
+    fputs(str.c_str(), fp_);
+    fileBytes_ += str.size();
+}
+
+void Log::write(int level, const char *format, ...) {
+    if(level >= 0 && level < LEVEL_NUM) {
+        Metrics::Instance()->Add(static_cast<Metrics::Counter>(Metrics::LOG_DEBUG_LINES + level));
     }
-    
-    
+    // 时间戳在锁外生成：同一秒内只拷贝缓存好的"年-月-日 时:分:秒"，不再每条都 gettimeofday + localtime_r
+    char stamp[CachedClock::LOG_TIME_LEN + 1];
+    int n = CachedClock::LogTime(stamp);
+
+    std::string line;
     {
         unique_lock<mutex> locker(mtx_);
-        lineCount_++;
 
         // 在buffer内生成一条对应的日志信息1(TITLE)
-        int n = snprintf(buff_.BeginWrite(), 128, "%d-%02d-%02d %02d:%02d:%02d.%06ld ",
-                    t.tm_year + 1900, t.tm_mon + 1, t.tm_mday,
-                    t.tm_hour, t.tm_min, t.tm_sec, now.tv_usec);
-        buff_.HasWritten(n);
+        buff_.Append(stamp, n);
         AppendLogLevelTitle_(level); 
         
         // 在buffer内生成一条对应的日志信息2(INFO)
@@ -122,26 +229,111 @@ void Log::write(int level, const char *format, ...) {
         int m = vsnprintf(buff_.BeginWrite(), buff_.WritableBytes(), format, vaList);
         va_end(vaList);
         buff_.HasWritten(m);
-        buff_.Append("\n\0", 2);    // 换行
-
-        if(isAsync_ && deque_ && !deque_->full()) { 
-            // 异步方式
-            // 加入阻塞队列中，等待写线程读取日志信息
-            deque_->push_back(buff_.RetrieveAllToStr());
-        } else {    
-            // 同步方式
-            // 直接向文件中写入日志信息
-            fputs(buff_.Peek(), fp_); 
+        buff_.Append("\n", 1);    // 换行
+
+        line = buff_.RetrieveAllToStr();    // 取出后buff已清空
+    }
+
+    if(isAsync_ && deque_) { 
+        // 异步方式
+        // 加入阻塞队列中，等待写线程读取日志信息（文件切换也由写线程完成）
+        // 队列满了按溢出策略处理，不会退回到在请求线程上同步写文件
+        Push_(level, std::move(line));
+    } else {    
+        // 同步方式
+        // 直接向文件中写入日志信息，没有写线程，只能在这里切换文件
+        lock_guard<mutex> locker(fileMtx_);
+        RotateIfNeeded_();
+        WriteFile_(line);
+    }
+}
+
+void Log::Push_(int level, std::string&& line) {
+    int idx = (level < 0 || level >= LEVEL_NUM) ? 1 : level;   // 和AppendLogLevelTitle_一致，未知等级按info算
+    LogLine item{idx, std::move(line)};
+    switch(policy_.load(std::memory_order_relaxed)) {
+    case DROP_NEWEST:
+        if(!deque_->try_push_back(item)) {
+            dropped_[idx].fetch_add(1, std::memory_order_relaxed);
         }
-        buff_.RetrieveAll();    // 清空buff
+        break;
+    case DROP_OLDEST: {
+        LogLine evicted;
+        if(deque_->push_back_evict(item, evicted)) {
+            dropped_[evicted.level].fetch_add(1, std::memory_order_relaxed);
+        }
+        break;
     }
+    case DROP_BELOW_LEVEL:
+        if(idx < dropLevel_.load(std::memory_order_relaxed)) {
+            if(!deque_->try_push_back(item)) {
+                dropped_[idx].fetch_add(1, std::memory_order_relaxed);
+            }
+        } else {
+            deque_->push_back(item);
+        }
+        break;
+    case BLOCK:
+    default:
+        deque_->push_back(item);
+        break;
+    }
+}
+
+void Log::SetOverflowPolicy(OverflowPolicy policy, int dropLevel) {
+    policy_ = policy;
+    dropLevel_ = dropLevel;
+}
+
+uint64_t Log::GetDropped(int level) {
+    assert(level >= 0 && level < LEVEL_NUM);
+    return dropped_[level].load(std::memory_order_relaxed);
+}
+
+// 写一行汇总："N log lines dropped"，只写上次汇总之后新丢弃的条数
+void Log::WriteDropSummary_() {
+    uint64_t delta[LEVEL_NUM];
+    uint64_t total = 0;
+    for(int i = 0; i < LEVEL_NUM; i++) {
+        uint64_t cur = dropped_[i].load(std::memory_order_relaxed);
+        delta[i] = cur - reported_[i];
+        reported_[i] = cur;
+        total += delta[i];
+    }
+    if(total == 0) {
+        return;
+    }
+
+    char line[256];
+    int n = CachedClock::LogTime(line);     // 和其他日志行一样的时间戳
+    snprintf(line + n, sizeof(line) - n, "[warn] : "
+            "%lu log lines dropped (debug:%lu info:%lu warn:%lu error:%lu)\n",
+            total, delta[0], delta[1], delta[2], delta[3]);
+    WriteFile_(line);
 }
 
-// 清空fp_连接，若异步会通知deque_
+// 异步模式只通知写线程（写线程队列写空时会fflush），同步模式直接fflush
 void Log::flush() {
     // 只有异步日志，才会用到日志队列deque_
-    if (isAsync_) deque_->flush();  
-    fflush(fp_);    // 清空输入缓冲区
+    if (isAsync_) {
+        deque_->flush();
+        return;
+    }
+    lock_guard<mutex> locker(fileMtx_);
+    if(fp_) {
+        fflush(fp_);    // 清空输入缓冲区
+        WS_PROBE(log__flush, fileBytes_);
+    }
+}
+
+void Log::Reopen() {
+    reopen_ = true;
+    if(isAsync_ && deque_) deque_->flush();
+}
+
+// 信号处理函数里只置标志位，真正的reopen由写线程（同步模式下由下一次write）完成
+void Log::SigHup_(int) {
+    reopen_ = true;
 }
 
 // 异步日志的写线程函数
@@ -150,12 +342,33 @@ void Log::FlushLogThread() {
 }
 
 // 写线程真正的执行函数
+// 带超时的pop：即使没有日志，也能定期检查是否需要切换文件（按时间切换、跨天、SIGHUP）
+// 每秒最多写一次丢弃汇总
 void Log::AsyncWrite_() {
-    string str = "";
-    while (deque_->pop(str)) {
-        lock_guard<mutex> locker(mtx_);
-        fputs(str.c_str(), fp_);
+    LogLine item;
+    time_t lastSummary = time(nullptr);
+    while (true) {
+        bool got = deque_->pop(item, 1);
+        if(!got && deque_->IsClosed()) {
+            break;
+        }
+        lock_guard<mutex> locker(fileMtx_);
+        if(got) {
+            WriteFile_(item.text);
+        }
+        time_t now = time(nullptr);
+        if(now != lastSummary) {
+            lastSummary = now;
+            WriteDropSummary_();
+        }
+        if(!got || deque_->empty()) {   // 队列写空了再刷盘，减少系统调用
+            fflush(fp_);
+            WS_PROBE(log__flush, fileBytes_);
+        }
+        RotateIfNeeded_();
     }
+    lock_guard<mutex> locker(fileMtx_);
+    WriteDropSummary_();
 }
 
 // 添加日志等级
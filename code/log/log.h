@@ -3,19 +3,37 @@
 
 #include "../buffer/buffer.h"
 #include "blockqueue.h"
+#include "logarchiver.h"
+#include "../timer/cachedclock.h"
 
 #include <memory>
 #include <string>
 #include <mutex>
 #include <thread>
+#include <atomic>
 #include <cassert>
+#include <signal.h>     // SIGHUP
 #include <sys/time.h>
 #include <sys/stat.h>   // mkdir
 #include <sys/types.h>  
 #include <stdarg.h>     // va_list
 
+// 异步队列中的一条日志，带上等级，丢弃时按等级计数
+struct LogLine {
+    int level;
+    std::string text;
+};
+
 class Log {
 public:
+    // 异步队列满了之后的处理策略
+    enum OverflowPolicy {
+        BLOCK,              // 阻塞调用线程，直到写线程腾出位置
+        DROP_NEWEST,        // 丢弃当前这条
+        DROP_OLDEST,        // 挤掉队列里最旧的一条
+        DROP_BELOW_LEVEL,   // 低于dropLevel的丢弃，其余阻塞
+    };
+
     static Log* Instance();
     // 初始化日志实例（阻塞队列最大容量、日志保存路径、日志文件后缀）
     void init(int level, const char* path = "./log", 
@@ -23,6 +41,14 @@ public:
                 int maxQueueCapacity = 1024);
     void write(int level, const char *format, ...);  // 将输出内容按照标准格式整理
 
+    // 切换策略（需在init之前调用）：单个文件最大字节数（0不限）、按时间切换的间隔秒数（0只按天切换）
+    void SetRotate(size_t maxFileBytes, int rotateSec);
+    // 保留策略（需在init之前调用）：最多保留的归档个数、最长保留天数（0不限）、是否压缩为.gz
+    void SetRetention(int maxBackups, int keepDays, bool compress);
+    void Reopen();                  // 重新打开当前日志文件（外部工具rename之后使用），SIGHUP触发
+    void SetOverflowPolicy(OverflowPolicy policy, int dropLevel = 3);
+    uint64_t GetDropped(int level); // 累计丢弃的日志条数（按等级）
+
     static void FlushLogThread();   // 异步写日志公有方法，调用私有方法asyncWrite
     void flush();
     int GetLevel();
@@ -37,20 +63,29 @@ private:
 
     void AppendLogLevelTitle_(int level);
     void AsyncWrite_(); // 异步写日志方法
+    void WriteFile_(const std::string& str);    // 写入文件并统计字节数（需持有fileMtx_）
+    void Push_(int level, std::string&& line);  // 按溢出策略放入异步队列
+    void WriteDropSummary_();                   // 把这段时间丢弃的条数写成一行日志（需持有fileMtx_）
+    void RotateIfNeeded_();                     // 检查并切换日志文件（需持有fileMtx_）
+    void OpenFile_(const struct tm& t);         // 打开当天的日志文件（需持有fileMtx_）
+    void Stop_();                               // 停止写线程和归档线程，关闭文件
+    static void SigHup_(int sig);
 
 private:
     // 类共享的静态成员，不属于具体对象
     static const int LOG_PATH_LEN = 256;    // 日志文件最长文件名
     static const int LOG_NAME_LEN = 256;    // 日志最长名字
-    static const int MAX_LINES = 50000;     // 日志文件内的最长日志条数
+    static const size_t MAX_FILE_BYTES = 64 * 1024 * 1024;  // 默认单个日志文件的最大字节数
+    static const int LEVEL_NUM = 4;                         // debug、info、warn、error
     
 private:
     FILE* fp_;                                       //打开log的文件指针
     Buffer buff_;       // 输出的内容，缓冲区
-    std::mutex mtx_;                                 //同步日志必需的互斥量
+    std::mutex mtx_;                                 //保护buff_和level_
+    std::mutex fileMtx_;                             //保护fp_和切换状态，异步时只有写线程使用
 
     bool isAsync_;      // 是否开启异步日志
-    std::unique_ptr<BlockQueue<std::string>> deque_; //阻塞队列
+    std::unique_ptr<BlockQueue<LogLine>> deque_;     //阻塞队列
     std::unique_ptr<std::thread> writeThread_;       //写线程的指针
     
     bool isOpen_;   
@@ -58,8 +93,24 @@ private:
     const char* suffix_;        //后缀名
     int level_;                 // 日志等级
 
-    int lineCount_;             // 日志行数记录
-    int toDay_;                 // 按当天日期区分文件
+    time_t nextDay_;            // 下一个零点，到达后切换到当天新的日志文件
+    char curFile_[LOG_NAME_LEN];    // 当前正在写的日志文件
+    size_t fileBytes_;          // 当前文件已写入的字节数
+    time_t openTime_;           // 当前文件的打开时间
+
+    size_t maxFileBytes_;       // 按大小切换
+    int rotateSec_;             // 按时间切换
+    int maxBackups_;            // 保留策略
+    int keepDays_;
+    bool compress_;
+    std::unique_ptr<LogArchiver> archiver_;     // 压缩、清理旧文件的低优先级线程
+
+    static std::atomic<bool> reopen_;           // SIGHUP 置位，写线程检查后重新打开文件
+
+    std::atomic<int> policy_;                   // OverflowPolicy
+    std::atomic<int> dropLevel_;
+    std::atomic<uint64_t> dropped_[LEVEL_NUM];  // 累计丢弃条数
+    uint64_t reported_[LEVEL_NUM];              // 已经写过汇总的条数，只有写线程使用
 };
 
 // 多语句宏封装
@@ -0,0 +1,163 @@
+#include "logarchiver.h"
+
+#include <vector>
+#include <algorithm>
+#include <cstdio>
+#include <ctime>
+#include <dirent.h>     // opendir/readdir
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>      // SCHED_IDLE
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/resource.h>   // setpriority
+#include <zlib.h>       // gzopen/gzwrite
+
+using namespace std;
+
+LogArchiver::LogArchiver(const string& path, const string& suffix,
+                         int maxBackups, int keepDays, bool compress)
+    : path_(path), suffix_(suffix), maxBackups_(maxBackups),
+      keepDays_(keepDays), compress_(compress) {
+    jobs_ = make_unique<BlockQueue<string>>();
+    thread_ = make_unique<thread>(&LogArchiver::Work_, this);
+}
+
+// 空串作为结束标记排在已提交的任务后面：切换下来还没压缩、清理的文件都处理完线程才退出
+// （直接Close会清空队列，这些文件就一直不压缩，也不计入保留个数）
+LogArchiver::~LogArchiver() {
+    jobs_->push_back(string());
+    if(thread_ && thread_->joinable()) {
+        thread_->join();
+    }
+}
+
+void LogArchiver::Submit(const string& file) {
+    if(file.empty()) {
+        return;     // 空串是结束标记
+    }
+    jobs_->push_back(file);
+}
+
+void LogArchiver::SetActive(const string& file) {
+    lock_guard<mutex> locker(mtx_);
+    active_ = file;
+}
+
+void LogArchiver::Work_() {
+    // 把自己降到最低优先级：CPU 用 SCHED_IDLE + nice 19，IO 用 idle 调度类
+    // 压缩只在系统空闲时进行，不和请求线程抢资源
+    struct sched_param param = {0};
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+    setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+    syscall(SYS_ioprio_set, 1 /* IOPRIO_WHO_PROCESS */, 0, 3 << 13 /* IOPRIO_CLASS_IDLE */);
+
+    Prune_();   // 启动时先按策略清理一次
+    string file;
+    while(jobs_->pop(file) && !file.empty()) {
+        if(compress_) {
+            Compress_(file);
+        }
+        Prune_();
+    }
+}
+
+bool LogArchiver::Compress_(const string& file) {
+    FILE* in = fopen(file.c_str(), "rb");
+    if(!in) {
+        return false;
+    }
+    string gzName = file + ".gz";
+    gzFile out = gzopen(gzName.c_str(), "wb6");
+    if(!out) {
+        fclose(in);
+        return false;
+    }
+
+    char buf[64 * 1024];
+    size_t n = 0;
+    bool ok = true;
+    while((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if(gzwrite(out, buf, static_cast<unsigned>(n)) != static_cast<int>(n)) {
+            ok = false;
+            break;
+        }
+    }
+    fclose(in);
+    if(gzclose(out) != Z_OK) {
+        ok = false;
+    }
+
+    if(ok) {
+        // .gz沿用原文件的修改时间，清理时按真实的写入时间排序
+        struct stat st = {0};
+        if(stat(file.c_str(), &st) == 0) {
+            struct timespec times[2] = { st.st_atim, st.st_mtim };
+            utimensat(AT_FDCWD, gzName.c_str(), times, 0);
+        }
+        unlink(file.c_str());       // 压缩成功才删除原文件
+    } else {
+        unlink(gzName.c_str());     // 压缩失败，保留原文件，删除半成品
+    }
+    return ok;
+}
+
+// 本日志系统生成的文件：以数字开头（日期），以 suffix 或 suffix.gz 结尾
+bool LogArchiver::IsArchive_(const string& name) {
+    if(name.empty() || name[0] < '0' || name[0] > '9') {
+        return false;
+    }
+    auto endsWith = [&name](const string& tail) {
+        return name.size() >= tail.size() &&
+               name.compare(name.size() - tail.size(), tail.size(), tail) == 0;
+    };
+    return endsWith(suffix_) || endsWith(suffix_ + ".gz");
+}
+
+void LogArchiver::Prune_() {
+    if(maxBackups_ <= 0 && keepDays_ <= 0) {
+        return;
+    }
+    string active;
+    {
+        lock_guard<mutex> locker(mtx_);
+        active = active_;
+    }
+
+    DIR* dir = opendir(path_.c_str());
+    if(!dir) {
+        return;
+    }
+    vector<pair<struct timespec, string>> files;    // (修改时间, 完整路径)
+    while(struct dirent* ent = readdir(dir)) {
+        string name(ent->d_name);
+        if(!IsArchive_(name)) {
+            continue;
+        }
+        string full = path_ + "/" + name;
+        if(full == active) {
+            continue;
+        }
+        struct stat st = {0};
+        if(stat(full.c_str(), &st) == 0 && S_ISREG(st.st_mode)) {
+            files.emplace_back(st.st_mtim, full);
+        }
+    }
+    closedir(dir);
+
+    // 新的在前，旧的在后（同一秒内可能切换多次，比较到纳秒）
+    sort(files.begin(), files.end(), [](const pair<struct timespec, string>& a,
+                                        const pair<struct timespec, string>& b) {
+        if(a.first.tv_sec != b.first.tv_sec) return a.first.tv_sec > b.first.tv_sec;
+        return a.first.tv_nsec > b.first.tv_nsec;
+    });
+    time_t deadline = time(nullptr) - static_cast<time_t>(keepDays_) * 24 * 3600;
+    for(size_t i = 0; i < files.size(); i++) {
+        bool tooMany = maxBackups_ > 0 && i >= static_cast<size_t>(maxBackups_);
+        bool tooOld = keepDays_ > 0 && files[i].first.tv_sec < deadline;
+        if(tooMany || tooOld) {
+            unlink(files[i].second.c_str());
+        }
+    }
+}
@@ -0,0 +1,47 @@
+#ifndef LOG_ARCHIVER_H
+#define LOG_ARCHIVER_H
+
+#include "blockqueue.h"
+
+#include <string>
+#include <mutex>
+#include <thread>
+#include <memory>
+
+/*
+    日志归档线程（低优先级）
+    负责：
+        1. 将已经切换下来的日志文件压缩为 .gz（压缩成功后删除原文件）
+        2. 按保留策略清理旧的归档文件（最多保留 maxBackups 个，最长保留 keepDays 天）
+    Log 的写线程只负责 rename + reopen，耗时的压缩和删除全部放到这里，不影响请求线程和写线程
+*/
+class LogArchiver {
+public:
+    LogArchiver(const std::string& path, const std::string& suffix,
+                int maxBackups, int keepDays, bool compress);
+    ~LogArchiver();     // 等已经提交的文件都压缩、清理完再返回
+
+    void Submit(const std::string& file);       // 提交一个已经关闭的日志文件，等待压缩/清理
+    void SetActive(const std::string& file);    // 当前正在写的日志文件，清理时跳过
+
+private:
+    void Work_();
+    bool Compress_(const std::string& file);    // 压缩为 file.gz，成功后删除 file
+    void Prune_();                              // 按保留策略删除旧文件
+    bool IsArchive_(const std::string& name);   // 是否是本日志系统生成的文件
+
+private:
+    std::string path_;      // 日志目录
+    std::string suffix_;    // 日志后缀
+    int maxBackups_;        // 最多保留的归档个数，0表示不限制
+    int keepDays_;          // 归档最长保留天数，0表示不限制
+    bool compress_;         // 是否压缩
+
+    std::mutex mtx_;
+    std::string active_;    // 当前正在写的日志文件（完整路径）
+
+    std::unique_ptr<BlockQueue<std::string>> jobs_;
+    std::unique_ptr<std::thread> thread_;
+};
+
+#endif // LOG_ARCHIVER_H
@@ -6,8 +6,19 @@ int main() {
     WebServer server(
         1316, 3, 60000, false,             /* 端口 ET模式 timeoutMs 优雅退出  */
         3306, "webserver_user", "123456", "webserver_db", /* Mysql配置 */
-        12, 8, true, 1, 1024
-    );             /* 连接池数量 线程池数量 日志开关 日志等级 日志异步队列容量 */
+        12, 8, true, 1, 1024,              /* 连接池数量 线程池数量 日志开关 日志等级 日志异步队列容量 */
+        0                                  /* 用户存储 0:MySQL 1:SQLite 2:内存 */
+    );
+    server.SetTimeouts(10000, 30000, 15000, 10000, 4096, 100);  /* 请求头 正文 keep-alive空闲 发响应(ms) 最低发送速度(B/s) 单连接最多请求数 */
+    server.SetMetrics(true, 0);         /* 运行指标 GET /metrics，第二个参数>0时改为只在这个管理端口上提供 */
+    server.SetTracing(100, 500);        /* 每100个请求采样一个的分阶段耗时，超过500ms的请求打日志 */
+    server.SetPoolSizing(2, 64, 5, 30000);  /* 工作线程数2~64，排队超过5ms时扩容，空闲30s的线程退出 */
+    server.SetRequestClasses(8, 1, 2, 2);   /* 静态:数据库:管理 的调度权重，数据库类最多同时占2个工作线程 */
+    server.SetFileCache(256, 64);       /* 256KB以内的静态文件缓存在内存里，总共最多64MB */
+    server.SetInlineFastPath(16384, 32);    /* 缓存命中、16KB以内的GET直接在主循环上处理，每轮epoll最多32个 */
+    server.SetAdmission(5, 100, 4096, 1);   /* 排队时间连续100ms超过5ms或排队超过4096个任务时，新请求回503（Retry-After: 1）并暂停accept */
+    server.SetClientLimits(1024, 0, 200, 100000);    /* 每个IP最多1024个连接，超过的回429；请求速率不限（压测都从一个地址来），对外时按需打开，如每秒100个、突发200个 */
+    server.SetGracefulShutdown(30000, true);    /* SIGTERM：不再accept，等正在处理的请求做完再退出（最多30s）；SIGUSR2：把监听socket交给重新执行的新版本后退出 */
     server.Start();
 } 
 
@@ -0,0 +1,181 @@
+#include "metrics.h"
+
+using namespace std;
+
+const char* Metrics::PATH = "/metrics";
+
+namespace {
+
+// 指标名（family）、标签、说明；同一family的几项必须相邻
+struct Desc {
+    const char* family;
+    const char* labels;
+    const char* help;
+};
+
+const Desc COUNTER_DESC[Metrics::COUNTER_NUM] = {
+    { "webserver_connections_accepted_total", "", "Accepted client connections." },
+    { "webserver_connections_rejected_total", "", "Connections refused because the server was full." },
+    { "webserver_connections_closed_total", "", "Closed client connections." },
+    { "webserver_connection_timeouts_total", "", "Connections closed by a phase timeout." },
+    { "webserver_requests_total", "", "Complete requests received." },
+    { "webserver_responses_total", "code=\"2xx\"", "Responses fully written, by status class." },
+    { "webserver_responses_total", "code=\"3xx\"", "" },
+    { "webserver_responses_total", "code=\"4xx\"", "" },
+    { "webserver_responses_total", "code=\"5xx\"", "" },
+    { "webserver_read_bytes_total", "", "Bytes read from clients." },
+    { "webserver_written_bytes_total", "", "Bytes written to clients." },
+    { "webserver_log_lines_total", "level=\"debug\"", "Log lines written, by level." },
+    { "webserver_log_lines_total", "level=\"info\"", "" },
+    { "webserver_log_lines_total", "level=\"warn\"", "" },
+    { "webserver_log_lines_total", "level=\"error\"", "" },
+    { "webserver_inline_requests_total", "result=\"served\"", "Reads handled on the event loop by the static fast path, or handed to workers." },
+    { "webserver_inline_requests_total", "result=\"fallback\"", "" },
+    { "webserver_requests_shed_total", "", "New requests answered with a prebuilt 503 because the worker pool was overloaded." },
+    { "webserver_accept_pauses_total", "", "Times accepting new connections was paused because of overload." },
+    { "webserver_client_limited_total", "kind=\"connection\"", "Connections and requests refused by the per-IP limits." },
+    { "webserver_client_limited_total", "kind=\"request\"", "" },
+};
+
+const Desc HIST_DESC[Metrics::HIST_NUM] = {
+    { "webserver_request_duration_seconds", "", "From the first byte of a request to the end of its response." },
+    { "webserver_process_duration_seconds", "", "Time spent parsing a request and building its response." },
+    { "webserver_threadpool_queue_seconds", "pool=\"worker\"", "Time a task waited in a thread pool queue." },
+    { "webserver_threadpool_queue_seconds", "pool=\"db\"", "" },
+    { "webserver_sql_conn_wait_seconds", "", "Time spent in SqlConnPool::GetConn." },
+    { "webserver_request_stage_seconds", "stage=\"recv\"", "Per-stage latency of sampled requests." },
+    { "webserver_request_stage_seconds", "stage=\"queue\"", "" },
+    { "webserver_request_stage_seconds", "stage=\"read_parse\"", "" },
+    { "webserver_request_stage_seconds", "stage=\"db\"", "" },
+    { "webserver_request_stage_seconds", "stage=\"build\"", "" },
+    { "webserver_request_stage_seconds", "stage=\"write_wait\"", "" },
+    { "webserver_request_stage_seconds", "stage=\"send\"", "" },
+};
+
+// 桶的上界（微秒），最后还有一个 +Inf
+const int64_t BUCKET_US[Metrics::BUCKET_NUM] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000,
+    50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000,
+};
+
+// 输出一个family的 HELP 和 TYPE（和上一项同名时跳过）
+void Header(string& out, const char* family, const char* type, const string& help, string& last) {
+    if(last == family) {
+        return;
+    }
+    last = family;
+    out += "# HELP "; out += family; out += ' '; out += help; out += '\n';
+    out += "# TYPE "; out += family; out += ' '; out += type; out += '\n';
+}
+
+// name{labels,extra} value
+void Sample(string& out, const string& name, const char* labels, const string& extra, double value) {
+    out += name;
+    if(*labels || !extra.empty()) {
+        out += '{';
+        out += labels;
+        if(*labels && !extra.empty()) { out += ','; }
+        out += extra;
+        out += '}';
+    }
+    char num[64];
+    if(value == static_cast<double>(static_cast<int64_t>(value))) {
+        snprintf(num, sizeof(num), " %lld\n", static_cast<long long>(value));
+    } else {
+        snprintf(num, sizeof(num), " %.6f\n", value);
+    }
+    out += num;
+}
+
+} // namespace
+
+Metrics* Metrics::Instance() {
+    static Metrics inst;
+    return &inst;
+}
+
+// 线程第一次用时轮流分配一个分片，之后一直用这个
+Metrics::Shard& Metrics::LocalShard_() {
+    thread_local int idx = nextShard_.fetch_add(1, memory_order_relaxed) % SHARD_NUM;
+    return shards_[idx];
+}
+
+void Metrics::Observe(Hist h, int64_t us) {
+    if(!Enabled()) { return; }
+    if(us < 0) { us = 0; }
+    int b = 0;
+    while(b < BUCKET_NUM && us > BUCKET_US[b]) { b++; }
+    Shard& shard = LocalShard_();
+    shard.buckets[h][b].fetch_add(1, memory_order_relaxed);
+    shard.sumUs[h].fetch_add(static_cast<uint64_t>(us), memory_order_relaxed);
+}
+
+void Metrics::AddCallback(const string& name, const char* type, const string& help, function<double()> fn) {
+    lock_guard<mutex> locker(mtx_);
+    for(Callback& cb : callbacks_) {
+        if(cb.name == name) {
+            cb = {name, type, help, std::move(fn)};
+            return;
+        }
+    }
+    callbacks_.push_back({name, type, help, std::move(fn)});
+}
+
+void Metrics::ClearCallbacks() {
+    lock_guard<mutex> locker(mtx_);
+    callbacks_.clear();
+}
+
+string Metrics::Render() {
+    string out;
+    out.reserve(8192);
+    string last;
+
+    for(int c = 0; c < COUNTER_NUM; c++) {
+        uint64_t total = 0;
+        for(const Shard& shard : shards_) {
+            total += shard.counters[c].load(memory_order_relaxed);
+        }
+        Header(out, COUNTER_DESC[c].family, "counter", COUNTER_DESC[c].help, last);
+        Sample(out, COUNTER_DESC[c].family, COUNTER_DESC[c].labels, "", static_cast<double>(total));
+    }
+
+    for(int h = 0; h < HIST_NUM; h++) {
+        uint64_t buckets[BUCKET_NUM + 1] = {};
+        uint64_t sumUs = 0;
+        for(const Shard& shard : shards_) {
+            for(int b = 0; b <= BUCKET_NUM; b++) {
+                buckets[b] += shard.buckets[h][b].load(memory_order_relaxed);
+            }
+            sumUs += shard.sumUs[h].load(memory_order_relaxed);
+        }
+        const Desc& d = HIST_DESC[h];
+        string family = d.family;
+        Header(out, d.family, "histogram", d.help, last);
+        uint64_t cumulative = 0;
+        char le[48];
+        for(int b = 0; b <= BUCKET_NUM; b++) {
+            cumulative += buckets[b];
+            if(b < BUCKET_NUM) {
+                snprintf(le, sizeof(le), "le=\"%g\"", BUCKET_US[b] / 1e6);
+            } else {
+                snprintf(le, sizeof(le), "le=\"+Inf\"");
+            }
+            Sample(out, family + "_bucket", d.labels, le, static_cast<double>(cumulative));
+        }
+        Sample(out, family + "_sum", d.labels, "", sumUs / 1e6);
+        Sample(out, family + "_count", d.labels, "", static_cast<double>(cumulative));
+    }
+
+    lock_guard<mutex> locker(mtx_);
+    for(const Callback& cb : callbacks_) {
+        size_t brace = cb.name.find('{');
+        string family = cb.name.substr(0, brace);
+        Header(out, family.c_str(), cb.type, cb.help, last);
+        out += cb.name;
+        char num[64];
+        snprintf(num, sizeof(num), " %.17g\n", cb.fn());
+        out += num;
+    }
+    return out;
+}
@@ -0,0 +1,120 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <cstdint>
+
+/*
+    运行指标（Prometheus 文本格式，GET /metrics 或单独的管理端口）
+        计数器、直方图：按线程分片，每个线程固定落在一个分片上（各分片按缓存行对齐），
+                       更新只是一次没有竞争的 relaxed 原子加，抓取时才把所有分片加起来
+        直方图：固定的桶（100us ~ 10s），记录时在16个边界里找位置，不加锁
+        其他模块已有的统计（连接池、缓存、日志丢弃……）注册成回调，抓取时现取
+    SetEnabled(false) 时 Add/Observe 直接返回
+*/
+class Metrics {
+public:
+    enum Counter {
+        CONN_ACCEPTED,      // 接受的连接
+        CONN_REJECTED,      // 连接数满了拒绝的连接
+        CONN_CLOSED,        // 关闭的连接
+        CONN_TIMEOUT,       // 其中因为超时关闭的
+        REQUESTS,           // 收完整的请求
+        RESP_2XX,           // 发完的响应，按状态码分类
+        RESP_3XX,
+        RESP_4XX,
+        RESP_5XX,
+        BYTES_READ,
+        BYTES_WRITTEN,
+        LOG_DEBUG_LINES,    // 写出的日志条数，按等级
+        LOG_INFO_LINES,
+        LOG_WARN_LINES,
+        LOG_ERROR_LINES,
+        INLINE_SERVED,      // 主循环上直接处理完的请求（见WebServer::SetInlineFastPath）
+        INLINE_FALLBACK,    // 读到了数据但不能快速处理，交给工作线程的
+        REQ_SHED,           // 过载时直接回503的新请求（见WebServer::SetAdmission）
+        ACCEPT_PAUSES,      // 过载时暂停accept的次数
+        CONN_LIMITED,       // 客户端IP的连接数到上限拒绝的连接（见WebServer::SetClientLimits）
+        REQ_LIMITED,        // 客户端IP的请求速率超限回429的请求
+        COUNTER_NUM,
+    };
+
+    enum Hist {
+        REQUEST_SECONDS,        // 请求的第一个字节读到 -> 响应发完
+        PROCESS_SECONDS,        // 解析请求、生成响应（HttpConn::process）
+        WORKER_QUEUE_SECONDS,   // 工作线程池：任务排队时间
+        DB_QUEUE_SECONDS,       // 数据库线程池：任务排队时间
+        SQL_WAIT_SECONDS,       // SqlConnPool::GetConn 取连接的等待时间
+        STAGE_RECV,             // 请求的各阶段（只统计采样的请求，见ReqTrace）：分几次收完请求
+        STAGE_QUEUE,            // 在线程池里排队
+        STAGE_PARSE,            // 读socket并解析
+        STAGE_DB,               // 数据库验证
+        STAGE_BUILD,            // 生成响应（文件stat/open/mmap）
+        STAGE_WRITE_WAIT,       // 响应生成后到第一次写（交回主循环、等可写、再排队）
+        STAGE_SEND,             // 第一次写到发完
+        HIST_NUM,
+    };
+
+    static const char* PATH;                // 指标的访问路径 "/metrics"
+    static const int BUCKET_NUM = 16;       // 直方图的桶数（另有一个 +Inf）
+
+    static Metrics* Instance();
+
+    void SetEnabled(bool enabled) { enabled_.store(enabled, std::memory_order_relaxed); }
+    bool Enabled() const { return enabled_.load(std::memory_order_relaxed); }
+
+    void Add(Counter c, uint64_t n = 1) {
+        if(!Enabled()) { return; }
+        LocalShard_().counters[c].fetch_add(n, std::memory_order_relaxed);
+    }
+    void Observe(Hist h, int64_t us);       // 记录一次耗时（微秒）
+
+    // 抓取时调用fn取值；name可以带标签，如 webserver_threadpool_queue_length{pool="worker"}
+    // type 为 "gauge" 或 "counter"，同名（不含标签）的只输出一次 HELP/TYPE；name（含标签）已经注册过时替换原来的
+    void AddCallback(const std::string& name, const char* type, const std::string& help, std::function<double()> fn);
+    // 去掉所有回调：回调里捕获的对象（服务器、线程池）销毁前调用，等正在进行的Render做完才返回
+    void ClearCallbacks();
+
+    std::string Render();   // 汇总各分片，生成 Prometheus 文本格式
+
+    static int64_t NowUs() {
+        return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+private:
+    Metrics() = default;
+    Metrics(const Metrics&) = delete;
+    Metrics& operator=(const Metrics&) = delete;
+
+    static const int SHARD_NUM = 32;
+
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> counters[COUNTER_NUM] = {};
+        std::atomic<uint64_t> buckets[HIST_NUM][BUCKET_NUM + 1] = {};
+        std::atomic<uint64_t> sumUs[HIST_NUM] = {};
+    };
+
+    struct Callback {
+        std::string name;
+        const char* type;
+        std::string help;
+        std::function<double()> fn;
+    };
+
+    Shard& LocalShard_();
+
+    std::atomic<bool> enabled_{false};
+    Shard shards_[SHARD_NUM];
+    std::atomic<int> nextShard_{0};
+
+    std::mutex mtx_;                    // 保护 callbacks_
+    std::vector<Callback> callbacks_;
+};
+
+#endif // METRICS_H
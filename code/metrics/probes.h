@@ -0,0 +1,34 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+    USDT静态探针（provider为webserver），给bpftrace/perf/systemtap在线上挂载用，现成的脚本见 scripts/bpftrace/
+        make USDT=1 编译时定义ENABLE_USDT，需要 sys/sdt.h（systemtap-sdt-dev / systemtap-sdt-devel）
+        探针在没有挂载时只是一条nop，不读时钟、不加锁；不定义ENABLE_USDT时整个宏为空，参数也不会求值
+
+    探针                  参数
+    conn__accept          fd, ip(char*), port
+    conn__close           fd, 连接上处理的请求数
+    request__start        fd                                      开始解析一个请求
+    request__parsed       fd, ok, method(char*), path(char*)      ok为0表示请求不完整（还要再收）或出错
+    request__shed         fd                                      过载，新请求直接回了503
+    request__limited      fd                                      客户端IP请求太快，新请求直接回了429
+    response__start       fd, code, 要发送的字节数（响应头+文件）
+    response__done        fd, code                                响应发完
+    pool__enqueue         pool, 入队后的队列长度                  pool为线程池的地址，区分工作线程池/数据库线程池
+    pool__dequeue         pool, 排队时间(us)
+    timer__expire         id（连接的fd或内部定时器id）, 超过期限的时间(us)
+    sql__acquire          MYSQL*（取不到为0）, 等待时间(us)
+    sql__release          MYSQL*
+    log__flush            当前日志文件的字节数
+*/
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+#define USDT_ENABLED 1
+#define WS_PROBE(...) STAP_PROBEV(webserver, __VA_ARGS__)
+#else
+#define USDT_ENABLED 0
+#define WS_PROBE(...) do {} while(0)
+#endif
+
+#endif // PROBES_H
@@ -0,0 +1,95 @@
+#include "reqtrace.h"
+
+using namespace std;
+
+int ReqTrace::sampleEvery_ = 0;
+int64_t ReqTrace::slowUs_ = 0;
+
+void ReqTrace::Configure(int sampleEvery, int slowMs) {
+    sampleEvery_ = sampleEvery > 0 ? sampleEvery : 0;
+    slowUs_ = slowMs > 0 ? slowMs * 1000LL : 0;
+}
+
+// 每个线程自己数，不用原子操作；总体上仍然是每sampleEvery_个请求采样一个
+void ReqTrace::Sample_() {
+    thread_local uint32_t counter = 0;
+    sampled_ = sampleEvery_ > 0 && ++counter % sampleEvery_ == 0;
+}
+
+void ReqTrace::Reset() {
+    for(int64_t& t : t_) { t = 0; }
+    Sample_();
+    Mark(ACCEPT);
+}
+
+void ReqTrace::Begin(int64_t now) {
+    if(sampled_ && now == 0) {
+        now = Metrics::NowUs();
+    }
+    t_[FIRST_BYTE] = now;
+    // DISPATCH、WORKER_START 在读之前已经记好了，只清掉后面的阶段
+    for(int s = PARSE_DONE; s < STAGE_NUM; s++) { t_[s] = 0; }
+}
+
+void ReqTrace::BeginInline(int64_t now) {
+    Begin(now);
+    if(sampled_) {
+        t_[DISPATCH] = t_[WORKER_START] = t_[FIRST_BYTE];
+    }
+}
+
+int64_t ReqTrace::Span_(Stage from, Stage to) const {
+    if(t_[from] == 0 || t_[to] == 0) {
+        return -1;
+    }
+    return t_[to] > t_[from] ? t_[to] - t_[from] : 0;
+}
+
+bool ReqTrace::Finish(int64_t now, string* line) {
+    if(sampled_) {
+        t_[LAST_WRITE] = now ? now : Metrics::NowUs();
+        now = t_[LAST_WRITE];
+    }
+    int64_t total = (now && t_[FIRST_BYTE]) ? now - t_[FIRST_BYTE] : -1;
+    bool slow = slowUs_ > 0 && total >= slowUs_;
+
+    if(sampled_ || slow) {
+        Stage built = t_[VERIFY_DONE] ? VERIFY_DONE : PARSE_DONE;
+        const struct { const char* name; Metrics::Hist hist; int64_t us; } spans[] = {
+            { "recv",       Metrics::STAGE_RECV,       Span_(FIRST_BYTE, DISPATCH) },
+            { "queue",      Metrics::STAGE_QUEUE,      Span_(DISPATCH, WORKER_START) },
+            { "read_parse", Metrics::STAGE_PARSE,      Span_(WORKER_START, PARSE_DONE) },
+            { "db",         Metrics::STAGE_DB,         Span_(PARSE_DONE, VERIFY_DONE) },
+            { "build",      Metrics::STAGE_BUILD,      Span_(built, RESPONSE_BUILT) },
+            { "write_wait", Metrics::STAGE_WRITE_WAIT, Span_(RESPONSE_BUILT, FIRST_WRITE) },
+            { "send",       Metrics::STAGE_SEND,       Span_(FIRST_WRITE, LAST_WRITE) },
+        };
+        if(sampled_) {
+            for(const auto& span : spans) {
+                if(span.us >= 0) { Metrics::Instance()->Observe(span.hist, span.us); }
+            }
+        }
+        if(slow) {
+            char buf[64];
+            snprintf(buf, sizeof(buf), "total_us=%lld", static_cast<long long>(total));
+            *line = buf;
+            if(t_[ACCEPT]) {
+                snprintf(buf, sizeof(buf), " since_accept_us=%lld", static_cast<long long>(now - t_[ACCEPT]));
+                *line += buf;
+            }
+            if(sampled_) {
+                for(const auto& span : spans) {
+                    if(span.us < 0) { continue; }
+                    snprintf(buf, sizeof(buf), " %s_us=%lld", span.name, static_cast<long long>(span.us));
+                    *line += buf;
+                }
+            } else {
+                *line += " sampled=0";
+            }
+        }
+    }
+
+    t_[ACCEPT] = 0;     // 只有连接上的第一个请求算接受连接的时间
+    Sample_();          // 下一个请求是否采样
+    return slow;
+}
@@ -0,0 +1,70 @@
+#ifndef REQ_TRACE_H
+#define REQ_TRACE_H
+
+#include <string>
+#include <cstdint>
+#include "metrics.h"
+
+/*
+    单个请求的分阶段时间戳（单调时钟，微秒），每个HttpConn带一个
+        ACCEPT          接受连接（只有连接上的第一个请求有）
+        FIRST_BYTE      读到请求的第一个字节（流水线里后面的请求：前一个响应发完）
+        DISPATCH        主循环把读事件交给线程池（请求分几次收到时取最后一次）
+        WORKER_START    工作线程开始处理
+        PARSE_DONE      读完并解析完请求
+        VERIFY_DONE     数据库验证完成（只有登录/注册）
+        RESPONSE_BUILT  响应头生成、文件映射完成
+        FIRST_WRITE     第一次writev
+        LAST_WRITE      响应发完
+    采样：每sampleEvery个请求记录一个的全部阶段（在上一个请求结束时就决定下一个是否采样，不采样的请求不读时钟），
+         采样的请求按阶段记入 webserver_request_stage_seconds 直方图
+    慢请求：总耗时（FIRST_BYTE -> LAST_WRITE，所有请求都有）超过slowMs的打一行日志，采样到的带上各阶段耗时
+    时间戳由当前持有连接的线程写（主循环或工作线程），交接经过线程池队列/LoopQueue
+*/
+class ReqTrace {
+public:
+    enum Stage {
+        ACCEPT,
+        FIRST_BYTE,
+        DISPATCH,
+        WORKER_START,
+        PARSE_DONE,
+        VERIFY_DONE,
+        RESPONSE_BUILT,
+        FIRST_WRITE,
+        LAST_WRITE,
+        STAGE_NUM,
+    };
+
+    // sampleEvery：每多少个请求采样一个，0为不记录阶段；slowMs：慢请求阈值，0为不输出
+    static void Configure(int sampleEvery, int slowMs);
+    // 是否需要请求的起止时间（指标或慢请求日志要用）
+    static bool Timing() { return slowUs_ > 0 || Metrics::Instance()->Enabled(); }
+
+    void Reset();                   // 新连接
+    void Begin(int64_t now);        // 新请求的第一个字节；now为0表示不计时
+    void BeginInline(int64_t now);  // 流水线：请求已经在缓冲区里，直接在写完上一个响应的线程上处理
+    void Mark(Stage s) {
+        if(sampled_) { t_[s] = Metrics::NowUs(); }
+    }
+    void MarkOnce(Stage s) {
+        if(sampled_ && t_[s] == 0) { t_[s] = Metrics::NowUs(); }
+    }
+    int64_t Start() const { return t_[FIRST_BYTE]; }
+
+    // 响应发完：采样的记入各阶段直方图；是慢请求时返回true，line为各阶段耗时（key=value）
+    // 同时决定下一个请求是否采样
+    bool Finish(int64_t now, std::string* line);
+
+private:
+    int64_t Span_(Stage from, Stage to) const;  // 两个阶段之间的耗时，缺少任一时间戳时为-1
+    void Sample_();
+
+    static int sampleEvery_;
+    static int64_t slowUs_;
+
+    int64_t t_[STAGE_NUM] = {};
+    bool sampled_ = false;
+};
+
+#endif // REQ_TRACE_H
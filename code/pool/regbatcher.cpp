@@ -0,0 +1,90 @@
+#include "regbatcher.h"
+
+using namespace std;
+
+RegBatcher* RegBatcher::Instance() {
+    static RegBatcher batcher;
+    return &batcher;
+}
+
+void RegBatcher::Init(int maxBatch, int maxDelayMs) {
+    assert(maxBatch > 0 && maxDelayMs >= 0);
+    lock_guard<mutex> locker(mtx_);
+    if(!isClose_) { return; }
+    maxBatch_ = maxBatch;
+    maxDelayMs_ = maxDelayMs;
+    isClose_ = false;
+    thread_ = make_unique<thread>(&RegBatcher::Work_, this);
+}
+
+bool RegBatcher::Submit(const string& name, const string& pwd, bool check, Callback done) {
+    {
+        lock_guard<mutex> locker(mtx_);
+        if(!isClose_) {
+            if(!reserved_.insert(name).second) {
+                conflicts_++;
+                return false;   // 同一个用户名已经有注册在途
+            }
+            queue_.push_back({{name, pwd, check, -1}, std::move(done)});
+            cond_.notify_one();
+            return true;
+        }
+    }
+    done(-1);
+    return true;
+}
+
+void RegBatcher::Close() {
+    {
+        lock_guard<mutex> locker(mtx_);
+        isClose_ = true;
+    }
+    cond_.notify_all();
+    if(thread_ && thread_->joinable()) {
+        thread_->join();
+    }
+}
+
+void RegBatcher::Work_() {
+    unique_lock<mutex> locker(mtx_);
+    while(true) {
+        cond_.wait(locker, [this]() { return isClose_ || !queue_.empty(); });
+        if(queue_.empty()) { break; }   // 已关闭且没有剩余的注册
+
+        // 第一个注册到达后再等maxDelayMs_，让这段时间内的注册攒成一批
+        auto deadline = chrono::steady_clock::now() + chrono::milliseconds(maxDelayMs_);
+        cond_.wait_until(locker, deadline, [this]() {
+            return isClose_ || queue_.size() >= static_cast<size_t>(maxBatch_);
+        });
+
+        vector<Job> jobs;
+        if(queue_.size() <= static_cast<size_t>(maxBatch_)) {
+            jobs.swap(queue_);
+        } else {
+            jobs.assign(make_move_iterator(queue_.begin()), make_move_iterator(queue_.begin() + maxBatch_));
+            queue_.erase(queue_.begin(), queue_.begin() + maxBatch_);
+        }
+        locker.unlock();
+        Commit_(jobs);
+        locker.lock();
+        // 回调里已经更新了缓存，这时再放开预留
+        for(auto& job : jobs) {
+            reserved_.erase(job.row.name);
+        }
+    }
+}
+
+void RegBatcher::Commit_(vector<Job>& jobs) {
+    vector<RegRow*> rows;
+    rows.reserve(jobs.size());
+    for(auto& job : jobs) {
+        rows.push_back(&job.row);
+    }
+    UserStore::Instance()->Register(rows);
+
+    batches_++;
+    for(auto& job : jobs) {
+        if(job.row.ret == 1) { rows_++; }
+        job.done(job.row.ret);
+    }
+}
@@ -0,0 +1,70 @@
+#ifndef REG_BATCHER_H
+#define REG_BATCHER_H
+
+#include <string>
+#include <vector>
+#include <unordered_set>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <memory>
+#include <atomic>
+#include <cassert>
+#include "../store/userstore.h"
+#include "../log/log.h"
+
+/*
+    注册写合并（write-behind + group commit）
+        1. Submit 先在内存的预留集合里占住用户名，同一个用户名同时只能有一个注册在途
+           （只是本进程里按字节比较的快速路径，真正的判重靠存储的唯一约束）
+        2. 批处理线程每 maxDelayMs 毫秒（或攒够 maxBatch 个）取一批，交给 UserStore::Register 一次提交
+           （MySQL：一个事务里多行 INSERT IGNORE；SQLite：一个事务里 INSERT OR IGNORE）
+        3. 提交返回（已持久化）后才回调 done，调用方此时再发送HTTP响应
+    回调在批处理线程执行，不要在回调里做耗时操作
+*/
+class RegBatcher {
+public:
+    using Callback = std::function<void(int)>;     // 1 注册成功，0 用户名已被使用，-1 数据库不可用
+
+    static RegBatcher* Instance();
+    void Init(int maxBatch, int maxDelayMs);
+    /*
+        check：是否需要查重（负缓存/布隆过滤器确定不存在时传false）
+        用户名正在被别的请求注册时返回false，不会回调
+    */
+    bool Submit(const std::string& name, const std::string& pwd, bool check, Callback done);
+    void Close();   // 提交完队列里剩下的注册再退出
+
+    uint64_t GetBatches() const { return batches_; }        // 提交的批数
+    uint64_t GetRows() const { return rows_; }              // 插入成功的行数
+    uint64_t GetConflicts() const { return conflicts_; }    // 预留冲突次数
+
+private:
+    RegBatcher() = default;
+    ~RegBatcher() { Close(); }
+
+    struct Job {
+        RegRow row;
+        Callback done;
+    };
+
+    void Work_();
+    void Commit_(std::vector<Job>& jobs);
+
+    int maxBatch_ = 128;
+    int maxDelayMs_ = 2;
+
+    std::mutex mtx_;
+    std::condition_variable cond_;
+    std::vector<Job> queue_;
+    std::unordered_set<std::string> reserved_;     // 在途的用户名（排队中 + 提交中）
+    bool isClose_ = true;
+    std::unique_ptr<std::thread> thread_;
+
+    std::atomic<uint64_t> batches_{0};
+    std::atomic<uint64_t> rows_{0};
+    std::atomic<uint64_t> conflicts_{0};
+};
+
+#endif // REG_BATCHER_H
@@ -0,0 +1,69 @@
+#ifndef SINGLE_FLIGHT_H
+#define SINGLE_FLIGHT_H
+
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <cstdint>
+
+/*
+    请求合并（singleflight）：同一个key同时只执行一次fn
+    执行期间到达的相同key的调用者不再执行fn，而是等待并共享第一个调用者（leader）的结果
+    执行结束后key立即移除，之后的调用会重新执行（不做缓存，缓存见UserCache）
+*/
+template<typename K, typename V>
+class SingleFlight {
+public:
+    // shared：返回的结果是否是共享别人的（自己没有执行fn）
+    V Do(const K& key, const std::function<V()>& fn, bool* shared = nullptr);
+
+    uint64_t GetCalls() const { return calls_; }          // 总调用次数
+    uint64_t GetCoalesced() const { return coalesced_; }  // 被合并（没有执行fn）的次数
+
+private:
+    struct Call {
+        std::condition_variable cond;
+        bool done = false;
+        V val;
+    };
+
+    std::mutex mtx_;
+    std::unordered_map<K, std::shared_ptr<Call>> flights_;  // 正在执行中的调用
+    std::atomic<uint64_t> calls_{0};
+    std::atomic<uint64_t> coalesced_{0};
+};
+
+template<typename K, typename V>
+V SingleFlight<K, V>::Do(const K& key, const std::function<V()>& fn, bool* shared) {
+    calls_++;
+    std::unique_lock<std::mutex> locker(mtx_);
+    auto it = flights_.find(key);
+    if(it != flights_.end()) {
+        // 已经有人在查了，等他的结果
+        std::shared_ptr<Call> call = it->second;
+        coalesced_++;
+        call->cond.wait(locker, [&call]() { return call->done; });
+        if(shared) *shared = true;
+        return call->val;
+    }
+
+    std::shared_ptr<Call> call = std::make_shared<Call>();
+    flights_[key] = call;
+    locker.unlock();
+
+    V val = fn();   // 执行期间不持有锁
+
+    locker.lock();
+    call->val = val;
+    call->done = true;
+    flights_.erase(key);
+    locker.unlock();
+    call->cond.notify_all();
+    if(shared) *shared = false;
+    return val;
+}
+
+#endif // SINGLE_FLIGHT_H
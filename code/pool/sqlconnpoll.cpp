@@ -1,30 +1,100 @@
 #include "sqlconnpool.h"
+#include "../metrics/metrics.h"
+#include "../metrics/probes.h"
+
+const char* SqlConnPool::STMT_SQL[STMT_NUM] = {
+    "SELECT password FROM user WHERE username = ? LIMIT 1",     // STMT_USER_QUERY
+    "INSERT IGNORE INTO user(username, password) VALUES(?, ?)", // STMT_USER_INSERT（用户名重复时忽略，影响行数为0）
+};
+
+// 等待时间直方图的桶上界（微秒）：0.1ms 0.5ms 1ms 5ms 10ms 50ms 100ms 500ms 1s +Inf
+const int64_t SqlConnPool::WAIT_BUCKET_US[WAIT_BUCKET_NUM - 1] = {
+    100, 500, 1000, 5000, 10000, 50000, 100000, 500000, 1000000,
+};
 
 SqlConnPool* SqlConnPool::Instance() {
     static SqlConnPool pool;
     return &pool;
 }
 
-// 初始化
+void SqlConnPool::SetPolicy(int minConn, int acquireTimeoutMs, int idleTimeoutSec, int pingAfterSec) {
+    assert(minConn >= 0 && acquireTimeoutMs > 0);
+    minConn_ = minConn;
+    acquireTimeoutMs_ = acquireTimeoutMs;
+    idleTimeoutSec_ = idleTimeoutSec;
+    pingAfterSec_ = pingAfterSec;
+}
+
+// 初始化：并行建立minConn_个连接，其余的等用到时再建立
 void SqlConnPool::Init(const char* host, int port,
               const char* user,const char* pwd, 
               const char* dbName, int connSize = 10) {
     assert(connSize > 0);
-    for(int i = 0; i < connSize; i++) {
-        MYSQL* conn = nullptr;
-        conn = mysql_init(conn);
-        if(!conn) {
-            LOG_ERROR("MySql init error!");
-            assert(conn);
-        }
-        conn = mysql_real_connect(conn, host, user, pwd, dbName, port, nullptr, 0);
-        if (!conn) {
-            LOG_ERROR("MySql Connect error!");
-        }
-        connQue_.emplace(conn);
+    host_ = host;
+    port_ = port;
+    user_ = user;
+    pwd_ = pwd;
+    dbName_ = dbName;
+    maxConn_ = connSize;
+    if(minConn_ > maxConn_) minConn_ = maxConn_;
+    isClose_ = false;
+
+    std::vector<std::thread> connectors;
+    for(int i = 0; i < minConn_; i++) {
+        connectors.emplace_back([this]() {
+            Conn* conn = NewConn_();
+            if(!conn) {
+                LOG_ERROR("MySql Connect error!");
+                return;
+            }
+            lock_guard<mutex> locker(mtx_);
+            total_++;
+            idle_.push_back(conn);
+        });
+    }
+    for(auto& t : connectors) t.join();
+    LOG_INFO("SqlConnPool init: %d/%d connected, max %d", (int)idle_.size(), minConn_, maxConn_);
+
+    reaper_ = std::make_unique<std::thread>(&SqlConnPool::Reap_, this);
+}
+
+// 在连接池自己分配的MYSQL对象上建立连接
+bool SqlConnPool::Connect_(MYSQL* conn) {
+    if(!mysql_init(conn)) {
+        LOG_ERROR("MySql init error!");
+        return false;
+    }
+    // 数据库挂了的时候不要让线程无限期卡在connect/read上
+    unsigned int connectTimeout = 3, rwTimeout = 10;
+    mysql_options(conn, MYSQL_OPT_CONNECT_TIMEOUT, &connectTimeout);
+    mysql_options(conn, MYSQL_OPT_READ_TIMEOUT, &rwTimeout);
+    mysql_options(conn, MYSQL_OPT_WRITE_TIMEOUT, &rwTimeout);
+    return mysql_real_connect(conn, host_.c_str(), user_.c_str(), pwd_.c_str(),
+                              dbName_.c_str(), port_, nullptr, 0) != nullptr;
+}
+
+SqlConnPool::Conn* SqlConnPool::NewConn_() {
+    std::unique_ptr<Conn> conn(new Conn());
+    conn->stmts.fill(nullptr);
+    conn->lastUsed = SteadyClock::now();
+    if(!Connect_(&conn->mysql)) {
+        LOG_ERROR("MySql connect error: %s", mysql_error(&conn->mysql));
+        mysql_close(&conn->mysql);
+        return nullptr;
     }
-    MAX_CONN_ = connSize;
-    sem_init(&semId_, 0, MAX_CONN_);
+    Conn* ptr = conn.get();
+    lock_guard<mutex> locker(mtx_);
+    all_[&ptr->mysql] = std::move(conn);
+    return ptr;
+}
+
+void SqlConnPool::DestroyConn_(Conn* conn) {
+    CloseStmts_(conn);
+    mysql_close(&conn->mysql);
+    lock_guard<mutex> locker(mtx_);
+    all_.erase(&conn->mysql);
+    total_--;
+    cond_.notify_one();     // 名额空出来了，等待的线程可以去新建连接
 }
 
 // 个人觉得这里的出栈不是很好（没做到先读出再弹出），所以修改了一下（大致有些地方大改）
@@ -41,38 +111,211 @@ void SqlConnPool::Init(const char* host, int port,
 //     return conn;
 // }
 
+/*
+    取连接的顺序：
+        1. 有空闲连接就用（空闲太久的先ping，断了就重连，重连不上就丢掉这个连接）
+        2. 没有空闲但还没到上限，当前线程自己去建立一个新连接（多个线程同时缺连接时就是并行建立）
+        3. 到上限了就等待归还，最多等acquireTimeoutMs_，超时返回空指针
+*/
 void SqlConnPool::GetConn(MYSQL** conn) {
-    sem_wait(&semId_);  // -1
+    *conn = nullptr;
+    auto begin = SteadyClock::now();
+    auto deadline = begin + std::chrono::milliseconds(acquireTimeoutMs_);
 
-    lock_guard<mutex> locker(mtx_);
-    if(connQue_.empty()) {
-        LOG_WARN("SqlConnPool busy!");
-        *conn = nullptr;   // 给调用者赋个空指针，告诉他没拿到连接
-        return;
+    unique_lock<mutex> locker(mtx_);
+    while(!isClose_) {
+        if(!idle_.empty()) {
+            Conn* c = idle_.front();
+            idle_.pop_front();
+            locker.unlock();
+            bool idleLong = SteadyClock::now() - c->lastUsed > std::chrono::seconds(pingAfterSec_);
+            if(idleLong && mysql_ping(&c->mysql) != 0 && !Reconnect(&c->mysql)) {
+                DestroyConn_(c);    // 数据库可能挂了，丢掉这个连接，继续尝试
+                locker.lock();
+                continue;
+            }
+            *conn = &c->mysql;
+            break;
+        }
+        if(total_ < maxConn_) {
+            total_++;       // 先占名额再去连接，连接期间不持有锁
+            locker.unlock();
+            Conn* c = NewConn_();
+            if(c) {
+                *conn = &c->mysql;
+            } else {
+                locker.lock();
+                total_--;
+                cond_.notify_one();
+            }
+            break;          // 数据库连不上就直接返回错误，不在这里空等
+        }
+        if(cond_.wait_until(locker, deadline) == std::cv_status::timeout) {
+            timeouts_++;
+            LOG_WARN("SqlConnPool busy!");
+            break;
+        }
     }
-    *conn = connQue_.front();
-    connQue_.pop();
+    if(locker.owns_lock()) locker.unlock();
+    int64_t waitUs = std::chrono::duration_cast<std::chrono::microseconds>(SteadyClock::now() - begin).count();
+    RecordWait_(waitUs);
+    WS_PROBE(sql__acquire, *conn, waitUs);
 }
 
 // 存入连接池，实际上没有关闭
 void SqlConnPool::FreeConn(MYSQL* conn) {
     assert(conn);
+    WS_PROBE(sql__release, conn);
+    Conn* c = FindConn_(conn);
+    assert(c);
+    c->lastUsed = SteadyClock::now();
+    {
+        lock_guard<mutex> locker(mtx_);
+        if(!isClose_) {
+            idle_.push_front(c);
+            cond_.notify_one();
+            return;
+        }
+    }
+    DestroyConn_(c);    // 连接池已经关闭，直接释放
+}
+
+SqlConnPool::Conn* SqlConnPool::FindConn_(MYSQL* conn) {
     lock_guard<mutex> locker(mtx_);
-    connQue_.push(conn);
-    sem_post(&semId_);  // +1
+    auto it = all_.find(conn);
+    return it == all_.end() ? nullptr : it->second.get();
 }
 
+void SqlConnPool::RecordWait_(int64_t us) {
+    int bucket = 0;
+    while(bucket < WAIT_BUCKET_NUM - 1 && us > WAIT_BUCKET_US[bucket]) {
+        bucket++;
+    }
+    waitHist_[bucket]++;
+    waitSumUs_ += us;
+    Metrics::Instance()->Observe(Metrics::SQL_WAIT_SECONDS, us);
+}
+
+// 回收线程：每秒检查一次
+//   空闲太久的连接关掉（保留minConn_个）；连接数掉到minConn_以下时补建
+void SqlConnPool::Reap_() {
+    unique_lock<mutex> locker(mtx_);
+    while(!isClose_) {
+        reaperCond_.wait_for(locker, std::chrono::seconds(1));
+        if(isClose_) break;
+
+        std::vector<Conn*> expired;
+        auto now = SteadyClock::now();
+        int removable = total_ - minConn_;
+        while(removable > 0 && !idle_.empty() &&
+              now - idle_.back()->lastUsed > std::chrono::seconds(idleTimeoutSec_)) {
+            expired.push_back(idle_.back());
+            idle_.pop_back();
+            removable--;
+        }
+        int missing = minConn_ - total_;
+        total_ += missing > 0 ? missing : 0;
+        locker.unlock();
+
+        for(Conn* c : expired) {
+            DestroyConn_(c);
+        }
+        for(int i = 0; i < missing; i++) {
+            Conn* c = NewConn_();
+            lock_guard<mutex> guard(mtx_);
+            if(c) {
+                idle_.push_back(c);
+                cond_.notify_one();
+            } else {
+                total_--;
+            }
+        }
+        if(!expired.empty()) {
+            LOG_INFO("SqlConnPool reap %d idle conns", (int)expired.size());
+        }
+        locker.lock();
+    }
+}
+
+MYSQL_STMT* SqlConnPool::GetStmt(MYSQL* conn, SqlStmtId id) {
+    assert(conn && id >= 0 && id < STMT_NUM);
+    Conn* c = FindConn_(conn);
+    assert(c);
+    MYSQL_STMT*& stmt = c->stmts[id];
+    if(stmt) {
+        return stmt;    // 命中缓存，直接复用服务器端已经解析好的语句
+    }
+
+    // 第一次使用（或重连之后），prepare一次；断线则重连后再试一次
+    for(int retry = 0; retry < 2; retry++) {
+        stmt = mysql_stmt_init(conn);
+        if(stmt && mysql_stmt_prepare(stmt, STMT_SQL[id], strlen(STMT_SQL[id])) == 0) {
+            return stmt;
+        }
+        unsigned int err = stmt ? mysql_stmt_errno(stmt) : mysql_errno(conn);
+        LOG_ERROR("MySql prepare error(%u): %s", err, stmt ? mysql_stmt_error(stmt) : mysql_error(conn));
+        if(stmt) mysql_stmt_close(stmt);
+        stmt = nullptr;
+        if(retry > 0 || !Reconnect(conn)) {
+            break;
+        }
+    }
+    return nullptr;
+}
+
+bool SqlConnPool::Reconnect(MYSQL* conn) {
+    assert(conn);
+    LOG_WARN("MySql reconnect...");
+    Conn* c = FindConn_(conn);
+    assert(c);
+    CloseStmts_(c);
+    mysql_close(conn);  // 对象不是mysql_init分配的，这里只断开连接，不会释放内存
+    if(!Connect_(conn)) {
+        LOG_ERROR("MySql reconnect error: %s", mysql_error(conn));
+        return false;
+    }
+    return true;
+}
+
+bool SqlConnPool::IsConnLost(unsigned int err) {
+    return err == CR_SERVER_GONE_ERROR || err == CR_SERVER_LOST;
+}
+
+void SqlConnPool::CloseStmts_(Conn* conn) {
+    for(auto& stmt : conn->stmts) {
+        if(stmt) {
+            mysql_stmt_close(stmt);
+            stmt = nullptr;
+        }
+    }
+}
+
+// 关闭空闲连接；使用中的连接在归还时关闭
 void SqlConnPool::ClosePool() {
-    lock_guard<mutex> locker(mtx_);
-    while(!connQue_.empty()) {
-        auto conn = connQue_.front();
-        connQue_.pop();
-        mysql_close(conn);
+    std::deque<Conn*> idle;
+    {
+        lock_guard<mutex> locker(mtx_);
+        if(isClose_) return;
+        isClose_ = true;
+        idle.swap(idle_);
+    }
+    cond_.notify_all();
+    reaperCond_.notify_all();
+    if(reaper_ && reaper_->joinable()) {
+        reaper_->join();
+    }
+    for(Conn* c : idle) {
+        DestroyConn_(c);
     }
     mysql_library_end();
 }
 
 int SqlConnPool::GetFreeConnCount() {
     lock_guard<mutex> locker(mtx_);
-    return connQue_.size();
+    return idle_.size();
+}
+
+int SqlConnPool::GetConnCount() {
+    lock_guard<mutex> locker(mtx_);
+    return total_;
 }
@@ -2,34 +2,113 @@
 #define SQLCONNPOOL_H
 
 #include <mysql/mysql.h>
+#include <mysql/errmsg.h>     // CR_SERVER_GONE_ERROR
 #include <string>
-#include <queue>
+#include <deque>
+#include <vector>
+#include <array>
+#include <memory>
+#include <unordered_map>
 #include <mutex>
-#include <semaphore.h>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
 #include <thread>
 #include "../log/log.h"
 
+// 预编译语句编号，SQL文本见 SqlConnPool::STMT_SQL
+enum SqlStmtId {
+    STMT_USER_QUERY = 0,    // 按用户名查密码（登录、注册查重）
+    STMT_USER_INSERT,       // 注册新用户（INSERT IGNORE，靠username上的唯一索引判重）
+    STMT_NUM,
+};
+
+/*
+    弹性连接池
+        最少保留 minConn_ 个连接（启动时并行建立），不够用时按需建立，最多 maxConn_ 个
+        空闲超过 idleTimeoutSec_ 的连接由回收线程关闭（不低于 minConn_）
+        空闲超过 pingAfterSec_ 的连接取出时先 mysql_ping，断了就透明重连
+        GetConn 最多等待 acquireTimeoutMs_，超时返回空指针，调用方应返回 503 而不是卡住线程
+*/
 class SqlConnPool {
 public:
     static SqlConnPool *Instance();
+    // 弹性策略（需在Init之前调用）
+    void SetPolicy(int minConn, int acquireTimeoutMs, int idleTimeoutSec, int pingAfterSec);
     void Init(const char* host, int port,
               const char* user,const char* pwd, 
               const char* dbName, int connSize);
 
-    void GetConn(MYSQL** conn);
+    void GetConn(MYSQL** conn);     // 超时或连不上数据库时 *conn 为 nullptr
     void FreeConn(MYSQL * conn);
     int GetFreeConnCount();
+    int GetConnCount();             // 已建立的连接总数（空闲 + 使用中）
     void ClosePool();
 
+    /*
+        取该连接上缓存的预编译语句，第一次使用时才prepare，之后一直复用（直到重连）
+        连接同一时间只属于一个线程，所以缓存本身不需要加锁
+    */
+    MYSQL_STMT* GetStmt(MYSQL* conn, SqlStmtId id);
+    /*
+        断线重连：关闭该连接上缓存的语句，在同一个MYSQL对象上重新连接（指针不变）
+        之后的GetStmt会重新prepare
+    */
+    bool Reconnect(MYSQL* conn);
+    static bool IsConnLost(unsigned int err);   // 是否是断线类错误（需要重连后重试）
+
+    // GetConn 等待时间直方图，桶的上界见 WAIT_BUCKET_US（最后一个桶是 +Inf）
+    static const int WAIT_BUCKET_NUM = 10;
+    static const int64_t WAIT_BUCKET_US[WAIT_BUCKET_NUM - 1];
+    uint64_t GetWaitCount(int bucket) const { return waitHist_[bucket]; }
+    uint64_t GetWaitSumUs() const { return waitSumUs_; }
+    uint64_t GetTimeoutCount() const { return timeouts_; }
+
 private:
     SqlConnPool() = default;
     ~SqlConnPool() { ClosePool(); }
 
-    int MAX_CONN_;
+    using SteadyClock = std::chrono::steady_clock;
+
+    // 连接池里的一个连接：MYSQL对象由连接池分配，mysql_close不会释放它，重连后指针不变
+    struct Conn {
+        MYSQL mysql;
+        std::array<MYSQL_STMT*, STMT_NUM> stmts;    // 语句缓存
+        SteadyClock::time_point lastUsed;           // 上次归还的时间
+    };
+
+    Conn* NewConn_();               // 建立一个新连接，失败返回nullptr（不持有锁调用）
+    void DestroyConn_(Conn* conn);  // 关闭并释放（不持有锁调用）
+    bool Connect_(MYSQL* conn);
+    void CloseStmts_(Conn* conn);
+    Conn* FindConn_(MYSQL* conn);
+    void RecordWait_(int64_t us);
+    void Reap_();                   // 回收线程：定期关闭空闲太久的连接
+
+    std::string host_, user_, pwd_, dbName_;
+    int port_ = 0;
+
+    int minConn_ = 2;
+    int maxConn_ = 10;
+    int acquireTimeoutMs_ = 500;
+    int idleTimeoutSec_ = 60;
+    int pingAfterSec_ = 10;
 
-    std::queue<MYSQL *> connQue_;
     std::mutex mtx_;
-    sem_t semId_;
+    std::condition_variable cond_;      // 有连接归还（或名额空出）时唤醒
+    std::deque<Conn*> idle_;            // 空闲连接，头部是最近归还的（先用热连接，尾部的老连接被回收）
+    std::unordered_map<MYSQL*, std::unique_ptr<Conn>> all_;     // 全部连接
+    int total_ = 0;                     // 已建立 + 正在建立的连接数
+    bool isClose_ = true;
+
+    std::unique_ptr<std::thread> reaper_;
+    std::condition_variable reaperCond_;
+
+    std::atomic<uint64_t> waitHist_[WAIT_BUCKET_NUM] = {};
+    std::atomic<uint64_t> waitSumUs_{0};
+    std::atomic<uint64_t> timeouts_{0};
+
+    static const char* STMT_SQL[STMT_NUM];
 };
 
 /* 资源在对象构造初始化 资源在对象析构时释放*/
@@ -0,0 +1,313 @@
+#include "threadpool.h"
+#include "../log/log.h"
+#include <algorithm>
+#include <time.h>
+
+thread_local int64_t ThreadPool::taskWaitUs_ = 0;
+
+ThreadPool::ThreadPool(int threadCount) : pool_(std::make_shared<Pool>()) {
+    assert(threadCount > 0);
+    std::lock_guard<std::mutex> locker(pool_->mtx_);
+    for(int i = 0; i < threadCount; i++) {
+        Spawn_(pool_);
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    if(!pool_) {
+        return;
+    }
+    std::vector<std::thread> threads;
+    {
+        std::lock_guard<std::mutex> locker(pool_->mtx_);
+        pool_->isClosed = true;
+        for(auto& worker : pool_->workers) {
+            threads.push_back(std::move(worker.second));
+        }
+        pool_->workers.clear();
+        for(auto& t : pool_->exited) {
+            threads.push_back(std::move(t));
+        }
+        pool_->exited.clear();
+    }
+    pool_->cond_.notify_all();  // 唤醒所有的线程，把剩下的任务执行完后退出
+    for(auto& t : threads) {
+        if(t.get_id() == std::this_thread::get_id()) {
+            t.detach();         // 在自己的任务里析构线程池，不能join自己
+        } else {
+            t.join();
+        }
+    }
+}
+
+void ThreadPool::SetQueueMetric(int hist) {
+    std::lock_guard<std::mutex> locker(pool_->mtx_);
+    pool_->queueHist = hist;
+}
+
+void ThreadPool::SetAdaptive(int minThreads, int maxThreads, int targetDelayUs, int idleMs, const char* name) {
+    assert(minThreads > 0 && maxThreads >= minThreads && targetDelayUs > 0 && idleMs > 0);
+    std::lock_guard<std::mutex> locker(pool_->mtx_);
+    Pool* pool = pool_.get();
+    pool->adaptive = true;
+    pool->name = name;
+    pool->minThreads = minThreads;
+    pool->maxThreads = maxThreads;
+    pool->targetDelayUs = targetDelayUs;
+    pool->idleMs = idleMs;
+    while(static_cast<int>(pool->workers.size()) < minThreads) {
+        Spawn_(pool_);
+    }
+    pool->cond_.notify_all();   // 多出来的线程醒来后自己退出
+}
+
+void ThreadPool::SetClass(int cls, int weight, int limit) {
+    assert(cls >= 0 && cls < MAX_CLASS && weight > 0 && limit >= 0);
+    std::lock_guard<std::mutex> locker(pool_->mtx_);
+    if(static_cast<int>(pool_->classes.size()) <= cls) {
+        pool_->classes.resize(cls + 1);
+    }
+    pool_->classes[cls].weight = weight;
+    pool_->classes[cls].limit = limit;
+}
+
+void ThreadPool::SetCoDel(int targetUs, int intervalUs, size_t maxQueue) {
+    assert(targetUs > 0 && intervalUs > 0);
+    std::lock_guard<std::mutex> locker(pool_->mtx_);
+    pool_->codel = true;
+    pool_->codelTargetUs = targetUs;
+    pool_->codelIntervalUs = intervalUs;
+    pool_->maxQueue = maxQueue;
+}
+
+/*
+    CoDel（Nichols & Jacobson）的判断部分：排队时间短暂超过target是正常的突发，
+    连续interval都超过才算过载（队列里积压了消化不掉的任务）；队首等待时间一低于target就恢复
+    看的是队首现在已经等了多久，线程都卡住、没有任务出队时也能发现
+*/
+bool ThreadPool::CheckOverload() {
+    Pool* pool = pool_.get();
+    if(!pool->codel) {
+        return false;
+    }
+    int64_t now = Metrics::NowUs();
+    int64_t oldest = pool->oldestUs.load(std::memory_order_relaxed);
+    int64_t delay = oldest > 0 ? now - oldest : 0;
+    bool over = false;
+    if(delay < pool->codelTargetUs) {
+        pool->firstAboveUs = 0;
+    } else if(pool->firstAboveUs == 0) {
+        pool->firstAboveUs = now + pool->codelIntervalUs;
+    } else {
+        over = now >= pool->firstAboveUs;
+    }
+    if(pool->maxQueue > 0 && pool->depth.load(std::memory_order_relaxed) > pool->maxQueue) {
+        over = true;
+    }
+    pool->overloaded.store(over, std::memory_order_relaxed);
+    return over;
+}
+
+size_t ThreadPool::QueueSize() {
+    std::lock_guard<std::mutex> locker(pool_->mtx_);
+    return pool_->queued;
+}
+
+size_t ThreadPool::QueueSize(int cls) {
+    std::lock_guard<std::mutex> locker(pool_->mtx_);
+    return cls < static_cast<int>(pool_->classes.size()) ? pool_->classes[cls].tasks.size() : 0;
+}
+
+int ThreadPool::RunningCount(int cls) {
+    std::lock_guard<std::mutex> locker(pool_->mtx_);
+    return cls < static_cast<int>(pool_->classes.size()) ? pool_->classes[cls].running : 0;
+}
+
+int ThreadPool::ThreadCount() {
+    std::lock_guard<std::mutex> locker(pool_->mtx_);
+    return pool_->workers.size();
+}
+
+uint64_t ThreadPool::GrowCount() {
+    std::lock_guard<std::mutex> locker(pool_->mtx_);
+    return pool_->grows;
+}
+
+uint64_t ThreadPool::ShrinkCount() {
+    std::lock_guard<std::mutex> locker(pool_->mtx_);
+    return pool_->shrinks;
+}
+
+double ThreadPool::BlockedRatio() {
+    std::lock_guard<std::mutex> locker(pool_->mtx_);
+    return Blocked_(pool_.get());
+}
+
+void ThreadPool::Push_(std::function<void()> fn, int cls) {
+    Pool* pool = pool_.get();
+    assert(cls >= 0 && cls < static_cast<int>(pool->classes.size()));
+    // 只有要统计时才读时钟（编译了USDT探针或自适应时总是读），入队时间为0表示不统计
+    bool timing = USDT_ENABLED || pool->adaptive || pool->codel || (pool->queueHist >= 0 && Metrics::Instance()->Enabled());
+    int64_t now = timing ? Metrics::NowUs() : 0;
+    std::vector<std::thread> exited;
+    {
+        std::lock_guard<std::mutex> locker(pool->mtx_);
+        pool->classes[cls].tasks.push({std::move(fn), now});
+        pool->queued++;
+        WS_PROBE(pool__enqueue, pool, pool->queued);
+        QueueChanged_(pool);
+        if(pool->adaptive && NeedGrow_(pool, now)) {
+            Spawn_(pool_);
+            pool->grows++;
+            pool->lastGrowUs = now;
+            exited.swap(pool->exited);
+            LOG_INFO("ThreadPool[%s] grow to %d threads: queued %zu, blocked %d%%",
+                     pool->name.c_str(), static_cast<int>(pool->workers.size()),
+                     pool->queued, static_cast<int>(Blocked_(pool) * 100));
+        }
+    }
+    pool->cond_.notify_one();
+    for(auto& t : exited) {
+        t.join();               // 已经退出的线程，join很快
+    }
+}
+
+// 只看能执行的类：到了并发上限的类，加线程也不会让它更快，它排得久也不代表线程池过载
+int64_t ThreadPool::OldestUs_(const Pool* pool) {
+    int64_t oldest = 0;
+    for(const Class& c : pool->classes) {
+        if(Runnable_(c) && (oldest == 0 || c.tasks.front().enqueueUs < oldest)) {
+            oldest = c.tasks.front().enqueueUs;
+        }
+    }
+    return oldest;
+}
+
+void ThreadPool::QueueChanged_(Pool* pool) {
+    if(pool->codel) {
+        pool->oldestUs.store(OldestUs_(pool), std::memory_order_relaxed);
+        pool->depth.store(pool->queued, std::memory_order_relaxed);
+    }
+}
+
+bool ThreadPool::NeedGrow_(Pool* pool, int64_t now) {
+    if(pool->idle > 0 || static_cast<int>(pool->workers.size()) >= pool->maxThreads) {
+        return false;
+    }
+    int64_t oldest = OldestUs_(pool);
+    if(oldest == 0 || now - oldest < pool->targetDelayUs || now - pool->lastGrowUs < pool->targetDelayUs) {
+        return false;
+    }
+    static const int cpuNum = std::max(1u, std::thread::hardware_concurrency());
+    return static_cast<int>(pool->workers.size()) < cpuNum || Blocked_(pool) >= 0.5;
+}
+
+// 平滑加权轮询：每个能执行的类加上自己的权重，取最大的，被选中的减去总权重
+// 权重5:1时取的顺序是 A A A B A A，不会连着把一类取完
+int ThreadPool::Pick_(Pool* pool) {
+    int best = -1, total = 0;
+    for(int i = 0; i < static_cast<int>(pool->classes.size()); i++) {
+        Class& c = pool->classes[i];
+        if(!Runnable_(c)) {
+            continue;
+        }
+        c.current += c.weight;
+        total += c.weight;
+        if(best < 0 || c.current > pool->classes[best].current) {
+            best = i;
+        }
+    }
+    if(best >= 0) {
+        pool->classes[best].current -= total;
+    }
+    return best;
+}
+
+void ThreadPool::Spawn_(const std::shared_ptr<Pool>& pool) {
+    // 新线程一开始就要加锁，调用方释放锁之后才会运行，那时自己的句柄已经放进workers了
+    std::thread t(&ThreadPool::Work_, pool);
+    std::thread::id id = t.get_id();
+    pool->workers.emplace(id, std::move(t));
+}
+
+int64_t ThreadPool::ThreadCpuUs_() {
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void ThreadPool::Work_(std::shared_ptr<Pool> pool) {
+    std::unique_lock<std::mutex> locker(pool->mtx_);
+    while(true) {
+        int cls = Pick_(pool.get());
+        if(cls >= 0) {
+            Class& c = pool->classes[cls];
+            auto task = std::move(c.tasks.front());    // 左值变右值,资产转移
+            c.tasks.pop();
+            c.running++;
+            pool->queued--;
+            QueueChanged_(pool.get());
+            int queueHist = pool->queueHist;
+            bool adaptive = pool->adaptive;
+            locker.unlock();    // 因为已经把任务取出来了，所以可以提前解锁了
+            int64_t start = 0, cpu = 0;
+            if(task.enqueueUs) {
+                start = Metrics::NowUs();
+                if(queueHist >= 0) {
+                    Metrics::Instance()->Observe(static_cast<Metrics::Hist>(queueHist), start - task.enqueueUs);
+                }
+                WS_PROBE(pool__dequeue, pool.get(), start - task.enqueueUs);
+            }
+            if(adaptive) {
+                cpu = ThreadCpuUs_();
+            }
+            taskWaitUs_ = task.enqueueUs ? start - task.enqueueUs : 0;
+            task.fn();
+            int64_t wall = 0;
+            if(adaptive) {
+                wall = Metrics::NowUs() - start;
+                cpu = ThreadCpuUs_() - cpu;
+            }
+            locker.lock();      // 马上又要取任务了，上锁
+            Class& done = pool->classes[cls];
+            done.running--;
+            if(done.limit > 0) {
+                QueueChanged_(pool.get());  // 这一类可能又能执行了
+            }
+            if(done.limit > 0 && !done.tasks.empty()) {
+                pool->cond_.notify_one();   // 这一类空出一个名额，叫醒一个线程（可能在等别的类都空了）
+            } else if(pool->isClosed && pool->queued == 0) {
+                pool->cond_.notify_all();   // 析构在等：因为类的上限在等的线程可以退出了
+            }
+            if(adaptive) {
+                pool->runUs = pool->runUs * 0.99 + wall;
+                pool->blockedUs = pool->blockedUs * 0.99 + std::max<int64_t>(0, std::min(wall, wall - cpu));
+            }
+        } else if(pool->isClosed && pool->queued == 0) {
+            break;
+        } else if(!pool->adaptive) {
+            pool->cond_.wait(locker);    // 等待,如果任务来了就notify的
+        } else {
+            int threads = pool->workers.size();
+            bool timeout = false;
+            if(threads <= pool->maxThreads) {
+                pool->idle++;
+                timeout = pool->cond_.wait_for(locker, std::chrono::milliseconds(pool->idleMs)) == std::cv_status::timeout;
+                pool->idle--;
+                threads = pool->workers.size();
+            }
+            // 空闲太久（或SetAdaptive调小了上限）就退出，保留minThreads个
+            if(pool->queued == 0 && !pool->isClosed &&
+               ((timeout && threads > pool->minThreads) || threads > pool->maxThreads)) {
+                auto self = pool->workers.find(std::this_thread::get_id());
+                assert(self != pool->workers.end());
+                pool->exited.push_back(std::move(self->second));
+                pool->workers.erase(self);
+                pool->shrinks++;
+                LOG_INFO("ThreadPool[%s] shrink to %d threads: idle %dms, blocked %d%%",
+                         pool->name.c_str(), threads - 1, pool->idleMs, static_cast<int>(Blocked_(pool.get()) * 100));
+                break;
+            }
+        }
+    }
+}
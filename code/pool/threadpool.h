@@ -6,62 +6,124 @@
 #include <condition_variable>
 #include <functional>
 #include <thread>
+#include <unordered_map>
+#include <vector>
+#include <string>
 #include <cassert>
+#include <atomic>
+#include "../metrics/metrics.h"
+#include "../metrics/probes.h"
 
-
+/*
+    线程池：固定threadCount个线程；调用SetAdaptive后按任务的排队时间自动伸缩
+        扩容：提交任务时没有空闲线程、队首任务已经等了超过targetDelayUs，就加一个线程（每targetDelayUs最多加一个，
+             等新线程起作用；线程数已经不少于CPU数时，只有任务大部分时间在阻塞（等数据库、磁盘）才加，
+             否则加线程只会增加争用）
+        缩容：线程空闲超过idleMs就退出，保留minThreads个
+        阻塞比例：任务执行的墙上时间里没在CPU上运行的部分（CLOCK_THREAD_CPUTIME_ID），按时间加权、指数衰减；
+                 CPU不够时等调度的时间也算在里面，所以CPU满载时也会偏高，只作为扩容的参考
+    过载判断（CoDel）：队首任务的等待时间连续interval都超过target（短暂的突发不算），或排队的任务超过maxQueue，
+             就算过载，直到队首等待时间降到target以下；只给调用方一个判断，怎么拒绝新请求由调用方决定（见WebServer::SetAdmission），
+             任务里可以用TaskWaitUs看自己排了多久，过载时丢掉排得太久的（CoDel在出队时丢包）
+    任务分类：每类一个队列，线程按权重在有任务的类之间轮流取（平滑加权轮询，和nginx的upstream一样），
+             一类可以限制同时执行它的线程数，到了上限的类暂时不参与轮询；不调用SetClass时只有一个类，就是FIFO
+    线程都是joinable的，析构时等队列里的任务执行完再回收所有线程
+*/
 class ThreadPool {
 public:
     ThreadPool() = default;
     ThreadPool(ThreadPool&&) = default;
-    explicit ThreadPool(int threadCount = 8) : pool_(std::make_shared<Pool>()) { 
-        assert(threadCount > 0);
-        for(int i = 0; i < threadCount; i++) {
-            std::thread([this]() {
-                std::unique_lock<std::mutex> locker(pool_->mtx_);
-                while(true) {
-                    if(!pool_->tasks.empty()) {
-                        auto task = std::move(pool_->tasks.front());    // 左值变右值,资产转移
-                        pool_->tasks.pop();
-                        locker.unlock();    // 因为已经把任务取出来了，所以可以提前解锁了
-                        task();
-                        locker.lock();      // 马上又要取任务了，上锁
-                    } else if(pool_->isClosed) {
-                        break;
-                    } else {
-                        pool_->cond_.wait(locker);    // 等待,如果任务来了就notify的
-                    }
-                    
-                }
-            }).detach();
-        }
-    }
+    explicit ThreadPool(int threadCount = 8);
+    ~ThreadPool();
 
-    ~ThreadPool() {
-        if(pool_) {
-            std::unique_lock<std::mutex> locker(pool_->mtx_);
-            pool_->isClosed = true;
-        }
-        pool_->cond_.notify_all();  // 唤醒所有的线程
-    }
+    // 任务的排队时间记到哪个直方图（Metrics::Hist），不调用则不统计；需在AddTask之前调用
+    void SetQueueMetric(int hist);
+    // 自适应线程数，name用于日志；需在AddTask之前调用。线程数不在[minThreads, maxThreads]内时逐步调整过去
+    void SetAdaptive(int minThreads, int maxThreads, int targetDelayUs, int idleMs, const char* name);
+    // 第cls类任务的权重和并发上限（limit为0不限）；需在AddTask之前调用
+    void SetClass(int cls, int weight, int limit);
+    // 过载判断的参数，maxQueue为0不按队列长度判断；需在AddTask之前调用
+    void SetCoDel(int targetUs, int intervalUs, size_t maxQueue);
+    bool CheckOverload();       // 按现在的队首等待时间判断一次，只能在一个线程里调用（主循环）
+    bool Overloaded() const { return pool_->overloaded.load(std::memory_order_relaxed); }  // 最近一次判断的结果
+    static int64_t TaskWaitUs() { return taskWaitUs_; }    // 在任务里调用：这个任务排队等了多久（不统计时为0）
+
+    size_t QueueSize();
+    size_t QueueSize(int cls);
+    int RunningCount(int cls);  // 正在执行第cls类任务的线程数
+    int ThreadCount();
+    uint64_t GrowCount();
+    uint64_t ShrinkCount();
+    double BlockedRatio();      // 任务执行时间里阻塞的比例（0~1），只在自适应时统计
 
     template<typename T>
-    void AddTask(T&& task) {
-        {
-            std::unique_lock<std::mutex> locker(pool_->mtx_);
-            pool_->tasks.emplace(std::forward<T>(task));
-        }
-        pool_->cond_.notify_one();
+    void AddTask(T&& task, int cls = 0) {
+        Push_(std::function<void()>(std::forward<T>(task)), cls);
     }
 
+    static const int MAX_CLASS = 8;
+
 private:
-    // 用一个结构体封装起来，方便调用
+    struct Task {
+        std::function<void()> fn;   // 函数类型为void()
+        int64_t enqueueUs;          // 入队时间（微秒），0为不统计排队时间
+    };
+    struct Class {
+        std::queue<Task> tasks;     // 任务队列
+        int weight = 1;
+        int limit = 0;              // 同时执行的线程数上限，0为不限
+        int running = 0;
+        int current = 0;            // 平滑加权轮询的当前值
+    };
+    // 用一个结构体封装起来，方便调用；线程持有它的shared_ptr，ThreadPool对象可以移动
     struct Pool {
         std::mutex mtx_;
         std::condition_variable cond_;
         bool isClosed = false;
-        std::queue<std::function<void()>> tasks; // 任务队列，函数类型为void()
+        int queueHist = -1;         // 排队时间记到的直方图，-1为不统计
+        std::vector<Class> classes = std::vector<Class>(1);
+        size_t queued = 0;          // 所有类排队的任务数
+
+        std::unordered_map<std::thread::id, std::thread> workers;
+        std::vector<std::thread> exited;    // 缩容时退出的线程，下次扩容或析构时join
+        int idle = 0;               // 正在等任务的线程数
+
+        bool adaptive = false;
+        std::string name;
+        int minThreads = 0;
+        int maxThreads = 0;
+        int64_t targetDelayUs = 0;
+        int idleMs = 0;
+        int64_t lastGrowUs = 0;
+        double runUs = 0;           // 任务执行时间、其中阻塞的时间，每个任务衰减一次
+        double blockedUs = 0;
+        uint64_t grows = 0;
+        uint64_t shrinks = 0;
+
+        bool codel = false;
+        int64_t codelTargetUs = 0;
+        int64_t codelIntervalUs = 0;
+        size_t maxQueue = 0;
+        std::atomic<int64_t> oldestUs{0};   // 能执行的任务里最早的入队时间（0为没有），队列变化时更新，判断过载时不用加锁
+        std::atomic<size_t> depth{0};       // queued的副本
+        int64_t firstAboveUs = 0;           // 队首等待时间一直超过target的话，到这个时间算过载；只由CheckOverload访问
+        std::atomic<bool> overloaded{false};
     };
+
+    void Push_(std::function<void()> fn, int cls);
+    // 以下持有锁调用
+    static int Pick_(Pool* pool);                       // 轮到哪一类，没有能执行的任务时返回-1
+    static bool Runnable_(const Class& c) { return !c.tasks.empty() && (c.limit <= 0 || c.running < c.limit); }
+    static int64_t OldestUs_(const Pool* pool);         // 能执行的类里最早的入队时间，没有时为0
+    static bool NeedGrow_(Pool* pool, int64_t now);
+    static void QueueChanged_(Pool* pool);              // 更新oldestUs、depth
+    static void Spawn_(const std::shared_ptr<Pool>& pool);
+    static void Work_(std::shared_ptr<Pool> pool);
+    static int64_t ThreadCpuUs_();
+    static double Blocked_(const Pool* pool) { return pool->runUs > 0 ? pool->blockedUs / pool->runUs : 0; }
+
     std::shared_ptr<Pool> pool_;
+    static thread_local int64_t taskWaitUs_;
 };
 
 #endif
@@ -0,0 +1,185 @@
+#include "iplimiter.h"
+#include "../timer/cachedclock.h"
+#include "../log/log.h"
+#include <cassert>
+#include <cstring>
+#include <algorithm>
+
+IpLimiter::Key IpLimiter::MakeKey(const sockaddr* addr) {
+    Key key = {0, 0};
+    if(addr->sa_family == AF_INET6) {
+        const uint8_t* b = reinterpret_cast<const sockaddr_in6*>(addr)->sin6_addr.s6_addr;
+        memcpy(&key.hi, b, 8);
+        memcpy(&key.lo, b + 8, 8);
+    } else if(addr->sa_family == AF_INET) {
+        // ::ffff:a.b.c.d，同一个客户端不管从IPv4还是双栈socket进来都是同一个条目
+        uint8_t b[16] = {0};
+        b[10] = b[11] = 0xff;
+        memcpy(b + 12, &reinterpret_cast<const sockaddr_in*>(addr)->sin_addr.s_addr, 4);
+        memcpy(&key.hi, b, 8);
+        memcpy(&key.lo, b + 8, 8);
+    }
+    return key;
+}
+
+void IpLimiter::Init(int maxConns, int rate, int burst, int idleSec, size_t maxEntries) {
+    assert(maxConns >= 0 && maxConns <= UINT16_MAX && rate >= 0 && burst >= 0 && maxEntries > 0);
+    maxConns_ = maxConns;
+    rate_ = rate;
+    burst_ = std::max(burst, 1);
+    // 令牌没补满就删掉的话，删掉再来的客户端会白得一桶令牌
+    int64_t refillMs = rate > 0 ? static_cast<int64_t>(burst_) * 1000 / rate : 0;
+    idleMs_ = static_cast<uint32_t>(std::max<int64_t>(static_cast<int64_t>(idleSec) * 1000, refillMs));
+    maxPerShard_ = (maxEntries + SHARD_NUM - 1) / SHARD_NUM;
+    perShard_ = 1;
+    while(perShard_ < maxPerShard_ * 2) {
+        perShard_ <<= 1;
+    }
+    slots_.assign(perShard_ * SHARD_NUM, Slot());
+    used_.assign(SHARD_NUM, 0);
+    count_ = 0;
+    LOG_INFO("IpLimiter init: %d conns/ip, %d req/s burst %d, %zu slots (%zuMB)",
+             maxConns, rate, burst_, slots_.size(), GetMemoryBytes() >> 20);
+}
+
+// splitmix64 的最后一步，IPv4映射地址的高64位都一样，主要靠低64位
+uint64_t IpLimiter::Hash_(const Key& key) {
+    uint64_t h = key.hi ^ (key.lo * 0x9e3779b97f4a7c15ULL);
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
+
+uint32_t IpLimiter::NowMs_() {
+    return static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        CachedClock::Now().time_since_epoch()).count());
+}
+
+IpLimiter::Slot* IpLimiter::Find_(const Key& key, bool insert) {
+    uint64_t h = Hash_(key);
+    size_t shard = h % SHARD_NUM;
+    Slot* base = Base_(shard);
+    size_t mask = perShard_ - 1;
+    for(size_t i = (h / SHARD_NUM) & mask; ; i = (i + 1) & mask) {
+        Slot& slot = base[i];
+        if(slot.used && slot.hi == key.hi && slot.lo == key.lo) {
+            return &slot;
+        }
+        if(!slot.used) {
+            // 负载不超过一半，一定能碰到空槽
+            if(!insert || used_[shard] >= maxPerShard_) {
+                return nullptr;
+            }
+            slot.hi = key.hi;
+            slot.lo = key.lo;
+            slot.lastMs = NowMs_();
+            slot.tokens = burst_ * 1000;
+            slot.conns = 0;
+            slot.used = 1;
+            used_[shard]++;
+            count_++;
+            return &slot;
+        }
+    }
+}
+
+void IpLimiter::Refill_(Slot* slot, uint32_t now) {
+    uint32_t elapsed = now - slot->lastMs;  // 回绕也对
+    slot->lastMs = now;
+    int64_t tokens = slot->tokens + static_cast<int64_t>(elapsed) * rate_;     // 每毫秒rate个千分之一令牌
+    slot->tokens = static_cast<int32_t>(std::min<int64_t>(tokens, static_cast<int64_t>(burst_) * 1000));
+}
+
+bool IpLimiter::Connect(const Key& key) {
+    if(maxConns_ <= 0) {
+        return true;
+    }
+    Slot* slot = Find_(key, true);
+    if(!slot) {
+        untracked_++;
+        return true;
+    }
+    Refill_(slot, NowMs_());
+    if(slot->conns >= maxConns_) {
+        return false;
+    }
+    slot->conns++;
+    return true;
+}
+
+void IpLimiter::Disconnect(const Key& key) {
+    if(maxConns_ <= 0) {
+        return;
+    }
+    Slot* slot = Find_(key, false);
+    if(slot && slot->conns > 0) {
+        Refill_(slot, NowMs_());
+        slot->conns--;
+    }
+}
+
+bool IpLimiter::Request(const Key& key) {
+    if(rate_ <= 0) {
+        return true;
+    }
+    Slot* slot = Find_(key, true);
+    if(!slot) {
+        untracked_++;
+        return true;
+    }
+    Refill_(slot, NowMs_());
+    if(slot->tokens < 1000) {
+        return false;
+    }
+    slot->tokens -= 1000;
+    return true;
+}
+
+// 后移删除：把后面本该更靠前的元素挪到空出来的位置，保证线性探测链不断（同SessionStore::Erase_）
+void IpLimiter::Erase_(size_t shard, size_t idx) {
+    Slot* base = Base_(shard);
+    size_t mask = perShard_ - 1;
+    size_t i = idx, j = idx;
+    while(true) {
+        base[i].used = 0;
+        while(true) {
+            j = (j + 1) & mask;
+            if(!base[j].used) {
+                used_[shard]--;
+                count_--;
+                return;
+            }
+            size_t k = (Hash_({base[j].hi, base[j].lo}) / SHARD_NUM) & mask;  // j处元素的理想位置
+            // k 落在 (i, j] 之间说明 j 不需要前移
+            bool stay = i <= j ? (i < k && k <= j) : (i < k || k <= j);
+            if(!stay) { break; }
+        }
+        base[i] = base[j];
+        i = j;
+    }
+}
+
+size_t IpLimiter::Expire(int shardNum) {
+    if(slots_.empty()) {
+        return 0;
+    }
+    uint32_t now = NowMs_();
+    size_t cnt = 0;
+    for(int n = 0; n < shardNum && n < SHARD_NUM; n++) {
+        size_t shard = cursor_;
+        cursor_ = (cursor_ + 1) % SHARD_NUM;
+        if(used_[shard] == 0) {
+            continue;
+        }
+        Slot* base = Base_(shard);
+        for(size_t j = 0; j < perShard_; ) {
+            if(base[j].used && base[j].conns == 0 && now - base[j].lastMs >= idleMs_) {
+                Erase_(shard, j);
+                cnt++;
+                continue;   // 后面的元素可能挪到了j，再看一次
+            }
+            j++;
+        }
+    }
+    return cnt;
+}
@@ -0,0 +1,79 @@
+#ifndef IP_LIMITER_H
+#define IP_LIMITER_H
+
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+/*
+    按客户端IP限流：每个IP的并发连接数上限 + 令牌桶限制请求速率
+        地址：IPv4按IPv4映射的IPv6地址（::ffff:a.b.c.d）存，和IPv6共用一张表
+        存储：固定容量的开放寻址哈希表（线性探测，删除用后移法，不留墓碑），按地址哈希分片，和SessionStore一样
+        并发：只由主循环线程访问（accept、读事件、关闭、定时器都在主循环上），不加锁；
+             分片只是为了定时清理时每次只扫几个分片，不会一下扫完整张表
+        令牌桶：每个IP最多burst个令牌，每秒补充rate个，每个新请求取一个；按取令牌时和上次相隔的时间补充，不需要定时器
+        清理：没有连接、空闲超过idleSec（且令牌已经补满）的条目由定时器调用Expire删掉
+        表满：新IP不记录，直接放行（计入GetUntracked），不因为表满拒绝正常客户端
+    每个条目32字节，槽数是maxEntries的两倍（负载不超过一半），100万个IP约64MB
+*/
+class IpLimiter {
+public:
+    struct Key {
+        uint64_t hi;
+        uint64_t lo;
+    };
+    static Key MakeKey(const sockaddr* addr);   // AF_INET / AF_INET6
+    static Key MakeKey(const sockaddr_in& addr) { return MakeKey(reinterpret_cast<const sockaddr*>(&addr)); }
+
+    IpLimiter() = default;
+    // maxConns为0不限连接数，rate为0不限请求速率；都为0时关闭
+    void Init(int maxConns, int rate, int burst, int idleSec, size_t maxEntries);
+    bool Enabled() const { return maxConns_ > 0 || rate_ > 0; }
+
+    bool Connect(const Key& key);       // accept之后：这个IP的连接数到上限返回false，否则计数加一
+    void Disconnect(const Key& key);    // 关闭一个Connect成功的连接
+    bool Request(const Key& key);       // 新请求开始：取一个令牌，没有令牌返回false
+    size_t Expire(int shardNum);        // 清理接下来shardNum个分片里空闲的条目，返回清理的个数
+
+    size_t GetCount() const { return count_; }
+    size_t GetMemoryBytes() const { return slots_.size() * sizeof(Slot); }
+    uint64_t GetUntracked() const { return untracked_; }
+
+private:
+    struct Slot {
+        uint64_t hi;
+        uint64_t lo;
+        uint32_t lastMs;    // 上次补充令牌（或连接数变化）的单调时间，毫秒取低32位，回绕相减
+        int32_t tokens;     // 令牌数 * 1000
+        uint16_t conns;     // 当前连接数
+        uint8_t used;
+    };
+
+    static uint64_t Hash_(const Key& key);
+    static uint32_t NowMs_();
+    Slot* Base_(size_t shard) { return &slots_[shard * perShard_]; }
+    Slot* Find_(const Key& key, bool insert);   // insert时没有就插入一个新条目，分片满了返回nullptr
+    void Refill_(Slot* slot, uint32_t now);
+    void Erase_(size_t shard, size_t idx);
+
+    static const int SHARD_NUM = 64;
+
+    std::vector<Slot> slots_;
+    size_t perShard_ = 0;       // 每个分片的槽数（2的幂）
+    size_t maxPerShard_ = 0;    // 每个分片最多的条目数
+    std::vector<size_t> used_;  // 每个分片已占用的槽数
+
+    int maxConns_ = 0;
+    int rate_ = 0;
+    int burst_ = 0;
+    uint32_t idleMs_ = 0;
+    size_t cursor_ = 0;         // Expire 下一次从哪个分片开始
+
+    std::atomic<size_t> count_{0};          // 指标线程会读
+    std::atomic<uint64_t> untracked_{0};
+};
+
+#endif // IP_LIMITER_H
@@ -0,0 +1,59 @@
+#include "loopqueue.h"
+
+LoopQueue::LoopQueue(size_t capacity) : evFd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)),
+        tail_(0), pending_(0), head_(0) {
+    assert(evFd_ >= 0);
+    size_t size = 2;
+    while(size < capacity) { size <<= 1; }
+    mask_ = size - 1;
+    cells_ = new Cell[size];
+    for(size_t i = 0; i < size; i++) {
+        cells_[i].seq.store(i, std::memory_order_relaxed);
+    }
+}
+
+LoopQueue::~LoopQueue() {
+    close(evFd_);
+    delete[] cells_;
+}
+
+void LoopQueue::Post(const LoopMail& mail) {
+    size_t pos = tail_.load(std::memory_order_relaxed);
+    Cell* cell;
+    for(;;) {
+        cell = &cells_[pos & mask_];
+        size_t seq = cell->seq.load(std::memory_order_acquire);
+        intptr_t dif = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+        if(dif == 0) {
+            // 槽位空闲，抢这个下标
+            if(tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if(dif < 0) {
+            // 满了（主循环还没取走上一圈的消息）
+            std::this_thread::yield();
+            pos = tail_.load(std::memory_order_relaxed);
+        } else {
+            pos = tail_.load(std::memory_order_relaxed);    // 被别的生产者抢了
+        }
+    }
+    cell->mail = mail;
+    cell->seq.store(pos + 1, std::memory_order_release);    // 发布
+
+    if(pending_.fetch_add(1, std::memory_order_acq_rel) == 0) {
+        uint64_t one = 1;
+        ssize_t n = write(evFd_, &one, sizeof(one));   // 计数器+1，唤醒epoll_wait
+        (void)n;
+    }
+}
+
+bool LoopQueue::Pop_(LoopMail* mail) {
+    Cell* cell = &cells_[head_ & mask_];
+    if(cell->seq.load(std::memory_order_acquire) != head_ + 1) {
+        return false;   // 空，或生产者还没写完
+    }
+    *mail = cell->mail;
+    cell->seq.store(head_ + mask_ + 1, std::memory_order_release);     // 还给下一圈的生产者
+    head_++;
+    return true;
+}
@@ -0,0 +1,84 @@
+#ifndef LOOP_QUEUE_H
+#define LOOP_QUEUE_H
+
+#include <sys/eventfd.h>    // eventfd
+#include <unistd.h>         // read/write/close
+#include <atomic>
+#include <thread>
+#include <cstdint>
+#include <cassert>
+
+// 投递给主循环的消息，都是针对某个连接的：用(fd, seq)确认还是原来那个连接
+struct LoopMail {
+    enum Type {
+        CLOSE,          // 关闭连接
+        WAIT_READ,      // 工作线程处理完，重新监听读事件
+        WAIT_WRITE,     // 工作线程处理完，重新监听写事件
+        VERIFY_DONE,    // 登录/注册完成（arg为UserVerify的返回值）
+    };
+    int type;
+    int fd;
+    int arg;
+    uint64_t seq;
+};
+
+/*
+    其他线程（工作线程、数据库线程、注册批处理线程）向反应堆（主循环）投递消息的信箱
+    多生产者单消费者的无锁环形队列：每个槽位带序号，生产者CAS抢尾部下标，写完消息后发布序号；
+    只有主循环消费，读完再把槽位序号推进一圈还给生产者
+    唤醒：pending_从0变成1的那个生产者写eventfd，主循环Drain到pending_回到0为止，
+         主循环忙的时候投递不需要系统调用
+    定时器、users_、epoll注册都只由主循环修改，不需要加锁
+*/
+class LoopQueue {
+public:
+    explicit LoopQueue(size_t capacity = 1 << 17);     // 取整到2的幂，满了生产者让出CPU等待
+    ~LoopQueue();
+
+    int GetFd() const { return evFd_; }
+    void Post(const LoopMail& mail);    // 任意线程调用（主循环自己不要投递，满了会等不到消费）
+
+    // 只在主循环线程调用：取出全部消息依次交给handle，返回处理的条数
+    template<class Handler>
+    size_t Drain(Handler&& handle);
+
+private:
+    bool Pop_(LoopMail* mail);
+
+    struct Cell {
+        std::atomic<size_t> seq;
+        LoopMail mail;
+    };
+
+    Cell* cells_;
+    size_t mask_;
+    int evFd_;
+    alignas(64) std::atomic<size_t> tail_;      // 生产者
+    alignas(64) std::atomic<int64_t> pending_;  // 已发布、还没被消费的消息数
+    alignas(64) size_t head_;                   // 消费者（只有主循环）
+};
+
+template<class Handler>
+size_t LoopQueue::Drain(Handler&& handle) {
+    uint64_t cnt = 0;
+    ssize_t n = read(evFd_, &cnt, sizeof(cnt));     // 清零计数器
+    (void)n;
+
+    size_t total = 0;
+    int64_t left = 0;
+    do {
+        size_t k = 0;
+        LoopMail mail;
+        while(Pop_(&mail)) {
+            handle(mail);
+            k++;
+        }
+        total += k;
+        // 还有生产者已经计数但没取到的消息（正在写槽位），它们不会再写eventfd，接着取
+        left = pending_.fetch_sub(static_cast<int64_t>(k), std::memory_order_acq_rel) - static_cast<int64_t>(k);
+        if(left > 0) { std::this_thread::yield(); }
+    } while(left > 0);
+    return total;
+}
+
+#endif // LOOP_QUEUE_H
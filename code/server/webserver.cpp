@@ -1,7 +1,11 @@
 #include "webserver.h"
+#include "../metrics/probes.h"
 
 using namespace std;
 
+const char* WebServer::UPGRADE_ENV = "TINYWEBSERVER_UPGRADE_FD";
+int WebServer::signalPipe_[2] = {-1, -1};
+
 /*
     参数        含义
     port        初始化列表port_(port)，端口
@@ -16,17 +20,27 @@ using namespace std;
     openLog     是否打开日志的标志
     logLevel    用于日志单例化单线程的参数，日志等级
     logQueSize  用于日志单例化单线程的参数，0为同步日志，>0为异步日志
+    storeType   用户存储后端（UserStore::Type）：0 MySQL，1 SQLite（文件为 dbName.db），2 内存
 */
 WebServer::WebServer(
             int port, int trigMode, int timeoutMS, bool OptLinger,
             int sqlPort, const char* sqlUser, const  char* sqlPwd, const char* dbName, 
-            int connPoolNum, int threadNum, bool openLog, int logLevel, int logQueSize):
-            port_(port), timeoutMS_(timeoutMS), isClose_(false),
-            timer_(new HeapTimer()), threadpool_(new ThreadPool(threadNum)), epoller_(new Epoller())
+            int connPoolNum, int threadNum, bool openLog, int logLevel, int logQueSize, int storeType):
+            port_(port), timeoutMS_(timeoutMS), headerMs_(timeoutMS), bodyMs_(timeoutMS),
+            idleMs_(timeoutMS), writeMs_(timeoutMS), minWriteRate_(0), isClose_(false), adminFd_(-1), reqClasses_(false),
+            inlineMaxBytes_(0), inlineBudget_(0), inlineLeft_(0),
+            admission_(false), admissionMs_(0), admissionTargetUs_(0), acceptPaused_(false),
+            busyResponse_(RejectResponse_(503, "Service Unavailable", "Server busy, please retry later.", 1)),
+            drainMs_(0), drainReason_(nullptr), draining_(false), upgradeFd_(-1), parentFd_(-1),
+            timer_(new HeapTimer()), threadpool_(new ThreadPool(threadNum)),
+            dbpool_(new ThreadPool(connPoolNum)), loopQueue_(new LoopQueue()), epoller_(new Epoller())
     {
 
     // 是否打开日志标志
     if(openLog) {
+        Log::Instance()->SetRotate(64 * 1024 * 1024, 0);   // 单个文件超过64MB切换，另外每天零点切换
+        Log::Instance()->SetRetention(30, 7, true);         // 最多保留30个归档、7天，切换下来的文件压缩为.gz
+        Log::Instance()->SetOverflowPolicy(Log::DROP_BELOW_LEVEL, 3);   // 队列满时丢弃error以下的日志，error阻塞等待
         Log::Instance()->init(logLevel, "./log", ".log", logQueSize);
         if(isClose_) { LOG_ERROR("========== Server init error!=========="); }
         else {
@@ -47,22 +61,273 @@ WebServer::WebServer(
     // 在 srcDir_ 后追加字符串 "/resources/"。
     strcat(srcDir_, "/resources/");
     HttpConn::userCount = 0;
+    HttpConn::keepAliveSec = timeoutMS / 1000;
     HttpConn::srcDir = srcDir_; // ：HTTP 服务器的资源目录路径
 
     // 初始化操作
-    SqlConnPool::Instance()->Init("localhost", sqlPort, sqlUser, sqlPwd, dbName, connPoolNum);  // 连接池单例的初始化
+    if(storeType == UserStore::MYSQL_STORE) {
+        SqlConnPool::Instance()->SetPolicy(2, 500, 60, 10);     // 最少2个连接，取连接最多等500ms，空闲60秒回收，空闲10秒以上取出时先ping
+        SqlConnPool::Instance()->Init("localhost", sqlPort, sqlUser, sqlPwd, dbName, connPoolNum);  // 连接池单例的初始化
+    }
+    std::string storePath = std::string(dbName) + ".db";
+    if(!UserStore::Init(static_cast<UserStore::Type>(storeType), storePath.c_str())) { isClose_ = true; }
+    UserCache::Instance()->Init(300, 30, 100000, 1 << 24);  // 凭据缓存：正缓存5分钟，负缓存30秒，最多10万条
+    RegBatcher::Instance()->Init(128, 2);                   // 注册写合并：每2ms（或攒够128个）提交一批
+    SessionStore::Instance()->Init(24 * 3600, 100000, "./session.db");  // 会话有效1天，最多10万个，持久化到文件
+    HttpRequest::LoadUserBloom();
+    ReceiveListenFds_();    // 热升级启动的新进程：先拿到旧进程的监听socket，下面就不用重新bind
     // 初始化事件和初始化socket(监听)
     InitEventMode_(trigMode);
     if(!InitSocket_()) { isClose_ = true;}
+    epoller_->AddFd(loopQueue_->GetFd(), EPOLLIN);  // 数据库线程的完成通知
+    epoller_->AddFd(timer_->GetFd(), EPOLLIN);      // 定时器到期通知
+    SessionTick_();
 }
 
 WebServer::~WebServer() {
-    close(listenFd_);
+    Metrics::Instance()->ClearCallbacks();  // 回调里捕获了this和线程池、缓存的指针
+    if(listenFd_ >= 0) { close(listenFd_); }
+    if(adminFd_ >= 0) { close(adminFd_); }
     isClose_ = true;
+    threadpool_.reset();    // 等工作线程把手上的任务做完（其中可能还会往数据库线程池提交），再停数据库线程池
+    dbpool_.reset();
     free(srcDir_);
+    RegBatcher::Instance()->Close();    // 先把排队的注册提交完，再关存储
+    UserStore::Close();
     SqlConnPool::Instance()->ClosePool();
 }
 
+void WebServer::SetTimeouts(int headerMs, int bodyMs, int idleMs, int writeMs, int minWriteRate, int maxRequests) {
+    headerMs_ = headerMs;
+    bodyMs_ = bodyMs;
+    idleMs_ = idleMs;
+    writeMs_ = writeMs;
+    minWriteRate_ = minWriteRate;
+    HttpConn::keepAliveSec = idleMs / 1000;
+    HttpConn::maxRequests = maxRequests;
+    LOG_INFO("Timeout header:%dms body:%dms idle:%dms write:%dms+%dB/s, max requests:%d",
+             headerMs, bodyMs, idleMs, writeMs, minWriteRate, maxRequests);
+}
+
+void WebServer::SetPoolSizing(int minThreads, int maxThreads, int targetDelayMs, int idleMs) {
+    threadpool_->SetAdaptive(minThreads, maxThreads, targetDelayMs * 1000, idleMs, "worker");
+    int dbMax = dbpool_->ThreadCount();
+    dbpool_->SetAdaptive(1, dbMax, targetDelayMs * 1000, idleMs, "db");
+    LOG_INFO("ThreadPool worker: %d~%d threads, db: 1~%d threads, target queue delay %dms, idle %dms",
+             minThreads, maxThreads, dbMax, targetDelayMs, idleMs);
+}
+
+void WebServer::SetRequestClasses(int staticWeight, int dbWeight, int adminWeight, int dbLimit) {
+    threadpool_->SetClass(HttpConn::CLASS_STATIC, staticWeight, 0);
+    threadpool_->SetClass(HttpConn::CLASS_DB, dbWeight, dbLimit);
+    threadpool_->SetClass(HttpConn::CLASS_ADMIN, adminWeight, 1);   // 抓指标一次一个就够了
+    reqClasses_ = true;
+    LOG_INFO("Request classes weight static:%d db:%d admin:%d, db limit %d",
+             staticWeight, dbWeight, adminWeight, dbLimit);
+}
+
+void WebServer::SetFileCache(int maxFileKB, int maxTotalMB) {
+    FileCache::Instance()->SetLimits(static_cast<size_t>(maxFileKB) * 1024, static_cast<size_t>(maxTotalMB) * 1024 * 1024);
+    LOG_INFO("File cache: files up to %dKB, %dMB total", maxFileKB, maxTotalMB);
+}
+
+void WebServer::SetInlineFastPath(int maxBytes, int budget) {
+    if(maxBytes > 0 && !FileCache::Instance()->Enabled()) {
+        LOG_WARN("Inline fast path needs the file cache, disabled");
+        maxBytes = 0;
+    }
+    inlineMaxBytes_ = maxBytes;
+    inlineBudget_ = budget;
+    LOG_INFO("Inline fast path: files up to %dB, %d requests per loop iteration", maxBytes, budget);
+}
+
+void WebServer::SetAdmission(int targetMs, int intervalMs, int maxQueue, int retryAfterSec) {
+    threadpool_->SetCoDel(targetMs * 1000, intervalMs * 1000, maxQueue);
+    admission_ = true;
+    admissionMs_ = intervalMs;
+    admissionTargetUs_ = targetMs * 1000;
+    busyResponse_ = RejectResponse_(503, "Service Unavailable", "Server busy, please retry later.", retryAfterSec);
+    LOG_INFO("Admission control: queue delay %dms for %dms or %d queued tasks, Retry-After %ds",
+             targetMs, intervalMs, maxQueue, retryAfterSec);
+}
+
+void WebServer::SetClientLimits(int maxConnsPerIp, int ratePerSec, int burst, int maxIps) {
+    ipLimiter_.Init(maxConnsPerIp, ratePerSec, burst, 60, maxIps);
+    limitResponse_ = RejectResponse_(429, "Too Many Requests", "Too many requests from your address, please slow down.", 1);
+    if(ipLimiter_.Enabled()) {
+        LimiterTick_();
+    }
+    LOG_INFO("Client limits: %d connections/ip, %d req/s/ip burst %d, %d ips tracked",
+             maxConnsPerIp, ratePerSec, burst, maxIps);
+}
+
+void WebServer::SetGracefulShutdown(int drainMs, bool hotUpgrade) {
+    drainMs_ = drainMs;
+    if(signalPipe_[0] < 0) {
+        if(pipe2(signalPipe_, O_NONBLOCK | O_CLOEXEC) < 0) {
+            LOG_ERROR("Create signal pipe error: %s", strerror(errno));
+            return;
+        }
+        epoller_->AddFd(signalPipe_[0], EPOLLIN);
+    }
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = OnSignal_;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, nullptr);
+    if(hotUpgrade) {
+        char path[PATH_MAX];
+        ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+        if(len > 0) {
+            exePath_.assign(path, len);
+            sigaction(SIGUSR2, &sa, nullptr);
+        } else {
+            LOG_ERROR("Hot upgrade disabled: readlink /proc/self/exe error: %s", strerror(errno));
+        }
+    }
+    LOG_INFO("Graceful shutdown on SIGTERM: drain %dms; hot upgrade on SIGUSR2: %s",
+             drainMs, exePath_.empty() ? "off" : exePath_.c_str());
+}
+
+// 预先生成，拒绝时不再格式化；没有Date头（RFC 7231允许），响应里不带时间就可以一直复用
+std::string WebServer::RejectResponse_(int code, const char* status, const char* message, int retryAfterSec) {
+    const std::string title = std::to_string(code) + " : " + status;
+    const std::string body = "<html><title>Error</title><body bgcolor=\"ffffff\">" + title + "\n"
+                             "<p>" + message + "</p><hr><em>TinyWebServer</em></body></html>";
+    return "HTTP/1.1 " + std::to_string(code) + " " + status + "\r\n"
+           "Retry-After: " + std::to_string(retryAfterSec) + "\r\n"
+           "Connection: close\r\n"
+           "Content-type: text/html\r\n"
+           "Content-length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+}
+
+void WebServer::SetTracing(int sampleEvery, int slowMs) {
+    ReqTrace::Configure(sampleEvery, slowMs);
+    LOG_INFO("Trace sample: 1/%d, slow request: %dms", sampleEvery, slowMs);
+}
+
+/*
+    指标的更新点：接受/拒绝连接（DealListen_）、读到的字节（OnRead_）、请求数和处理耗时（OnProcess）、
+    发出的字节、响应状态码和请求总耗时（OnWrite_）、关闭和超时（CloseConn_、OnTimeout_）、
+    线程池排队时间（ThreadPool）、取数据库连接的等待（SqlConnPool::GetConn）、日志条数（Log::write）
+    其他模块已有的统计在这里注册成回调，抓取时现取
+*/
+void WebServer::SetMetrics(bool enable, int adminPort) {
+    Metrics* metrics = Metrics::Instance();
+    metrics->SetEnabled(enable);
+    if(!enable) {
+        return;
+    }
+    threadpool_->SetQueueMetric(Metrics::WORKER_QUEUE_SECONDS);
+    dbpool_->SetQueueMetric(Metrics::DB_QUEUE_SECONDS);
+
+    metrics->AddCallback("webserver_connections", "gauge", "Open client connections.",
+                         []() { return static_cast<double>(HttpConn::userCount); });
+    ThreadPool* worker = threadpool_.get();
+    ThreadPool* db = dbpool_.get();
+    metrics->AddCallback("webserver_threadpool_queue_length{pool=\"worker\"}", "gauge", "Tasks waiting in a thread pool queue.",
+                         [worker]() { return static_cast<double>(worker->QueueSize()); });
+    metrics->AddCallback("webserver_threadpool_queue_length{pool=\"db\"}", "gauge", "",
+                         [db]() { return static_cast<double>(db->QueueSize()); });
+    static const char* CLASS_NAME[HttpConn::CLASS_NUM] = {"static", "db", "admin"};
+    for(int cls = 0; cls < HttpConn::CLASS_NUM; cls++) {
+        std::string label = std::string("{class=\"") + CLASS_NAME[cls] + "\"}";
+        metrics->AddCallback("webserver_request_class_queue_length" + label, "gauge",
+                             cls == 0 ? "Worker tasks waiting, by request class." : "",
+                             [worker, cls]() { return static_cast<double>(worker->QueueSize(cls)); });
+    }
+    for(int cls = 0; cls < HttpConn::CLASS_NUM; cls++) {
+        std::string label = std::string("{class=\"") + CLASS_NAME[cls] + "\"}";
+        metrics->AddCallback("webserver_request_class_running" + label, "gauge",
+                             cls == 0 ? "Workers running a task, by request class." : "",
+                             [worker, cls]() { return static_cast<double>(worker->RunningCount(cls)); });
+    }
+    metrics->AddCallback("webserver_threadpool_threads{pool=\"worker\"}", "gauge", "Threads in a thread pool.",
+                         [worker]() { return static_cast<double>(worker->ThreadCount()); });
+    metrics->AddCallback("webserver_threadpool_threads{pool=\"db\"}", "gauge", "",
+                         [db]() { return static_cast<double>(db->ThreadCount()); });
+    metrics->AddCallback("webserver_threadpool_resizes_total{pool=\"worker\",direction=\"grow\"}", "counter",
+                         "Thread pool resize decisions (adaptive sizing).",
+                         [worker]() { return static_cast<double>(worker->GrowCount()); });
+    metrics->AddCallback("webserver_threadpool_resizes_total{pool=\"worker\",direction=\"shrink\"}", "counter", "",
+                         [worker]() { return static_cast<double>(worker->ShrinkCount()); });
+    metrics->AddCallback("webserver_threadpool_resizes_total{pool=\"db\",direction=\"grow\"}", "counter", "",
+                         [db]() { return static_cast<double>(db->GrowCount()); });
+    metrics->AddCallback("webserver_threadpool_resizes_total{pool=\"db\",direction=\"shrink\"}", "counter", "",
+                         [db]() { return static_cast<double>(db->ShrinkCount()); });
+    metrics->AddCallback("webserver_overloaded", "gauge", "1 while the worker pool is judged overloaded (admission control).",
+                         [worker]() { return worker->Overloaded() ? 1.0 : 0.0; });
+    metrics->AddCallback("webserver_threadpool_blocked_ratio{pool=\"worker\"}", "gauge",
+                         "Share of task run time spent off-CPU (adaptive sizing only).",
+                         [worker]() { return worker->BlockedRatio(); });
+    metrics->AddCallback("webserver_threadpool_blocked_ratio{pool=\"db\"}", "gauge", "",
+                         [db]() { return db->BlockedRatio(); });
+
+    SqlConnPool* sql = SqlConnPool::Instance();
+    metrics->AddCallback("webserver_sql_pool_connections{state=\"total\"}", "gauge", "MySQL connections in the pool.",
+                         [sql]() { return static_cast<double>(sql->GetConnCount()); });
+    metrics->AddCallback("webserver_sql_pool_connections{state=\"idle\"}", "gauge", "",
+                         [sql]() { return static_cast<double>(sql->GetFreeConnCount()); });
+    metrics->AddCallback("webserver_sql_pool_timeouts_total", "counter", "GetConn calls that timed out waiting for a connection.",
+                         [sql]() { return static_cast<double>(sql->GetTimeoutCount()); });
+
+    static const char* LEVEL_NAME[] = {"debug", "info", "warn", "error"};
+    for(int level = 0; level < 4; level++) {
+        metrics->AddCallback(std::string("webserver_log_dropped_total{level=\"") + LEVEL_NAME[level] + "\"}", "counter",
+                             level == 0 ? "Log lines dropped because the async queue was full." : "",
+                             [level]() { return static_cast<double>(Log::Instance()->GetDropped(level)); });
+    }
+
+    UserCache* cache = UserCache::Instance();
+    metrics->AddCallback("webserver_user_cache_total{result=\"hit\"}", "counter", "Credential cache lookups.",
+                         [cache]() { return static_cast<double>(cache->GetHits()); });
+    metrics->AddCallback("webserver_user_cache_total{result=\"miss\"}", "counter", "",
+                         [cache]() { return static_cast<double>(cache->GetMisses()); });
+    metrics->AddCallback("webserver_user_cache_total{result=\"bloom_skip\"}", "counter", "",
+                         [cache]() { return static_cast<double>(cache->GetBloomSkips()); });
+    metrics->AddCallback("webserver_login_lookups_total{result=\"executed\"}", "counter", "Login user lookups, executed or coalesced by singleflight.",
+                         []() { return static_cast<double>(HttpRequest::GetVerifyCalls() - HttpRequest::GetVerifyCoalesced()); });
+    metrics->AddCallback("webserver_login_lookups_total{result=\"coalesced\"}", "counter", "",
+                         []() { return static_cast<double>(HttpRequest::GetVerifyCoalesced()); });
+
+    RegBatcher* reg = RegBatcher::Instance();
+    metrics->AddCallback("webserver_register_batches_total", "counter", "Registration batches committed.",
+                         [reg]() { return static_cast<double>(reg->GetBatches()); });
+    metrics->AddCallback("webserver_register_rows_total", "counter", "Users inserted by registration batches.",
+                         [reg]() { return static_cast<double>(reg->GetRows()); });
+    metrics->AddCallback("webserver_register_conflicts_total", "counter", "Registrations rejected because the name was taken.",
+                         [reg]() { return static_cast<double>(reg->GetConflicts()); });
+    metrics->AddCallback("webserver_sessions", "gauge", "Live login sessions.",
+                         []() { return static_cast<double>(SessionStore::Instance()->GetCount()); });
+    FileCache* files = FileCache::Instance();
+    metrics->AddCallback("webserver_file_cache_total{result=\"hit\"}", "counter", "Static file cache lookups when building a response.",
+                         [files]() { return static_cast<double>(files->GetHits()); });
+    metrics->AddCallback("webserver_file_cache_total{result=\"miss\"}", "counter", "",
+                         [files]() { return static_cast<double>(files->GetMisses()); });
+    metrics->AddCallback("webserver_file_cache_bytes", "gauge", "Bytes of file content held by the static file cache.",
+                         [files]() { return static_cast<double>(files->GetBytes()); });
+    metrics->AddCallback("webserver_draining", "gauge", "1 while the server is draining connections before exit or upgrade.",
+                         []() { return HttpConn::draining ? 1.0 : 0.0; });
+    IpLimiter* limiter = &ipLimiter_;
+    metrics->AddCallback("webserver_client_ips", "gauge", "Client addresses tracked by the per-IP limits.",
+                         [limiter]() { return static_cast<double>(limiter->GetCount()); });
+    metrics->AddCallback("webserver_client_ip_table_bytes", "gauge", "Memory preallocated for the per-IP table.",
+                         [limiter]() { return static_cast<double>(limiter->GetMemoryBytes()); });
+    metrics->AddCallback("webserver_client_ips_untracked_total", "counter", "Checks let through because the per-IP table was full.",
+                         [limiter]() { return static_cast<double>(limiter->GetUntracked()); });
+
+    if(adminPort > 0) {
+        adminFd_ = OpenListen_(adminPort);
+        if(adminFd_ < 0) {
+            LOG_ERROR("Metrics admin port:%d unavailable", adminPort);
+            return;
+        }
+        HttpConn::metricsOnMainPort = false;
+    }
+    LOG_INFO("Metrics on %s port:%d%s", adminPort > 0 ? "admin" : "server", adminPort > 0 ? adminPort : port_, Metrics::PATH);
+}
+
 void WebServer::InitEventMode_(int trigMode) {
     listenEvent_ = EPOLLRDHUP;    // 检测socket关闭
     connEvent_ = EPOLLONESHOT | EPOLLRDHUP;     // EPOLLONESHOT由一个线程处理
@@ -90,12 +355,31 @@ void WebServer::InitEventMode_(int trigMode) {
 
 // 初始化监听 sockFd（listenFd_），执行成功返回 true，失败返回 false
 bool WebServer::InitSocket_() {
+    listenFd_ = OpenListen_(port_);
+    return listenFd_ >= 0;
+}
+
+// 在port上监听，返回监听的fd，失败返回-1（业务端口和管理端口共用）
+int WebServer::OpenListen_(int port) {
+    int inherited = TakeInheritedFd_(port);
+    if(inherited >= 0) {
+        // 热升级：直接用旧进程交过来的监听socket，不重新bind，内核backlog里排队的连接也不会丢
+        if(!epoller_->AddFd(inherited, listenEvent_ | EPOLLIN)) {
+            LOG_ERROR("Add inherited listen error!");
+            close(inherited);
+            return -1;
+        }
+        SetFdNonblock(inherited);
+        LOG_INFO("Server port:%d (inherited)", port);
+        return inherited;
+    }
+
     // 1. 创建套接字：socket()
     // AF_INET为IPV4协议、SOCK_STREAM为TCP流式套接字、0为默认协议
-    listenFd_ = socket(AF_INET, SOCK_STREAM, 0);
-    if(listenFd_ < 0) {
-        LOG_ERROR("Create socket error!", port_);
-        return false;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) {
+        LOG_ERROR("Create socket error!", port);
+        return -1;
     }
 
     int ret;
@@ -109,72 +393,95 @@ bool WebServer::InitSocket_() {
         SO_REUSEADDR 并不意味着多个服务“同时”接收数据。
         如果多个 socket 使用 SO_REUSEADDR 绑定同一个地址端口，只有最后一个成功 bind 的 socket 能收到数据。
     */
-    ret = setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, (const void*)&optval, sizeof(int));
+    ret = setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (const void*)&optval, sizeof(int));
     if(ret == -1) {
         LOG_ERROR("set socket setsockopt error !");
-        close(listenFd_);
-        return false;
+        close(fd);
+        return -1;
     }
 
     // 2. 绑定地址端口：bind()
     struct sockaddr_in addr;
     addr.sin_family = AF_INET;
     addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons(port_);
-    ret = bind(listenFd_, (struct sockaddr *)&addr, sizeof(addr));
+    addr.sin_port = htons(port);
+    ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
     if(ret < 0) {
-        LOG_ERROR("Bind Port:%d error!", port_);
-        close(listenFd_);
-        return false;
+        LOG_ERROR("Bind Port:%d error!", port);
+        close(fd);
+        return -1;
     }
 
     // 3. 开始监听：listen()
     // ret = listen(listenFd_, 8);      //（原版）
-    ret = listen(listenFd_, SOMAXCONN); // (改动)
+    ret = listen(fd, SOMAXCONN); // (改动)
     if(ret < 0) {
-        LOG_ERROR("Listen port:%d error!", port_);
-        close(listenFd_);
-        return false;
+        LOG_ERROR("Listen port:%d error!", port);
+        close(fd);
+        return -1;
     }
 
-    // 4. 注册listenFd_到epoller
-    ret = epoller_->AddFd(listenFd_,  listenEvent_ | EPOLLIN);  // 将监听套接字加入epoller
+    // 4. 注册fd到epoller
+    ret = epoller_->AddFd(fd,  listenEvent_ | EPOLLIN);  // 将监听套接字加入epoller
     if(ret == 0) {
         LOG_ERROR("Add listen error!");
-        close(listenFd_);
-        return false;
+        close(fd);
+        return -1;
     }
 
     // 非阻塞是 IO 多路复用（如 epoll）配套使用的关键点
     // 否则一次 accept 或 recv 就可能挂住整个线程。
-    SetFdNonblock(listenFd_);       // 设置非阻塞，epoll一般和非阻塞一起用
-    LOG_INFO("Server port:%d", port_);
-    return true;
+    SetFdNonblock(fd);       // 设置非阻塞，epoll一般和非阻塞一起用
+    LOG_INFO("Server port:%d", port);
+    return fd;
 }
 
 void WebServer::Start() {
-    int timeMS = -1;  /* epoll wait timeout == -1 无事件将阻塞 */
     if(!isClose_) { LOG_INFO("========== Server start =========="); }
+    loopThread_ = std::this_thread::get_id();
+    for(int fd : inheritedFds_) {
+        close(fd);      // 旧进程交过来、这次没有用上的（如不再开管理端口）
+    }
+    inheritedFds_.clear();
+    if(parentFd_ >= 0) {
+        // 热升级的新进程：监听socket已经注册好了，通知旧进程退出；初始化失败时不回复，旧进程照常服务
+        if(!isClose_ && write(parentFd_, "R", 1) != 1) {
+            LOG_ERROR("Upgrade: notify old process error: %s", strerror(errno));
+        }
+        close(parentFd_);
+        parentFd_ = -1;
+    }
     while(!isClose_) {
         /*
-        1. 计算下一次超时时间（用于 epoll_wait 的超时时间）
-        2. 等待事件：epoll_wait
+        1. 等待事件：epoll_wait（不设超时，定时器到期由timerfd唤醒）
+        2. 更新缓存时钟，这一轮里定时器都用这个时间
         3. 遍历返回的事件数组，依次处理
         */
-        if(timeoutMS_ > 0) {
-            // 获取下一次的超时等待事件(至少这个时间才会有用户过期，每次关闭超时连接则需要有新的请求进来)
-            // 第一次运行时，事件堆为空，返回-1
-            timeMS = timer_->GetNextTick();     
-        }
-        // timeMS为-1时，永久阻塞，直到有事件
-        // timeMS>0时，指定MS内阻塞，超时返回
-        int eventCnt = epoller_->Wait(timeMS);
+        int eventCnt = epoller_->Wait(-1);
+        CachedClock::Update();
+        inlineLeft_ = inlineBudget_;
         for(int i = 0; i < eventCnt; i++) {
             int fd = epoller_->GetEventFd(i);
             uint32_t events = epoller_->GetEvents(i);
             // fd等于listenFd_，代表是连接事件
-            if(fd == listenFd_) {
-                DealListen_();              
+            if(fd == listenFd_ || fd == adminFd_) {
+                DealListen_(fd);              
+            }
+            // 其他线程投递过来的任务（数据库查询完成等）
+            else if(fd == loopQueue_->GetFd()) {
+                loopQueue_->Drain([this](const LoopMail& mail) { OnMail_(mail); });
+            }
+            // 定时器到期，批量处理
+            else if(fd == timer_->GetFd()) {
+                timer_->OnTick();
+            }
+            // SIGTERM / SIGUSR2
+            else if(fd == signalPipe_[0]) {
+                DealSignal_();
+            }
+            // 热升级：新进程的回复
+            else if(fd == upgradeFd_) {
+                DealUpgrade_();
             }
             // fd等于connFd，代表服务器和客户端之间的事务事件
             else if(events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
@@ -182,8 +489,7 @@ void WebServer::Start() {
                 assert(users_.count(fd) > 0);
                 // 不要直接手动关闭（原版）
                 // CloseConn_(&users_[fd]);
-                // 只调用定时器的doWork，由定时器复杂触发CloseConn_回调
-                timer_->doWork(fd); // 已内部清除user_
+                CloseInLoop_(fd, users_[fd].GetSeq());
             }
             else if(events & EPOLLIN) {
                 // 读事件
@@ -198,6 +504,14 @@ void WebServer::Start() {
                 LOG_ERROR("Unexpected event");
             }
         }
+        // 这一轮的事件里可能还有要关闭的连接和监听fd，处理完再开始退出
+        if(drainReason_ && !draining_) {
+            BeginDrain_();
+        }
+        if(draining_ && users_.empty()) {
+            LOG_INFO("Drain finished, server exit");
+            isClose_ = true;
+        }
     }
 }
 
@@ -210,12 +524,16 @@ void WebServer::Start() {
     在 EPOLLET 模式下，一次 epoll_wait() 唤醒后，可能有 多个客户端同时连接；
     你必须用循环 accept() 把他们一次性全部接收完，否则后续连接会被“饿死”。
 */
-void WebServer::DealListen_() {
+void WebServer::DealListen_(int listenFd) {
     struct sockaddr_in clientAddr;
     socklen_t len = sizeof(clientAddr);
+    if(admission_ && listenFd == listenFd_ && threadpool_->CheckOverload()) {
+        PauseAccept_();     // 新连接留在内核的backlog里，恢复后再接
+        return;
+    }
 
     while (listenEvent_ & EPOLLET) {
-        int connFd = accept(listenFd_, (struct sockaddr *)&clientAddr, &len);
+        int connFd = accept(listenFd, (struct sockaddr *)&clientAddr, &len);
         if (connFd < 0) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 // EAGAIN此处代表，操作资源暂时不可用（如 socket 当前无连接可 accept）
@@ -229,45 +547,181 @@ void WebServer::DealListen_() {
             break;
         }
         if(HttpConn::userCount >= MAX_FD) {
-            SendError_(connFd, "Server busy!");
+            Metrics::Instance()->Add(Metrics::CONN_REJECTED);
+            SendError_(connFd, busyResponse_.c_str());
             LOG_WARN("Clients is full!");
             continue;
         }
 
-        AddClient_(connFd, clientAddr); // 将connFd加入epoll管理
+        if(listenFd == listenFd_ && ipLimiter_.Enabled() && !ipLimiter_.Connect(IpLimiter::MakeKey(clientAddr))) {
+            Metrics::Instance()->Add(Metrics::CONN_LIMITED);
+            SendError_(connFd, limitResponse_.c_str());
+            LOG_DEBUG("Client %s: too many connections", inet_ntoa(clientAddr.sin_addr));
+            continue;
+        }
+
+        Metrics::Instance()->Add(Metrics::CONN_ACCEPTED);
+        AddClient_(connFd, clientAddr, listenFd == adminFd_); // 将connFd加入epoll管理
     }
 }
 
 void WebServer::SendError_(int connFd, const char*info) {
     assert(connFd > 0);
-    int ret = send(connFd, info, strlen(info), 0);
+    int ret = send(connFd, info, strlen(info), MSG_NOSIGNAL);
     if(ret < 0) {
         LOG_WARN("send error to client[%d] error!", connFd);
     }
     close(connFd);
 }
 
-void WebServer::AddClient_(int connFd, sockaddr_in clientAddr) {
+/*
+    过载（ThreadPool::CheckOverload）时：
+        新请求：主循环不再交给工作线程池，读掉请求，直接send预先生成的503，关闭
+               （有没读的数据时close会发RST，客户端可能收不到503）；
+               过载前已经进了队列的新请求，工作线程取到时如果已经排了超过target，同样回503（CoDel在出队时丢包），
+               积压的队列很快就能清掉，而不是让每个请求都等到超时
+        新连接：把监听fd从epoll里拿掉，连接留在内核的backlog里（满了内核自己拒绝），过载解除后加回，
+               加回时backlog里有连接epoll会马上通知
+    收了一半的请求和已经在处理的请求不受影响，被接纳的请求的排队时间因此有上界
+*/
+void WebServer::Shed_(HttpConn* client) {
+    Metrics::Instance()->Add(Metrics::REQ_SHED);
+    WS_PROBE(request__shed, client->GetFd());
+    Reject_(client, busyResponse_);
+}
+
+void WebServer::Reject_(HttpConn* client, const std::string& response) {
+    int readErrno = 0;
+    client->read(&readErrno);
+    if(send(client->GetFd(), response.data(), response.size(), MSG_NOSIGNAL) < 0) {
+        LOG_DEBUG("send reject to client[%d] error!", client->GetFd());
+    }
+    CloseAsync_(client);
+}
+
+void WebServer::PauseAccept_() {
+    if(acceptPaused_) {
+        return;
+    }
+    epoller_->DelFd(listenFd_);
+    acceptPaused_ = true;
+    Metrics::Instance()->Add(Metrics::ACCEPT_PAUSES);
+    LOG_WARN("Overloaded: worker queue %zu, accept paused", threadpool_->QueueSize());
+    timer_->add(ADMISSION_TIMER_ID, admissionMs_, [this]() { CheckAdmission_(); });
+}
+
+void WebServer::CheckAdmission_() {
+    if(listenFd_ < 0) {
+        return;     // 正在退出，不再accept
+    }
+    if(threadpool_->CheckOverload()) {
+        timer_->add(ADMISSION_TIMER_ID, admissionMs_, [this]() { CheckAdmission_(); });
+        return;
+    }
+    epoller_->AddFd(listenFd_, listenEvent_ | EPOLLIN);
+    acceptPaused_ = false;
+    LOG_INFO("Overload cleared: worker queue %zu, accept resumed", threadpool_->QueueSize());
+}
+
+void WebServer::AddClient_(int connFd, sockaddr_in clientAddr, bool admin) {
     assert(connFd > 0);
-    users_[connFd].init(connFd, clientAddr);
+    users_[connFd].init(connFd, clientAddr, admin);    // 从收请求头阶段开始
+    WS_PROBE(conn__accept, connFd, users_[connFd].GetIP(), users_[connFd].GetPort());
     if(timeoutMS_ > 0) {
-        timer_->add(connFd, timeoutMS_, [this, connFd]() {
-            if (users_.count(connFd)) {
-                CloseConn_(&users_[connFd]);
-            }
-        });
+        timer_->add(connFd, headerMs_, [this, connFd]() { OnTimeout_(connFd); });
     }
     epoller_->AddFd(connFd, EPOLLIN | connEvent_);
     SetFdNonblock(connFd);  // // 设置非阻塞
     LOG_INFO("Client[%d] in!", users_[connFd].GetFd());
 }
+
+// 超时：连接还在工作线程手里（或在等数据库）时不能销毁，记下来，交回主循环时再关闭
+void WebServer::OnTimeout_(int fd) {
+    auto it = users_.find(fd);
+    if(it == users_.end()) {
+        return;
+    }
+    static const char* PHASE_NAME[] = {"idle", "header", "body", "write"};
+    // 按定时器设置时的阶段打日志：phase_在连接忙的时候由工作线程改写，主循环这里不能读
+    LOG_INFO("Client[%d] %s timeout", fd, PHASE_NAME[it->second.GetTimerPhase()]);
+    Metrics::Instance()->Add(Metrics::CONN_TIMEOUT);
+    if(it->second.IsBusy()) {
+        it->second.SetExpired();
+        return;
+    }
+    CloseConn_(&it->second);
+}
+
+/*
+    定时器、users_、epoll注册只由主循环修改
+    工作线程处理完一个连接后不直接改epoll，而是投递"等读/等写/关闭"给主循环，
+    主循环用(fd, seq)确认还是原来那个连接，再重设定时器、重新注册事件或关闭
+    连接交给工作线程时标记为忙，忙的连接超时了也不会被销毁（工作线程还在用HttpConn）
+*/
+void WebServer::PostAsync_(HttpConn* client, int type, int arg) {
+    LoopMail mail = {type, client->GetFd(), arg, client->GetSeq()};
+    if(InLoop_()) {
+        OnMail_(mail);      // 快速路径本来就在主循环上，直接处理
+        return;
+    }
+    loopQueue_->Post(mail);
+}
+
+void WebServer::CloseAsync_(HttpConn* client) {
+    PostAsync_(client, LoopMail::CLOSE);
+}
+
+// 主循环线程：处理其他线程投递的消息
+void WebServer::OnMail_(const LoopMail& mail) {
+    auto it = users_.find(mail.fd);
+    if(it == users_.end() || it->second.GetSeq() != mail.seq) {
+        return;     // 已经关闭了（fd可能已被新连接复用）
+    }
+    HttpConn* client = &it->second;
+    client->SetBusy(false);
+    if(client->IsExpired() || mail.type == LoopMail::CLOSE) {
+        CloseInLoop_(mail.fd, mail.seq);
+        return;
+    }
+    switch(mail.type) {
+    case LoopMail::WAIT_READ:
+        UpdateTimer_(client);
+        epoller_->ModFd(mail.fd, connEvent_ | EPOLLIN);
+        break;
+    case LoopMail::WAIT_WRITE:
+        UpdateTimer_(client);
+        epoller_->ModFd(mail.fd, connEvent_ | EPOLLOUT);
+        break;
+    case LoopMail::VERIFY_DONE:
+        OnVerifyDone_(client, mail.arg);
+        break;
+    default:
+        LOG_ERROR("Unexpected loop mail: %d", mail.type);
+        break;
+    }
+}
+
+void WebServer::CloseInLoop_(int fd, uint64_t seq) {
+    auto it = users_.find(fd);
+    if(it == users_.end() || it->second.GetSeq() != seq) {
+        return;     // 已经被定时器关闭了（fd可能已被新连接复用）
+    }
+    timer_->cancel(fd);     // 定时器回调只用于超时关闭（会记录是哪个阶段超时）
+    CloseConn_(&it->second);
+}
+
 // 不要直接手动关闭
-// 只调用定时器的doWork，由定时器复杂触发CloseConn_回调
+// 只调用CloseInLoop_（先取消定时器）或由定时器超时回调触发
 void WebServer::CloseConn_(HttpConn* client) {
     assert(client);
 
     int connFd = client->GetFd();
     LOG_INFO("Client[%d] quit!", connFd);
+    Metrics::Instance()->Add(Metrics::CONN_CLOSED);
+    WS_PROBE(conn__close, connFd, client->GetReqCount());
+    if(ipLimiter_.Enabled() && !client->IsAdmin()) {
+        ipLimiter_.Disconnect(IpLimiter::MakeKey(client->GetAddr()));
+    }
     epoller_->DelFd(connFd);   // 从epoll中删除
     client->Close();
     users_.erase(connFd);   // 内部清除users_中的HttpConn
@@ -284,30 +738,123 @@ void WebServer::CloseConn_(HttpConn* client) {
 // 处理读事件，主要逻辑是将OnRead加入线程池的任务队列中
 void WebServer::DealRead_(HttpConn* client) {
     assert(client);
+    bool fresh = client->ReadableBytes() == 0;      // 新请求的开始，不是收了一半的
     ExtentTime_(client);
-    threadpool_->AddTask(std::bind(&WebServer::OnRead_, this, client)); // 这是一个右值，bind将参数和函数绑定
+    if(fresh && ipLimiter_.Enabled() && !client->IsAdmin() && !ipLimiter_.Request(IpLimiter::MakeKey(client->GetAddr()))) {
+        Metrics::Instance()->Add(Metrics::REQ_LIMITED);
+        WS_PROBE(request__limited, client->GetFd());
+        client->SetBusy(true);
+        Reject_(client, limitResponse_);
+        return;
+    }
+    if(inlineMaxBytes_ > 0 && TryInline_(client)) {
+        return;     // 快速路径不进工作线程池，过载时也照常处理
+    }
+    client->SetBusy(true);
+    if(admission_ && fresh && !client->IsAdmin() && threadpool_->CheckOverload()) {
+        Shed_(client);
+        return;
+    }
+    client->Trace().Mark(ReqTrace::DISPATCH);
+    threadpool_->AddTask(std::bind(&WebServer::OnRead_, this, client, fresh), TaskClass_(client)); // 这是一个右值，bind将参数和函数绑定
+}
+
+/*
+    主循环快速路径：缓存命中的小文件GET在这里读、解析、发送，省掉交给工作线程再交回来的两次线程切换
+    只在主循环上读一次socket、查一次内存里的缓存，不碰磁盘；判断不了的读到的数据留在读缓冲区里交给工作线程，
+    工作线程再读一次（EAGAIN）就接着处理。发完后的重设定时器/事件和工作线程交回时一样走OnMail_
+    每轮epoll_wait最多处理inlineBudget_个，一批连接同时来时主循环不会被拖住，其余的照常并行处理
+*/
+bool WebServer::TryInline_(HttpConn* client) {
+    if(inlineLeft_ <= 0) {
+        return false;
+    }
+    int readErrno = 0;
+    size_t before = client->ReadableBytes();
+    ssize_t ret = client->read(&readErrno);
+    Metrics* metrics = Metrics::Instance();
+    metrics->Add(Metrics::BYTES_READ, client->ReadableBytes() - before);
+    if(ret <= 0 && readErrno != EAGAIN) {
+        CloseInLoop_(client->GetFd(), client->GetSeq());
+        return true;
+    }
+    if(!client->IsCachedGet(inlineMaxBytes_)) {
+        metrics->Add(Metrics::INLINE_FALLBACK);
+        return false;
+    }
+    inlineLeft_--;
+    metrics->Add(Metrics::INLINE_SERVED);
+    client->Trace().Mark(ReqTrace::DISPATCH);
+    client->Trace().Mark(ReqTrace::WORKER_START);
+    client->SetBusy(true);  // 和交给工作线程一样，OnMail_交回时清掉
+    int64_t begin = metrics->Enabled() ? Metrics::NowUs() : 0;
+    client->process();      // 完整的GET，一定生成了响应，不会去查数据库
+    if(begin) {
+        metrics->Add(Metrics::REQUESTS);
+        metrics->Observe(Metrics::PROCESS_SECONDS, Metrics::NowUs() - begin);
+    }
+    client->SetPhase(HttpConn::WRITE);
+    OnWrite_(client);       // 小响应一般一次writev就发完了；发不完就等可写事件，交给工作线程续传
+    return true;
 }
 
 // 处理写事件，主要逻辑是将OnWrite加入线程池的任务队列中
 void WebServer::DealWrite_(HttpConn* client) {
     assert(client);
-    ExtentTime_(client);
-    threadpool_->AddTask(std::bind(&WebServer::OnWrite_, this, client));
+    client->SetBusy(true);
+    threadpool_->AddTask(std::bind(&WebServer::OnWrite_, this, client), TaskClass_(client));
 }
-// 读/写事件，标志此connFd不需要定时销毁===>刷新对应的时间堆
+/*
+    读事件：只有keep-alive空闲的连接收到新数据时才切换到收请求头阶段、重设期限
+    收请求头/正文期间的读事件不延长期限，一个字节一个字节发的慢速客户端到点就会被关闭
+*/
 void WebServer::ExtentTime_(HttpConn* client) {
     assert(client);
-    if(timeoutMS_ > 0) { timer_->adjust(client->GetFd(), timeoutMS_); }
+    if(client->GetPhase() != HttpConn::IDLE) {
+        return;
+    }
+    client->SetPhase(HttpConn::HEADER);
+    UpdateTimer_(client);
+}
+
+int WebServer::PhaseTimeout_(HttpConn* client) const {
+    switch(client->GetPhase()) {
+    case HttpConn::IDLE:
+        return idleMs_;
+    case HttpConn::HEADER:
+        return headerMs_;
+    case HttpConn::BODY:
+        return bodyMs_;
+    default:
+        // 发响应：固定时间 + 按最低速度发完整个响应需要的时间，写得太慢（对端不收）就关闭
+        return writeMs_ + (minWriteRate_ > 0 ? static_cast<int>(client->ToWriteBytes() * 1000LL / minWriteRate_) : 0);
+    }
+}
+
+// 阶段变了才按新阶段重设期限，同一阶段内（如分几次写完响应）不延长
+void WebServer::UpdateTimer_(HttpConn* client) {
+    if(timeoutMS_ <= 0 || client->GetPhase() == client->GetTimerPhase()) {
+        return;
+    }
+    client->SetTimerPhase(client->GetPhase());
+    timer_->adjust(client->GetFd(), PhaseTimeout_(client));
 }
 
-void WebServer::OnRead_(HttpConn* client) {
+void WebServer::OnRead_(HttpConn* client, bool fresh) {
     assert(client);
+    if(admission_ && fresh && !client->IsAdmin() && threadpool_->Overloaded() &&
+       ThreadPool::TaskWaitUs() >= admissionTargetUs_) {
+        Shed_(client);
+        return;
+    }
     int ret = -1;
     int readErrno = 0;
+    client->Trace().Mark(ReqTrace::WORKER_START);
+    size_t before = client->ReadableBytes();
     ret = client->read(&readErrno);         // 将fd的内容读到httpconn的readBuff_缓存区
+    Metrics::Instance()->Add(Metrics::BYTES_READ, client->ReadableBytes() - before);    // ET模式下ret只是最后一次read的返回值
     if(ret <= 0 && readErrno != EAGAIN) {   // 读异常就关闭客户端(EAGAIN标志暂时无数据可读/写)
-        // 只调用定时器的doWork，由定时器复杂触发CloseConn_回调
-        timer_->doWork(client->GetFd()); // 已内部清除user_
+        CloseAsync_(client);
         return;
     }
     // 业务逻辑的处理（先读后处理）
@@ -316,13 +863,296 @@ void WebServer::OnRead_(HttpConn* client) {
 
 /* 处理读（请求）数据的函数 */
 void WebServer::OnProcess(HttpConn* client) {
+    Metrics* metrics = Metrics::Instance();
+    int64_t begin = metrics->Enabled() ? Metrics::NowUs() : 0;
     // 首先调用process()进行逻辑处理
-    if(client->process()) { // 根据返回的信息重新将fd置为EPOLLOUT（写）或EPOLLIN（读）
+    bool done = client->process();
+    if(begin && (done || client->IsVerifyPending())) {
+        // 只统计收完整的请求（没收完的process会马上返回）
+        metrics->Add(Metrics::REQUESTS);
+        metrics->Observe(Metrics::PROCESS_SECONDS, Metrics::NowUs() - begin);
+    }
+    if(done) { // 根据返回的信息重新将fd置为EPOLLOUT（写）或EPOLLIN（读）
     //读完事件就跟内核说可以写了
-        epoller_->ModFd(client->GetFd(), connEvent_ | EPOLLOUT);    // 响应成功，修改监听事件为写,等待OnWrite_()发送
+        client->SetPhase(HttpConn::WRITE);
+        PostAsync_(client, LoopMail::WAIT_WRITE);   // 响应成功，修改监听事件为写,等待OnWrite_()发送
+    } else if(client->IsVerifyPending()) {
+        // 登录/注册：交给数据库线程，连接挂起（仍算忙）直到查询完成
+        AsyncVerify_(client);
     } else {
-    //写完事件就跟内核说可以读了
-        epoller_->ModFd(client->GetFd(), connEvent_ | EPOLLIN);
+    //写完事件就跟内核说可以读了（请求没收完，process里已经切换到收请求头/正文阶段）
+        PostAsync_(client, LoopMail::WAIT_READ);
+    }
+}
+
+/*
+    数据库线程只拿到用户名、密码的拷贝，不碰HttpConn
+    查询完成后投递回主循环，用(fd, seq)确认还是原来那个连接，再生成响应
+*/
+void WebServer::AsyncVerify_(HttpConn* client) {
+    int fd = client->GetFd();
+    uint64_t seq = client->GetSeq();
+    std::string name = client->GetPost("username");
+    std::string pwd = client->GetPost("password");
+    if(!client->IsLogin()) {
+        // 注册不占用数据库线程，交给RegBatcher攒批提交，提交后回调
+        HttpRequest::UserRegister(name, pwd, [this, fd, seq](int ret) {
+            loopQueue_->Post({LoopMail::VERIFY_DONE, fd, ret, seq});
+        });
+        return;
+    }
+    dbpool_->AddTask([this, fd, seq, name, pwd]() {
+        int ret = HttpRequest::UserVerify(name, pwd, true);
+        loopQueue_->Post({LoopMail::VERIFY_DONE, fd, ret, seq});
+    });
+}
+
+void WebServer::OnVerifyDone_(HttpConn* client, int ret) {
+    client->FinishVerify(ret);
+    client->SetPhase(HttpConn::WRITE);
+    UpdateTimer_(client);
+    epoller_->ModFd(client->GetFd(), connEvent_ | EPOLLOUT);
+}
+
+// 每秒清理4个分片（64个分片16秒一轮），过期会话在Verify时也会被发现，这里只是回收空间
+void WebServer::SessionTick_() {
+    SessionStore::Instance()->Expire(4);
+    timer_->add(SESSION_TIMER_ID, 1000, [this]() { SessionTick_(); });
+}
+
+/*
+    按客户端IP限流：表只在主循环上访问（accept、读事件、关闭、这里的定时清理），不加锁
+        连接数：accept后计数加一，关闭时减一，到上限的新连接直接回429关闭，不进users_
+        请求速率：读事件到来时连接上没有收了一半的请求就算一个新请求，取一个令牌，没有令牌回429关闭连接；
+                 流水线里同一次读到的后续请求不再检查（它们不经过读事件），按连接数限制兜底
+    每秒清理4个分片，64个分片16秒一轮
+*/
+void WebServer::LimiterTick_() {
+    ipLimiter_.Expire(4);
+    timer_->add(LIMITER_TIMER_ID, 1000, [this]() { LimiterTick_(); });
+}
+
+/*
+    优雅退出和热升级（SetGracefulShutdown）
+        信号处理函数里只往信号管道写一个字节（异步信号安全），真正的处理在主循环上做，不用考虑信号打断了哪个线程
+        SIGTERM：这一轮事件处理完后开始退出（BeginDrain_）：
+            监听fd从epoll拿掉并关闭；之后生成的响应都带Connection: close，发完就关闭；
+            空闲的keep-alive连接（包括开始退出前生成的keep-alive响应发完的）再等DRAIN_IDLE_MS，期间来的请求照常处理，
+            没来的到时关闭——直接关闭正在发下一个请求的连接，客户端会收到RST；
+            连接都关完后Start返回，析构时等工作线程、数据库线程把手上的事做完；drainMs后还有没关完的不再等
+        SIGUSR2：fork两次再exec（新进程直接成为孤儿，旧进程不用回收它），新进程的fd 3是和旧进程之间的Unix socket，
+            旧进程通过它用SCM_RIGHTS发送监听fd（Unix socket的缓冲区先存着）；新进程构造时取出监听fd，
+            不重新bind直接注册到自己的epoll，进入Start时回复一个字节，旧进程收到后关闭自己的监听fd、开始退出
+            两个进程同时accept同一个监听socket的这段时间，连接由谁接都可以；backlog里的连接一直在，不会被拒绝或RST
+            新进程初始化失败（连不上数据库、找不到文件等）时不回复直接退出，旧进程收到EOF，照常服务
+            新进程在开始accept前已经建好了数据库连接池；会话表是MAP_SHARED的同一个文件，新进程直接接着用，
+            从新进程Init到旧进程退出，两个进程同时读写会话表，靠文件上每个分片的记录锁互斥（见SessionStore）
+*/
+void WebServer::OnSignal_(int sig) {
+    int savedErrno = errno;
+    char c = static_cast<char>(sig);
+    if(write(signalPipe_[1], &c, 1) < 0) {}     // 管道满了说明已经有信号没处理，丢掉这个也没关系
+    errno = savedErrno;
+}
+
+void WebServer::DealSignal_() {
+    char sigs[16];
+    ssize_t len;
+    while((len = read(signalPipe_[0], sigs, sizeof(sigs))) > 0) {
+        for(ssize_t i = 0; i < len; i++) {
+            if(sigs[i] == SIGTERM) {
+                LOG_INFO("SIGTERM received, draining");
+                drainReason_ = "SIGTERM";
+            } else if(sigs[i] == SIGUSR2) {
+                StartUpgrade_();
+            }
+        }
+    }
+}
+
+bool WebServer::StartUpgrade_() {
+    if(draining_ || drainReason_ || upgradeFd_ >= 0) {
+        LOG_WARN("Upgrade: already upgrading or exiting, SIGUSR2 ignored");
+        return false;
+    }
+    int sv[2];
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        LOG_ERROR("Upgrade: socketpair error: %s", strerror(errno));
+        return false;
+    }
+    // fork之后的子进程里只能调用异步信号安全的函数（其他线程可能正拿着malloc、日志的锁），参数、环境变量都先准备好
+    std::vector<std::string> env;
+    std::string prefix = std::string(UPGRADE_ENV) + "=";
+    for(char** e = environ; *e; e++) {
+        if(strncmp(*e, prefix.c_str(), prefix.size()) != 0) {
+            env.push_back(*e);
+        }
+    }
+    env.push_back(prefix + "3");
+    std::vector<char*> envp;
+    for(auto& e : env) {
+        envp.push_back(&e[0]);
+    }
+    envp.push_back(nullptr);
+    char* argv[] = { &exePath_[0], nullptr };
+    long maxFd = sysconf(_SC_OPEN_MAX);
+
+    pid_t pid = fork();
+    if(pid < 0) {
+        LOG_ERROR("Upgrade: fork error: %s", strerror(errno));
+        close(sv[0]);
+        close(sv[1]);
+        return false;
+    }
+    if(pid == 0) {
+        if(fork() != 0) {
+            _exit(0);
+        }
+        // 新进程：fd 3是和旧进程之间的socket，其余的fd（连接、epoll、日志文件……）都不能带过去，
+        // 否则旧进程关闭连接时新进程还拿着，连接关不掉
+        if(sv[1] == 3) {
+            fcntl(3, F_SETFD, 0);
+        } else {
+            dup2(sv[1], 3);
+        }
+        bool closed = false;
+#ifdef SYS_close_range
+        closed = syscall(SYS_close_range, 4U, ~0U, 0) == 0;
+#endif
+        for(long fd = 4; !closed && fd < maxFd; fd++) {
+            close(fd);
+        }
+        execve(argv[0], argv, envp.data());
+        _exit(127);
+    }
+    close(sv[1]);
+    waitpid(pid, nullptr, 0);   // 中间那个进程马上就退出了
+
+    int fds[2];
+    int num = 0;
+    fds[num++] = listenFd_;
+    if(adminFd_ >= 0) {
+        fds[num++] = adminFd_;
+    }
+    char data = 'F';
+    struct iovec iov = { &data, 1 };
+    char ctrl[CMSG_SPACE(sizeof(fds))];
+    memset(ctrl, 0, sizeof(ctrl));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * num);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num);
+    if(sendmsg(sv[0], &msg, MSG_NOSIGNAL) != 1) {
+        LOG_ERROR("Upgrade: send listen fds error: %s", strerror(errno));
+        close(sv[0]);
+        return false;
+    }
+    upgradeFd_ = sv[0];
+    epoller_->AddFd(upgradeFd_, EPOLLIN);
+    LOG_INFO("Upgrade: started %s, %d listen fds sent, waiting for it to take over", exePath_.c_str(), num);
+    return true;
+}
+
+void WebServer::DealUpgrade_() {
+    char reply = 0;
+    ssize_t len = read(upgradeFd_, &reply, 1);
+    epoller_->DelFd(upgradeFd_);
+    close(upgradeFd_);
+    upgradeFd_ = -1;
+    if(len == 1 && reply == 'R') {
+        LOG_INFO("Upgrade: new process is accepting, draining");
+        drainReason_ = "upgrade";
+        return;
+    }
+    LOG_ERROR("Upgrade: new process exited before taking over, keep serving");
+}
+
+void WebServer::ReceiveListenFds_() {
+    const char* env = getenv(UPGRADE_ENV);
+    if(!env) {
+        return;
+    }
+    int fd = atoi(env);
+    unsetenv(UPGRADE_ENV);
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    char data = 0;
+    struct iovec iov = { &data, 1 };
+    char ctrl[CMSG_SPACE(sizeof(int) * 4)];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctrl;
+    msg.msg_controllen = sizeof(ctrl);
+    if(recvmsg(fd, &msg, MSG_CMSG_CLOEXEC) <= 0) {
+        LOG_ERROR("Upgrade: receive listen fds error: %s", strerror(errno));
+        close(fd);
+        return;
+    }
+    for(struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+        size_t num = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for(size_t i = 0; i < num; i++) {
+            int listenFd;
+            memcpy(&listenFd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            inheritedFds_.push_back(listenFd);
+        }
+    }
+    parentFd_ = fd;
+    LOG_INFO("Upgrade: %zu listen fds received from the old process", inheritedFds_.size());
+}
+
+int WebServer::TakeInheritedFd_(int port) {
+    for(auto it = inheritedFds_.begin(); it != inheritedFds_.end(); ++it) {
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        if(getsockname(*it, reinterpret_cast<sockaddr*>(&addr), &len) == 0 &&
+           addr.sin_family == AF_INET && ntohs(addr.sin_port) == port) {
+            int fd = *it;
+            inheritedFds_.erase(it);
+            return fd;
+        }
+    }
+    return -1;
+}
+
+void WebServer::BeginDrain_() {
+    draining_ = true;
+    HttpConn::draining = true;
+    // 热升级时监听socket在新进程里还开着，backlog里的连接由新进程接
+    for(int* fd : {&listenFd_, &adminFd_}) {
+        if(*fd >= 0) {
+            epoller_->DelFd(*fd);
+            close(*fd);
+            *fd = -1;
+        }
+    }
+    // 空闲连接不马上关：客户端可能正在发下一个请求，这时关闭它会收到RST；
+    // 把空闲超时缩短到DRAIN_IDLE_MS，这期间来的请求照常处理（响应带Connection: close），没有请求的到时关闭
+    idleMs_ = std::min(idleMs_, DRAIN_IDLE_MS);
+    size_t idle = 0;
+    for(auto& user : users_) {
+        if(timeoutMS_ > 0 && !user.second.IsBusy() && user.second.GetPhase() == HttpConn::IDLE) {
+            timer_->adjust(user.first, idleMs_);
+            idle++;
+        }
+    }
+    LOG_INFO("Draining (%s): stop accepting, %zu connections (%zu idle) left",
+             drainReason_, users_.size(), idle);
+    if(drainMs_ > 0) {
+        timer_->add(DRAIN_TIMER_ID, drainMs_, [this]() {
+            LOG_WARN("Drain timeout: %zu connections still open, exit", users_.size());
+            isClose_ = true;
+        });
     }
 }
 
@@ -330,25 +1160,42 @@ void WebServer::OnWrite_(HttpConn* client) {
     assert(client);
     int ret = -1;
     int writeErrno = 0;
+    int before = client->ToWriteBytes();
     ret = client->write(&writeErrno);
+    Metrics* metrics = Metrics::Instance();
+    metrics->Add(Metrics::BYTES_WRITTEN, before - client->ToWriteBytes());
     if(client->ToWriteBytes() == 0) {
         /* 传输完成 */
+        client->FinishRequest();    // 状态码计数、请求耗时、各阶段耗时，慢请求打日志
+        WS_PROBE(response__done, client->GetFd(), client->GetCode());
         if(client->IsKeepAlive()) {
+            if(client->HasBuffered()) {
+                // 流水线：下一个请求已经在读缓冲区里了（ET模式下不会再有读事件），直接处理
+                client->BeginBuffered();    // 从这里算起
+                client->SetPhase(HttpConn::HEADER);
+                if(InLoop_()) {
+                    // 快速路径上发完的：后面的请求不一定能命中缓存，交给工作线程
+                    threadpool_->AddTask(std::bind(&WebServer::OnProcess, this, client), TaskClass_(client));
+                    return;
+                }
+                OnProcess(client);
+                return;
+            }
             // 保持连接，改成监听读事件，等待下一次请求
-            epoller_->ModFd(client->GetFd(), connEvent_ | EPOLLIN); // 回归换成监测读事件
+            client->SetPhase(HttpConn::IDLE);
+            PostAsync_(client, LoopMail::WAIT_READ);    // 回归换成监测读事件
             return;
         }
     }
     else if(ret < 0) {
         if(writeErrno == EAGAIN) { 
             // 写缓冲区满了，继续监听写事件，等待可写时续传
-            // 只要再规定时间内再次继续写，就不会触发关闭connfd
-            epoller_->ModFd(client->GetFd(), connEvent_ | EPOLLOUT);
+            // 发响应阶段的期限是进入时按响应大小算好的，续传不延长
+            PostAsync_(client, LoopMail::WAIT_WRITE);
             return;
         }
     }
-    // 只调用定时器的doWork，由定时器复杂触发CloseConn_回调
-    timer_->doWork(client->GetFd()); // 已内部清除user_
+    CloseAsync_(client);
 }
 
 // 设置非阻塞
@@ -9,59 +9,170 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <thread>
+#include <string>
+#include <vector>
+#include <signal.h>      // sigaction
+#include <sys/wait.h>    // waitpid
+#include <sys/syscall.h> // SYS_close_range
+#include <climits>       // PATH_MAX
 
 #include "epoller.h"
+#include "loopqueue.h"
+#include "iplimiter.h"
 #include "../timer/heaptimer.h"
 
 #include "../log/log.h"
 #include "../pool/sqlconnpool.h"
+#include "../store/userstore.h"
 #include "../pool/threadpool.h"
 
 #include "../http/httpconn.h"
+#include "../metrics/metrics.h"
 
 class WebServer {
 public:
     WebServer(
         int port, int trigMode, int timeoutMS, bool OptLinger,
         int sqlPort, const char* sqlUser, const  char* sqlPwd, const char* dbName, 
-        int connPoolNum, int threadNum, bool openLog, int logLevel, int logQueSize);
+        int connPoolNum, int threadNum, bool openLog, int logLevel, int logQueSize, int storeType);
     ~WebServer();
 
+    // 分阶段超时（毫秒）：收请求头、收正文、keep-alive空闲、发响应（再按minWriteRate字节/秒加上响应大小需要的时间）
+    // 每个阶段的期限从进入该阶段开始算，期间的读写事件不会延长；maxRequests为单连接请求数上限，0为不限
+    // 不调用时各阶段都用构造函数的timeoutMS
+    void SetTimeouts(int headerMs, int bodyMs, int idleMs, int writeMs, int minWriteRate, int maxRequests);
+    // 运行指标：GET /metrics（Prometheus文本格式）；adminPort>0时只在这个单独的端口上提供，业务端口上不再提供
+    void SetMetrics(bool enable, int adminPort);
+    // 请求分阶段耗时：每sampleEvery个请求采样一个记入阶段直方图（需开启指标）；总耗时超过slowMs的请求打一行WARN日志
+    // 0为关闭对应功能；不调用时都关闭
+    void SetTracing(int sampleEvery, int slowMs);
+    // 工作线程池按排队时间自动伸缩：队首任务等待超过targetDelayMs且没有空闲线程时加线程（最多maxThreads），
+    // 空闲超过idleMs的线程退出（保留minThreads）；数据库线程池同样伸缩，上限为构造时的connPoolNum（再多也拿不到连接）
+    void SetPoolSizing(int minThreads, int maxThreads, int targetDelayMs, int idleMs);
+    // 请求分类调度：静态、数据库（登录/注册）、管理（/metrics）三类请求在工作线程池里各排一个队，按权重轮流取，
+    // 数据库类同时最多占dbLimit个工作线程，管理类最多1个；不调用时所有任务排一个FIFO队列
+    void SetRequestClasses(int staticWeight, int dbWeight, int adminWeight, int dbLimit);
+    // 静态文件缓存：不超过maxFileKB的能读的文件整个缓存在内存里，总共最多maxTotalMB，每秒最多stat一次确认没改
+    void SetFileCache(int maxFileKB, int maxTotalMB);
+    // 主循环快速路径：读事件在主循环上直接读，是完整的GET且文件在缓存里、不超过maxBytes就直接解析、发送，
+    // 不经过工作线程；每轮epoll_wait最多这样处理budget个请求，其余的（以及POST、没命中、大文件、流水线里后面的请求）
+    // 照常交给工作线程。需要先SetFileCache；maxBytes为0关闭，不调用时关闭
+    void SetInlineFastPath(int maxBytes, int budget);
+    // 过载保护：工作线程池的任务排队时间连续intervalMs都超过targetMs（CoDel），或排队的任务超过maxQueue（0不限）时算过载，
+    // 过载期间新请求（连接上没收到一半的）直接回预先生成好的503（带Retry-After: retryAfterSec）并关闭连接，
+    // 业务端口暂停accept（从epoll里拿掉监听fd），每intervalMs检查一次，恢复后重新加回；管理端口不受影响
+    // 不调用时不做过载保护，只有连接数满了才拒绝
+    void SetAdmission(int targetMs, int intervalMs, int maxQueue, int retryAfterSec);
+    // 按客户端IP限流（业务端口）：每个IP最多maxConnsPerIp个并发连接，超过的新连接回429并关闭；
+    // 每个IP每秒ratePerSec个新请求（令牌桶，允许突发burst个），超过的回429（Retry-After: 1）并关闭连接
+    // 最多记录maxIps个IP（表是预先分配好的，每个IP 64字节），记满了新IP不受限；空闲一分钟的IP定时清掉
+    // 0为不限对应的一项；不调用时不限
+    void SetClientLimits(int maxConnsPerIp, int ratePerSec, int burst, int maxIps);
+    // 优雅退出：收到SIGTERM后不再accept，收了一半和正在处理的请求照常做完（响应带Connection: close，发完就关闭），
+    // 空闲的keep-alive连接再等1秒没有请求就关闭，连接都关完后Start返回；drainMs后还没关完的不再等（0为一直等）
+    // hotUpgrade：收到SIGUSR2时重新执行自己的可执行文件（部署时先把新版本替换到原来的路径），通过Unix socket（SCM_RIGHTS）
+    // 把监听fd交给新进程，新进程初始化完、开始accept后旧进程再按上面的方式退出，监听socket一直开着，连接不会被拒绝
+    // 不调用时SIGTERM按默认方式直接结束进程，SIGUSR2也是
+    void SetGracefulShutdown(int drainMs, bool hotUpgrade);
     void Start();
 
 private:
     void InitEventMode_(int trigMode);
     bool InitSocket_(); 
+    int OpenListen_(int port);      // 创建监听socket并注册到epoller，失败返回-1
   
-    void DealListen_();
+    void DealListen_(int listenFd);
     void SendError_(int connFd, const char*info);
-    void AddClient_(int connFd, sockaddr_in clientAddr);
+    void Shed_(HttpConn* client);               // 过载：把请求读掉，回503并关闭（主循环或工作线程）
+    void Reject_(HttpConn* client, const std::string& response);    // 把请求读掉，发预先生成的响应并关闭
+    void PauseAccept_();                        // 过载：暂停accept
+    void CheckAdmission_();                     // 定时检查是否还过载，恢复accept
+    // 预先生成的完整HTTP错误响应（带Retry-After、Connection: close）：过载和连接数满时的503、限流的429
+    static std::string RejectResponse_(int code, const char* status, const char* message, int retryAfterSec);
+    void LimiterTick_();                        // 周期清理空闲的IP
+
+    static void OnSignal_(int sig);             // 信号处理函数：只把信号写进信号管道，由主循环处理
+    void DealSignal_();                         // 主循环线程：读信号管道
+    bool StartUpgrade_();                       // SIGUSR2：启动新进程，把监听fd发过去
+    void DealUpgrade_();                        // 主循环线程：新进程回复准备好了就开始退出，失败了照常服务
+    void ReceiveListenFds_();                   // 新进程（构造时）：从旧进程收监听fd
+    int TakeInheritedFd_(int port);             // 新进程：收到的监听fd里端口是port的那个，没有返回-1
+    void BeginDrain_();                         // 主循环线程：不再accept，关闭空闲连接
+    void AddClient_(int connFd, sockaddr_in clientAddr, bool admin);
+    void OnTimeout_(int fd);
     void CloseConn_(HttpConn* client);
+    void PostAsync_(HttpConn* client, int type, int arg = 0);   // 工作线程：把连接交回主循环
+    void CloseAsync_(HttpConn* client);         // 工作线程：请主循环关闭连接
+    void CloseInLoop_(int fd, uint64_t seq);    // 主循环线程
+    void OnMail_(const LoopMail& mail);         // 主循环线程：处理其他线程投递的消息
 
     void DealWrite_(HttpConn* client);
     void DealRead_(HttpConn* client);
+    bool TryInline_(HttpConn* client);          // 主循环快速路径，返回false时交给工作线程
+    bool InLoop_() const { return std::this_thread::get_id() == loopThread_; }
     void ExtentTime_(HttpConn* client);
-    void OnRead_(HttpConn* client);
+    int PhaseTimeout_(HttpConn* client) const;  // 连接当前阶段的超时
+    void UpdateTimer_(HttpConn* client);        // 主循环线程：阶段变了才重设定时器
+    void OnRead_(HttpConn* client, bool fresh);     // fresh：读事件到来时连接上没有收了一半的请求
     void OnProcess(HttpConn* client);
     void OnWrite_(HttpConn* client);
+    int TaskClass_(const HttpConn* client) const { return reqClasses_ ? client->GetClass() : 0; }
+    void AsyncVerify_(HttpConn* client);                // 登录/注册交给数据库线程，连接挂起
+    void OnVerifyDone_(HttpConn* client, int ret);      // 主循环线程：恢复挂起的连接
+    void SessionTick_();                                // 周期清理过期会话
     
     static int SetFdNonblock(int fd);
 
 private:
     static const int MAX_FD = 65536;
+    static const int SESSION_TIMER_ID = MAX_FD;     // 定时器id：连接用fd，大于等于MAX_FD的留给内部周期任务
+    static const int ADMISSION_TIMER_ID = MAX_FD + 1;
+    static const int LIMITER_TIMER_ID = MAX_FD + 2;
+    static const int DRAIN_TIMER_ID = MAX_FD + 3;
+    static constexpr int DRAIN_IDLE_MS = 1000;  // 退出时空闲的keep-alive连接再等多久
+    static const char* UPGRADE_ENV;     // 环境变量：热升级时新进程从哪个fd收监听fd
+    static int signalPipe_[2];          // 信号管道，读端注册在epoll里
 
     int port_;          // 端口
-    int timeoutMS_;     // 毫秒MS,定时器的默认过期时间
+    int timeoutMS_;     // 毫秒MS,定时器的默认过期时间，<=0时不设超时
+    int headerMs_;      // 各阶段的超时，见SetTimeouts
+    int bodyMs_;
+    int idleMs_;
+    int writeMs_;
+    int minWriteRate_;  // 发响应的最低速度（字节/秒），0为不按速度算
     bool isClose_;      // 服务启动标志
     int listenFd_;      // 用于监听客户端连接请求，fd是操作系统中的一个资源句柄
+    int adminFd_;       // 管理端口（/metrics）的监听socket，没有时为-1
     bool openLinger_;   // 优雅关闭选项
     char* srcDir_;      // 需要获取的路径
+    bool reqClasses_;   // 读写任务是否按请求分类进不同的队列，见SetRequestClasses
+    int inlineMaxBytes_;    // 主循环快速路径的文件大小上限，0为关闭，见SetInlineFastPath
+    int inlineBudget_;      // 每轮epoll_wait在主循环上处理的请求数上限
+    int inlineLeft_;        // 这一轮还剩多少
+    std::thread::id loopThread_;    // 运行Start的线程
+    bool admission_;        // 是否做过载保护，见SetAdmission
+    int admissionMs_;       // 暂停accept后多久检查一次
+    int admissionTargetUs_; // 过载时，新请求在线程池里排队超过这个时间就回503
+    bool acceptPaused_;
+    std::string busyResponse_;      // 预先生成好的503响应
+    IpLimiter ipLimiter_;           // 按客户端IP限流，只在主循环上用，见SetClientLimits
+    std::string limitResponse_;     // 预先生成好的429响应
+    int drainMs_;           // 退出时最多等多久，见SetGracefulShutdown
+    std::string exePath_;   // 热升级时执行的文件（启动时/proc/self/exe指向的路径）
+    const char* drainReason_;       // 收到退出请求（"SIGTERM"/"upgrade"），这一轮事件处理完后开始退出
+    bool draining_;
+    int upgradeFd_;         // 旧进程：和新进程之间的Unix socket，等它的回复
+    int parentFd_;          // 新进程：和旧进程之间的Unix socket，Start时回复后关闭
+    std::vector<int> inheritedFds_;     // 新进程：旧进程交过来、还没用上的监听fd
     
     uint32_t listenEvent_;  // listenFd_的监听事件设置，InitEventMode_->InitSocket_
     uint32_t connEvent_;    // connFd的监听事件设置，InitEventMode_->DealListen_[AddClient_]->DealRead_或DealWrite_
 
     std::unique_ptr<HeapTimer> timer_;          // 时间堆
     std::unique_ptr<ThreadPool> threadpool_;    // 线程池
+    std::unique_ptr<ThreadPool> dbpool_;        // 数据库线程，阻塞的MySQL调用只在这里执行，不占用工作线程
+    std::unique_ptr<LoopQueue> loopQueue_;      // 其他线程向主循环投递关闭/重设定时器/验证完成（无锁，eventfd唤醒）
     std::unique_ptr<Epoller> epoller_;          // 反应堆
     std::unordered_map<int, HttpConn> users_;   // 连接队列
 };
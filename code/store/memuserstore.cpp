@@ -0,0 +1,44 @@
+#include "memuserstore.h"
+
+#include <thread>
+#include <chrono>
+
+using namespace std;
+
+MemUserStore::Shard& MemUserStore::GetShard_(const string& name) {
+    return shards_[hash<string>()(name) % SHARD_NUM];
+}
+
+int MemUserStore::Query(const string& name, string* pwd) {
+    queries_.fetch_add(1, memory_order_relaxed);
+    int delayMs = delayMs_;
+    if(delayMs > 0) {
+        this_thread::sleep_for(chrono::milliseconds(delayMs));     // 不持有分片锁
+    }
+    Shard& shard = GetShard_(name);
+    lock_guard<mutex> locker(shard.mtx);
+    auto it = shard.users.find(name);
+    if(it == shard.users.end()) {
+        return 0;
+    }
+    *pwd = it->second;
+    return 1;
+}
+
+void MemUserStore::Register(vector<RegRow*>& rows) {
+    for(RegRow* row : rows) {
+        Shard& shard = GetShard_(row->name);
+        lock_guard<mutex> locker(shard.mtx);
+        row->ret = shard.users.emplace(row->name, row->pwd).second ? 1 : 0;
+    }
+}
+
+bool MemUserStore::ForEachName(const function<void(const char*)>& fn) {
+    for(int i = 0; i < SHARD_NUM; i++) {
+        lock_guard<mutex> locker(shards_[i].mtx);
+        for(auto& user : shards_[i].users) {
+            fn(user.first.c_str());
+        }
+    }
+    return true;
+}
@@ -0,0 +1,38 @@
+#ifndef MEM_USER_STORE_H
+#define MEM_USER_STORE_H
+
+#include "userstore.h"
+
+#include <unordered_map>
+#include <mutex>
+#include <atomic>
+
+/*
+    内存后端：按用户名哈希分片，每个分片一把锁（锁分段），不同用户名的读写基本不会互相等待
+    数据只在进程内，退出即丢失；用于压测/剖析时把数据库的开销排除在外
+*/
+class MemUserStore : public UserStore {
+public:
+    const char* Name() const override { return "memory"; }
+    int Query(const std::string& name, std::string* pwd) override;
+    void Register(std::vector<RegRow*>& rows) override;
+    bool ForEachName(const std::function<void(const char*)>& fn) override;
+    // 模拟慢数据库：每次Query先阻塞delayMs毫秒（测试数据库慢时对其他请求的影响），默认0
+    void SetQueryDelay(int delayMs) { delayMs_ = delayMs; }
+    uint64_t GetQueries() const { return queries_; }    // Query被调用的次数
+
+private:
+    struct alignas(64) Shard {     // 对齐到缓存行，相邻分片的锁不会伪共享
+        std::mutex mtx;
+        std::unordered_map<std::string, std::string> users;     // 用户名 -> 密码
+    };
+
+    Shard& GetShard_(const std::string& name);
+
+    static const int SHARD_NUM = 64;
+    Shard shards_[SHARD_NUM];
+    std::atomic<int> delayMs_{0};
+    std::atomic<uint64_t> queries_{0};
+};
+
+#endif // MEM_USER_STORE_H
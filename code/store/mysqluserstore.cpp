@@ -0,0 +1,246 @@
+#include "mysqluserstore.h"
+
+#include <cstring>
+#include <cstdlib>      // strtoul
+#include <algorithm>
+
+using namespace std;
+
+int MysqlUserStore::Query(const string& name, string* pwd) {
+    // 获取数据库连接（通过 RAII 自动管理资源，注意要有变量名，否则临时对象立刻就把连接还回去了）
+    MYSQL* sql;
+    SqlConnRAII sqlRAII(&sql, SqlConnPool::Instance());
+    if(!sql) { return -1; }     // 连接池等待超时或数据库连不上
+    return QueryUser_(sql, name, pwd);
+}
+
+/*
+    启动时确认username上有单列的唯一索引，没有就建一个
+    表里已经有重复的用户名（建表时没有唯一索引）时建不了：照常服务，但退回先查重再插入，
+    同名（按排序规则）的注册同时到达时仍可能都插入，需要清理掉重复的行后重启，见readme
+*/
+void MysqlUserStore::Open() {
+    MYSQL* sql;
+    SqlConnRAII sqlRAII(&sql, SqlConnPool::Instance());
+    if(!sql) {
+        LOG_ERROR("MySql: no connection, can not check unique index on user.username");
+        return;
+    }
+    const char* check = "SELECT 1 FROM information_schema.STATISTICS "
+                        "WHERE TABLE_SCHEMA = DATABASE() AND TABLE_NAME = 'user' AND NON_UNIQUE = 0 "
+                        "GROUP BY INDEX_NAME "
+                        "HAVING COUNT(*) = 1 AND MAX(COLUMN_NAME) = 'username' AND MAX(SUB_PART) IS NULL";
+    if(mysql_query(sql, check) == 0) {
+        MYSQL_RES* res = mysql_store_result(sql);
+        if(res) {
+            uniqueIndex_ = mysql_num_rows(res) > 0;
+            mysql_free_result(res);
+        }
+    }
+    if(!uniqueIndex_) {
+        if(mysql_query(sql, "ALTER TABLE user ADD UNIQUE INDEX uk_username(username)") == 0) {
+            uniqueIndex_ = true;
+            LOG_INFO("MySql: created unique index uk_username on user.username");
+        } else {
+            LOG_ERROR("MySql: add unique index on user.username error(%u): %s, "
+                      "duplicate registrations are only checked before insert",
+                      mysql_errno(sql), mysql_error(sql));
+        }
+    }
+}
+
+/*
+    一个事务里多行 INSERT IGNORE，整批只有一次提交，重复的用户名由唯一索引判定（包括同一批里按排序规则同名的）
+    连接断了重连后整批重试一次
+*/
+void MysqlUserStore::Register(vector<RegRow*>& rows) {
+    MYSQL* sql;
+    SqlConnRAII sqlRAII(&sql, SqlConnPool::Instance());
+    for(int retry = 0; sql && retry < 2; retry++) {
+        for(RegRow* row : rows) { row->ret = -1; }
+        if(Insert_(sql, rows)) { return; }
+        for(RegRow* row : rows) { row->ret = -1; }
+
+        unsigned int err = mysql_errno(sql);
+        if(SqlConnPool::IsConnLost(err)) {
+            if(retry == 0 && SqlConnPool::Instance()->Reconnect(sql)) { continue; }
+            LOG_ERROR("MySql batch register error(%u): %s", err, mysql_error(sql));
+            return;
+        }
+        LOG_ERROR("MySql batch register error(%u): %s", err, mysql_error(sql));
+        mysql_query(sql, "ROLLBACK");   // 连接还要还回池里，不能留着没结束的事务
+        return;
+    }
+}
+
+/*
+    全部插入了（影响行数等于行数）就提交；有行被忽略时分不出是哪几行，回滚后逐行 INSERT IGNORE，
+    按每一行的影响行数确定结果，再一起提交
+*/
+bool MysqlUserStore::Insert_(MYSQL* sql, vector<RegRow*>& rows) {
+    for(RegRow* row : rows) {
+        if(CharLen_(row->name) > FIELD_LEN || CharLen_(row->pwd) > FIELD_LEN) {
+            row->ret = 0;   // INSERT IGNORE会把超长的值截断后插入，截断后的用户名不能算注册成功
+        }
+    }
+    if(!uniqueIndex_ && SelectExist_(sql, rows) < 0) { return false; }
+
+    vector<RegRow*> inserts;
+    for(RegRow* row : rows) {
+        if(row->ret != 0) { inserts.push_back(row); }
+    }
+    if(inserts.empty()) { return true; }
+    if(mysql_query(sql, "START TRANSACTION")) { return false; }
+    int n = InsertRows_(sql, inserts);
+    if(n < 0) { return false; }
+    if(n == static_cast<int>(inserts.size())) {
+        for(RegRow* row : inserts) { row->ret = 1; }
+    } else {
+        if(mysql_query(sql, "ROLLBACK") || mysql_query(sql, "START TRANSACTION")) { return false; }
+        for(RegRow* row : inserts) {
+            row->ret = InsertUser_(sql, row->name, row->pwd);
+            if(row->ret < 0) { return false; }
+            if(row->ret == 0) { LOG_INFO("user used!"); }
+        }
+    }
+    return mysql_query(sql, "COMMIT") == 0;
+}
+
+bool MysqlUserStore::ForEachName(const function<void(const char*)>& fn) {
+    MYSQL* sql;
+    SqlConnRAII sqlRAII(&sql, SqlConnPool::Instance());
+    if(!sql || mysql_query(sql, "SELECT username FROM user")) {
+        return false;
+    }
+    MYSQL_RES* res = mysql_use_result(sql);     // 逐行取，不把整张表读进内存
+    if(!res) { return false; }
+    while(MYSQL_ROW row = mysql_fetch_row(res)) {
+        if(row[0]) { fn(row[0]); }
+    }
+    bool ok = mysql_errno(sql) == 0;
+    mysql_free_result(res);
+    return ok;
+}
+
+// 绑定一个字符串参数/结果
+static void BindString(MYSQL_BIND& bind, char* buf, unsigned long bufLen, unsigned long* len, bool* isNull) {
+    memset(&bind, 0, sizeof(bind));
+    bind.buffer_type = MYSQL_TYPE_STRING;
+    bind.buffer = buf;
+    bind.buffer_length = bufLen;
+    bind.length = len;
+    bind.is_null = isNull;
+}
+
+// 查询用户名对应的密码：1 找到，0 没有这个用户，-1 出错
+int MysqlUserStore::QueryUser_(MYSQL* sql, const string& name, string* pwd) {
+    SqlConnPool* pool = SqlConnPool::Instance();
+    for(int retry = 0; retry < 2; retry++) {
+        MYSQL_STMT* stmt = pool->GetStmt(sql, STMT_USER_QUERY);
+        if(!stmt) { return -1; }
+
+        MYSQL_BIND param;
+        unsigned long nameLen = name.size();
+        BindString(param, const_cast<char*>(name.data()), nameLen, &nameLen, nullptr);
+
+        char buf[64];   // password char(50)
+        unsigned long len = 0;
+        bool isNull = false;
+        MYSQL_BIND result;
+        BindString(result, buf, sizeof(buf), &len, &isNull);
+
+        if(mysql_stmt_bind_param(stmt, &param) || mysql_stmt_execute(stmt)) {
+            unsigned int err = mysql_stmt_errno(stmt);
+            if(retry == 0 && SqlConnPool::IsConnLost(err) && pool->Reconnect(sql)) {
+                continue;   // 断线重连后语句会重新prepare，再试一次
+            }
+            LOG_ERROR("MySql query error(%u): %s", err, mysql_stmt_error(stmt));
+            return -1;
+        }
+        if(mysql_stmt_bind_result(stmt, &result) || mysql_stmt_store_result(stmt)) {
+            LOG_ERROR("MySql fetch error: %s", mysql_stmt_error(stmt));
+            mysql_stmt_free_result(stmt);
+            return -1;
+        }
+
+        int found = 0;
+        int ret = mysql_stmt_fetch(stmt);
+        if(ret == 0 || ret == MYSQL_DATA_TRUNCATED) {
+            found = 1;
+            if(!isNull) { pwd->assign(buf, std::min<unsigned long>(len, sizeof(buf))); }
+            LOG_DEBUG("MYSQL ROW: %s %s", name.c_str(), pwd->c_str());
+        }
+        mysql_stmt_free_result(stmt);
+        return found;
+    }
+    return -1;
+}
+
+// 插入新用户（INSERT IGNORE）：1 插入了，0 用户名已存在，-1 出错
+int MysqlUserStore::InsertUser_(MYSQL* sql, const string& name, const string& pwd) {
+    MYSQL_STMT* stmt = SqlConnPool::Instance()->GetStmt(sql, STMT_USER_INSERT);
+    if(!stmt) { return -1; }
+
+    MYSQL_BIND params[2];
+    unsigned long nameLen = name.size(), pwdLen = pwd.size();
+    BindString(params[0], const_cast<char*>(name.data()), nameLen, &nameLen, nullptr);
+    BindString(params[1], const_cast<char*>(pwd.data()), pwdLen, &pwdLen, nullptr);
+
+    if(mysql_stmt_bind_param(stmt, params) || mysql_stmt_execute(stmt)) {
+        LOG_ERROR("MySql insert error(%u): %s", mysql_stmt_errno(stmt), mysql_stmt_error(stmt));
+        return -1;
+    }
+    return mysql_stmt_affected_rows(stmt) == 1 ? 1 : 0;
+}
+
+/*
+    没有唯一索引时才用：每个用户名一个带LIMIT 1的子查询，用UNION ALL拼成一条语句，返回的是已存在的那些行的下标
+    比较用的是数据库的排序规则（大小写、尾部空格），和单条查询 STMT_USER_QUERY 的判断一致
+*/
+int MysqlUserStore::SelectExist_(MYSQL* sql, vector<RegRow*>& rows) {
+    string order;
+    for(size_t i = 0; i < rows.size(); i++) {
+        if(!rows[i]->check) { continue; }
+        if(!order.empty()) { order += " UNION ALL "; }
+        order += "(SELECT " + to_string(i) + " FROM user WHERE username = " + Quote_(sql, rows[i]->name) + " LIMIT 1)";
+    }
+    if(order.empty()) { return 0; }
+    if(mysql_real_query(sql, order.data(), order.size())) { return -1; }
+    MYSQL_RES* res = mysql_store_result(sql);
+    if(!res) { return -1; }
+    while(MYSQL_ROW row = mysql_fetch_row(res)) {
+        size_t i = row[0] ? strtoul(row[0], nullptr, 10) : rows.size();
+        if(i < rows.size()) {
+            rows[i]->ret = 0;
+            LOG_INFO("user used!");
+        }
+    }
+    mysql_free_result(res);
+    return 0;
+}
+
+int MysqlUserStore::InsertRows_(MYSQL* sql, vector<RegRow*>& rows) {
+    string order = "INSERT IGNORE INTO user(username, password) VALUES ";
+    for(size_t i = 0; i < rows.size(); i++) {
+        if(i > 0) { order += ","; }
+        order += "(" + Quote_(sql, rows[i]->name) + "," + Quote_(sql, rows[i]->pwd) + ")";
+    }
+    if(mysql_real_query(sql, order.data(), order.size())) { return -1; }
+    return static_cast<int>(mysql_affected_rows(sql));
+}
+
+// 行数不固定，用不了预编译语句，按连接的字符集转义后拼接
+string MysqlUserStore::Quote_(MYSQL* sql, const string& str) {
+    string buf(str.size() * 2 + 1, '\0');
+    unsigned long len = mysql_real_escape_string(sql, &buf[0], str.data(), str.size());
+    buf.resize(len);
+    return "'" + buf + "'";
+}
+
+size_t MysqlUserStore::CharLen_(const string& str) {
+    size_t len = 0;
+    for(unsigned char c : str) {
+        if((c & 0xC0) != 0x80) { len++; }  // 不是UTF-8的后续字节
+    }
+    return len;
+}
@@ -0,0 +1,36 @@
+#ifndef MYSQL_USER_STORE_H
+#define MYSQL_USER_STORE_H
+
+#include "userstore.h"
+#include "../pool/sqlconnpool.h"
+
+/*
+    MySQL/MariaDB 后端：连接取自 SqlConnPool，单条查询/插入用连接上缓存的预编译语句
+    用户名的唯一性由 username 上的唯一索引保证（按列的排序规则比较，忽略大小写和尾部空格），
+    注册用 INSERT IGNORE，哪一行真正插入了看影响行数；同一批里、多个进程（热升级）之间的重复也由数据库判定
+*/
+class MysqlUserStore : public UserStore {
+public:
+    void Open();    // 检查/创建username上的唯一索引，需要先初始化连接池
+
+    const char* Name() const override { return "mysql"; }
+    int Query(const std::string& name, std::string* pwd) override;
+    void Register(std::vector<RegRow*>& rows) override;
+    bool ForEachName(const std::function<void(const char*)>& fn) override;
+    bool UniqueNames() const override { return uniqueIndex_; }
+
+private:
+    static const int FIELD_LEN = 50;    // username/password 都是char(50)
+
+    bool Insert_(MYSQL* sql, std::vector<RegRow*>& rows);   // 一个事务插入一批，结果写入ret，出错返回false
+    static int QueryUser_(MYSQL* sql, const std::string& name, std::string* pwd);           // 预编译语句查询密码
+    static int InsertUser_(MYSQL* sql, const std::string& name, const std::string& pwd);    // 预编译语句插入：1 插入，0 重复，-1 出错
+    static int SelectExist_(MYSQL* sql, std::vector<RegRow*>& rows);    // 已存在的用户名ret置0，失败返回-1
+    static int InsertRows_(MYSQL* sql, std::vector<RegRow*>& rows);     // 多行INSERT IGNORE，返回影响行数，失败返回-1
+    static std::string Quote_(MYSQL* sql, const std::string& str);      // 转义并加引号
+    static size_t CharLen_(const std::string& str);                     // UTF-8字符数
+
+    bool uniqueIndex_ = false;  // username上有唯一索引；没有时（表里已有重复的用户名）退回先查重再插入
+};
+
+#endif // MYSQL_USER_STORE_H
@@ -0,0 +1,157 @@
+#include "sqliteuserstore.h"
+#include "../log/log.h"
+
+using namespace std;
+
+SqliteUserStore::~SqliteUserStore() {
+    for(Reader* reader : readers_) {
+        sqlite3_finalize(reader->query);
+        sqlite3_close(reader->db);
+        delete reader;
+    }
+    if(insert_) { sqlite3_finalize(insert_); }
+    if(writer_) { sqlite3_close(writer_); }
+}
+
+bool SqliteUserStore::Open(const string& path) {
+    path_ = path;
+    writer_ = OpenConn_();
+    if(!writer_) {
+        return false;
+    }
+    // synchronous=FULL：提交返回时WAL已经fsync，回调里再发响应是安全的
+    if(!Exec_("PRAGMA journal_mode=WAL") || !Exec_("PRAGMA synchronous=FULL") ||
+       !Exec_("CREATE TABLE IF NOT EXISTS user("
+              "username TEXT PRIMARY KEY NOT NULL, password TEXT NOT NULL)")) {
+        return false;
+    }
+    if(sqlite3_prepare_v2(writer_, "INSERT OR IGNORE INTO user(username, password) VALUES(?, ?)",
+                          -1, &insert_, nullptr) != SQLITE_OK) {
+        LOG_ERROR("SQLite prepare error: %s", sqlite3_errmsg(writer_));
+        return false;
+    }
+    return true;
+}
+
+sqlite3* SqliteUserStore::OpenConn_() {
+    sqlite3* db = nullptr;
+    // 每个连接同一时间只属于一个线程，用 NOMUTEX 省掉SQLite内部的锁
+    int flags = SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX;
+    if(sqlite3_open_v2(path_.c_str(), &db, flags, nullptr) != SQLITE_OK) {
+        LOG_ERROR("SQLite open %s error: %s", path_.c_str(), db ? sqlite3_errmsg(db) : "");
+        sqlite3_close(db);
+        return nullptr;
+    }
+    sqlite3_busy_timeout(db, 3000);
+    return db;
+}
+
+bool SqliteUserStore::Exec_(const char* sql) {
+    char* err = nullptr;
+    if(sqlite3_exec(writer_, sql, nullptr, nullptr, &err) != SQLITE_OK) {
+        LOG_ERROR("SQLite exec [%s] error: %s", sql, err ? err : "");
+        sqlite3_free(err);
+        return false;
+    }
+    return true;
+}
+
+SqliteUserStore::Reader* SqliteUserStore::GetReader_() {
+    {
+        lock_guard<mutex> locker(readMtx_);
+        if(!readers_.empty()) {
+            Reader* reader = readers_.back();
+            readers_.pop_back();
+            return reader;
+        }
+    }
+    sqlite3* db = OpenConn_();
+    if(!db) {
+        return nullptr;
+    }
+    sqlite3_stmt* query = nullptr;
+    if(sqlite3_prepare_v2(db, "SELECT password FROM user WHERE username = ? LIMIT 1",
+                          -1, &query, nullptr) != SQLITE_OK) {
+        LOG_ERROR("SQLite prepare error: %s", sqlite3_errmsg(db));
+        sqlite3_close(db);
+        return nullptr;
+    }
+    return new Reader{db, query};
+}
+
+void SqliteUserStore::FreeReader_(Reader* reader) {
+    lock_guard<mutex> locker(readMtx_);
+    readers_.push_back(reader);
+}
+
+int SqliteUserStore::Query(const string& name, string* pwd) {
+    Reader* reader = GetReader_();
+    if(!reader) {
+        return -1;
+    }
+    sqlite3_stmt* stmt = reader->query;
+    sqlite3_bind_text(stmt, 1, name.data(), static_cast<int>(name.size()), SQLITE_STATIC);
+    int found = -1;
+    int rc = sqlite3_step(stmt);
+    if(rc == SQLITE_ROW) {
+        const char* text = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+        pwd->assign(text ? text : "", sqlite3_column_bytes(stmt, 0));
+        found = 1;
+    } else if(rc == SQLITE_DONE) {
+        found = 0;
+    } else {
+        LOG_ERROR("SQLite query error: %s", sqlite3_errmsg(reader->db));
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    FreeReader_(reader);
+    return found;
+}
+
+// 一批注册在一个事务里，只有一次提交（一次fsync）
+void SqliteUserStore::Register(vector<RegRow*>& rows) {
+    for(RegRow* row : rows) { row->ret = -1; }
+    lock_guard<mutex> locker(writeMtx_);
+    if(!Exec_("BEGIN IMMEDIATE")) {
+        return;
+    }
+    bool ok = true;
+    for(RegRow* row : rows) {
+        sqlite3_bind_text(insert_, 1, row->name.data(), static_cast<int>(row->name.size()), SQLITE_STATIC);
+        sqlite3_bind_text(insert_, 2, row->pwd.data(), static_cast<int>(row->pwd.size()), SQLITE_STATIC);
+        if(sqlite3_step(insert_) == SQLITE_DONE) {
+            row->ret = sqlite3_changes(writer_) == 1 ? 1 : 0;
+            if(row->ret == 0) { LOG_INFO("user used!"); }
+        } else {
+            LOG_ERROR("SQLite insert error: %s", sqlite3_errmsg(writer_));
+            ok = false;
+        }
+        sqlite3_reset(insert_);
+        sqlite3_clear_bindings(insert_);
+        if(!ok) { break; }
+    }
+    if(!ok || !Exec_("COMMIT")) {
+        Exec_("ROLLBACK");
+        for(RegRow* row : rows) { row->ret = -1; }
+    }
+}
+
+bool SqliteUserStore::ForEachName(const function<void(const char*)>& fn) {
+    Reader* reader = GetReader_();
+    if(!reader) {
+        return false;
+    }
+    sqlite3_stmt* stmt = nullptr;
+    bool ok = false;
+    if(sqlite3_prepare_v2(reader->db, "SELECT username FROM user", -1, &stmt, nullptr) == SQLITE_OK) {
+        int rc;
+        while((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            const char* name = reinterpret_cast<const char*>(sqlite3_column_text(stmt, 0));
+            if(name) { fn(name); }
+        }
+        ok = rc == SQLITE_DONE;
+    }
+    sqlite3_finalize(stmt);
+    FreeReader_(reader);
+    return ok;
+}
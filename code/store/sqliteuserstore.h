@@ -0,0 +1,46 @@
+#ifndef SQLITE_USER_STORE_H
+#define SQLITE_USER_STORE_H
+
+#include "userstore.h"
+
+#include <sqlite3.h>
+#include <mutex>
+
+/*
+    SQLite 后端（单文件，WAL 模式）
+        写：只有一个写连接（SQLite 同一时刻只允许一个写事务），一批注册在一个事务里提交
+        读：WAL 下读不阻塞写，读连接按需打开、用完放回，每个连接缓存自己的查询语句
+    username 是主键，INSERT OR IGNORE 被忽略说明用户名已被使用，不需要单独查重
+*/
+class SqliteUserStore : public UserStore {
+public:
+    ~SqliteUserStore();
+    bool Open(const std::string& path);
+
+    const char* Name() const override { return "sqlite"; }
+    int Query(const std::string& name, std::string* pwd) override;
+    void Register(std::vector<RegRow*>& rows) override;
+    bool ForEachName(const std::function<void(const char*)>& fn) override;
+
+private:
+    struct Reader {
+        sqlite3* db;
+        sqlite3_stmt* query;
+    };
+
+    sqlite3* OpenConn_();
+    Reader* GetReader_();
+    void FreeReader_(Reader* reader);
+    bool Exec_(const char* sql);    // 在写连接上执行
+
+    std::string path_;
+
+    std::mutex writeMtx_;
+    sqlite3* writer_ = nullptr;
+    sqlite3_stmt* insert_ = nullptr;    // 写连接上缓存的插入语句
+
+    std::mutex readMtx_;
+    std::vector<Reader*> readers_;      // 空闲的读连接
+};
+
+#endif // SQLITE_USER_STORE_H
@@ -0,0 +1,44 @@
+#include "userstore.h"
+#include "mysqluserstore.h"
+#include "sqliteuserstore.h"
+#include "memuserstore.h"
+#include "../log/log.h"
+
+std::unique_ptr<UserStore> UserStore::store_;
+
+bool UserStore::Init(Type type, const char* path) {
+    switch(type) {
+    case MYSQL_STORE: {
+        MysqlUserStore* store = new MysqlUserStore();
+        store_.reset(store);
+        store->Open();
+        break;
+    }
+    case SQLITE_STORE: {
+        SqliteUserStore* store = new SqliteUserStore();
+        store_.reset(store);
+        if(!store->Open(path ? path : "./webserver.db")) {
+            LOG_ERROR("UserStore: open sqlite %s failed!", path ? path : "./webserver.db");
+            return false;
+        }
+        break;
+    }
+    case MEMORY_STORE:
+        store_.reset(new MemUserStore());
+        break;
+    default:
+        assert(false);
+        return false;
+    }
+    LOG_INFO("UserStore: %s", store_->Name());
+    return true;
+}
+
+UserStore* UserStore::Instance() {
+    assert(store_);
+    return store_.get();
+}
+
+void UserStore::Close() {
+    store_.reset();
+}
@@ -0,0 +1,52 @@
+#ifndef USER_STORE_H
+#define USER_STORE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+
+// 一个待注册的用户
+struct RegRow {
+    std::string name, pwd;
+    bool check;     // 是否需要查重（负缓存/布隆过滤器确定不存在时为false）
+    int ret;        // 结果：1 注册成功，0 用户名已被使用，-1 存储不可用
+};
+
+/*
+    用户存储后端，启动时选定一种（UserStore::Init），之后通过 UserStore::Instance() 使用
+        MYSQL_STORE     MySQL/MariaDB（SqlConnPool），需要先初始化连接池
+        SQLITE_STORE    嵌入式SQLite单文件，小规模部署不需要单独的数据库进程
+        MEMORY_STORE    分片加锁的内存表，进程退出即丢失，用来单独压测/剖析服务器自身的开销
+    凭据缓存、登录合并（SingleFlight）、注册写合并（RegBatcher）都在它上面，和具体后端无关
+    实现必须是线程安全的
+*/
+class UserStore {
+public:
+    enum Type {
+        MYSQL_STORE = 0,
+        SQLITE_STORE,
+        MEMORY_STORE,
+    };
+
+    static bool Init(Type type, const char* path = nullptr);   // path：SQLITE_STORE的数据库文件
+    static UserStore* Instance();
+    static void Close();
+
+    virtual ~UserStore() = default;
+    virtual const char* Name() const = 0;
+    // 查询用户名对应的密码：1 找到，0 没有这个用户，-1 出错
+    virtual int Query(const std::string& name, std::string* pwd) = 0;
+    // 批量注册，尽量一次提交；每一行的结果写入row->ret，返回时已经提交（持久化）
+    virtual void Register(std::vector<RegRow*>& rows) = 0;
+    // 遍历全部用户名（启动时装载布隆过滤器），中途出错返回false
+    virtual bool ForEachName(const std::function<void(const char*)>& fn) = 0;
+    // 存储自己保证用户名唯一（唯一约束，按它自己比较用户名的规则），Register时重复的会被忽略
+    // 为false时注册必须查重，不能用按字节比较的布隆过滤器/负缓存跳过（比较规则不一样，如MySQL不区分大小写）
+    virtual bool UniqueNames() const { return true; }
+
+private:
+    static std::unique_ptr<UserStore> store_;
+};
+
+#endif // USER_STORE_H
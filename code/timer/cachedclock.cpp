@@ -0,0 +1,77 @@
+#include "cachedclock.h"
+
+#include <cstdio>
+#include <cstring>
+
+using namespace std;
+
+std::atomic<int64_t> CachedClock::monoNs_{0};
+
+static int64_t ReadNs(clockid_t id, struct timespec* ts) {
+    clock_gettime(id, ts);
+    return static_cast<int64_t>(ts->tv_sec) * 1000000000 + ts->tv_nsec;
+}
+
+void CachedClock::Update() {
+    struct timespec ts;
+    monoNs_.store(ReadNs(CLOCK_MONOTONIC_COARSE, &ts), memory_order_relaxed);
+}
+
+CachedClock::TimePoint CachedClock::Now() {
+    int64_t ns = monoNs_.load(memory_order_relaxed);
+    if(ns == 0) {
+        struct timespec ts;
+        ns = ReadNs(CLOCK_MONOTONIC_COARSE, &ts);
+    }
+    // steady_clock 就是 CLOCK_MONOTONIC，COARSE 版本和它同一个起点
+    return TimePoint(chrono::nanoseconds(ns));
+}
+
+int CachedClock::LogTime(char* buf) {
+    thread_local time_t cachedSec = -1;
+    thread_local char prefix[64];   // "2026-10-19 02:42:00"
+
+    // 不用COARSE：它一个节拍才走一次，微秒位只会是节拍的整数倍，同一节拍内的日志时间都一样
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if(ts.tv_sec != cachedSec) {
+        struct tm t;
+        localtime_r(&ts.tv_sec, &t);
+        snprintf(prefix, sizeof(prefix), "%d-%02d-%02d %02d:%02d:%02d",
+                 t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec);
+        cachedSec = ts.tv_sec;
+    }
+    memcpy(buf, prefix, 19);
+    buf[19] = '.';
+    long usec = ts.tv_nsec / 1000;
+    for(int i = 25; i >= 20; i--) {    // 手写6位微秒，比snprintf快
+        buf[i] = static_cast<char>('0' + usec % 10);
+        usec /= 10;
+    }
+    buf[26] = ' ';
+    buf[27] = '\0';
+    return LOG_TIME_LEN;
+}
+
+const string& CachedClock::HttpDate() {
+    static const char* DAYS[] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
+    static const char* MONTHS[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun",
+                                   "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+    thread_local time_t cachedSec = -1;
+    thread_local string header;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    if(ts.tv_sec != cachedSec) {
+        struct tm t;
+        gmtime_r(&ts.tv_sec, &t);
+        char buf[64];
+        // 星期、月份自己查表，不受locale影响
+        snprintf(buf, sizeof(buf), "Date: %s, %02d %s %d %02d:%02d:%02d GMT\r\n",
+                 DAYS[t.tm_wday], t.tm_mday, MONTHS[t.tm_mon], t.tm_year + 1900,
+                 t.tm_hour, t.tm_min, t.tm_sec);
+        header = buf;
+        cachedSec = ts.tv_sec;
+    }
+    return header;
+}
@@ -0,0 +1,35 @@
+#ifndef CACHED_CLOCK_H
+#define CACHED_CLOCK_H
+
+#include <chrono>
+#include <atomic>
+#include <string>
+#include <ctime>
+#include <cstdint>
+
+/*
+    时间服务（定时器、日志、响应头共用）
+        单调时间：主循环每轮 epoll_wait 返回后 Update 一次（CLOCK_MONOTONIC_COARSE），定时器在这一轮里都用这个缓存值
+        墙上时间：各线程自己缓存"这一秒"格式化好的字符串，每个线程每秒最多格式化一次，
+                 不再每条日志都调用 localtime（glibc 内部要加锁）
+    COARSE 时钟的精度是一个时钟节拍（通常1~4ms），对超时判断和Date头足够；
+    日志时间戳要打到微秒，读精确的 CLOCK_REALTIME（同样走vDSO，不进内核），缓存只省掉格式化
+*/
+class CachedClock {
+public:
+    using TimePoint = std::chrono::steady_clock::time_point;
+
+    static void Update();       // 主循环每轮调用
+    static TimePoint Now();     // 本轮缓存的单调时间（还没有Update过时直接读时钟）
+
+    // 日志时间戳："2026-10-19 02:42:00.123456 "，写入buf（至少LOG_TIME_LEN+1字节），返回长度
+    static const int LOG_TIME_LEN = 27;
+    static int LogTime(char* buf);
+    // 响应头："Date: Sun, 19 Oct 2026 02:42:00 GMT\r\n"（RFC 7231 IMF-fixdate）
+    static const std::string& HttpDate();
+
+private:
+    static std::atomic<int64_t> monoNs_;
+};
+
+#endif // CACHED_CLOCK_H
@@ -1,4 +1,22 @@
 #include "heaptimer.h"
+#include "../metrics/probes.h"
+
+HeapTimer::HeapTimer() {
+    heap_.reserve(64);  // 保留（扩充）容量
+    timerFd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    assert(timerFd_ >= 0);
+}
+
+HeapTimer::~HeapTimer() {
+    clear();
+    close(timerFd_);
+}
+
+TimeStamp HeapTimer::Deadline_(int timeOut) {
+    auto t = std::chrono::duration_cast<MS>((CachedClock::Now() + MS(timeOut)).time_since_epoch()).count();
+    t = (t + SLACK_MS - 1) / SLACK_MS * SLACK_MS;
+    return TimeStamp(MS(t));
+}
 
 // 向时间堆中添加一个定时器
 // 如果该 id 已存在，则更新其到期时间（调大/调小）与回调函数；否则新建一个定时器加入小根堆。
@@ -7,7 +25,7 @@ void HeapTimer::add(int id, int timeOut, const TimeoutCallBack& cb) {
     // 如果有，则调整
     if(ref_.count(id)) {
         int tmp = ref_[id];
-        heap_[tmp].expires = Clock::now() + MS(timeOut);
+        heap_[tmp].expires = Deadline_(timeOut);
         heap_[tmp].cb = cb;
         if(!siftdown_(tmp, heap_.size())) {
             siftup_(tmp);
@@ -17,7 +35,7 @@ void HeapTimer::add(int id, int timeOut, const TimeoutCallBack& cb) {
         size_t n = heap_.size();
         ref_[id] = n;
 
-        heap_.push_back({id, Clock::now() + MS(timeOut), cb});
+        heap_.push_back({id, Deadline_(timeOut), cb});
         // 结构体 TimerNode 的列表初始化
         // 等价于
         // TimerNode node(id, expires, cb);  // 构造
@@ -27,6 +45,7 @@ void HeapTimer::add(int id, int timeOut, const TimeoutCallBack& cb) {
         // heap_.emplace_back(id, Clock::now() + MS(timeOut), cb);
         siftup_(n);
     }
+    Rearm_();
 }
 
 // 用于插入时维护小根堆结构
@@ -60,6 +79,8 @@ bool HeapTimer::siftdown_(size_t i, size_t n) {
             SwapNode_(index, child);
             index = child;
             child = 2*child+1;
+        } else {
+            break;  // 已经满足小根堆，不能再下沉（否则死循环）
         }
     }
     return index > i; // 是否发生了下沉
@@ -92,11 +113,24 @@ void HeapTimer::del_(size_t index) {
 }
 
 
-// 调整指定id的结点（只设计了调大），需要调小需要add
+// 调整指定id的结点的到期时间（调大调小都可以，回调不变）
 void HeapTimer::adjust(int id, int newExpires) {
     assert(!heap_.empty() && ref_.count(id));
-    heap_[ref_[id]].expires = Clock::now() + MS(newExpires);
-    siftdown_(ref_[id], heap_.size());
+    TimeStamp expires = Deadline_(newExpires);
+    size_t i = ref_[id];
+    if(heap_[i].expires == expires) {
+        return;     // 同一个时间桶里，不用动
+    }
+    bool earlier = expires < heap_[i].expires;
+    heap_[i].expires = expires;
+    if(earlier) {
+        // 连接换到期限更短的阶段（如keep-alive空闲后开始收请求头），可能成为新的堆顶
+        siftup_(i);
+        Rearm_();
+    } else {
+        siftdown_(i, heap_.size());
+        // 往后调时堆顶只会变晚，timerfd不用重设（早到了就空跑一次再按新的堆顶设置）
+    }
 }
 
 // 删除指定id，并触发回调函数
@@ -106,23 +140,64 @@ void HeapTimer::doWork(int id) {
     }
     size_t i = ref_[id];
     auto node = heap_[i];
-    node.cb();  // 触发回调函数
     del_(i);
+    node.cb();  // 触发回调函数（先删除，回调里可以安全地操作定时器）
+}
+
+void HeapTimer::cancel(int id) {
+    if(ref_.count(id)) {
+        del_(ref_[id]);
+    }
 }
 
 void HeapTimer::tick() {
     /* 清除超时结点 */
-    if(heap_.empty()) {
-        return;
-    }
+    Expire_(CachedClock::Now());
+}
+
+void HeapTimer::Expire_(TimeStamp now) {
     while(!heap_.empty()) {
         TimerNode node = heap_.front();
-        if(std::chrono::duration_cast<MS>(node.expires - Clock::now()).count() > 0) { 
+        if(node.expires > now) { 
             break; 
         }
-        node.cb();
+        WS_PROBE(timer__expire, node.id, std::chrono::duration_cast<std::chrono::microseconds>(now - node.expires).count());
+        // 先出堆再回调：回调里可能重新add（周期定时器），堆顶已经不是这个结点了
         pop();
+        node.cb();
+    }
+}
+
+void HeapTimer::OnTick() {
+    uint64_t exp = 0;
+    ssize_t n = read(timerFd_, &exp, sizeof(exp));  // 读掉到期次数，否则timerfd一直可读
+    (void)n;
+    // COARSE 时钟可能比timerfd慢一个节拍：timerfd已经响了，说明至少到了设置的时间，
+    // 否则堆顶看起来还没到期，又按同一个时间设置，timerfd会连续空响到缓存时间追上为止
+    TimeStamp now = std::max(CachedClock::Now(), armed_);
+    armed_ = TimeStamp();
+    Expire_(now);
+    Rearm_();
+}
+
+void HeapTimer::Rearm_() {
+    if(heap_.empty()) {
+        return;     // 没有定时器了，已经设置的到点空跑一次即可，不专门取消
+    }
+    TimeStamp next = heap_.front().expires;
+    if(armed_ != TimeStamp() && armed_ <= next) {
+        return;
+    }
+    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(next.time_since_epoch()).count();
+    struct itimerspec its = {};
+    its.it_value.tv_sec = ns / 1000000000;
+    its.it_value.tv_nsec = ns % 1000000000;
+    if(its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0) {
+        its.it_value.tv_nsec = 1;   // 全0表示取消
     }
+    timerfd_settime(timerFd_, TFD_TIMER_ABSTIME, &its, nullptr);
+    armed_ = next;
+    armCount_++;
 }
 
 void HeapTimer::pop() {
@@ -9,12 +9,15 @@
 #include <functional>   // function
 #include <assert.h> 
 #include <chrono>
+#include <sys/timerfd.h>    // timerfd_create
+#include <unistd.h>
 #include "../log/log.h"
+#include "cachedclock.h"
 
 
-using Clock = std::chrono::high_resolution_clock;
+using Clock = std::chrono::steady_clock;    // 和timerfd的CLOCK_MONOTONIC是同一个时钟
 using MS = std::chrono::milliseconds;
-using TimeStamp = Clock::time_point; // Clock::time_point 是 high_resolution_clock 的“时间点”类型
+using TimeStamp = Clock::time_point; // Clock::time_point 是 steady_clock 的“时间点”类型
 using TimeoutCallBack = std::function<void()>;
 
 // 定时器节点结构
@@ -29,30 +32,48 @@ struct TimerNode {
         return expires > t.expires;
     }
 };
-// 小根堆定时器管理类
+/*
+    小根堆定时器管理类（只在主循环线程使用）
+    当前时间取 CachedClock 里主循环本轮缓存的值，一轮里的 add/adjust 不再各自读时钟
+    到期由timerfd通知：timerfd注册在epoller中，只按堆顶（最早的到期时间）设置，可读时调用OnTick批量处理
+    到期时间向上取整到SLACK_MS的整数倍，相近的到期合并到同一次唤醒
+*/
 class HeapTimer {
 public:
-    HeapTimer() { heap_.reserve(64); }  // 保留（扩充）容量
-    ~HeapTimer() { clear(); }
+    static const int SLACK_MS = 10;
+
+    HeapTimer();
+    ~HeapTimer();
     void clear();
     // 接口
     void add(int id, int timeOut, const TimeoutCallBack& cb);
-    void adjust(int id, int newExpires); // 调整指定id的结点（只设计了调大），需要调小需要add
+    void adjust(int id, int newExpires); // 调整指定id的结点的到期时间（当前时间+newExpires毫秒）
     void doWork(int id);    // 删除指定id，并触发回调函数
+    void cancel(int id);    // 删除指定id，不触发回调
     void tick();            // 清除超时结点
     void pop();
     int GetNextTick();      // 返回下一个定时器的剩余时间（单位：毫秒）
+    int GetFd() const { return timerFd_; }
+    void OnTick();          // timerfd可读：处理全部到期的定时器，再按新的堆顶设置timerfd
+    uint64_t GetArmCount() const { return armCount_; }  // timerfd_settime的次数
 
 private:
     void siftup_(size_t i);             // 向上调整
     bool siftdown_(size_t i, size_t n); // 向下调整,若不能向下则返回false
     void SwapNode_(size_t i, size_t j); // 交换两个结点位置
     void del_(size_t i);                // 删除指定定时器
+    void Rearm_();                      // 堆顶比timerfd设置的时间更早时重新设置
+    void Expire_(TimeStamp now);        // 处理到期时间不晚于now的结点
+    static TimeStamp Deadline_(int timeOut);   // 当前时间 + timeOut，向上取整到SLACK_MS
 
 private:
     std::vector<TimerNode> heap_;
     // key:id value:vector的下标
     std::unordered_map<int, size_t> ref_;   // id对应的在heap_中的下标，方便用heap_的时候查找
+
+    int timerFd_;
+    TimeStamp armed_;       // timerfd当前设置的到期时间，默认值表示没有设置
+    uint64_t armCount_ = 0;
 };
 
 #endif //HEAP_TIMER_H
@@ -0,0 +1,93 @@
+#ifndef LOADGEN_HISTOGRAM_H
+#define LOADGEN_HISTOGRAM_H
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+/*
+    HdrHistogram 风格的延迟直方图（单位微秒）
+    小于SUB_BUCKETS的值精确记录，更大的按2的幂分段、每段均分成 SUB_BUCKETS/2 个桶：相对误差不超过 2/SUB_BUCKETS（约0.2%），
+    记录是O(1)的数组加一，不保存原始样本，1小时的压测也只占固定内存，多个线程的直方图可以直接相加
+*/
+class Histogram {
+public:
+    static const int SUB_BITS = 10;
+    static const int64_t SUB_BUCKETS = 1 << SUB_BITS;     // 1024
+    static const int MAX_BITS = 40;                         // 最大约 2^40 微秒（12天）
+
+    Histogram() : counts_((MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS, 0) {}
+
+    void Record(int64_t value) {
+        if(value < 0) { value = 0; }
+        counts_[Index_(value)]++;
+        total_++;
+        sum_ += value;
+        min_ = std::min(min_, value);
+        max_ = std::max(max_, value);
+    }
+
+    void Merge(const Histogram& other) {
+        for(size_t i = 0; i < counts_.size(); i++) {
+            counts_[i] += other.counts_[i];
+        }
+        total_ += other.total_;
+        sum_ += other.sum_;
+        min_ = std::min(min_, other.min_);
+        max_ = std::max(max_, other.max_);
+    }
+
+    // p 取 0~100，返回该分位所在桶的上界（和HdrHistogram一样偏保守）
+    int64_t Percentile(double p) const {
+        if(total_ == 0) { return 0; }
+        int64_t rank = static_cast<int64_t>(p / 100.0 * total_ + 0.5);
+        rank = std::max<int64_t>(1, std::min(rank, total_));
+        int64_t seen = 0;
+        for(size_t i = 0; i < counts_.size(); i++) {
+            seen += counts_[i];
+            if(seen >= rank) {
+                return std::min(UpperBound_(i), max_);
+            }
+        }
+        return max_;
+    }
+
+    int64_t Count() const { return total_; }
+    int64_t Min() const { return total_ ? min_ : 0; }
+    int64_t Max() const { return max_; }
+    double Mean() const { return total_ ? static_cast<double>(sum_) / total_ : 0; }
+
+private:
+    // 小于SUB_BUCKETS的值一个值一个桶；更大的值按最高位分段，段内取紧跟最高位的SUB_BITS位
+    static size_t Index_(int64_t v) {
+        if(v < SUB_BUCKETS) {
+            return static_cast<size_t>(v);
+        }
+        int msb = 63 - __builtin_clzll(static_cast<uint64_t>(v));
+        if(msb >= MAX_BITS) {
+            msb = MAX_BITS - 1;
+            v = (int64_t(1) << MAX_BITS) - 1;
+        }
+        int shift = msb - SUB_BITS + 1;
+        int64_t sub = (v >> shift) - SUB_BUCKETS / 2;      // 段内 [0, SUB_BUCKETS/2)
+        return static_cast<size_t>(SUB_BUCKETS + (shift - 1) * (SUB_BUCKETS / 2) + sub);
+    }
+
+    static int64_t UpperBound_(size_t idx) {
+        if(idx < static_cast<size_t>(SUB_BUCKETS)) {
+            return static_cast<int64_t>(idx);
+        }
+        int64_t rest = static_cast<int64_t>(idx) - SUB_BUCKETS;
+        int shift = static_cast<int>(rest / (SUB_BUCKETS / 2)) + 1;
+        int64_t sub = rest % (SUB_BUCKETS / 2) + SUB_BUCKETS / 2;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    std::vector<int64_t> counts_;
+    int64_t total_ = 0;
+    int64_t sum_ = 0;
+    int64_t min_ = INT64_MAX;
+    int64_t max_ = 0;
+};
+
+#endif // LOADGEN_HISTOGRAM_H
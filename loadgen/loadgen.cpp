@@ -0,0 +1,544 @@
+/*
+    HTTP 压测工具（代替 webbench：webbench 每个客户端一个进程、每个请求一个新连接、只统计每分钟页面数）
+        多线程，每个线程一个 epoll 管理自己的一组连接
+        keep-alive，可以流水线（一个连接上同时有多个请求在途）
+        闭环：每个连接发完一个等响应再发下一个（默认）
+        开环：按固定速率发请求，延迟从"本该发出的时间"算起（修正协调遗漏：服务器卡住时排队的请求也计入延迟）
+        按权重混合多个请求（场景文件，可以包括登录POST）
+        延迟用HdrHistogram风格的直方图统计，结果输出JSON
+
+    用法：./loadgen [选项] http://127.0.0.1:1316/
+        -c 连接数（默认100）     -t 线程数（默认4）      -d 持续秒数（默认10）
+        -p 流水线深度（默认1）   -R 开环总速率 请求/秒（默认0：闭环）
+        -k 0 关闭keep-alive（每个请求一个连接）
+        -s 场景文件（每行：权重 方法 路径 [正文]，见scenario.txt；不指定时只请求URL里的路径）
+        -T 请求超时毫秒（默认5000）  -o JSON结果另存到文件
+*/
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <random>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <memory>
+
+#include "histogram.h"
+
+using namespace std;
+
+static int64_t NowUs() {
+    return chrono::duration_cast<chrono::microseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+struct Options {
+    string host = "127.0.0.1";
+    string port = "1316";
+    string path = "/";
+    int connections = 100;
+    int threads = 4;
+    double duration = 10;
+    int pipeline = 1;
+    double rate = 0;            // 0 闭环
+    bool keepAlive = true;
+    int timeoutMs = 5000;
+    string scenarioFile;
+    string output;
+};
+
+// 场景里的一种请求，报文提前拼好，发送时只做拷贝
+struct Request {
+    string name;    // "GET /index.html"
+    string raw;
+    int weight;
+};
+
+class Scenario {
+public:
+    bool Load(const Options& opt) {
+        if(opt.scenarioFile.empty()) {
+            Add_(opt, 1, "GET", opt.path, "");
+            return true;
+        }
+        ifstream in(opt.scenarioFile);
+        if(!in) {
+            cerr << "cannot open scenario " << opt.scenarioFile << endl;
+            return false;
+        }
+        string line;
+        while(getline(in, line)) {
+            if(line.empty() || line[0] == '#') { continue; }
+            istringstream ss(line);
+            int weight = 0;
+            string method, path, body;
+            if(!(ss >> weight >> method >> path) || weight <= 0) {
+                cerr << "bad scenario line: " << line << endl;
+                return false;
+            }
+            ss >> body;
+            Add_(opt, weight, method, path, body);
+        }
+        return !reqs_.empty();
+    }
+
+    int Pick(mt19937& rng) const {
+        int r = uniform_int_distribution<int>(0, total_ - 1)(rng);
+        for(size_t i = 0; i < reqs_.size(); i++) {
+            if(r < reqs_[i].weight) { return static_cast<int>(i); }
+            r -= reqs_[i].weight;
+        }
+        return 0;
+    }
+
+    const Request& Get(int i) const { return reqs_[i]; }
+    size_t Size() const { return reqs_.size(); }
+
+private:
+    void Add_(const Options& opt, int weight, const string& method, const string& path, const string& body) {
+        Request req;
+        req.name = method + " " + path;
+        req.weight = weight;
+        req.raw = method + " " + path + " HTTP/1.1\r\nHost: " + opt.host + ":" + opt.port + "\r\n";
+        req.raw += opt.keepAlive ? "Connection: keep-alive\r\n" : "Connection: close\r\n";
+        if(method == "POST") {
+            req.raw += "Content-Type: application/x-www-form-urlencoded\r\n";
+            req.raw += "Content-Length: " + to_string(body.size()) + "\r\n\r\n" + body;
+        } else {
+            req.raw += "\r\n";
+        }
+        reqs_.push_back(req);
+        total_ += weight;
+    }
+
+    vector<Request> reqs_;
+    int total_ = 0;
+};
+
+// 一个线程的统计，结束后合并
+struct Stats {
+    Histogram latency;
+    int64_t requests = 0;
+    int64_t bytes = 0;
+    int64_t connects = 0;
+    int64_t connectErrors = 0;
+    int64_t readErrors = 0;
+    int64_t timeouts = 0;
+    int64_t status[6] = {0};            // 按状态码首位：1xx..5xx，0为无法解析
+    vector<int64_t> perRequest;
+
+    void Merge(const Stats& o) {
+        latency.Merge(o.latency);
+        requests += o.requests;
+        bytes += o.bytes;
+        connects += o.connects;
+        connectErrors += o.connectErrors;
+        readErrors += o.readErrors;
+        timeouts += o.timeouts;
+        for(int i = 0; i < 6; i++) { status[i] += o.status[i]; }
+        perRequest.resize(max(perRequest.size(), o.perRequest.size()));
+        for(size_t i = 0; i < o.perRequest.size(); i++) { perRequest[i] += o.perRequest[i]; }
+    }
+};
+
+/*
+    一个线程：自己的epoll、自己的连接、自己的统计，线程之间不共享任何可变状态
+    "空位"（slot）：每个已连上的连接有 pipeline 个空位，发一个请求占一个，收到响应还一个
+    闭环：有空位就立刻发新请求；开环：按时间表把到点的请求放进积压队列，有空位就发，
+         没有空位就继续积压（延迟从时间表上的时间算，积压的时间也算在内）
+*/
+class Worker {
+public:
+    Worker(const Options& opt, const Scenario& scenario, const addrinfo* addr, int connNum, double rate, int seed)
+        : opt_(opt), scenario_(scenario), addr_(addr), conns_(connNum), rate_(rate), rng_(seed) {
+        stats_.perRequest.assign(scenario.Size(), 0);
+    }
+
+    void Run(int64_t begin, int64_t end) {
+        epfd_ = epoll_create1(EPOLL_CLOEXEC);
+        for(size_t i = 0; i < conns_.size(); i++) { Connect_(static_cast<int>(i)); }
+
+        int64_t interval = rate_ > 0 ? static_cast<int64_t>(1e6 / rate_) : 0;
+        int64_t nextSend = begin;
+        int64_t nextCheck = begin;
+        epoll_event events[256];
+        for(;;) {
+            int64_t now = NowUs();
+            if(now >= end) { break; }
+            if(rate_ > 0) {
+                for(; nextSend <= now; nextSend += max<int64_t>(interval, 1)) {
+                    backlog_.push_back({nextSend, scenario_.Pick(rng_), 0});
+                }
+            }
+            Dispatch_(now);
+            if(now >= nextCheck) {
+                CheckTimeout_(now);
+                nextCheck = now + 100000;
+            }
+
+            int waitMs = 100;
+            if(rate_ > 0) { waitMs = static_cast<int>(max<int64_t>(0, (nextSend - now) / 1000)); }
+            waitMs = static_cast<int>(min<int64_t>(waitMs, (end - now) / 1000 + 1));
+            int n = epoll_wait(epfd_, events, 256, waitMs);
+            for(int i = 0; i < n; i++) {
+                int idx = static_cast<int>(events[i].data.u64 & 0xffffffff);
+                Conn& c = conns_[idx];
+                if(c.fd < 0 || c.gen != static_cast<uint32_t>(events[i].data.u64 >> 32)) {
+                    continue;   // 这一批里前面的事件已经让它重连了，是旧连接的事件
+                }
+                if(c.connecting && (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+                    OnConnected_(idx);
+                    continue;
+                }
+                if(events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) { OnReadable_(idx); }
+                if(c.fd >= 0 && (events[i].events & EPOLLOUT)) { Flush_(idx); }
+            }
+        }
+        for(auto& c : conns_) {
+            if(c.fd >= 0) { close(c.fd); }
+        }
+        close(epfd_);
+    }
+
+    const Stats& GetStats() const { return stats_; }
+    int64_t GetBacklog() const { return static_cast<int64_t>(backlog_.size()); }
+
+private:
+    struct Pending {
+        int64_t start;      // 开环：时间表上的时间；闭环：实际发送时间
+        int req;
+        int64_t sent;       // 实际发送时间（判断超时用）
+    };
+    struct Conn {
+        int fd = -1;
+        uint32_t gen = 0;       // 重连一次加一，作废旧的空位
+        bool connecting = false;
+        string out;
+        size_t outOff = 0;
+        string in;
+        deque<Pending> inflight;
+    };
+    struct Slot {
+        int conn;
+        uint32_t gen;
+    };
+
+    void Connect_(int idx) {
+        Conn& c = conns_[idx];
+        c.gen++;
+        c.out.clear();
+        c.outOff = 0;
+        c.in.clear();
+        c.fd = socket(addr_->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        int one = 1;
+        setsockopt(c.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        stats_.connects++;
+        if(connect(c.fd, addr_->ai_addr, addr_->ai_addrlen) < 0 && errno != EINPROGRESS) {
+            stats_.connectErrors++;
+            close(c.fd);
+            c.fd = -1;      // 等CheckTimeout_定期重试，服务器没起来时不空转
+            return;
+        }
+        c.connecting = true;
+        epoll_event ev = {0};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP;
+        ev.data.u64 = (static_cast<uint64_t>(c.gen) << 32) | static_cast<uint32_t>(idx);
+        epoll_ctl(epfd_, EPOLL_CTL_ADD, c.fd, &ev);
+    }
+
+    void OnConnected_(int idx) {
+        Conn& c = conns_[idx];
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(c.fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if(err != 0) {
+            stats_.connectErrors++;
+            epoll_ctl(epfd_, EPOLL_CTL_DEL, c.fd, nullptr);
+            close(c.fd);
+            c.fd = -1;
+            c.connecting = false;
+            return;
+        }
+        c.connecting = false;
+        Watch_(idx, false);
+        int depth = opt_.keepAlive ? opt_.pipeline : 1;
+        for(int i = 0; i < depth; i++) { slots_.push_back({idx, c.gen}); }
+    }
+
+    // 关闭后重连；开环时在途的请求放回积压队列（保留原来的时间表时间）
+    void Reconnect_(int idx, bool requeue) {
+        Conn& c = conns_[idx];
+        if(requeue && rate_ > 0) {
+            for(auto it = c.inflight.rbegin(); it != c.inflight.rend(); ++it) { backlog_.push_front(*it); }
+        }
+        c.inflight.clear();
+        epoll_ctl(epfd_, EPOLL_CTL_DEL, c.fd, nullptr);
+        close(c.fd);
+        c.fd = -1;
+        Connect_(idx);
+    }
+
+    void Watch_(int idx, bool writable) {
+        epoll_event ev = {0};
+        ev.events = EPOLLIN | EPOLLRDHUP | (writable ? EPOLLOUT : 0);
+        ev.data.u64 = (static_cast<uint64_t>(conns_[idx].gen) << 32) | static_cast<uint32_t>(idx);
+        epoll_ctl(epfd_, EPOLL_CTL_MOD, conns_[idx].fd, &ev);
+    }
+
+    void Dispatch_(int64_t now) {
+        while(!slots_.empty()) {
+            if(rate_ > 0 && backlog_.empty()) { break; }
+            Slot slot = slots_.front();
+            slots_.pop_front();
+            Conn& c = conns_[slot.conn];
+            if(c.gen != slot.gen || c.fd < 0 || c.connecting) { continue; }    // 连接已经重建
+            Pending p;
+            if(rate_ > 0) {
+                p = backlog_.front();
+                backlog_.pop_front();
+            } else {
+                p = {now, scenario_.Pick(rng_), 0};
+            }
+            p.sent = now;
+            c.inflight.push_back(p);
+            c.out += scenario_.Get(p.req).raw;
+            Flush_(slot.conn);
+        }
+    }
+
+    void Flush_(int idx) {
+        Conn& c = conns_[idx];
+        while(c.outOff < c.out.size()) {
+            ssize_t n = send(c.fd, c.out.data() + c.outOff, c.out.size() - c.outOff, MSG_NOSIGNAL);
+            if(n < 0) {
+                if(errno == EAGAIN) {
+                    Watch_(idx, true);
+                    return;
+                }
+                stats_.readErrors++;
+                Reconnect_(idx, true);
+                return;
+            }
+            c.outOff += n;
+        }
+        c.out.clear();
+        c.outOff = 0;
+        Watch_(idx, false);
+    }
+
+    void OnReadable_(int idx) {
+        Conn& c = conns_[idx];
+        char buf[65536];
+        bool peerClosed = false;
+        for(;;) {
+            ssize_t n = recv(c.fd, buf, sizeof(buf), 0);
+            if(n > 0) {
+                c.in.append(buf, n);
+                stats_.bytes += n;
+                continue;
+            }
+            if(n == 0 || errno != EAGAIN) { peerClosed = true; }
+            break;
+        }
+        bool closeConn = false;
+        int64_t now = NowUs();
+        while(!c.inflight.empty()) {
+            int status = 0;
+            size_t used = 0;
+            bool close = false;
+            if(!ParseResponse_(c.in, &status, &used, &close)) { break; }
+            c.in.erase(0, used);
+            Pending p = c.inflight.front();
+            c.inflight.pop_front();
+            stats_.latency.Record(now - p.start);
+            stats_.requests++;
+            stats_.perRequest[p.req]++;
+            stats_.status[(status >= 100 && status < 600) ? status / 100 : 0]++;
+            if(close || !opt_.keepAlive) {
+                closeConn = true;
+                break;
+            }
+            slots_.push_back({idx, c.gen});
+        }
+        if(closeConn || peerClosed) {
+            if(peerClosed && !closeConn && !c.inflight.empty()) { stats_.readErrors++; }
+            Reconnect_(idx, true);
+        }
+    }
+
+    // 完整收到一个响应返回true：状态码、占用的字节数、对方是否要关闭连接
+    static bool ParseResponse_(const string& in, int* status, size_t* used, bool* close) {
+        size_t headEnd = in.find("\r\n\r\n");
+        if(headEnd == string::npos) { return false; }
+        if(in.compare(0, 5, "HTTP/") == 0 && in.size() > 12) {
+            *status = atoi(in.c_str() + 9);
+        }
+        size_t length = 0;
+        *close = false;
+        size_t pos = in.find("\r\n");
+        while(pos < headEnd) {
+            size_t next = in.find("\r\n", pos + 2);
+            string line = in.substr(pos + 2, next - pos - 2);
+            for(size_t i = 0; i < line.size() && line[i] != ':'; i++) { line[i] = tolower(line[i]); }
+            if(line.compare(0, 15, "content-length:") == 0) {
+                length = strtoul(line.c_str() + 15, nullptr, 10);
+            } else if(line.compare(0, 11, "connection:") == 0 && line.find("close") != string::npos) {
+                *close = true;
+            }
+            pos = next;
+        }
+        if(in.size() < headEnd + 4 + length) { return false; }
+        *used = headEnd + 4 + length;
+        return true;
+    }
+
+    // 每100ms：重连失败的连接再试一次；在途请求超时的断开重连
+    void CheckTimeout_(int64_t now) {
+        for(size_t i = 0; i < conns_.size(); i++) {
+            Conn& c = conns_[i];
+            if(c.fd < 0) {
+                Connect_(static_cast<int>(i));
+            } else if(!c.inflight.empty() && now - c.inflight.front().sent > opt_.timeoutMs * 1000LL) {
+                stats_.timeouts++;
+                c.inflight.pop_front();     // 超时的请求不计延迟，其余的重发
+                Reconnect_(static_cast<int>(i), true);
+            }
+        }
+    }
+
+    const Options& opt_;
+    const Scenario& scenario_;
+    const addrinfo* addr_;
+    vector<Conn> conns_;
+    double rate_;
+    mt19937 rng_;
+    int epfd_ = -1;
+    deque<Slot> slots_;
+    deque<Pending> backlog_;
+    Stats stats_;
+};
+
+static bool ParseUrl(const string& url, Options* opt) {
+    const string prefix = "http://";
+    if(url.compare(0, prefix.size(), prefix) != 0) { return false; }
+    string rest = url.substr(prefix.size());
+    size_t slash = rest.find('/');
+    string hostPort = rest.substr(0, slash);
+    opt->path = slash == string::npos ? "/" : rest.substr(slash);
+    size_t colon = hostPort.find(':');
+    opt->host = hostPort.substr(0, colon);
+    opt->port = colon == string::npos ? "80" : hostPort.substr(colon + 1);
+    return !opt->host.empty();
+}
+
+static void Usage() {
+    cerr << "usage: loadgen [-c conns] [-t threads] [-d seconds] [-p pipeline] [-R rate] [-k 0|1]\n"
+            "               [-s scenario] [-T timeoutMs] [-o result.json] http://host:port/path" << endl;
+}
+
+int main(int argc, char* argv[]) {
+    signal(SIGPIPE, SIG_IGN);
+    Options opt;
+    int ch;
+    while((ch = getopt(argc, argv, "c:t:d:p:R:k:s:T:o:h")) != -1) {
+        switch(ch) {
+        case 'c': opt.connections = atoi(optarg); break;
+        case 't': opt.threads = atoi(optarg); break;
+        case 'd': opt.duration = atof(optarg); break;
+        case 'p': opt.pipeline = max(1, atoi(optarg)); break;
+        case 'R': opt.rate = atof(optarg); break;
+        case 'k': opt.keepAlive = atoi(optarg) != 0; break;
+        case 's': opt.scenarioFile = optarg; break;
+        case 'T': opt.timeoutMs = atoi(optarg); break;
+        case 'o': opt.output = optarg; break;
+        default: Usage(); return 1;
+        }
+    }
+    if(optind >= argc || !ParseUrl(argv[optind], &opt)) {
+        Usage();
+        return 1;
+    }
+    opt.threads = max(1, min(opt.threads, opt.connections));
+
+    Scenario scenario;
+    if(!scenario.Load(opt)) { return 1; }
+    addrinfo hints = {}, *addr = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if(getaddrinfo(opt.host.c_str(), opt.port.c_str(), &hints, &addr) != 0 || !addr) {
+        cerr << "cannot resolve " << opt.host << endl;
+        return 1;
+    }
+
+    vector<unique_ptr<Worker>> workers;
+    for(int i = 0; i < opt.threads; i++) {
+        int connNum = opt.connections / opt.threads + (i < opt.connections % opt.threads ? 1 : 0);
+        workers.emplace_back(new Worker(opt, scenario, addr, connNum, opt.rate / opt.threads, 1234 + i));
+    }
+    int64_t begin = NowUs() + 10000;
+    int64_t end = begin + static_cast<int64_t>(opt.duration * 1e6);
+    vector<thread> threads;
+    for(auto& w : workers) {
+        threads.emplace_back([&w, begin, end]() { w->Run(begin, end); });
+    }
+    for(auto& t : threads) { t.join(); }
+    double elapsed = (NowUs() - begin) / 1e6;
+
+    Stats total;
+    int64_t backlog = 0;
+    for(auto& w : workers) {
+        total.Merge(w->GetStats());
+        backlog += w->GetBacklog();
+    }
+    freeaddrinfo(addr);
+
+    const Histogram& h = total.latency;
+    ostringstream js;
+    js << "{\n"
+       << "  \"target\": \"http://" << opt.host << ":" << opt.port << opt.path << "\",\n"
+       << "  \"mode\": \"" << (opt.rate > 0 ? "open" : "closed") << "\",\n"
+       << "  \"connections\": " << opt.connections << ",\n"
+       << "  \"threads\": " << opt.threads << ",\n"
+       << "  \"pipeline\": " << opt.pipeline << ",\n"
+       << "  \"keepalive\": " << (opt.keepAlive ? "true" : "false") << ",\n"
+       << "  \"target_rate\": " << opt.rate << ",\n"
+       << "  \"duration_s\": " << elapsed << ",\n"
+       << "  \"requests\": " << total.requests << ",\n"
+       << "  \"rps\": " << total.requests / elapsed << ",\n"
+       << "  \"bytes\": " << total.bytes << ",\n"
+       << "  \"connects\": " << total.connects << ",\n"
+       << "  \"unsent_backlog\": " << backlog << ",\n"
+       << "  \"errors\": {\"connect\": " << total.connectErrors << ", \"read\": " << total.readErrors
+       << ", \"timeout\": " << total.timeouts << "},\n"
+       << "  \"status\": {\"1xx\": " << total.status[1] << ", \"2xx\": " << total.status[2]
+       << ", \"3xx\": " << total.status[3] << ", \"4xx\": " << total.status[4]
+       << ", \"5xx\": " << total.status[5] << ", \"other\": " << total.status[0] << "},\n"
+       << "  \"latency_us\": {\"min\": " << h.Min() << ", \"mean\": " << static_cast<int64_t>(h.Mean())
+       << ", \"p50\": " << h.Percentile(50) << ", \"p90\": " << h.Percentile(90)
+       << ", \"p99\": " << h.Percentile(99) << ", \"p99.9\": " << h.Percentile(99.9)
+       << ", \"p99.99\": " << h.Percentile(99.99) << ", \"max\": " << h.Max() << "},\n"
+       << "  \"requests_by_type\": {";
+    for(size_t i = 0; i < scenario.Size(); i++) {
+        js << (i ? ", " : "") << "\"" << scenario.Get(i).name << "\": " << total.perRequest[i];
+    }
+    js << "}\n}\n";
+
+    cout << js.str();
+    if(!opt.output.empty()) {
+        ofstream(opt.output) << js.str();
+    }
+    return 0;
+}
@@ -1,8 +1,28 @@
 #include "../code/log/log.h"            // 日志模块头文件
 #include "../code/pool/threadpool.h"    // 线程池模块头文件
+#include "../code/pool/sqlconnpool.h"   // 数据库连接池头文件
+#include "../code/pool/singleflight.h"  // 请求合并头文件
+#include "../code/pool/regbatcher.h"    // 注册写合并头文件
+#include "../code/cache/sessionstore.h" // 会话表头文件
+#include "../code/timer/heaptimer.h"     // 定时器头文件
+#include "../code/server/loopqueue.h"   // 主循环信箱头文件
+#include "../code/metrics/metrics.h"    // 运行指标头文件
+#include "../code/metrics/reqtrace.h"   // 请求分阶段耗时头文件
+#include "../code/cache/filecache.h"    // 静态文件缓存头文件
+#include "../code/server/iplimiter.h"   // 按IP限流头文件
+#include "../code/server/webserver.h"   // 服务器头文件
+#include "../code/store/memuserstore.h" // 内存用户存储头文件
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <arpa/inet.h>
 #include <features.h>   //  GNU C 的内部系统头文件，允许我们访问 __GLIBC__ 等宏，用来判断 glibc 版本
 
 #include <iostream>
+#include <vector>
+#include <algorithm>
+#include <chrono>
 
 /*
 如果你的系统 glibc 版本小于 2.30（即不支持 std::this_thread::get_id() 打印真实线程 ID），则手动定义 gettid()。
@@ -68,11 +88,903 @@ void TestThreadPool() {
     getchar();  // 需输入
 }
 
+// 自适应线程池：先提交一批阻塞任务（模拟慢查询），线程数应当随排队时间涨上去；空闲idleMs后缩回minThreads
+void TestAdaptivePool(int minThreads, int maxThreads) {
+    ThreadPool pool(minThreads);
+    pool.SetAdaptive(minThreads, maxThreads, 2000, 500, "test");
+    std::atomic<int> done(0);
+    for(int i = 0; i < 400; i++) {
+        pool.AddTask([&done]() {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            done++;
+        });
+        std::this_thread::sleep_for(std::chrono::microseconds(500));
+        if(i % 50 == 0) {
+            std::cout << "submitted " << i << " threads " << pool.ThreadCount() << " queue " << pool.QueueSize()
+                      << " blocked " << pool.BlockedRatio() << std::endl;
+        }
+    }
+    while(done < 400) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    std::cout << "peak grows " << pool.GrowCount() << ", threads " << pool.ThreadCount() << std::endl;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1500));
+    std::cout << "after idle: threads " << pool.ThreadCount() << " expect " << minThreads
+              << ", shrinks " << pool.ShrinkCount() << std::endl;
+}
+
+/*
+    请求分类调度：登录风暴（每个任务在工作线程里阻塞20ms，模拟同步查数据库）的同时，每2ms来一个静态请求，
+    比较所有任务排一个FIFO和分类调度（静态:数据库 = 8:1，数据库类最多占2个线程）时静态请求的排队时间
+    真实服务器上用loadgen的场景文件同时压POST /login和静态页面，看 webserver_request_stage_seconds{stage="queue"}
+*/
+void TestRequestClasses(int threadNum) {
+    const int loginNum = 200, staticNum = 300;
+    enum { STATIC, DB };
+    for(int classes = 0; classes < 2; classes++) {
+        ThreadPool pool(threadNum);
+        if(classes) {
+            pool.SetClass(STATIC, 8, 0);
+            pool.SetClass(DB, 1, 2);
+        }
+        std::mutex mtx;
+        std::vector<double> costs;
+        std::atomic<int> done(0);
+        for(int i = 0; i < loginNum; i++) {
+            pool.AddTask([]() { std::this_thread::sleep_for(std::chrono::milliseconds(20)); }, classes ? DB : STATIC);
+        }
+        for(int i = 0; i < staticNum; i++) {
+            auto begin = std::chrono::steady_clock::now();
+            pool.AddTask([&, begin]() {
+                auto end = std::chrono::steady_clock::now();
+                std::lock_guard<std::mutex> locker(mtx);
+                costs.push_back(std::chrono::duration<double, std::milli>(end - begin).count());
+                done++;
+            }, STATIC);
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+        while(done < staticNum) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        std::sort(costs.begin(), costs.end());
+        std::cout << (classes ? "classes: " : "fifo   : ") << "static p50=" << costs[costs.size() / 2]
+                  << "ms p99=" << costs[costs.size() * 99 / 100] << "ms" << std::endl;
+    }   // 析构时等剩下的登录任务做完
+}
+
+/*
+    过载保护：threadNum个线程、每个任务2ms，按两倍的处理能力提交1秒
+    不做过载保护时排队时间一直涨；CoDel判断过载后提交方不再提交（相当于回503），
+    已经排了超过target的任务取出来直接丢掉，被接纳的任务排队时间应当在target + interval量级
+*/
+void TestAdmission(int threadNum) {
+    const int targetUs = 5000, intervalUs = 50000;
+    for(int codel = 0; codel < 2; codel++) {
+        ThreadPool pool(threadNum);
+        if(codel) {
+            pool.SetCoDel(targetUs, intervalUs, 0);
+        }
+        std::mutex mtx;
+        std::vector<double> waits;
+        std::atomic<int> dropped(0);
+        int rejected = 0;
+        int total = threadNum * 1000;       // 两倍处理能力，1秒
+        for(int i = 0; i < total; i++) {
+            if(pool.CheckOverload()) {
+                rejected++;
+            } else {
+                auto begin = std::chrono::steady_clock::now();
+                pool.AddTask([&, codel, begin]() {
+                    if(codel && pool.Overloaded() && ThreadPool::TaskWaitUs() >= targetUs) {
+                        dropped++;
+                        return;
+                    }
+                    double wait = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+                    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+                    std::lock_guard<std::mutex> locker(mtx);
+                    waits.push_back(wait);
+                });
+            }
+            std::this_thread::sleep_for(std::chrono::microseconds(1000 / threadNum));
+        }
+        while(pool.QueueSize() > 0) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        std::lock_guard<std::mutex> locker(mtx);
+        std::sort(waits.begin(), waits.end());
+        std::cout << (codel ? "codel: " : "none : ") << "served " << waits.size() << " rejected " << rejected
+                  << " dropped " << dropped << " wait p50=" << waits[waits.size() / 2]
+                  << "ms p99=" << waits[waits.size() * 99 / 100] << "ms" << std::endl;
+    }
+}
+
+/*
+    日志背压压力测试：多个"请求线程"一边模拟处理请求一边打日志，统计每个请求的耗时分布。
+    日志目录放在被限速的磁盘上才能看出区别，例如用 dm-delay 做一个慢速 loop 设备：
+        dd if=/dev/zero of=/tmp/slow.img bs=1M count=256 && losetup /dev/loop9 /tmp/slow.img
+        echo "0 $(blockdev --getsz /dev/loop9) delay /dev/loop9 0 200" | dmsetup create slowdisk
+        mkfs.ext4 /dev/mapper/slowdisk && mount -o sync /dev/mapper/slowdisk /mnt/slowlog
+    然后 TestLogBackpressure("/mnt/slowlog")。
+    BLOCK策略下请求耗时会跟着磁盘一起抖，DROP_*策略下应保持平稳，同时日志里能看到"N log lines dropped"
+*/
+void TestLogBackpressure(const char* path) {
+    const char* names[] = { "BLOCK", "DROP_NEWEST", "DROP_OLDEST", "DROP_BELOW_LEVEL" };
+    Log::OverflowPolicy policies[] = { Log::BLOCK, Log::DROP_NEWEST, Log::DROP_OLDEST, Log::DROP_BELOW_LEVEL };
+    const int threadNum = 8, reqNum = 20000;
+
+    for(int p = 0; p < 4; p++) {
+        Log::Instance()->SetOverflowPolicy(policies[p], 3);
+        Log::Instance()->init(0, path, ".log", 1024);
+
+        std::vector<std::vector<double>> costs(threadNum);
+        std::vector<std::thread> threads;
+        for(int t = 0; t < threadNum; t++) {
+            threads.emplace_back([&costs, t]() {
+                for(int i = 0; i < reqNum; i++) {
+                    auto begin = std::chrono::steady_clock::now();
+                    LOG_INFO("request %d from thread %d ==================================", i, t);
+                    if(i % 100 == 0) { LOG_ERROR("request %d failed", i); }
+                    auto end = std::chrono::steady_clock::now();
+                    costs[t].push_back(std::chrono::duration<double, std::micro>(end - begin).count());
+                }
+            });
+        }
+        for(auto& th : threads) th.join();
+
+        std::vector<double> all;
+        for(auto& c : costs) all.insert(all.end(), c.begin(), c.end());
+        std::sort(all.begin(), all.end());
+        uint64_t dropped = 0;
+        for(int level = 0; level < 4; level++) dropped += Log::Instance()->GetDropped(level);
+        std::cout << names[p] << ": p50=" << all[all.size() / 2] << "us"
+                  << " p99=" << all[all.size() * 99 / 100] << "us"
+                  << " max=" << all.back() << "us"
+                  << " dropped(total)=" << dropped << std::endl;
+    }
+}
+
+/*
+    对比文本协议（snprintf + mysql_query + mysql_store_result）和预编译语句（连接上缓存的MYSQL_STMT）
+    查同一个用户n次的耗时，需要本地MySQL/MariaDB，库表见readme
+*/
+void TestSqlStmt(int n) {
+    Log::Instance()->init(1, "./testSql", ".log", 1024);
+    SqlConnPool::Instance()->Init("localhost", 3306, "webserver_user", "123456", "webserver_db", 1);
+    MYSQL* sql;
+    SqlConnRAII sqlRAII(&sql, SqlConnPool::Instance());
+    assert(sql);
+
+    auto begin = std::chrono::steady_clock::now();
+    for(int i = 0; i < n; i++) {
+        char order[256] = { 0 };
+        snprintf(order, 256, "SELECT username, password FROM user WHERE username='%s' LIMIT 1", "name");
+        if(mysql_query(sql, order)) continue;
+        MYSQL_RES* res = mysql_store_result(sql);
+        while(mysql_fetch_row(res)) {}
+        mysql_free_result(res);
+    }
+    auto mid = std::chrono::steady_clock::now();
+    for(int i = 0; i < n; i++) {
+        MYSQL_STMT* stmt = SqlConnPool::Instance()->GetStmt(sql, STMT_USER_QUERY);
+        assert(stmt);
+        char name[] = "name";
+        unsigned long nameLen = 4, len = 0;
+        char buf[64];
+        MYSQL_BIND param, result;
+        memset(&param, 0, sizeof(param));
+        memset(&result, 0, sizeof(result));
+        param.buffer_type = MYSQL_TYPE_STRING;
+        param.buffer = name;
+        param.buffer_length = nameLen;
+        param.length = &nameLen;
+        result.buffer_type = MYSQL_TYPE_STRING;
+        result.buffer = buf;
+        result.buffer_length = sizeof(buf);
+        result.length = &len;
+        mysql_stmt_bind_param(stmt, &param);
+        mysql_stmt_execute(stmt);
+        mysql_stmt_bind_result(stmt, &result);
+        mysql_stmt_store_result(stmt);
+        while(mysql_stmt_fetch(stmt) == 0) {}
+        mysql_stmt_free_result(stmt);
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    double text = std::chrono::duration<double, std::micro>(mid - begin).count() / n;
+    double stmt = std::chrono::duration<double, std::micro>(end - mid).count() / n;
+    std::cout << "text protocol: " << text << "us/query, prepared: " << stmt << "us/query" << std::endl;
+}
+
+// 发一个请求（Connection: close），读到服务器关闭连接为止；返回耗时（毫秒），status为响应的状态码，没收到响应时为0
+static double SendRequest(int port, const std::string& request, int* status) {
+    auto begin = std::chrono::steady_clock::now();
+    *status = 0;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if(connect(fd, (sockaddr*)&addr, sizeof(addr)) == 0 && write(fd, request.data(), request.size()) == (ssize_t)request.size()) {
+        std::string response;
+        char buf[4096];
+        ssize_t len;
+        while((len = read(fd, buf, sizeof(buf))) > 0) response.append(buf, len);
+        if(response.compare(0, 5, "HTTP/") == 0 && response.size() > 12) *status = atoi(response.c_str() + 9);
+    }
+    close(fd);
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - begin).count();
+}
+
+/*
+    数据库很慢时静态请求会不会被登录拖慢：在本进程里起一个真实的WebServer（内存存储，每次查询阻塞delayMs），
+    登录请求走完整的路径：工作线程解析 -> AsyncVerify_交给数据库线程池 -> UserVerify查存储 -> VERIFY_DONE回主循环发响应
+    先在数据库空闲时测一遍静态页面的延迟作为基线，再在loginNum个登录同时挂在数据库上时测一遍，两次应该差不多
+    （登录在工作线程里同步查库的话，4个工作线程很快都卡在数据库上，静态请求要排到登录做完）
+    在test目录下运行（资源目录用../resources/），SIGTERM让服务器优雅退出
+*/
+void TestSlowDbIsolation(int loginNum, int delayMs) {
+    const int port = 1320, staticNum = 200;
+    WebServer server(port, 3, 60000, false, 3306, "", "", "testSlowDb",
+                     4, 4, false, 1, 1024, UserStore::MEMORY_STORE);   // 4个数据库线程，4个工作线程
+    server.SetGracefulShutdown(1000, false);
+    HttpConn::srcDir = "../resources/";
+    static_cast<MemUserStore*>(UserStore::Instance())->SetQueryDelay(delayMs);
+    std::thread loop([&server]() { server.Start(); });
+
+    const std::string get = "GET /index.html HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n\r\n";
+    auto measure = [&](const char* name) {
+        std::vector<double> costs;
+        for(int i = 0; i < staticNum; i++) {
+            int status;
+            double cost = SendRequest(port, get, &status);
+            if(status == 200) costs.push_back(cost);
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        }
+        std::sort(costs.begin(), costs.end());
+        std::cout << name << "static " << costs.size() << "/" << staticNum << " ok";
+        if(!costs.empty()) {
+            std::cout << " p50=" << costs[costs.size() / 2] << "ms p99=" << costs[costs.size() * 99 / 100]
+                      << "ms max=" << costs.back() << "ms";
+        }
+        std::cout << std::endl;
+    };
+    measure("idle db: ");
+
+    std::vector<double> loginCosts(loginNum);
+    std::atomic<int> loginDone(0);
+    std::vector<std::thread> logins;
+    for(int i = 0; i < loginNum; i++) {
+        logins.emplace_back([&, i]() {
+            // 用户名各不相同，凭据缓存和登录合并都帮不上忙，每个登录都要查一次存储
+            std::string body = "username=slow" + std::to_string(i) + "&password=123456";
+            std::string post = "POST /login.html HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n"
+                               "Content-Type: application/x-www-form-urlencoded\r\n"
+                               "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+            int status;
+            loginCosts[i] = SendRequest(port, post, &status);
+            if(status > 0) loginDone++;
+        });
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));    // 等登录都挂到数据库线程上
+    measure("slow db: ");
+    for(auto& th : logins) th.join();
+    std::sort(loginCosts.begin(), loginCosts.end());
+    std::cout << "login " << loginDone << "/" << loginNum << " answered, p50=" << loginCosts[loginNum / 2]
+              << "ms max=" << loginCosts.back() << "ms" << std::endl;
+
+    kill(getpid(), SIGTERM);
+    loop.join();
+}
+
+/*
+    重复请求占多数时（撞库、客户端重试），对比合并前后存储的查询次数：在本进程里起一个真实的WebServer（内存存储，每次查询阻塞delayMs），
+    每一轮requestNum个连接同时POST /login.html，用户名只有hotNum个，走完整的路径：
+    AsyncVerify_ -> 数据库线程池 -> UserVerify -> 凭据缓存 -> loginFlight_ -> UserStore::Query
+    每轮换一批用户名，缓存里都没有；不合并时同时到达的相同用户名各查一次（查完的进了负缓存，后面的就不查了），合并后每个用户名只查一次
+    真实服务器上可以用压测工具并发POST同一个用户名到 /login.html，对比MySQL的 Com_select 增量
+*/
+void TestSingleFlight(int hotNum, int requestNum, int delayMs) {
+    const int port = 1320;
+    WebServer server(port, 3, 60000, false, 3306, "", "", "testSingleFlight",
+                     16, 4, false, 1, 1024, UserStore::MEMORY_STORE);  // 16个数据库线程，让相同用户名的查询能同时进行
+    server.SetGracefulShutdown(1000, false);
+    HttpConn::srcDir = "../resources/";
+    MemUserStore* store = static_cast<MemUserStore*>(UserStore::Instance());
+    store->SetQueryDelay(delayMs);
+    std::thread loop([&server]() { server.Start(); });
+
+    for(int coalesce = 0; coalesce < 2; coalesce++) {
+        HttpRequest::SetLoginCoalescing(coalesce);
+        uint64_t queries = store->GetQueries(), coalesced = HttpRequest::GetVerifyCoalesced();
+        std::atomic<int> answered(0);
+        auto begin = std::chrono::steady_clock::now();
+        std::vector<std::thread> clients;
+        for(int i = 0; i < requestNum; i++) {
+            clients.emplace_back([&, i]() {
+                std::string body = "username=hot" + std::to_string(coalesce) + "_" + std::to_string(i % hotNum) + "&password=123456";
+                std::string post = "POST /login.html HTTP/1.1\r\nHost: localhost\r\nConnection: close\r\n"
+                                   "Content-Type: application/x-www-form-urlencoded\r\n"
+                                   "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+                int status;
+                SendRequest(port, post, &status);
+                if(status > 0) answered++;
+            });
+        }
+        for(auto& th : clients) th.join();
+        double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        std::cout << (coalesce ? "singleflight: " : "direct      : ") << "requests=" << requestNum
+                  << " answered=" << answered << " store queries=" << store->GetQueries() - queries
+                  << " coalesced=" << HttpRequest::GetVerifyCoalesced() - coalesced << " cost=" << sec << "s" << std::endl;
+    }
+    HttpRequest::SetLoginCoalescing(true);
+
+    kill(getpid(), SIGTERM);
+    loop.join();
+}
+
+/*
+    注册吞吐对比（需要本地MySQL/MariaDB，库表见readme）：
+    逐条：每个注册一次SELECT查重 + 一次INSERT，各自隐式提交（旧做法）
+    批量：RegBatcher每2ms把排队的注册合成一条查重 + 一条多行INSERT，一批只提交一次
+    innodb_flush_log_at_trx_commit=1 时每次提交都要刷盘，批量的优势最明显
+*/
+void TestRegisterBatch(int n) {
+    const int threadNum = 8;
+    Log::Instance()->init(1, "./testSql", ".log", 1024);
+    SqlConnPool::Instance()->Init("localhost", 3306, "webserver_user", "123456", "webserver_db", threadNum);
+    std::string prefix = "bench_" + std::to_string(time(nullptr)) + "_";
+
+    auto begin = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for(int t = 0; t < threadNum; t++) {
+        threads.emplace_back([&, t]() {
+            MYSQL* sql;
+            SqlConnRAII sqlRAII(&sql, SqlConnPool::Instance());
+            assert(sql);
+            for(int i = t; i < n; i += threadNum) {
+                std::string name = prefix + "r" + std::to_string(i);
+                std::string order = "SELECT password FROM user WHERE username='" + name + "' LIMIT 1";
+                if(mysql_query(sql, order.c_str())) continue;
+                MYSQL_RES* res = mysql_store_result(sql);
+                bool exist = mysql_fetch_row(res) != nullptr;
+                mysql_free_result(res);
+                if(exist) continue;
+                order = "INSERT INTO user(username, password) VALUES('" + name + "', 'pwd')";
+                mysql_query(sql, order.c_str());
+            }
+        });
+    }
+    for(auto& th : threads) th.join();
+    double single = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    UserStore::Init(UserStore::MYSQL_STORE);
+    RegBatcher::Instance()->Init(128, 2);
+    std::atomic<int> done(0), ok(0);
+    begin = std::chrono::steady_clock::now();
+    threads.clear();
+    for(int t = 0; t < threadNum; t++) {
+        threads.emplace_back([&, t]() {
+            for(int i = t; i < n; i += threadNum) {
+                RegBatcher::Instance()->Submit(prefix + "b" + std::to_string(i), "pwd", true, [&](int ret) {
+                    if(ret == 1) ok++;
+                    done++;
+                });
+            }
+        });
+    }
+    for(auto& th : threads) th.join();
+    while(done < n) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    double batch = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    RegBatcher::Instance()->Close();
+
+    std::cout << "one by one: " << static_cast<int>(n / single) << " reg/s" << std::endl;
+    std::cout << "batched   : " << static_cast<int>(n / batch) << " reg/s, ok=" << ok
+              << " batches=" << RegBatcher::Instance()->GetBatches() << std::endl;
+
+    MYSQL* sql;
+    SqlConnRAII sqlRAII(&sql, SqlConnPool::Instance());
+    std::string order = "DELETE FROM user WHERE username LIKE '" + prefix + "%'";
+    mysql_query(sql, order.c_str());
+}
+
+/*
+    各个存储后端的注册/查询吞吐（SQLite和内存不需要数据库进程）
+    注册按128个一批提交（和RegBatcher一致），查询8个线程并发
+*/
+void TestUserStore(UserStore::Type type, int n) {
+    const int threadNum = 8, batch = 128;
+    Log::Instance()->init(1, "./testStore", ".log", 1024);
+    if(type == UserStore::MYSQL_STORE) {
+        SqlConnPool::Instance()->Init("localhost", 3306, "webserver_user", "123456", "webserver_db", threadNum);
+    }
+    unlink("./testStore.db");
+    unlink("./testStore.db-wal");
+    unlink("./testStore.db-shm");
+    assert(UserStore::Init(type, "./testStore.db"));
+    UserStore* store = UserStore::Instance();
+    std::string prefix = "store_" + std::to_string(time(nullptr)) + "_";
+
+    auto begin = std::chrono::steady_clock::now();
+    int ok = 0;
+    for(int i = 0; i < n; i += batch) {
+        std::vector<RegRow> rows;
+        for(int j = i; j < std::min(n, i + batch); j++) {
+            rows.push_back({prefix + std::to_string(j), "pwd", true, -1});
+        }
+        std::vector<RegRow*> ptrs;
+        for(auto& row : rows) ptrs.push_back(&row);
+        store->Register(ptrs);
+        for(auto& row : rows) ok += row.ret == 1;
+    }
+    double reg = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    std::atomic<int> found(0);
+    begin = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for(int t = 0; t < threadNum; t++) {
+        threads.emplace_back([&, t]() {
+            std::string pwd;
+            for(int i = t; i < n; i += threadNum) {
+                if(store->Query(prefix + std::to_string(i), &pwd) == 1 && pwd == "pwd") found++;
+            }
+        });
+    }
+    for(auto& th : threads) th.join();
+    double query = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    std::cout << store->Name() << ": register " << static_cast<int>(n / reg) << "/s (ok=" << ok
+              << "), query " << static_cast<int>(n / query) << "/s (found=" << found << ")" << std::endl;
+    UserStore::Close();
+}
+
+/*
+    会话表：8个线程并发创建/校验的吞吐；重新Init同一个文件后会话还在（模拟重启）；过期后校验失败
+*/
+void TestSessionStore(int n) {
+    const int threadNum = 8;
+    Log::Instance()->init(1, "./testSession", ".log", 1024);
+    unlink("./testSession.db");
+    SessionStore* store = SessionStore::Instance();
+    assert(store->Init(2, n, "./testSession.db"));
+
+    std::vector<std::string> tokens(n);
+    auto begin = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for(int t = 0; t < threadNum; t++) {
+        threads.emplace_back([&, t]() {
+            for(int i = t; i < n; i += threadNum) tokens[i] = store->Create("user" + std::to_string(i));
+        });
+    }
+    for(auto& th : threads) th.join();
+    double create = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    std::atomic<int> ok(0);
+    begin = std::chrono::steady_clock::now();
+    threads.clear();
+    for(int t = 0; t < threadNum; t++) {
+        threads.emplace_back([&, t]() {
+            std::string name;
+            for(int i = t; i < n; i += threadNum) {
+                if(store->Verify(tokens[i], &name) && name == "user" + std::to_string(i)) ok++;
+            }
+        });
+    }
+    for(auto& th : threads) th.join();
+    double verify = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    std::cout << "create " << static_cast<int>(n / create) << "/s, verify " << static_cast<int>(n / verify)
+              << "/s, ok=" << ok << "/" << n << std::endl;
+
+    assert(store->Init(2, n, "./testSession.db"));     // 模拟重启
+    std::cout << "after reopen: " << store->GetCount() << " sessions, verify "
+              << (store->Verify(tokens[0], nullptr) ? "ok" : "failed") << std::endl;
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(2100));
+    size_t expired = 0;
+    for(int i = 0; i < 64; i++) expired += store->Expire(1);
+    std::cout << "after ttl: verify " << (store->Verify(tokens[1], nullptr) ? "ok" : "failed")
+              << ", expired " << expired << ", left " << store->GetCount() << std::endl;
+}
+
+/*
+    热升级时新旧两个进程同时读写同一个会话文件：fork出的子进程像新进程一样重新Init（自己打开文件），
+    和父进程同时各用threadNum个线程建会话、删掉一半，结束后检查：
+    各自留下的会话都能验证，文件里的占用数等于两边留下的总数，重新Init（重新数一遍）后也一样
+*/
+void TestSessionShared(int n) {
+    const int threadNum = 4;
+    unlink("./testShared.db");
+    SessionStore* store = SessionStore::Instance();
+    assert(store->Init(3600, n, "./testShared.db"));
+    int pipeFd[2];
+    assert(pipe(pipeFd) == 0);
+    pid_t child = fork();
+    if(child == 0) {
+        store->Init(3600, n, "./testShared.db");
+    }
+
+    std::atomic<int> kept(0), ok(0);
+    std::vector<std::thread> threads;
+    for(int t = 0; t < threadNum; t++) {
+        threads.emplace_back([&, t]() {
+            std::vector<std::string> tokens;
+            for(int i = 0; i < n / 4 / threadNum; i++) {
+                tokens.push_back(store->Create("user" + std::to_string(t)));
+                if(i % 2) {
+                    store->Remove(tokens[i - 1]);
+                    tokens[i - 1].clear();
+                }
+            }
+            for(auto& token : tokens) {
+                if(token.empty()) continue;
+                kept++;
+                if(store->Verify(token, nullptr)) ok++;
+            }
+        });
+    }
+    for(auto& th : threads) th.join();
+    if(child == 0) {
+        int result[2] = {kept, ok};
+        if(write(pipeFd[1], result, sizeof(result)) != sizeof(result)) {}
+        _exit(0);
+    }
+    int result[2] = {0, 0};
+    if(read(pipeFd[0], result, sizeof(result)) != sizeof(result)) {}
+    waitpid(child, nullptr, 0);
+    close(pipeFd[0]);
+    close(pipeFd[1]);
+
+    int total = kept + result[0];
+    std::cout << "parent verify " << ok << "/" << kept << ", child verify " << result[1] << "/" << result[0]
+              << ", count " << store->GetCount() << "/" << total;
+    store->Init(3600, n, "./testShared.db");
+    std::cout << ", recount " << store->GetCount() << "/" << total << std::endl;
+}
+
+/*
+    timerfd + 10ms时间桶：n个连接在1秒内随机到期，统计主循环被唤醒的次数和timerfd_settime的次数
+    （原来每次epoll_wait前都要tick + 计算超时，每个到期时间都可能单独唤醒一次）
+*/
+void TestTimerSlack(int n) {
+    HeapTimer timer;
+    int epfd = epoll_create1(0);
+    epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.fd = timer.GetFd();
+    epoll_ctl(epfd, EPOLL_CTL_ADD, timer.GetFd(), &ev);
+
+    int fired = 0, wakeups = 0;
+    CachedClock::Update();      // 和主循环一样，先更新本轮的缓存时间再加定时器
+    srand(1);
+    for(int i = 0; i < n; i++) {
+        timer.add(i, rand() % 1000, [&fired]() { fired++; });
+    }
+    for(int i = 0; i < n; i++) {
+        timer.adjust(i, 1000 + rand() % 1000);     // 模拟读写事件刷新超时
+    }
+    auto begin = std::chrono::steady_clock::now();
+    while(fired < n) {
+        if(epoll_wait(epfd, &ev, 1, 5000) <= 0) break;
+        wakeups++;
+        CachedClock::Update();
+        timer.OnTick();
+    }
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    std::cout << "timers=" << n << " fired=" << fired << " wakeups=" << wakeups
+              << " settime=" << timer.GetArmCount() << " cost=" << sec << "s" << std::endl;
+    close(epfd);
+}
+
+/*
+    缓存时钟：每个请求要取的时间（定时器的单调时间、日志时间戳、Date头）逐次读时钟+格式化 vs 走CachedClock
+    threadNum个线程同时跑，看 localtime_r 等带锁的调用在多线程下的开销
+*/
+void TestClock(int n, int threadNum) {
+    auto bench = [n, threadNum](const char* name, const std::function<void()>& fn) {
+        std::vector<std::thread> threads;
+        auto begin = std::chrono::steady_clock::now();
+        for(int i = 0; i < threadNum; i++) {
+            threads.emplace_back([n, &fn]() { for(int j = 0; j < n; j++) fn(); });
+        }
+        for(auto& t : threads) t.join();
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+        std::cout << name << ": " << ns / n << " ns/op" << std::endl;
+    };
+    static volatile long sink = 0;
+
+    bench("steady_clock::now", []() {
+        sink += std::chrono::steady_clock::now().time_since_epoch().count();
+    });
+    CachedClock::Update();
+    bench("CachedClock::Now", []() {
+        sink += CachedClock::Now().time_since_epoch().count();
+    });
+    bench("gettimeofday+localtime_r+snprintf", []() {
+        struct timeval now;
+        gettimeofday(&now, nullptr);
+        struct tm t;
+        localtime_r(&now.tv_sec, &t);
+        char buf[64];
+        sink += snprintf(buf, sizeof(buf), "%d-%02d-%02d %02d:%02d:%02d.%06ld ",
+                t.tm_year + 1900, t.tm_mon + 1, t.tm_mday, t.tm_hour, t.tm_min, t.tm_sec, now.tv_usec);
+    });
+    bench("CachedClock::LogTime", []() {
+        char buf[CachedClock::LOG_TIME_LEN + 1];
+        sink += CachedClock::LogTime(buf);
+    });
+    bench("time+gmtime_r+strftime", []() {
+        time_t now = time(nullptr);
+        struct tm t;
+        gmtime_r(&now, &t);
+        char buf[64];
+        sink += strftime(buf, sizeof(buf), "Date: %a, %d %b %Y %H:%M:%S GMT\r\n", &t);
+    });
+    bench("CachedClock::HttpDate", []() {
+        sink += CachedClock::HttpDate().size();
+    });
+    char buf[CachedClock::LOG_TIME_LEN + 1];
+    CachedClock::LogTime(buf);
+    std::cout << "threads=" << threadNum << " log=\"" << buf << "\" " << CachedClock::HttpDate();
+}
+
+/*
+    主循环信箱压力测试：producerNum个线程各投递n条消息，主线程像主循环一样epoll_wait + Drain
+    检查：条数不丢不重、同一个生产者的消息保持顺序、最后不会有消息留在队列里却没人唤醒
+    容量故意设得很小，覆盖队列满时生产者等待的路径；用 make tsan 编译可以检查数据竞争
+*/
+void TestLoopQueue(int producerNum, int n) {
+    LoopQueue queue(1024);
+    int epfd = epoll_create1(0);
+    epoll_event ev = {0};
+    ev.events = EPOLLIN;
+    ev.data.fd = queue.GetFd();
+    epoll_ctl(epfd, EPOLL_CTL_ADD, queue.GetFd(), &ev);
+
+    std::vector<std::thread> producers;
+    auto begin = std::chrono::steady_clock::now();
+    for(int p = 0; p < producerNum; p++) {
+        producers.emplace_back([&queue, p, n]() {
+            for(int i = 0; i < n; i++) {
+                queue.Post({LoopMail::WAIT_READ, p, 0, static_cast<uint64_t>(i)});
+                if(i % 4096 == 0) {
+                    std::this_thread::sleep_for(std::chrono::microseconds(100));    // 让主循环有机会睡下去
+                }
+            }
+        });
+    }
+
+    std::vector<uint64_t> next(producerNum, 0);
+    long total = 0, wakeups = 0, disorder = 0;
+    while(total < static_cast<long>(producerNum) * n) {
+        if(epoll_wait(epfd, &ev, 1, 5000) <= 0) {
+            break;  // 5秒没被唤醒：消息丢了或者漏了唤醒
+        }
+        wakeups++;
+        total += queue.Drain([&next, &disorder](const LoopMail& mail) {
+            if(mail.seq != next[mail.fd]) { disorder++; }
+            next[mail.fd] = mail.seq + 1;
+        });
+    }
+    for(auto& t : producers) { t.join(); }
+    double sec = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    std::cout << "producers=" << producerNum << " mails=" << total << "/" << static_cast<long>(producerNum) * n
+              << " disorder=" << disorder << " wakeups=" << wakeups
+              << " rate=" << total / sec / 1e6 << "M/s" << std::endl;
+    close(epfd);
+}
+
+/*
+    多个线程同时更新计数器和直方图，汇总后的数应该正好是 threadNum * n，
+    同时对比开关指标时每次更新的耗时
+*/
+void TestMetrics(int threadNum, int n) {
+    Metrics* metrics = Metrics::Instance();
+    for(int enabled = 0; enabled <= 1; enabled++) {
+        metrics->SetEnabled(enabled);
+        std::vector<std::thread> threads;
+        auto begin = std::chrono::steady_clock::now();
+        for(int t = 0; t < threadNum; t++) {
+            threads.emplace_back([metrics, n]() {
+                for(int i = 0; i < n; i++) {
+                    metrics->Add(Metrics::REQUESTS);
+                    metrics->Add(Metrics::BYTES_WRITTEN, 100);
+                    metrics->Observe(Metrics::PROCESS_SECONDS, i % 2000);
+                }
+            });
+        }
+        for(auto& t : threads) { t.join(); }
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+        std::cout << "enabled=" << enabled << " " << ns / (static_cast<double>(threadNum) * n) << "ns per request (3 updates)" << std::endl;
+    }
+    metrics->AddCallback("test_gauge{kind=\"a\"}", "gauge", "Test gauge.", []() { return 42.0; });
+    std::string text = metrics->Render();
+    // 期望：webserver_requests_total = threadNum*n，process直方图的 _count 也是 threadNum*n
+    for(const char* key : {"webserver_requests_total ", "webserver_written_bytes_total ",
+                           "webserver_process_duration_seconds_count ", "webserver_process_duration_seconds_bucket{le=\"0.001\"} ",
+                           "test_gauge{kind=\"a\"} "}) {
+        size_t pos = text.find(std::string("\n") + key);     // 跳过 # HELP 行
+        if(pos == std::string::npos) {
+            std::cout << key << "missing" << std::endl;
+            continue;
+        }
+        pos += 1 + strlen(key);
+        std::cout << key << text.substr(pos, text.find('\n', pos) - pos) << std::endl;
+    }
+    std::cout << "expect " << static_cast<long>(threadNum) * n << " requests, "
+              << static_cast<long>(threadNum) * n * 100 << " bytes, bucket le=0.001: "
+              << static_cast<long>(threadNum) * (n / 2000 * 1001 + std::min(n % 2000, 1001)) << std::endl;
+
+    // 同名回调再注册一次是替换（服务器重建时不会重复输出），ClearCallbacks之后不再输出
+    metrics->AddCallback("test_gauge{kind=\"a\"}", "gauge", "Test gauge.", []() { return 43.0; });
+    text = metrics->Render();
+    size_t first = text.find("\ntest_gauge{kind=\"a\"} ");
+    std::cout << "re-registered: " << text.substr(first + 1, text.find('\n', first + 1) - first - 1)
+              << (text.find("\ntest_gauge{kind=\"a\"} ", first + 1) == std::string::npos ? ", once" : ", DUPLICATE") << std::endl;
+    metrics->ClearCallbacks();
+    std::cout << "after ClearCallbacks: " << (metrics->Render().find("test_gauge") == std::string::npos ? "gone" : "STILL THERE") << std::endl;
+}
+
+// 每sampleEvery个请求应当有一个带各阶段耗时；慢请求（这里阈值1ms，奇数个请求里睡2ms）都返回true
+// sampleEvery取偶数，采样到的正好都是慢请求
+void TestReqTrace(int sampleEvery, int n) {
+    Metrics::Instance()->SetEnabled(true);
+    ReqTrace::Configure(sampleEvery, 1);
+    ReqTrace trace;
+    trace.Reset();
+    int slow = 0, withStages = 0;
+    for(int i = 0; i < n; i++) {
+        trace.Begin(Metrics::NowUs());
+        trace.Mark(ReqTrace::DISPATCH);
+        trace.Mark(ReqTrace::WORKER_START);
+        trace.Mark(ReqTrace::PARSE_DONE);
+        if(i % 2 == 1) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
+        }
+        trace.Mark(ReqTrace::RESPONSE_BUILT);
+        trace.MarkOnce(ReqTrace::FIRST_WRITE);
+        trace.MarkOnce(ReqTrace::FIRST_WRITE);
+        std::string line;
+        if(trace.Finish(Metrics::NowUs(), &line)) {
+            slow++;
+            if(line.find("build_us=") != std::string::npos) { withStages++; }
+            if(i < 2 * sampleEvery) { std::cout << line << std::endl; }
+        }
+    }
+    // 连接上的第一个请求在Reset里已经数过一次，所以采样到的是第sampleEvery-1、2*sampleEvery-1……个
+    std::cout << "slow " << slow << " expect " << n / 2
+              << ", with stages " << withStages << " expect " << n / sampleEvery << std::endl;
+    std::string text = Metrics::Instance()->Render();
+    size_t pos = text.find("\nwebserver_request_stage_seconds_count{stage=\"build\"} ");
+    if(pos != std::string::npos) {
+        pos += 1;
+        std::cout << text.substr(pos, text.find('\n', pos) - pos) << " expect " << n / sampleEvery << std::endl;
+    }
+    ReqTrace::Configure(0, 0);
+}
+
+/*
+    静态文件缓存：第一次Get读文件，之后命中；Peek不碰磁盘，过了确认间隔返回空；
+    文件改了，过了确认间隔Get读到新内容；同时对比每次stat + open + mmap的耗时
+*/
+void TestFileCache(int n) {
+    const char* path = "./filecache_test.html";
+    FILE* fp = fopen(path, "w");
+    fputs("<html>v1</html>", fp);
+    fclose(fp);
+    chmod(path, 0644);
+    FileCache* cache = FileCache::Instance();
+    cache->SetLimits(64 * 1024, 1024 * 1024, 100);
+    FileCache::EntryPtr first = cache->Get(path);
+    FileCache::EntryPtr second = cache->Get(path);
+    std::cout << "first " << (first ? first->data : "null") << " same entry " << (first == second)
+              << " peek " << (cache->Peek(path) != nullptr) << " hits " << cache->GetHits()
+              << " misses " << cache->GetMisses() << " (expect 1 1 1 1)" << std::endl;
+
+    auto begin = std::chrono::steady_clock::now();
+    size_t bytes = 0;
+    for(int i = 0; i < n; i++) {
+        bytes += cache->Get(path)->data.size();
+    }
+    double cacheNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count() / n;
+    begin = std::chrono::steady_clock::now();
+    for(int i = 0; i < n; i++) {
+        struct stat st;
+        stat(path, &st);
+        int fd = open(path, O_RDONLY);
+        void* mm = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        bytes += st.st_size;
+        munmap(mm, st.st_size);
+    }
+    double mmapNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count() / n;
+    std::cout << "get " << cacheNs << "ns, stat+open+mmap " << mmapNs << "ns (" << bytes << " bytes)" << std::endl;
+
+    fp = fopen(path, "w");
+    fputs("<html>version 2</html>", fp);
+    fclose(fp);
+    std::this_thread::sleep_for(std::chrono::milliseconds(150));
+    std::cout << "peek after 150ms " << (cache->Peek(path) != nullptr) << " (expect 0)";
+    FileCache::EntryPtr third = cache->Get(path);
+    std::cout << ", reloaded " << (third ? third->data : "null") << ", old entry still " << first->data << std::endl;
+    unlink(path);
+    cache->SetLimits(0, 0);
+}
+
+/*
+    按IP限流：同一个IP的连接数上限、令牌桶（突发burst个，之后按rate补充）、IPv4和IPv4映射的IPv6是同一个IP；
+    再放进n个不同的IP，统计插入和已有IP检查的耗时、表占的内存；表满后的新IP不受限；空闲的IP被Expire清掉
+*/
+void TestIpLimiter(int n) {
+    IpLimiter limiter;
+    limiter.Init(2, 10, 5, 0, n);      // 空闲时间按令牌补满算：5 / 10 = 500ms
+    sockaddr_in v4 = {};
+    v4.sin_family = AF_INET;
+    inet_pton(AF_INET, "10.1.2.3", &v4.sin_addr);
+    sockaddr_in6 mapped = {};
+    mapped.sin6_family = AF_INET6;
+    inet_pton(AF_INET6, "::ffff:10.1.2.3", &mapped.sin6_addr);
+    sockaddr_in6 v6 = {};
+    v6.sin6_family = AF_INET6;
+    inet_pton(AF_INET6, "2001:db8::1", &v6.sin6_addr);
+    IpLimiter::Key a = IpLimiter::MakeKey(v4);
+    IpLimiter::Key b = IpLimiter::MakeKey(reinterpret_cast<sockaddr*>(&mapped));
+    IpLimiter::Key c = IpLimiter::MakeKey(reinterpret_cast<sockaddr*>(&v6));
+
+    bool c1 = limiter.Connect(a), c2 = limiter.Connect(b), c3 = limiter.Connect(a);
+    limiter.Disconnect(a);
+    bool c4 = limiter.Connect(b);
+    std::cout << "connect " << c1 << c2 << c3 << c4 << " (expect 1101), v6 " << limiter.Connect(c) << std::endl;
+
+    int granted = 0;
+    for(int i = 0; i < 20; i++) granted += limiter.Request(a);
+    std::this_thread::sleep_for(std::chrono::milliseconds(300));
+    int refilled = 0;
+    for(int i = 0; i < 20; i++) refilled += limiter.Request(b);
+    std::cout << "burst " << granted << " (expect 5), after 300ms " << refilled << " (expect 3)" << std::endl;
+
+    IpLimiter::Key key = {0, 0};
+    auto begin = std::chrono::steady_clock::now();
+    for(int i = 0; i < n; i++) {
+        key.lo = 0xffff00000000ULL | static_cast<uint32_t>(i);
+        limiter.Request(key);
+    }
+    double insertNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count() / n;
+    begin = std::chrono::steady_clock::now();
+    int allowed = 0;
+    for(int i = 0; i < n; i++) {
+        key.lo = 0xffff00000000ULL | static_cast<uint32_t>(i * 7919LL % n);    // 打乱顺序，不连续访问
+        allowed += limiter.Request(key);
+    }
+    double checkNs = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count() / n;
+    std::cout << n << " ips: insert " << insertNs << "ns, check " << checkNs << "ns, allowed " << allowed
+              << ", tracked " << limiter.GetCount() << ", untracked " << limiter.GetUntracked()
+              << ", table " << (limiter.GetMemoryBytes() >> 20) << "MB" << std::endl;
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(600));
+    size_t expired = limiter.Expire(64);
+    std::cout << "expired " << expired << ", left " << limiter.GetCount() << " (expect 2, the ones with connections)" << std::endl;
+}
+
 int main() {
     // std::cout << "进入TestLog" << std::endl;
     // TestLog();
     // std::cout << "TestLog出来" << std::endl;
 
+    // TestLogBackpressure("./logBackpressure");
+    // TestSqlStmt(10000);
+    // TestSlowDbIsolation(32, 200);
+    // TestAdaptivePool(2, 64);
+    // TestRequestClasses(4);
+    // TestAdmission(2);
+    // TestSingleFlight(4, 64, 20);
+    // TestRegisterBatch(10000);
+    // TestUserStore(UserStore::MEMORY_STORE, 100000);
+    // TestUserStore(UserStore::SQLITE_STORE, 100000);
+    // TestSessionStore(100000);
+    // TestSessionShared(400000);
+    // TestTimerSlack(10000);
+    // TestClock(1000000, 4);
+    // TestLoopQueue(8, 1000000);
+    // TestMetrics(8, 1000000);
+    // TestReqTrace(10, 1000);
+    // TestFileCache(1000000);
+    // TestIpLimiter(1000000);
+
     std::cout << "进入TestThreadPool" << std::endl;
     TestThreadPool();
     std::cout << "TestThreadPool出来" << std::endl;